@@ -0,0 +1,202 @@
+// Measures how many socks handshakes per second each connection engine can complete, along
+// with the amount of heap allocations each of them performs.
+//
+// Everything runs in this process: the server, a sink that accepts the outbound connections
+// and the clients. The clients and the sink use plain blocking sockets so every allocation
+// counted is performed by the server.
+
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <boost/asio/io_service.hpp>
+#include <log4cxx/logger.h>
+#include "server.h"
+#include "connection_context.h"
+
+using std::atomic;
+using std::thread;
+using std::vector;
+using std::string;
+using std::cout;
+using std::endl;
+using std::make_shared;
+using std::runtime_error;
+using std::chrono::seconds;
+using std::chrono::duration;
+using std::chrono::steady_clock;
+
+using boost::asio::io_service;
+using boost::asio::ip::tcp;
+using boost::asio::ip::address;
+
+using namespace roberto;
+
+static atomic<uint64_t> allocation_count{0};
+
+void* operator new(size_t size) {
+    ++allocation_count;
+    void* output = malloc(size ? size : 1);
+    if (!output) {
+        throw std::bad_alloc();
+    }
+    return output;
+}
+
+void operator delete(void* pointer) noexcept {
+    free(pointer);
+}
+
+static sockaddr_in make_address(uint16_t port) {
+    sockaddr_in output;
+    memset(&output, 0, sizeof(output));
+    output.sin_family = AF_INET;
+    output.sin_port = htons(port);
+    output.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    return output;
+}
+
+static bool read_exactly(int fd, uint8_t* buffer, size_t size) {
+    while (size > 0) {
+        const ssize_t result = ::read(fd, buffer, size);
+        if (result <= 0) {
+            return false;
+        }
+        buffer += result;
+        size -= result;
+    }
+    return true;
+}
+
+// Accepts every outbound connection made by the server and closes it right away
+class Sink {
+public:
+    Sink() {
+        fd_ = ::socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address = make_address(0);
+        socklen_t address_length = sizeof(address);
+        if (::bind(fd_, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+            ::listen(fd_, 4096) != 0 ||
+            ::getsockname(fd_, reinterpret_cast<sockaddr*>(&address), &address_length) != 0) {
+            throw runtime_error("Failed to set up sink");
+        }
+        port_ = ntohs(address.sin_port);
+        thread_ = thread([&] {
+            int fd;
+            while ((fd = ::accept(fd_, nullptr, nullptr)) >= 0) {
+                ::close(fd);
+            }
+        });
+    }
+
+    ~Sink() {
+        ::shutdown(fd_, SHUT_RDWR);
+        thread_.join();
+        ::close(fd_);
+    }
+
+    uint16_t get_port() const {
+        return port_;
+    }
+private:
+    int fd_;
+    uint16_t port_;
+    thread thread_;
+};
+
+// Performs a full socks5 handshake, including the connect request
+static bool run_handshake(uint16_t server_port, uint16_t sink_port) {
+    int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = make_address(server_port);
+    bool success = false;
+    if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+        const uint8_t method_selection[] = { 5, 1, 0 };
+        uint8_t connect_request[] = { 5, 1, 0, 1, 127, 0, 0, 1, 0, 0 };
+        const uint16_t port = htons(sink_port);
+        memcpy(connect_request + 8, &port, sizeof(port));
+        uint8_t response[10];
+        success = ::write(fd, method_selection, sizeof(method_selection)) > 0 &&
+                  read_exactly(fd, response, 2) &&
+                  ::write(fd, connect_request, sizeof(connect_request)) > 0 &&
+                  read_exactly(fd, response, sizeof(response)) &&
+                  response[1] == 0;
+    }
+    ::close(fd);
+    return success;
+}
+
+static void run_benchmark(const string& name, ConnectionEngine engine, size_t duration_seconds,
+                          size_t client_count, size_t thread_count) {
+    io_service service;
+    Server server(service, tcp::endpoint(address::from_string("127.0.0.1"), 0),
+                  make_shared<ConnectionContext>(), engine);
+    server.start();
+    const uint16_t server_port = server.get_local_endpoint().port();
+    Sink sink;
+
+    vector<thread> server_threads;
+    for (size_t i = 0; i < thread_count; ++i) {
+        server_threads.emplace_back([&] { service.run(); });
+    }
+
+    atomic<bool> running{true};
+    atomic<uint64_t> handshake_count{0};
+    atomic<uint64_t> failure_count{0};
+    const uint64_t initial_allocations = allocation_count.load();
+    const auto start_time = steady_clock::now();
+    vector<thread> client_threads;
+    for (size_t i = 0; i < client_count; ++i) {
+        client_threads.emplace_back([&] {
+            while (running) {
+                if (run_handshake(server_port, sink.get_port())) {
+                    ++handshake_count;
+                }
+                else {
+                    ++failure_count;
+                }
+            }
+        });
+    }
+    std::this_thread::sleep_for(seconds(duration_seconds));
+    running = false;
+    for (auto& th : client_threads) {
+        th.join();
+    }
+    const duration<double> elapsed = steady_clock::now() - start_time;
+    const uint64_t allocations = allocation_count.load() - initial_allocations;
+
+    service.stop();
+    for (auto& th : server_threads) {
+        th.join();
+    }
+
+    const uint64_t handshakes = handshake_count.load();
+    cout << name << ": " << static_cast<uint64_t>(handshakes / elapsed.count())
+         << " handshakes/s, " << (handshakes ? static_cast<double>(allocations) / handshakes : 0)
+         << " allocations/handshake, " << failure_count.load() << " failures" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    const size_t duration_seconds = argc > 1 ? std::stoul(argv[1]) : 5;
+    const size_t client_count = argc > 2 ? std::stoul(argv[2]) : 8;
+    const size_t thread_count = argc > 3 ? std::stoul(argv[3]) : 2;
+
+    log4cxx::Logger::getRootLogger()->setLevel(log4cxx::Level::getOff());
+    cout << "Running for " << duration_seconds << "s using " << client_count << " clients and "
+         << thread_count << " server threads" << endl;
+    run_benchmark("callbacks", ConnectionEngine::CALLBACKS, duration_seconds, client_count,
+                  thread_count);
+    run_benchmark("coroutines", ConnectionEngine::COROUTINES, duration_seconds, client_count,
+                  thread_count);
+}
@@ -0,0 +1,731 @@
+// Replays the connections recorded through the traffic-record-file option against a running
+// instance, so builds and settings can be compared on a realistic workload entirely offline.
+//
+// Every connection is made at its recorded time, scaled by the speed factor, and goes through
+// the same handshake it did when it was recorded. Its target is a sink run by this process,
+// which plays the part of the destination: the chunks recorded in each direction are sent at
+// their recorded times by either the client or the sink, and have to arrive in full on the
+// other end. Domain names are replaced by localhost and IPv6 addresses by IPv4 ones, as sinks
+// listen on the IPv4 loopback. Connections that failed to connect when recorded are made to a
+// port nothing listens on.
+
+#include <array>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "traffic_recorder.h"
+#include "relay_direction.h"
+#include "socks_messages.h"
+
+using std::min;
+using std::move;
+using std::sort;
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+using std::unique_ptr;
+using std::make_shared;
+using std::runtime_error;
+using std::enable_shared_from_this;
+using std::chrono::seconds;
+using std::chrono::duration;
+using std::chrono::microseconds;
+using std::chrono::steady_clock;
+using std::chrono::duration_cast;
+
+using boost::asio::io_service;
+using boost::asio::steady_timer;
+using boost::asio::ip::tcp;
+using boost::asio::ip::address;
+using boost::asio::ip::address_v4;
+
+using boost::system::error_code;
+
+using namespace roberto;
+
+// The most each write sends, chunks bigger than this are split
+static const size_t WRITE_SIZE = 64 * 1024;
+// How long a connection can go past its recorded duration before it's given up on
+static const steady_clock::duration STALL_TIMEOUT = seconds(10);
+static const uint8_t USERNAME_PASSWORD_AUTH_VERSION = 1;
+
+static const vector<uint8_t> PAYLOAD(WRITE_SIZE, 'r');
+
+struct Settings {
+    tcp::endpoint proxy_endpoint;
+    double speed;
+    string username;
+    string password;
+    // Connecting to this port fails
+    uint16_t closed_port;
+};
+
+struct Results {
+    uint64_t completed{0};
+    // Connections that failed to connect, just like they did when recorded
+    uint64_t failed_as_recorded{0};
+    uint64_t handshake_failures{0};
+    uint64_t truncated{0};
+    uint64_t stalled{0};
+    uint64_t byte_count{0};
+    // From connecting to the proxy to getting its reply, in microseconds
+    vector<uint64_t> handshake_times;
+};
+
+static steady_clock::duration scale(const Settings& settings, uint64_t time) {
+    return duration_cast<steady_clock::duration>(microseconds(
+        static_cast<uint64_t>(time / settings.speed)));
+}
+
+static string encode_base64(const string& input) {
+    static const char ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+                                   "0123456789+/";
+    string output;
+    for (size_t i = 0; i < input.size(); i += 3) {
+        uint32_t group = static_cast<uint8_t>(input[i]) << 16;
+        if (i + 1 < input.size()) {
+            group |= static_cast<uint8_t>(input[i + 1]) << 8;
+        }
+        if (i + 2 < input.size()) {
+            group |= static_cast<uint8_t>(input[i + 2]);
+        }
+        output += ALPHABET[(group >> 18) & 0x3f];
+        output += ALPHABET[(group >> 12) & 0x3f];
+        output += i + 1 < input.size() ? ALPHABET[(group >> 6) & 0x3f] : '=';
+        output += i + 2 < input.size() ? ALPHABET[group & 0x3f] : '=';
+    }
+    return output;
+}
+
+// The listening sockets the proxy connects to. Each connection being replayed gets one of its
+// own, so there's no doubt which trace an accepted connection belongs to
+class SinkPool {
+public:
+    explicit SinkPool(io_service& service)
+    : io_service_(service) {
+
+    }
+
+    unique_ptr<tcp::acceptor> acquire() {
+        if (idle_.empty()) {
+            return unique_ptr<tcp::acceptor>(new tcp::acceptor(
+                io_service_, tcp::endpoint(address_v4::loopback(), 0)));
+        }
+        unique_ptr<tcp::acceptor> output = move(idle_.back());
+        idle_.pop_back();
+        return output;
+    }
+
+    void release(unique_ptr<tcp::acceptor> acceptor) {
+        idle_.push_back(move(acceptor));
+    }
+private:
+    io_service& io_service_;
+    vector<unique_ptr<tcp::acceptor>> idle_;
+};
+
+// Replays a single connection, from the handshake until everything was relayed
+class Replay : public enable_shared_from_this<Replay> {
+public:
+    Replay(io_service& service, const ConnectionTrace& trace, const Settings& settings,
+           SinkPool& sinks, Results& results)
+    : trace_(trace), settings_(settings), sinks_(sinks), results_(results),
+      client_socket_(service), sink_socket_(service), deadline_timer_(service),
+      end_timer_(service), upstream_send_timer_(service), downstream_send_timer_(service) {
+
+    }
+
+    void start() {
+        auto self = shared_from_this();
+        start_time_ = steady_clock::now();
+        deadline_timer_.expires_at(start_time_ + scale(settings_, trace_.duration) +
+                                   STALL_TIMEOUT);
+        deadline_timer_.async_wait([self](const error_code& error) {
+            if (!error) {
+                self->finish(&Results::stalled);
+            }
+        });
+        if (trace_.connected) {
+            sink_acceptor_ = sinks_.acquire();
+            sink_acceptor_->async_accept(sink_socket_, [self](const error_code& error) {
+                self->handle_accept(error);
+            });
+        }
+        client_socket_.async_connect(settings_.proxy_endpoint, [self](const error_code& error) {
+            self->handle_proxy_connect(error);
+        });
+    }
+private:
+    using Step = void (Replay::*)();
+
+    struct Sender {
+        size_t next_chunk{0};
+        uint64_t pending_bytes{0};
+        // Bytes past the recorded chunks, which are sent right after them
+        uint64_t unchunked_bytes{0};
+        steady_clock::time_point next_time;
+        bool done{false};
+    };
+
+    struct Receiver {
+        vector<uint8_t> buffer;
+        uint64_t byte_count{0};
+        bool done{false};
+    };
+
+    uint16_t get_target_port() const {
+        return trace_.connected ? sink_acceptor_->local_endpoint().port() :
+                                  settings_.closed_port;
+    }
+
+    tcp::socket& get_sender_socket(RelayDirection direction) {
+        return direction == UPSTREAM ? client_socket_ : sink_socket_;
+    }
+
+    tcp::socket& get_receiver_socket(RelayDirection direction) {
+        return direction == UPSTREAM ? sink_socket_ : client_socket_;
+    }
+
+    steady_timer& get_send_timer(RelayDirection direction) {
+        return direction == UPSTREAM ? upstream_send_timer_ : downstream_send_timer_;
+    }
+
+    // Sends the request and reads a response of the given size
+    void exchange(size_t response_size, Step step) {
+        auto self = shared_from_this();
+        response_.resize(response_size);
+        boost::asio::async_write(client_socket_, boost::asio::buffer(request_),
+                                 [self, step](const error_code& error, size_t) {
+            if (self->finished_) {
+                return;
+            }
+            if (error) {
+                self->finish(&Results::handshake_failures);
+                return;
+            }
+            boost::asio::async_read(self->client_socket_, boost::asio::buffer(self->response_),
+                                    [self, step](const error_code& error, size_t) {
+                if (self->finished_) {
+                    return;
+                }
+                if (error) {
+                    self->finish(&Results::handshake_failures);
+                    return;
+                }
+                ((*self).*step)();
+            });
+        });
+    }
+
+    void handle_accept(const error_code& error) {
+        if (finished_ || error) {
+            return;
+        }
+        accepted_ = true;
+        if (handshake_done_) {
+            start_relaying();
+        }
+    }
+
+    void handle_proxy_connect(const error_code& error) {
+        if (finished_) {
+            return;
+        }
+        if (error) {
+            finish(&Results::handshake_failures);
+            return;
+        }
+        if (trace_.protocol == ConnectionTrace::Protocol::HTTP) {
+            send_http_request();
+            return;
+        }
+        request_ = { get_socks_version(), 1, static_cast<uint8_t>(trace_.auth_method) };
+        exchange(2, &Replay::handle_method_response);
+    }
+
+    uint8_t get_socks_version() const {
+        return trace_.protocol == ConnectionTrace::Protocol::SOCKS4 ? 4 : 5;
+    }
+
+    void handle_method_response() {
+        if (response_[1] != static_cast<uint8_t>(trace_.auth_method)) {
+            finish(&Results::handshake_failures);
+            return;
+        }
+        if (trace_.auth_method != SocksAuthentication::USERNAME_PASSWORD) {
+            send_socks_request();
+            return;
+        }
+        request_ = { USERNAME_PASSWORD_AUTH_VERSION };
+        request_.push_back(settings_.username.size());
+        request_.insert(request_.end(), settings_.username.begin(), settings_.username.end());
+        request_.push_back(settings_.password.size());
+        request_.insert(request_.end(), settings_.password.begin(), settings_.password.end());
+        exchange(2, &Replay::handle_auth_response);
+    }
+
+    void handle_auth_response() {
+        if (response_[1] != static_cast<uint8_t>(AuthenticationStatus::SUCCESS)) {
+            finish(&Results::handshake_failures);
+            return;
+        }
+        send_socks_request();
+    }
+
+    void send_socks_request() {
+        request_ = { get_socks_version(), static_cast<uint8_t>(CommandType::CONNECT), 0 };
+        if (trace_.address_type == AddressType::DOMAIN_NAME) {
+            const string host = "localhost";
+            request_.push_back(static_cast<uint8_t>(AddressType::DOMAIN_NAME));
+            request_.push_back(host.size());
+            request_.insert(request_.end(), host.begin(), host.end());
+        }
+        else {
+            const auto loopback = address_v4::loopback().to_bytes();
+            request_.push_back(static_cast<uint8_t>(AddressType::IPV4));
+            request_.insert(request_.end(), loopback.begin(), loopback.end());
+        }
+        const uint16_t port = get_target_port();
+        request_.push_back(port >> 8);
+        request_.push_back(port & 0xff);
+        // The version, the reply and the address type
+        exchange(4, &Replay::handle_socks_reply_header);
+    }
+
+    void handle_socks_reply_header() {
+        if (response_[1] != static_cast<uint8_t>(ReplyType::SUCCESS)) {
+            finish_failed_connect();
+            return;
+        }
+        // Skip the bound address and port
+        size_t address_size;
+        switch (static_cast<AddressType>(response_[3])) {
+            case AddressType::IPV4:
+                address_size = 4;
+                break;
+            case AddressType::IPV6:
+                address_size = 16;
+                break;
+            default:
+                finish(&Results::handshake_failures);
+                return;
+        }
+        auto self = shared_from_this();
+        response_.resize(address_size + sizeof(uint16_t));
+        boost::asio::async_read(client_socket_, boost::asio::buffer(response_),
+                                [self](const error_code& error, size_t) {
+            if (self->finished_) {
+                return;
+            }
+            if (error) {
+                self->finish(&Results::handshake_failures);
+                return;
+            }
+            self->handle_handshake_done();
+        });
+    }
+
+    void send_http_request() {
+        const string host = trace_.address_type == AddressType::DOMAIN_NAME ? "localhost" :
+                                                                               "127.0.0.1";
+        const string authority = host + ":" + std::to_string(get_target_port());
+        string request = "CONNECT " + authority + " HTTP/1.1\r\nHost: " + authority + "\r\n";
+        if (trace_.auth_method == SocksAuthentication::USERNAME_PASSWORD) {
+            request += "Proxy-Authorization: Basic " +
+                       encode_base64(settings_.username + ":" + settings_.password) + "\r\n";
+        }
+        request += "\r\n";
+        request_.assign(request.begin(), request.end());
+        auto self = shared_from_this();
+        boost::asio::async_write(client_socket_, boost::asio::buffer(request_),
+                                 [self](const error_code& error, size_t) {
+            if (self->finished_) {
+                return;
+            }
+            if (error) {
+                self->finish(&Results::handshake_failures);
+                return;
+            }
+            boost::asio::async_read_until(self->client_socket_, self->http_response_, "\r\n\r\n",
+                                          [self](const error_code& error, size_t size) {
+                self->handle_http_response(error, size);
+            });
+        });
+    }
+
+    void handle_http_response(const error_code& error, size_t size) {
+        if (finished_) {
+            return;
+        }
+        if (error) {
+            finish(&Results::handshake_failures);
+            return;
+        }
+        const string status_line = "HTTP/1.1 200";
+        const auto response_start = boost::asio::buffers_begin(http_response_.data());
+        const string response(response_start,
+                              response_start + min(status_line.size(), size));
+        if (response != status_line) {
+            finish_failed_connect();
+            return;
+        }
+        // Anything read past the response was relayed from the sink already
+        receivers_[DOWNSTREAM].byte_count += http_response_.size() - size;
+        handle_handshake_done();
+    }
+
+    void handle_handshake_done() {
+        const auto handshake_time = steady_clock::now() - start_time_;
+        results_.handshake_times.push_back(duration_cast<microseconds>(handshake_time).count());
+        if (!trace_.connected) {
+            // We were told we're connected before the proxy tried to, wait for the reset
+            auto self = shared_from_this();
+            receivers_[DOWNSTREAM].buffer.resize(WRITE_SIZE);
+            client_socket_.async_read_some(boost::asio::buffer(receivers_[DOWNSTREAM].buffer),
+                                           [self](const error_code&, size_t) {
+                if (!self->finished_) {
+                    self->finish_failed_connect();
+                }
+            });
+            return;
+        }
+        handshake_done_ = true;
+        if (accepted_) {
+            start_relaying();
+        }
+    }
+
+    void finish_failed_connect() {
+        finish(trace_.connected ? &Results::handshake_failures : &Results::failed_as_recorded);
+    }
+
+    void start_relaying() {
+        const auto now = steady_clock::now();
+        // The proxy is done when the connection was closed, minus the time the handshake took
+        const uint64_t relay_time = trace_.duration - min(trace_.duration,
+                                                          trace_.handshake_time +
+                                                          trace_.connect_time);
+        end_time_ = now + scale(settings_, relay_time);
+        for (size_t i = 0; i < RELAY_DIRECTION_COUNT; ++i) {
+            const RelayDirection direction = static_cast<RelayDirection>(i);
+            const ConnectionTrace::Direction& trace_direction = trace_.directions[direction];
+            Sender& sender = senders_[direction];
+            uint64_t chunked_bytes = 0;
+            for (const ConnectionTrace::Chunk& chunk : trace_direction.chunks) {
+                chunked_bytes += chunk.size;
+            }
+            sender.unchunked_bytes = trace_direction.byte_count - chunked_bytes;
+            sender.next_time = now;
+            send_next(direction);
+            receive(direction);
+        }
+    }
+
+    void send_next(RelayDirection direction) {
+        Sender& sender = senders_[direction];
+        const auto& chunks = trace_.directions[direction].chunks;
+        if (sender.next_chunk < chunks.size()) {
+            const ConnectionTrace::Chunk& chunk = chunks[sender.next_chunk++];
+            // Times are absolute, so falling behind doesn't push every later chunk back
+            sender.next_time += scale(settings_, chunk.delay);
+            sender.pending_bytes = chunk.size;
+        }
+        else if (sender.unchunked_bytes > 0) {
+            sender.pending_bytes = sender.unchunked_bytes;
+            sender.unchunked_bytes = 0;
+        }
+        else {
+            sender.done = true;
+            try_finish();
+            return;
+        }
+        if (sender.next_time <= steady_clock::now()) {
+            write(direction);
+            return;
+        }
+        auto self = shared_from_this();
+        steady_timer& timer = get_send_timer(direction);
+        timer.expires_at(sender.next_time);
+        timer.async_wait([self, direction](const error_code& error) {
+            if (!error && !self->finished_) {
+                self->write(direction);
+            }
+        });
+    }
+
+    void write(RelayDirection direction) {
+        Sender& sender = senders_[direction];
+        const size_t size = min<uint64_t>(sender.pending_bytes, PAYLOAD.size());
+        auto self = shared_from_this();
+        boost::asio::async_write(get_sender_socket(direction),
+                                 boost::asio::buffer(PAYLOAD.data(), size),
+                                 [self, direction](const error_code& error, size_t bytes) {
+            if (self->finished_) {
+                return;
+            }
+            if (error) {
+                self->finish(&Results::truncated);
+                return;
+            }
+            Sender& sender = self->senders_[direction];
+            sender.pending_bytes -= bytes;
+            if (sender.pending_bytes > 0) {
+                self->write(direction);
+            }
+            else {
+                self->send_next(direction);
+            }
+        });
+    }
+
+    void receive(RelayDirection direction) {
+        Receiver& receiver = receivers_[direction];
+        if (receiver.byte_count >= trace_.directions[direction].byte_count) {
+            receiver.done = true;
+            try_finish();
+            return;
+        }
+        receiver.buffer.resize(WRITE_SIZE);
+        auto self = shared_from_this();
+        get_receiver_socket(direction).async_read_some(boost::asio::buffer(receiver.buffer),
+            [self, direction](const error_code& error, size_t bytes) {
+                if (self->finished_) {
+                    return;
+                }
+                if (error) {
+                    self->finish(&Results::truncated);
+                    return;
+                }
+                self->results_.byte_count += bytes;
+                self->receivers_[direction].byte_count += bytes;
+                self->receive(direction);
+            });
+    }
+
+    // Once everything was relayed, the connection is closed as late as it was when recorded
+    void try_finish() {
+        for (size_t i = 0; i < RELAY_DIRECTION_COUNT; ++i) {
+            if (!senders_[i].done || !receivers_[i].done) {
+                return;
+            }
+        }
+        if (steady_clock::now() >= end_time_) {
+            finish(&Results::completed);
+            return;
+        }
+        auto self = shared_from_this();
+        end_timer_.expires_at(end_time_);
+        end_timer_.async_wait([self](const error_code& error) {
+            if (!error && !self->finished_) {
+                self->finish(&Results::completed);
+            }
+        });
+    }
+
+    void finish(uint64_t Results::* outcome) {
+        if (finished_) {
+            return;
+        }
+        finished_ = true;
+        ++(results_.*outcome);
+        error_code ignored;
+        client_socket_.close(ignored);
+        sink_socket_.close(ignored);
+        deadline_timer_.cancel(ignored);
+        end_timer_.cancel(ignored);
+        upstream_send_timer_.cancel(ignored);
+        downstream_send_timer_.cancel(ignored);
+        if (!sink_acceptor_) {
+            return;
+        }
+        // The proxy could still connect to a sink that didn't accept anything yet
+        if (accepted_) {
+            sinks_.release(move(sink_acceptor_));
+        }
+        else {
+            sink_acceptor_->close(ignored);
+        }
+    }
+
+    ConnectionTrace trace_;
+    const Settings& settings_;
+    SinkPool& sinks_;
+    Results& results_;
+    tcp::socket client_socket_;
+    tcp::socket sink_socket_;
+    unique_ptr<tcp::acceptor> sink_acceptor_;
+    steady_timer deadline_timer_;
+    steady_timer end_timer_;
+    steady_timer upstream_send_timer_;
+    steady_timer downstream_send_timer_;
+    std::array<Sender, RELAY_DIRECTION_COUNT> senders_;
+    std::array<Receiver, RELAY_DIRECTION_COUNT> receivers_;
+    vector<uint8_t> request_;
+    vector<uint8_t> response_;
+    boost::asio::streambuf http_response_;
+    steady_clock::time_point start_time_;
+    steady_clock::time_point end_time_;
+    bool accepted_{false};
+    bool handshake_done_{false};
+    bool finished_{false};
+};
+
+// Starts every connection at its recorded time
+class Player {
+public:
+    Player(io_service& service, vector<ConnectionTrace> traces, const Settings& settings,
+           Results& results)
+    : io_service_(service), traces_(move(traces)), settings_(settings), results_(results),
+      sinks_(service), timer_(service) {
+
+    }
+
+    void start() {
+        start_time_ = steady_clock::now();
+        first_trace_time_ = traces_.front().start_time;
+        schedule_next();
+    }
+private:
+    void schedule_next() {
+        if (next_trace_ == traces_.size()) {
+            return;
+        }
+        timer_.expires_at(get_start_time(next_trace_));
+        timer_.async_wait([this](const error_code& error) {
+            if (error) {
+                return;
+            }
+            // Start every connection that's due, in case we fell behind
+            const auto now = steady_clock::now();
+            do {
+                make_shared<Replay>(io_service_, traces_[next_trace_], settings_, sinks_,
+                                    results_)->start();
+                // The trace isn't needed anymore
+                traces_[next_trace_] = ConnectionTrace();
+                ++next_trace_;
+            } while (next_trace_ < traces_.size() && get_start_time(next_trace_) <= now);
+            schedule_next();
+        });
+    }
+
+    steady_clock::time_point get_start_time(size_t index) const {
+        return start_time_ + scale(settings_, traces_[index].start_time - first_trace_time_);
+    }
+
+    io_service& io_service_;
+    vector<ConnectionTrace> traces_;
+    const Settings& settings_;
+    Results& results_;
+    SinkPool sinks_;
+    steady_timer timer_;
+    steady_clock::time_point start_time_;
+    uint64_t first_trace_time_{0};
+    size_t next_trace_{0};
+};
+
+// Binds a socket without listening on it, so connecting to its port is refused for as long
+// as it's open
+static tcp::socket make_closed_port_socket(io_service& service) {
+    tcp::socket output(service);
+    output.open(tcp::v4());
+    output.bind(tcp::endpoint(address_v4::loopback(), 0));
+    return output;
+}
+
+static uint64_t get_percentile(const vector<uint64_t>& sorted_values, double percentile) {
+    if (sorted_values.empty()) {
+        return 0;
+    }
+    return sorted_values[static_cast<size_t>(percentile * (sorted_values.size() - 1))];
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 4) {
+        cerr << "Usage: " << argv[0] << " <trace-file> <proxy-address> <proxy-port> [speed] "
+             << "[username] [password]" << endl;
+        return 1;
+    }
+    io_service service;
+    tcp::socket closed_port_socket(service);
+    Settings settings;
+    vector<ConnectionTrace> traces;
+    try {
+        settings.proxy_endpoint = tcp::endpoint(address::from_string(argv[2]),
+                                                std::stoul(argv[3]));
+        settings.speed = argc > 4 ? std::stod(argv[4]) : 1.0;
+        settings.username = argc > 5 ? argv[5] : "";
+        settings.password = argc > 6 ? argv[6] : "";
+        closed_port_socket = make_closed_port_socket(service);
+        settings.closed_port = closed_port_socket.local_endpoint().port();
+        if (settings.speed <= 0) {
+            throw runtime_error("The speed has to be positive");
+        }
+
+        TraceReader reader(argv[1]);
+        ConnectionTrace trace;
+        while (reader.read(trace)) {
+            if (trace.auth_method == SocksAuthentication::USERNAME_PASSWORD &&
+                settings.username.empty()) {
+                throw runtime_error("Replaying authenticated connections requires credentials");
+            }
+            traces.push_back(move(trace));
+        }
+        if (reader.is_truncated()) {
+            cerr << "The trace file ends halfway through a connection, which is skipped" << endl;
+        }
+    }
+    catch (const std::exception& error) {
+        cerr << "Error: " << error.what() << endl;
+        return 1;
+    }
+    if (traces.empty()) {
+        cout << "There are no connections to replay" << endl;
+        return 0;
+    }
+    // Traces are written as connections are closed, rather than as they're made
+    sort(traces.begin(), traces.end(), [](const ConnectionTrace& lhs,
+                                          const ConnectionTrace& rhs) {
+        return lhs.start_time < rhs.start_time;
+    });
+
+    const size_t connection_count = traces.size();
+    cout << "Replaying " << connection_count << " connections at " << settings.speed
+         << "x speed" << endl;
+    Results results;
+    Player player(service, move(traces), settings, results);
+    const auto start_time = steady_clock::now();
+    player.start();
+    service.run();
+    const duration<double> elapsed = steady_clock::now() - start_time;
+
+    sort(results.handshake_times.begin(), results.handshake_times.end());
+    cout << std::fixed << std::setprecision(2)
+         << "Finished in " << elapsed.count() << "s" << endl
+         << "completed: " << results.completed
+         << ", failed as recorded: " << results.failed_as_recorded
+         << ", handshake failures: " << results.handshake_failures
+         << ", truncated: " << results.truncated
+         << ", stalled: " << results.stalled << endl
+         << "relayed: " << results.byte_count / 1048576.0 << "MB ("
+         << results.byte_count / 1048576.0 / elapsed.count() << "MB/s)" << endl
+         << "handshake time: p50 " << get_percentile(results.handshake_times, 0.5)
+         << "us, p99 " << get_percentile(results.handshake_times, 0.99) << "us" << endl;
+    const uint64_t failure_count = results.handshake_failures + results.truncated +
+                                   results.stalled;
+    return failure_count > 0 ? 1 : 0;
+}
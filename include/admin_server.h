@@ -0,0 +1,43 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <functional>
+#include <boost/asio/local/stream_protocol.hpp>
+
+namespace boost { namespace asio { class io_service; } }
+
+namespace roberto {
+
+// Answers queries sent by operators through a unix socket.
+//
+// Every query is a single line holding the name of a command. The command's output is
+// written back and the connection is then closed, so it can be queried with tools like
+// `echo top-destinations | socat - UNIX-CONNECT:<path>`.
+class AdminServer {
+public:
+    using Command = std::function<std::string()>;
+
+    AdminServer(boost::asio::io_service& io_service, std::string socket_path);
+    ~AdminServer();
+
+    // Commands are run on the thread that serves the query, so they must be thread safe
+    void add_command(const std::string& name, Command command);
+    void start();
+    void stop();
+private:
+    using LocalProtocol = boost::asio::local::stream_protocol;
+
+    class Session;
+
+    void start_accept();
+    void handle_accept(const boost::system::error_code& error);
+    std::string run_command(const std::string& name) const;
+
+    std::string socket_path_;
+    LocalProtocol::acceptor acceptor_;
+    LocalProtocol::socket peer_socket_;
+    std::map<std::string, Command> commands_;
+};
+
+} // roberto
@@ -2,6 +2,7 @@
 
 #include <set>
 #include <string>
+#include <vector>
 #include <utility>
 
 namespace roberto {
@@ -11,6 +12,7 @@ public:
     void add_credentials(std::string username, std::string password);
     bool validate_credentials(std::string username, std::string password) const;
     size_t get_credentials_count() const;
+    std::vector<std::string> get_usernames() const;
 private:
     using Credentials = std::pair<std::string, std::string>;
 
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <map>
+#include <array>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include "token_bucket.h"
+#include "relay_direction.h"
+
+namespace roberto {
+
+// A token bucket that can be shared by connections running on different threads
+class SharedTokenBucket {
+public:
+    explicit SharedTokenBucket(uint64_t rate);
+
+    TokenBucket::Clock::duration consume(uint64_t amount, TokenBucket::Clock::time_point now);
+private:
+    std::mutex mutex_;
+    TokenBucket bucket_;
+};
+
+// Limits the bandwidth used by a single connection. Each direction is limited independently
+// by a hierarchy of buckets: global, per user and per connection
+class BandwidthLimiter {
+public:
+    using Clock = TokenBucket::Clock;
+
+    Clock::duration consume(RelayDirection direction, uint64_t amount);
+private:
+    friend class BandwidthManager;
+
+    struct Buckets {
+        std::vector<std::shared_ptr<SharedTokenBucket>> shared_buckets;
+        std::unique_ptr<TokenBucket> connection_bucket;
+    };
+
+    std::array<Buckets, RELAY_DIRECTION_COUNT> buckets_;
+};
+
+class BandwidthManager {
+public:
+    // All rates are in bytes per second. A rate of 0 means unlimited
+    struct Limits {
+        uint64_t global_rate;
+        uint64_t user_rate;
+        uint64_t connection_rate;
+    };
+
+    explicit BandwidthManager(const Limits& limits);
+
+    void set_user_rate(const std::string& username, uint64_t rate);
+    std::unique_ptr<BandwidthLimiter> make_limiter(const std::string& username);
+private:
+    using SharedBuckets = std::array<std::shared_ptr<SharedTokenBucket>, RELAY_DIRECTION_COUNT>;
+    using WeakSharedBuckets = std::array<std::weak_ptr<SharedTokenBucket>, RELAY_DIRECTION_COUNT>;
+
+    SharedBuckets get_user_buckets(const std::string& username);
+
+    Limits limits_;
+    SharedBuckets global_buckets_;
+    std::map<std::string, uint64_t> user_rates_;
+    std::map<std::string, WeakSharedBuckets> user_buckets_;
+    std::mutex user_buckets_mutex_;
+};
+
+} // roberto
@@ -1,22 +1,35 @@
 #pragma once
 
+#include <chrono>
 #include <memory>
-#include <functional>
 #include <vector>
+#include <functional>
 #include <cstdint>
 #include <boost/variant.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "handler_allocator.h"
+#include "ring_buffer.h"
+#include "socket_options.h"
+#include "stream_socket.h"
+#include "upstream_pool.h"
 
 namespace boost { namespace asio { class io_service; } }
 
 namespace roberto {
 
+// An outbound connection, either to a TCP endpoint or to a Unix domain socket. TCP connections
+// can also be made through a parent SOCKS5 proxy
 class Channel : public std::enable_shared_from_this<Channel> {
 public:
     struct Error {
         enum class Stage {
             DNS,
             CONNECT,
+            // Resolving, connecting to or negotiating with the parent proxy failed, which
+            // says nothing about the target
+            PARENT,
             READ,
             WRITE
         };
@@ -30,50 +43,90 @@ public:
     };
 
     struct Read {
-        std::vector<uint8_t>::const_iterator buffer_start;
-        std::vector<uint8_t>::const_iterator buffer_end;
+        size_t bytes_read;
     };
 
     struct Write {
-
+        size_t bytes_written;
     };
 
     using StatusVariant = boost::variant<Error, Connected, Read, Write>;
     using StatusCallback = std::function<void(const StatusVariant&)>;
 
+    // If the unix path is not empty, the connection is made to it rather than to the address
+    // and port, which are then only used to identify the target
     Channel(boost::asio::io_service& io_service, boost::asio::ip::tcp::resolver& resolver,
-            const std::string& address, uint16_t port, StatusCallback status_callback);
+            const std::string& address, uint16_t port, const std::string& unix_path,
+            const SocketOptions& socket_options, StatusCallback status_callback);
+
+    // Used by ObjectPool when this channel is reused/returned to the pool
+    void initialize(boost::asio::ip::tcp::resolver& resolver, const std::string& address,
+                    uint16_t port, const std::string& unix_path,
+                    const SocketOptions& socket_options, StatusCallback status_callback);
+    void reset();
+
+    boost::asio::io_service& get_io_service();
 
     std::string get_target_endpoint() const;
     boost::asio::ip::tcp::endpoint get_local_endpoint() const;
+    int get_native_handle();
 
+    // Sends the SYN along with the first write if the socket options use fast open. Must be
+    // called before start, and only if there's data ready to be written as soon as connected
+    void enable_fast_open();
     void start();
+    // Uses an already established connection to the target instead of connecting to it
+    void start(StreamSocket connected_socket);
+    // Connects to the parent and asks it to connect to the target. Fails if that takes longer
+    // than the parent's handshake timeout
+    void start(UpstreamPool::Lease parent);
     void cancel();
-    void read(size_t max_size);
-    void write(const std::vector<uint8_t>& buffer);
-    template <typename ForwardIterator>
-    void write(const ForwardIterator& start, const ForwardIterator& end) {
-        write_buffer_.assign(start, end);
-        write_output_buffer();
-    }
+    // The buffers are owned by the caller and must be kept alive until the operation completes
+    void read(const RingBuffer::MutableBuffers& buffers);
+    void write(const RingBuffer::ConstBuffers& buffers);
 private:
     using Resolver = boost::asio::ip::tcp::resolver;
+    using ParentHandler = void (Channel::*)(const boost::system::error_code&);
 
     void connect(Resolver::iterator iter);
+    void connect_unix();
     void handle_resolve(const boost::system::error_code& error, Resolver::iterator iter);
     void handle_connect(const boost::system::error_code& error, Resolver::iterator iter);
     void handle_read(const boost::system::error_code& error, size_t bytes_read);
-    void handle_write(const boost::system::error_code& error, size_t bytes_read);
-
-    void write_output_buffer();
-
-    boost::asio::ip::tcp::socket socket_;
-    Resolver& resolver_;
+    void handle_write(const boost::system::error_code& error, size_t bytes_written);
+
+    // Parent proxy handshake. Each step writes the handshake buffer and reads the given amount
+    // of bytes back into it
+    void exchange_with_parent(size_t response_size, ParentHandler handler);
+    void handle_parent_write(const boost::system::error_code& error, size_t response_size,
+                             ParentHandler handler);
+    void handle_parent_method(const boost::system::error_code& error);
+    void handle_parent_authentication(const boost::system::error_code& error);
+    void send_parent_connect();
+    void handle_parent_reply_header(const boost::system::error_code& error);
+    void handle_parent_reply_end(const boost::system::error_code& error);
+    void handle_parent_deadline(const boost::system::error_code& error);
+    void fail_parent_handshake(const boost::system::error_code& error);
+    void finish_connecting();
+
+    StreamSocket socket_;
+    Resolver* resolver_;
     std::string address_;
     uint16_t port_;
+    std::string unix_path_;
+    SocketOptions socket_options_;
     StatusCallback status_callback_;
-    std::vector<uint8_t> read_buffer_;
-    std::vector<uint8_t> write_buffer_;
+    bool fast_open_{false};
+    HandlerAllocator read_allocator_;
+    HandlerAllocator write_allocator_;
+    // Empty unless connecting through a parent proxy
+    UpstreamPool::Lease parent_;
+    // The parent handshake and its deadline run within the strand
+    boost::asio::strand parent_strand_;
+    boost::asio::steady_timer parent_deadline_;
+    bool parent_timed_out_{false};
+    std::vector<uint8_t> handshake_buffer_;
+    std::chrono::steady_clock::time_point connect_start_time_;
 };
 
 } // roberto
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <array>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <unordered_map>
+#include "socks_messages.h"
+
+namespace boost { namespace system { class error_code; } }
+
+namespace roberto {
+
+// Keeps track of the health of every destination connections are made to, so connection
+// requests to destinations that are known to be down fail right away instead of tying up a
+// socket until the connection attempt times out.
+//
+// After a number of consecutive failures a destination's circuit is opened, and requests to it
+// are rejected. Once the circuit has been open for a while a single probe attempt is let
+// through: if it succeeds the circuit is closed, otherwise it's kept open for twice as long.
+//
+// Destinations are spread over shards, each with its own lock, so unrelated destinations
+// don't contend with each other.
+class CircuitBreaker {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    CircuitBreaker(size_t failure_threshold, Clock::duration open_duration);
+
+    // Returns false if requests to the destination must be rejected, in which case the reply
+    // to send to the client is stored in the given reference
+    bool allow_attempt(const std::string& destination, ReplyType& reply);
+    void record_success(const std::string& destination, Clock::duration connect_latency);
+    void record_failure(const std::string& destination, const boost::system::error_code& error);
+private:
+    enum class State {
+        CLOSED,
+        OPEN,
+        HALF_OPEN
+    };
+
+    struct Destination {
+        State state{State::CLOSED};
+        size_t consecutive_failures{0};
+        ReplyType failure_reply{ReplyType::HOST_UNREACHABLE};
+        Clock::duration open_duration{};
+        // While open this is when the next probe is allowed, while half open it's when the
+        // current probe is considered lost, e.g. if its connection was cancelled
+        Clock::time_point next_probe;
+        // An exponentially weighted moving average of the connect latency
+        Clock::duration average_latency{};
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        std::unordered_map<std::string, Destination> destinations;
+    };
+
+    static constexpr size_t SHARD_COUNT = 16;
+    static constexpr size_t MAX_SHARD_DESTINATIONS = 4096;
+
+    Shard& get_shard(const std::string& destination);
+    Destination* find_or_insert(Shard& shard, const std::string& destination);
+
+    size_t failure_threshold_;
+    Clock::duration open_duration_;
+    Clock::duration max_open_duration_;
+    std::array<Shard, SHARD_COUNT> shards_;
+};
+
+} // roberto
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <map>
+#include <array>
+#include <chrono>
+#include <string>
 #include <vector>
 #include <type_traits>
 #include <cstring>
@@ -10,23 +13,39 @@
 #include <boost/asio/strand.hpp>
 #include <boost/variant/static_visitor.hpp>
 #include "channel.h"
+#include "connection_context.h"
+#include "bandwidth_manager.h"
+#include "traffic_accountant.h"
+#include "heavy_hitters.h"
+#include "traffic_recorder.h"
+#include "socks_messages.h"
+#include "handler_allocator.h"
+#include "ring_buffer.h"
+#include "relay_direction.h"
+#include "stream_socket.h"
+#include "socket_redirector.h"
+#include "relay_scheduler.h"
 
 namespace boost { namespace asio { class io_service; } }
 
 namespace roberto {
 
-class AuthenticationManager;
-
 class ClientConnection : public std::enable_shared_from_this<ClientConnection> {
 public:
-    using SocketType = boost::asio::ip::tcp::socket;
+    using SocketType = StreamSocket;
 
     ClientConnection(boost::asio::io_service& io_service,
                      boost::asio::ip::tcp::resolver& resolver,
-                     std::shared_ptr<AuthenticationManager> auth_manager);
+                     std::shared_ptr<const ConnectionContext> context);
+
+    // Used by ObjectPool when this connection is reused/returned to the pool
+    void initialize(boost::asio::ip::tcp::resolver& resolver,
+                    std::shared_ptr<const ConnectionContext> context);
+    void reset();
 
     SocketType& get_socket();
     const SocketType& get_socket() const;
+    boost::asio::io_service& get_io_service();
 
     void start();
     void cancel();
@@ -34,16 +53,21 @@ private:
     enum ReadState {
         METHOD_SELECTION,
         METHOD_SELECTION_LIST,
+        AWAITING_AUTH_USERNAME_LENGTH,
+        AWAITING_AUTH_USERNAME,
+        AWAITING_AUTH_PASSWORD,
         AWAITING_COMMAND,
         AWAITING_COMMAND_ENDPOINT_IPV4,
         AWAITING_COMMAND_ENDPOINT_IPV6,
         AWAITING_COMMAND_ENDPOINT_DOMAIN_LENGTH,
         AWAITING_COMMAND_ENDPOINT_DOMAIN_BODY,
+        AWAITING_HTTP_REQUEST,
         PROXY_READ,
     };
 
     enum WriteState {
         SENDING_METHOD,
+        SENDING_AUTH_RESPONSE,
         SENDING_COMMAND_RESPONSE,
         PROXY_WRITE
     };
@@ -69,11 +93,32 @@ private:
 
     friend class VariantDispatcher;
 
+    // The data relayed in one direction. Reads into the buffer continue while the data
+    // already in it is being written, so everything that accumulates goes out in one write
+    struct RelayState {
+        RelayState();
+
+        RingBuffer buffer;
+        bool reading{false};
+        bool writing{false};
+        bool throttled{false};
+        bool flush_scheduled{false};
+        // The source was closed, only what's left in the buffer needs to be relayed
+        bool finished{false};
+        RelayScheduler::Flow flow;
+    };
+
+    static constexpr size_t RELAY_BUFFER_SIZE = 16 * 1024;
+    // Once this much data is buffered, waiting for more won't make segments any bigger
+    static constexpr size_t COALESCING_THRESHOLD = 1460;
+    // How often to check whether the kernel is done relaying a closed connection
+    static constexpr std::chrono::milliseconds REDIRECTION_DRAIN_INTERVAL{10};
+
     static const ReadStateHandlerMap READ_STATE_HANDLERS;
     static const WriteStateHandlerMap WRITE_STATE_HANDLERS;
 
     void schedule_read(size_t byte_count, size_t write_offset = 0);
-    void schedule_read_some();
+    void schedule_http_read();
     void schedule_write();
 
     template <typename T>
@@ -83,11 +128,6 @@ private:
         std::memcpy(write_buffer_.data() + offset, &contents, sizeof(contents));
     }
 
-    template <typename ForwardIterator>
-    void set_buffer(const ForwardIterator& start, const ForwardIterator& end) {
-        write_buffer_.assign(start, end);
-    }
-
     template <typename T>
     const T* cast_buffer(size_t offset = 0) {
         assert(read_buffer_.size() >= (sizeof(T) + offset));
@@ -107,29 +147,85 @@ private:
     // Read state handlers
     void handle_method_selection(size_t bytes_read);
     void handle_method_selection_list(size_t bytes_read);
+    void handle_auth_username_length(size_t bytes_read);
+    void handle_auth_username(size_t bytes_read);
+    void handle_auth_password(size_t bytes_read);
     void handle_command(size_t bytes_read);
     void handle_endpoint_ipv4(size_t bytes_read);
     void handle_endpoint_ipv6(size_t bytes_read);
     void handle_endpoint_domain_length(size_t bytes_read);
     void handle_endpoint_domain(size_t bytes_read);
+    void handle_http_request(size_t bytes_read);
     void handle_command_endpoint(const std::string& address, uint16_t port);
+    void make_command_reply(ReplyType reply, const boost::asio::ip::tcp::endpoint& endpoint);
+    void send_command_failure(ReplyType reply);
+    void send_http_error(unsigned status_code);
+    void reset_client();
     void handle_client_read(size_t bytes_read);
 
     // Write state handlers
     void handle_method_sent(size_t bytes_written);
+    void handle_auth_response_sent(size_t bytes_written);
     void handle_command_response_sent(size_t bytes_written);
     void handle_client_write(size_t bytes_written);
 
-    boost::asio::ip::tcp::socket socket_;
-    boost::asio::ip::tcp::resolver& resolver_;
+    // Relaying
+    SocketRedirector::Status redirect_in_kernel();
+    void stop_redirecting();
+    bool has_early_data();
+    void start_relaying();
+    void relay_read(RelayDirection direction);
+    void relay_write(RelayDirection direction);
+    void start_relay_write(RelayDirection direction);
+    void handle_relay_read(RelayDirection direction, size_t bytes_read);
+    void handle_relay_write(RelayDirection direction, size_t bytes_written);
+    void handle_relay_eof(RelayDirection direction);
+    void finish_relay(RelayDirection direction);
+    bool is_redirection_drained(RelayDirection direction);
+    void resume_relay_read(RelayDirection direction);
+    void flush_relay(RelayDirection direction);
+
+    // Traffic accounting, bandwidth shaping and relay scheduling
+    bool account_traffic(RelayDirection direction, size_t byte_count);
+    BandwidthLimiter::Clock::duration throttle(RelayDirection direction,
+                                               size_t byte_count);
+    bool must_yield(RelayDirection direction, size_t byte_count);
+    void schedule_throttled(BandwidthLimiter::Clock::duration delay,
+                            std::function<void()> callback);
+    void schedule_delayed(std::chrono::steady_clock::duration delay,
+                          std::function<void()> callback);
+
+    SocketType socket_;
+    boost::asio::ip::tcp::resolver* resolver_;
     boost::asio::strand strand_;
-    boost::asio::ip::tcp::endpoint endpoint_;
-    std::shared_ptr<AuthenticationManager> auth_manager_;
+    std::string endpoint_;
+    std::shared_ptr<const ConnectionContext> context_;
+    std::unique_ptr<BandwidthLimiter> bandwidth_limiter_;
+    std::unique_ptr<TrafficAccount> traffic_account_;
+    std::unique_ptr<HeavyHitterAccount> heavy_hitter_account_;
+    std::unique_ptr<TrafficRecording> traffic_recording_;
+    std::string username_;
     std::vector<uint8_t> read_buffer_;
     std::vector<uint8_t> write_buffer_;
     std::shared_ptr<Channel> outbound_connection_;
+    std::chrono::steady_clock::time_point connect_start_time_;
+    std::array<RelayState, RELAY_DIRECTION_COUNT> relays_;
+    HandlerAllocator read_allocator_;
+    HandlerAllocator write_allocator_;
+    HandlerAllocator status_allocator_;
     ReadState read_state_{ReadState::METHOD_SELECTION};
     WriteState write_state_{};
+    // Set if the client is speaking HTTP CONNECT rather than socks
+    bool is_http_{false};
+    size_t http_request_size_{0};
+    bool target_connected_{false};
+    // Set if the client was told it's connected before the connection to the target was made
+    bool replied_optimistically_{false};
+    // Set if the kernel is relaying between the sockets. The counts are taken from the client
+    // socket for the upstream direction and from the target socket for the downstream one
+    bool redirected_{false};
+    SocketRedirector::Pair redirected_pair_;
+    std::array<SocketRedirector::ByteCounts, RELAY_DIRECTION_COUNT> redirection_start_counts_;
 };
 
 } // roberto
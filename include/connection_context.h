@@ -0,0 +1,63 @@
+#pragma once
+
+#include <map>
+#include <memory>
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include "socket_options.h"
+#include "relay_scheduler.h"
+
+namespace roberto {
+
+class AuthenticationManager;
+class BandwidthManager;
+class TrafficAccountant;
+class TrafficRecorder;
+class CircuitBreaker;
+class HeavyHitterTracker;
+class WarmConnectionPool;
+class SocketRedirector;
+class UpstreamPool;
+
+// The services shared by every client connection. Any of them can be null if the feature
+// they implement is disabled
+struct ConnectionContext {
+    // The path connections to the destination are made through, or empty if it's not mapped
+    const std::string& get_unix_egress_path(const std::string& address, uint16_t port) const {
+        static const std::string no_path;
+        if (unix_egress_paths.empty()) {
+            return no_path;
+        }
+        auto iter = unix_egress_paths.find(address + ":" + std::to_string(port));
+        return iter == unix_egress_paths.end() ? no_path : iter->second;
+    }
+
+    std::shared_ptr<AuthenticationManager> auth_manager;
+    std::shared_ptr<BandwidthManager> bandwidth_manager;
+    std::shared_ptr<TrafficAccountant> traffic_accountant;
+    std::shared_ptr<TrafficRecorder> traffic_recorder;
+    std::shared_ptr<CircuitBreaker> circuit_breaker;
+    std::shared_ptr<HeavyHitterTracker> heavy_hitter_tracker;
+    // Belongs to the same io_service connections using this context run on
+    std::shared_ptr<WarmConnectionPool> warm_connection_pool;
+    std::shared_ptr<SocketRedirector> socket_redirector;
+    // If set, TCP connections are made through its parent proxies rather than directly
+    std::shared_ptr<UpstreamPool> upstream_pool;
+    // How long small relayed writes are held back so they can be coalesced with the data
+    // that follows them. Zero flushes them right away
+    std::chrono::microseconds coalescing_window{0};
+    // Whether clients are told they're connected before the connection to the target is made
+    bool optimistic_connect{false};
+    // How relays take turns on the threads. Disabled by default
+    RelayScheduler::Policy relay_scheduling;
+    // Applied to the listening socket and to every accepted client socket
+    SocketOptions listener_socket_options;
+    // Applied to outbound connections, depending on their destination port
+    EgressSocketProfiles egress_socket_profiles;
+    // Connections to these host:port destinations are made through the Unix domain socket
+    // at the mapped path instead, e.g. for services running on this same host
+    std::map<std::string, std::string> unix_egress_paths;
+};
+
+} // roberto
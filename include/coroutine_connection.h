@@ -0,0 +1,98 @@
+#pragma once
+
+#include <array>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/strand.hpp>
+#include "connection_context.h"
+#include "handler_allocator.h"
+#include "relay_direction.h"
+#include "bandwidth_manager.h"
+#include "traffic_accountant.h"
+#include "heavy_hitters.h"
+#include "traffic_recorder.h"
+#include "relay_scheduler.h"
+#include "stream_socket.h"
+
+namespace boost { namespace asio { class io_service; } }
+
+namespace roberto {
+
+// Serves a client connection using stackless coroutines instead of explicit state machines.
+//
+// This object is the coroutine frame: every bit of state used while serving the connection
+// lives in it, including the outbound socket. It's owned by the coroutines running on it:
+// first the handshake one and then a relay one for each direction. Once the last of them
+// finishes, the frame is destroyed and its memory is recycled.
+//
+// Every coroutine step runs within the connection's strand.
+class CoroutineConnection {
+public:
+    using SocketType = StreamSocket;
+
+    static void* operator new(size_t size);
+    static void operator delete(void* pointer);
+
+    // Starts serving the connection. Ownership is transferred to the connection's coroutines
+    static void start(std::unique_ptr<CoroutineConnection> connection);
+
+    CoroutineConnection(boost::asio::io_service& io_service,
+                        boost::asio::ip::tcp::resolver& resolver,
+                        std::shared_ptr<const ConnectionContext> context);
+
+    SocketType& get_socket();
+private:
+    class Handshake;
+    class Relay;
+
+    using Resolver = boost::asio::ip::tcp::resolver;
+
+    static constexpr size_t BUFFER_SIZE = 4096;
+
+    template <typename T>
+    const T* cast_buffer(size_t offset = 0) const {
+        return reinterpret_cast<const T*>(buffers_[UPSTREAM].data() + offset);
+    }
+
+    template <typename T>
+    void set_buffer(const T& contents) {
+        const auto* contents_start = reinterpret_cast<const uint8_t*>(&contents);
+        write_buffer_.assign(contents_start, contents_start + sizeof(contents));
+    }
+
+    bool account_traffic(RelayDirection direction, size_t byte_count);
+    BandwidthLimiter::Clock::duration throttle(RelayDirection direction, size_t byte_count);
+    bool must_yield(RelayDirection direction, size_t byte_count);
+    void schedule_throttled(BandwidthLimiter::Clock::duration delay,
+                            std::function<void()> callback);
+    void wait_for_turn(std::function<void()> callback);
+    void close();
+    void release();
+
+    SocketType client_socket_;
+    SocketType target_socket_;
+    Resolver& resolver_;
+    boost::asio::strand strand_;
+    std::shared_ptr<const ConnectionContext> context_;
+    std::string endpoint_;
+    std::string username_;
+    std::string target_address_;
+    uint16_t target_port_{0};
+    Resolver::iterator target_endpoints_;
+    std::unique_ptr<BandwidthLimiter> bandwidth_limiter_;
+    std::unique_ptr<TrafficAccount> traffic_account_;
+    std::unique_ptr<HeavyHitterAccount> heavy_hitter_account_;
+    std::unique_ptr<TrafficRecording> traffic_recording_;
+    std::array<std::vector<uint8_t>, RELAY_DIRECTION_COUNT> buffers_;
+    std::vector<uint8_t> write_buffer_;
+    std::array<HandlerAllocator, RELAY_DIRECTION_COUNT> allocators_;
+    std::array<RelayScheduler::Flow, RELAY_DIRECTION_COUNT> flows_;
+    // Only touched within the strand, so there's no need for this to be atomic
+    size_t coroutine_count_{0};
+};
+
+} // roberto
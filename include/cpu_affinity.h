@@ -0,0 +1,13 @@
+#pragma once
+
+namespace roberto {
+
+// Pins the calling thread to the given CPU and makes the memory it allocates from then on come
+// from that CPU's NUMA node. As buffer and object pools are per thread, this keeps the memory
+// each I/O thread relays through on its own node
+void pin_current_thread(int cpu);
+
+// Returns the NUMA node the given CPU belongs to, or -1 if it can't be determined
+int get_numa_node(int cpu);
+
+} // roberto
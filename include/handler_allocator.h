@@ -0,0 +1,70 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <type_traits>
+
+namespace roberto {
+
+// Recycles the memory used by asio when storing completion handlers.
+//
+// Connections only ever have a single outstanding operation in each direction, so a couple of
+// fixed size slots are enough to hold every operation. If every slot is in use or the handler
+// doesn't fit in one, the memory is taken from the heap instead.
+class HandlerAllocator {
+public:
+    HandlerAllocator();
+    HandlerAllocator(const HandlerAllocator&) = delete;
+    HandlerAllocator& operator=(const HandlerAllocator&) = delete;
+
+    void* allocate(size_t size);
+    void deallocate(void* pointer);
+private:
+    static constexpr size_t SLOT_SIZE = 384;
+    static constexpr size_t SLOT_COUNT = 2;
+
+    struct Slot {
+        typename std::aligned_storage<SLOT_SIZE>::type storage;
+        std::atomic<bool> in_use;
+    };
+
+    std::array<Slot, SLOT_COUNT> slots_;
+};
+
+// Wraps a handler so that asio allocates its memory using a HandlerAllocator
+template <typename Handler>
+class AllocatingHandler {
+public:
+    AllocatingHandler(HandlerAllocator& allocator, Handler handler)
+    : allocator_(&allocator), handler_(std::move(handler)) {
+
+    }
+
+    template <typename... Args>
+    void operator()(Args&&... args) {
+        handler_(std::forward<Args>(args)...);
+    }
+
+    friend void* asio_handler_allocate(size_t size, AllocatingHandler* this_handler) {
+        return this_handler->allocator_->allocate(size);
+    }
+
+    friend void asio_handler_deallocate(void* pointer, size_t /*size*/,
+                                        AllocatingHandler* this_handler) {
+        this_handler->allocator_->deallocate(pointer);
+    }
+private:
+    HandlerAllocator* allocator_;
+    Handler handler_;
+};
+
+template <typename Handler>
+AllocatingHandler<typename std::decay<Handler>::type>
+make_allocating_handler(HandlerAllocator& allocator, Handler&& handler) {
+    using HandlerType = typename std::decay<Handler>::type;
+    return AllocatingHandler<HandlerType>(allocator, std::forward<Handler>(handler));
+}
+
+} // roberto
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <mutex>
+#include <array>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace roberto {
+
+// Estimates how many times each key showed up in a stream using a fixed amount of memory.
+// Estimates never fall below the real count, and collisions make them overshoot it by a
+// small fraction of the stream's total with high probability
+class CountMinSketch {
+public:
+    CountMinSketch(size_t width, size_t depth);
+
+    void add(uint64_t key_hash, uint64_t count);
+    uint64_t estimate(uint64_t key_hash) const;
+    void merge(const CountMinSketch& other);
+    void clear();
+private:
+    size_t get_index(uint64_t key_hash, size_t row) const;
+
+    size_t width_;
+    size_t depth_;
+    std::vector<uint64_t> counters_;
+};
+
+// Keeps track of the keys with the highest counts in a stream using a fixed amount of entries
+// (the space saving algorithm). A key that isn't tracked takes over the entry with the lowest
+// count, so the count of every entry is an upper bound of its key's count
+class SpaceSaving {
+public:
+    struct Entry {
+        std::string key;
+        uint64_t key_hash;
+        uint64_t count;
+    };
+
+    explicit SpaceSaving(size_t capacity);
+
+    void add(const std::string& key, uint64_t key_hash, uint64_t count);
+    const std::vector<Entry>& get_entries() const;
+    void clear();
+private:
+    std::vector<Entry> entries_;
+    size_t capacity_;
+};
+
+// Tracks the destinations and client addresses driving the most connections and traffic.
+//
+// Every thread records into its own shard, made of a count-min sketch and a space saving
+// summary per kind of key and metric, so memory use doesn't depend on how many distinct keys
+// there are. Queries merge the shards: the summaries provide the candidate keys and the merged
+// sketches provide their counts.
+//
+// Only recent traffic is reported. Time is split into windows, and shards keep the summaries
+// of the current window and the previous one. Whatever was recorded before that is dropped.
+class HeavyHitterTracker {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    enum KeyType {
+        DESTINATION,
+        CLIENT,
+        KEY_TYPE_COUNT
+    };
+
+    enum Metric {
+        CONNECTIONS,
+        BYTES,
+        METRIC_COUNT
+    };
+
+    struct HeavyHitter {
+        std::string key;
+        uint64_t connections;
+        uint64_t bytes;
+    };
+
+    HeavyHitterTracker(size_t top_count, Clock::duration window_duration);
+
+    static uint64_t hash_key(const std::string& key);
+
+    void record(KeyType key_type, Metric metric, const std::string& key, uint64_t key_hash,
+                uint64_t count);
+
+    // The keys with the highest count for the given metric, highest first
+    std::vector<HeavyHitter> get_top(KeyType key_type, Metric metric) const;
+    // How far back the counts reported right now go: the previous window and however much of
+    // the current one has elapsed
+    Clock::duration get_reported_duration() const;
+    // A human readable report of both metrics for the given kind of key
+    std::string format_report(KeyType key_type) const;
+private:
+    struct Summary {
+        Summary(size_t capacity);
+
+        CountMinSketch sketch;
+        SpaceSaving top;
+    };
+
+    // Only the owning thread records into a shard, the mutex is there for queries
+    struct Shard {
+        explicit Shard(size_t capacity);
+
+        // Drops whatever is older than the previous window. Must hold the mutex
+        void rotate(uint64_t window);
+
+        mutable std::mutex mutex;
+        std::vector<Summary> summaries;
+        std::vector<Summary> previous_summaries;
+        uint64_t window{0};
+    };
+
+    static size_t get_summary_index(KeyType key_type, Metric metric);
+
+    uint64_t get_window(Clock::time_point now) const;
+    Shard& get_thread_shard();
+
+    size_t top_count_;
+    Clock::duration window_duration_;
+    Clock::time_point start_time_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    mutable std::mutex shards_mutex_;
+};
+
+// Records the connection and traffic of a single client connection into a tracker. Traffic is
+// recorded in batches, so relaying data rarely touches the tracker
+class HeavyHitterAccount {
+public:
+    HeavyHitterAccount(HeavyHitterTracker& tracker, std::string destination, std::string client);
+    ~HeavyHitterAccount();
+
+    HeavyHitterAccount(const HeavyHitterAccount&) = delete;
+    HeavyHitterAccount& operator=(const HeavyHitterAccount&) = delete;
+
+    void record(uint64_t byte_count);
+private:
+    static const uint64_t RECORD_BATCH_BYTES;
+
+    void flush();
+
+    HeavyHitterTracker* tracker_;
+    std::array<std::string, HeavyHitterTracker::KEY_TYPE_COUNT> keys_;
+    std::array<uint64_t, HeavyHitterTracker::KEY_TYPE_COUNT> key_hashes_;
+    uint64_t unrecorded_bytes_{0};
+};
+
+} // roberto
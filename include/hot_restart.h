@@ -0,0 +1,51 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <boost/asio/local/stream_protocol.hpp>
+
+namespace boost { namespace asio { class io_service; } }
+
+namespace roberto {
+
+// Hands the listening sockets over to a new instance so it can be restarted without
+// refusing connections.
+//
+// The running instance listens on a unix socket. A new instance connects to it and receives
+// the listening sockets through SCM_RIGHTS. Both instances then share the same accept queues,
+// so no pending connection is lost. Once the new instance is accepting connections it
+// acknowledges the handoff, and the running one stops accepting and drains its connections.
+class HotRestarter {
+public:
+    using HandoffCallback = std::function<void()>;
+
+    HotRestarter(boost::asio::io_service& io_service, std::string socket_path);
+    ~HotRestarter();
+
+    // Takes over the listening sockets of the running instance, if there's one. The running
+    // instance keeps accepting connections until the takeover is completed
+    std::vector<int> take_over_sockets();
+    void complete_takeover();
+
+    // Waits for a new instance to hand the listening sockets over to. The callback is
+    // executed once it has taken them over
+    void listen(std::vector<int> listening_sockets, HandoffCallback handoff_callback);
+private:
+    using LocalProtocol = boost::asio::local::stream_protocol;
+
+    void start_accept();
+    void handle_accept(const boost::system::error_code& error);
+    void handle_acknowledgement(const boost::system::error_code& error, size_t bytes_read);
+
+    std::string socket_path_;
+    LocalProtocol::acceptor acceptor_;
+    LocalProtocol::socket peer_socket_;
+    std::vector<int> listening_sockets_;
+    HandoffCallback handoff_callback_;
+    int takeover_socket_{-1};
+    uint8_t acknowledgement_{0};
+};
+
+} // roberto
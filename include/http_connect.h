@@ -0,0 +1,49 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <boost/utility/string_ref.hpp>
+#include "socks_messages.h"
+
+namespace roberto {
+
+// An HTTP CONNECT request. Every field points into the buffer the request was parsed from
+struct HttpConnectRequest {
+    boost::string_ref host;
+    uint16_t port{0};
+    // The base64 encoded credentials of a Basic Proxy-Authorization header, if any
+    boost::string_ref credentials;
+    // The size of the request line and headers. Anything after them is tunneled data
+    size_t size{0};
+};
+
+enum class HttpParseStatus {
+    COMPLETE,
+    INCOMPLETE,
+    BAD_REQUEST,
+    METHOD_NOT_ALLOWED
+};
+
+// Whether a connection starting with this byte is speaking HTTP rather than SOCKS, whose first
+// byte is its version
+bool is_http_request_start(uint8_t byte);
+
+// Parses a CONNECT request in place, without allocating. Returns INCOMPLETE if the buffer
+// doesn't contain the whole request yet
+HttpParseStatus parse_http_connect(const uint8_t* data, size_t size,
+                                   HttpConnectRequest& request);
+
+// HTTP clients can send IP addresses as well as domain names
+AddressType get_host_address_type(const std::string& host);
+
+// Decodes Basic credentials in the format base64(username:password)
+bool decode_http_credentials(boost::string_ref credentials, std::string& username,
+                             std::string& password);
+
+// Builds the response to a CONNECT request into the given buffer, either out of the reply to
+// the connection attempt or out of an HTTP status code
+void make_http_response(std::vector<uint8_t>& buffer, ReplyType reply);
+void make_http_response(std::vector<uint8_t>& buffer, unsigned status_code);
+
+} // roberto
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <mutex>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <condition_variable>
+#include <pthread.h>
+#include <sys/types.h>
+
+namespace roberto {
+
+// Measures how long every completion handler takes to run and detects I/O threads that don't
+// return to the event loop in time.
+//
+// Handlers record their latency into histograms owned by the thread running them, so timing a
+// handler only costs a couple of clock reads. A watchdog thread keeps an eye on the handler
+// each thread is running, logging it along with that thread's backtrace when it stalls, and
+// periodically logs the latency distribution of every handler type.
+class LoopProfiler {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Duration = Clock::duration;
+
+    enum HandlerType {
+        SERVER_ACCEPT,
+        CLIENT_READ,
+        CLIENT_WRITE,
+        CHANNEL_RESOLVE,
+        CHANNEL_CONNECT,
+        CHANNEL_READ,
+        CHANNEL_WRITE,
+        THROTTLE_TIMER,
+        RELAY_TURN,
+        COROUTINE_HANDSHAKE,
+        COROUTINE_RELAY,
+        HANDLER_TYPE_COUNT
+    };
+
+    // Times the handler running in the current scope. Does nothing unless a profiler is started
+    class ScopedTimer {
+    public:
+        explicit ScopedTimer(HandlerType type);
+        ~ScopedTimer();
+
+        ScopedTimer(const ScopedTimer&) = delete;
+        ScopedTimer& operator=(const ScopedTimer&) = delete;
+    private:
+        LoopProfiler* profiler_;
+        HandlerType type_;
+        Clock::time_point start_time_;
+    };
+
+    LoopProfiler(Duration stall_threshold, Duration report_interval);
+    ~LoopProfiler();
+
+    void start();
+    void stop();
+private:
+    // Handler latencies are bucketed in powers of two of microseconds
+    static constexpr size_t HISTOGRAM_BUCKET_COUNT = 32;
+    static constexpr size_t MAX_BACKTRACE_FRAMES = 64;
+
+    using Histogram = std::array<uint64_t, HISTOGRAM_BUCKET_COUNT>;
+    using Histograms = std::array<Histogram, HANDLER_TYPE_COUNT>;
+
+    // Everything in here is only ever written by the thread it belongs to, except for the
+    // backtrace, which is written by that same thread from within a signal handler
+    struct ThreadState {
+        ThreadState();
+
+        pthread_t thread;
+        pid_t thread_id;
+        std::atomic<int64_t> handler_start{0};
+        std::atomic<int> handler_type{0};
+        size_t handler_depth{0};
+        std::array<std::array<std::atomic<uint64_t>, HISTOGRAM_BUCKET_COUNT>,
+                   HANDLER_TYPE_COUNT> histograms;
+        std::array<void*, MAX_BACKTRACE_FRAMES> backtrace_frames;
+        std::atomic<int> backtrace_size{0};
+        // Only used by the watchdog, to report each stall just once
+        int64_t reported_handler_start{0};
+    };
+
+    static std::atomic<LoopProfiler*> active_profiler_;
+    static const char* HANDLER_NAMES[HANDLER_TYPE_COUNT];
+
+    static void handle_backtrace_signal(int);
+    static size_t get_bucket(Duration duration);
+    static int64_t to_ticks(Clock::time_point time_point);
+
+    ThreadState& get_thread_state();
+    void handler_started(HandlerType type, Clock::time_point start_time);
+    void handler_finished(HandlerType type, Clock::time_point start_time);
+
+    void run();
+    void check_stalls();
+    void log_backtrace(ThreadState& state);
+    void report_latencies();
+
+    Duration stall_threshold_;
+    Duration report_interval_;
+    std::vector<std::unique_ptr<ThreadState>> thread_states_;
+    std::mutex thread_states_mutex_;
+    Histograms reported_histograms_{};
+    std::thread watchdog_thread_;
+    std::mutex stop_mutex_;
+    std::condition_variable stop_condition_;
+    bool stopped_{false};
+};
+
+} // roberto
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <utility>
+#include <boost/asio/io_service.hpp>
+#include "recycling_allocator.h"
+
+namespace roberto {
+
+// Keeps a per thread pool of objects of type T so they can be reused rather than being
+// destroyed and constructed again. Objects are handed out as shared_ptrs which return them to
+// the pool of the thread that drops the last reference to them.
+//
+// T needs to provide:
+// * A constructor taking an io_service followed by some arguments.
+// * An initialize member function, taking those same arguments, which is called when the
+//   object is taken out of the pool.
+// * A reset member function, which releases every resource the object won't need while
+//   pooled (e.g. closes sockets) and is called when it's returned to the pool.
+// * A get_io_service member function.
+template <typename T>
+class ObjectPool {
+public:
+    template <typename... Args>
+    static std::shared_ptr<T> acquire(boost::asio::io_service& io_service, Args&&... args) {
+        FreeList* free_list = get_free_list();
+        std::unique_ptr<T> object;
+        // Objects that belong to a different io_service are useless to us
+        while (free_list && !free_list->objects.empty() && !object) {
+            object = std::move(free_list->objects.back());
+            free_list->objects.pop_back();
+            if (&object->get_io_service() != &io_service) {
+                object.reset();
+            }
+        }
+        if (object) {
+            object->initialize(std::forward<Args>(args)...);
+        }
+        else {
+            object.reset(new T(io_service, std::forward<Args>(args)...));
+        }
+        return std::shared_ptr<T>(object.release(), &ObjectPool::release,
+                                  RecyclingStdAllocator<T>());
+    }
+private:
+    static constexpr size_t MAX_FREE_OBJECTS = 1024;
+
+    struct FreeList {
+        explicit FreeList(bool& destroyed)
+        : destroyed(destroyed) {
+
+        }
+
+        ~FreeList() {
+            destroyed = true;
+        }
+
+        std::vector<std::unique_ptr<T>> objects;
+        bool& destroyed;
+    };
+
+    static void release(T* pointer) {
+        std::unique_ptr<T> object(pointer);
+        FreeList* free_list = get_free_list();
+        // Once the io_service is stopped it's likely about to be destroyed, along with the
+        // services our objects use, so don't hold on to them
+        if (free_list && free_list->objects.size() < MAX_FREE_OBJECTS &&
+            !object->get_io_service().stopped()) {
+            object->reset();
+            free_list->objects.push_back(std::move(object));
+        }
+    }
+
+    static FreeList* get_free_list() {
+        // Same as RecyclingAllocator, objects can be released after the pool is destroyed
+        static thread_local bool destroyed = false;
+        static thread_local FreeList free_list(destroyed);
+        return destroyed ? nullptr : &free_list;
+    }
+};
+
+} // roberto
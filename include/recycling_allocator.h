@@ -0,0 +1,106 @@
+#pragma once
+
+#include <new>
+#include <vector>
+#include <cstddef>
+
+namespace roberto {
+
+// Allocates memory blocks for objects of type T, keeping the ones that are freed in a per
+// thread free list so they can be handed out again without going through the heap.
+//
+// Blocks can be freed on a different thread than the one they were allocated on, in which
+// case they end up on the free list of the thread that freed them.
+template <typename T>
+class RecyclingAllocator {
+public:
+    static void* allocate() {
+        FreeList* free_list = get_free_list();
+        if (!free_list || free_list->blocks.empty()) {
+            return ::operator new(sizeof(T));
+        }
+        void* block = free_list->blocks.back();
+        free_list->blocks.pop_back();
+        return block;
+    }
+
+    static void deallocate(void* block) {
+        FreeList* free_list = get_free_list();
+        if (!free_list || free_list->blocks.size() == MAX_FREE_BLOCKS) {
+            ::operator delete(block);
+        }
+        else {
+            free_list->blocks.push_back(block);
+        }
+    }
+private:
+    static constexpr size_t MAX_FREE_BLOCKS = 1024;
+
+    struct FreeList {
+        explicit FreeList(bool& destroyed)
+        : destroyed(destroyed) {
+            blocks.reserve(MAX_FREE_BLOCKS);
+        }
+
+        ~FreeList() {
+            for (void* block : blocks) {
+                ::operator delete(block);
+            }
+            destroyed = true;
+        }
+
+        std::vector<void*> blocks;
+        bool& destroyed;
+    };
+
+    static FreeList* get_free_list() {
+        // Blocks can still be freed while other thread local objects are being destroyed, after
+        // our free list is gone. From then on, memory goes straight back to the heap
+        static thread_local bool destroyed = false;
+        static thread_local FreeList free_list(destroyed);
+        return destroyed ? nullptr : &free_list;
+    }
+};
+
+// A standard library allocator on top of RecyclingAllocator. Only single object allocations
+// are recycled, which makes it useful for node based containers and shared_ptr control blocks
+template <typename T>
+class RecyclingStdAllocator {
+public:
+    using value_type = T;
+
+    RecyclingStdAllocator() = default;
+
+    template <typename U>
+    RecyclingStdAllocator(const RecyclingStdAllocator<U>&) {
+
+    }
+
+    T* allocate(size_t count) {
+        if (count != 1) {
+            return static_cast<T*>(::operator new(count * sizeof(T)));
+        }
+        return static_cast<T*>(RecyclingAllocator<T>::allocate());
+    }
+
+    void deallocate(T* pointer, size_t count) {
+        if (count != 1) {
+            ::operator delete(pointer);
+        }
+        else {
+            RecyclingAllocator<T>::deallocate(pointer);
+        }
+    }
+};
+
+template <typename T, typename U>
+bool operator==(const RecyclingStdAllocator<T>&, const RecyclingStdAllocator<U>&) {
+    return true;
+}
+
+template <typename T, typename U>
+bool operator!=(const RecyclingStdAllocator<T>&, const RecyclingStdAllocator<U>&) {
+    return false;
+}
+
+} // roberto
@@ -0,0 +1,14 @@
+#pragma once
+
+namespace roberto {
+
+// The direction in which relayed data flows
+enum RelayDirection {
+    // From the client into the target
+    UPSTREAM,
+    // From the target into the client
+    DOWNSTREAM,
+    RELAY_DIRECTION_COUNT
+};
+
+} // roberto
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+#include <cstddef>
+#include <functional>
+
+namespace boost { namespace asio { class io_service; } }
+
+namespace roberto {
+
+// Takes turns between the relays that keep their sockets busy, so a few bulk transfers don't
+// hog the threads every other connection runs on.
+//
+// Each relayed direction gets a budget of bytes and operations per turn. Once it's used up, the
+// relay yields: its next read is queued until every handler that was ready before it ran,
+// including the ones of other relays that yielded. All relays that yielded are resumed by a
+// single handler, in the order they yielded. There's a single scheduler per thread.
+//
+// Relays can optionally be classified by the size of the chunks they read. Interactive ones,
+// which read small chunks (e.g. keystrokes or API calls) never yield, as they'd only add to
+// their own latency.
+class RelayScheduler {
+public:
+    using Callback = std::function<void()>;
+
+    // Zero disables each of the limits
+    struct Policy {
+        bool is_enabled() const {
+            return turn_bytes > 0 || turn_operations > 0;
+        }
+
+        size_t turn_bytes{0};
+        size_t turn_operations{0};
+        // Relays whose average chunk is smaller than this are interactive
+        size_t interactive_chunk_size{0};
+    };
+
+    // The bookkeeping for a single relayed direction
+    class Flow {
+    public:
+        // Records a chunk that was relayed. Returns true if the flow used up its turn and
+        // has to yield
+        bool record(const Policy& policy, size_t byte_count);
+        void reset();
+    private:
+        // Exponentially weighted, so the classification follows changes in the traffic
+        size_t average_chunk_size_{0};
+        size_t turn_bytes_{0};
+        size_t turn_operations_{0};
+    };
+
+    static RelayScheduler& for_current_thread(boost::asio::io_service& io_service);
+
+    explicit RelayScheduler(boost::asio::io_service& io_service);
+
+    // Runs the callback on the next turn
+    void wait_for_turn(Callback callback);
+private:
+    void run_turn();
+
+    boost::asio::io_service& io_service_;
+    std::vector<Callback> pending_;
+    std::mutex pending_mutex_;
+    bool turn_scheduled_{false};
+};
+
+} // roberto
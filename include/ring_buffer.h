@@ -0,0 +1,45 @@
+#pragma once
+
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <boost/asio/buffer.hpp>
+
+namespace roberto {
+
+// A fixed capacity byte ring buffer used to relay data in one direction.
+//
+// Data can be appended into the free space while the stored data is being written elsewhere,
+// as long as there's at most one operation of each kind in flight. Both regions can wrap
+// around the end of the storage, so they're exposed as a scatter/gather sequence of up to
+// two buffers that can be used directly with vectored reads and writes.
+class RingBuffer {
+public:
+    using MutableBuffers = std::array<boost::asio::mutable_buffer, 2>;
+    using ConstBuffers = std::array<boost::asio::const_buffer, 2>;
+
+    explicit RingBuffer(size_t capacity);
+
+    // The free space, to be filled and then committed
+    MutableBuffers get_free_buffers();
+    void commit(size_t byte_count);
+
+    // The stored data, to be written and then consumed
+    ConstBuffers get_data_buffers() const;
+    void consume(size_t byte_count);
+
+    // Appends as much of the given data as it fits, returning the amount of bytes appended
+    size_t append(const uint8_t* data, size_t byte_count);
+    void clear();
+
+    size_t size() const;
+    size_t capacity() const;
+    bool empty() const;
+    bool full() const;
+private:
+    std::vector<uint8_t> storage_;
+    size_t start_{0};
+    size_t size_{0};
+};
+
+} // roberto
@@ -2,29 +2,69 @@
 
 #include <memory>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/strand.hpp>
+#include "connection_context.h"
+#include "stream_socket.h"
 
 namespace boost { namespace asio { class io_service; } }
 
 namespace roberto {
 
 class ClientConnection;
-class AuthenticationManager;
+class CoroutineConnection;
+class TlsContext;
 
+// The implementation used to serve client connections
+enum class ConnectionEngine {
+    // State machines driven by completion callbacks (ClientConnection)
+    CALLBACKS,
+    // Stackless coroutines (CoroutineConnection)
+    COROUTINES
+};
+
+// Accepts client connections on either a TCP or a Unix domain socket. Listener socket options
+// only apply to TCP ones
 class Server {
 public:
-    Server(boost::asio::io_service& io_service, const boost::asio::ip::tcp::endpoint& endpoint,
-           std::shared_ptr<AuthenticationManager> auth_manager);
+    Server(boost::asio::io_service& io_service, const StreamEndpoint& endpoint,
+           std::shared_ptr<const ConnectionContext> context, ConnectionEngine engine);
+    // Accepts connections on an already listening socket, e.g. one taken over from a previous
+    // instance during a hot restart
+    Server(boost::asio::io_service& io_service, int listening_socket,
+           std::shared_ptr<const ConnectionContext> context, ConnectionEngine engine);
+    ~Server();
 
+    // Connections accepted from then on are served once they complete a TLS handshake
+    void enable_tls(std::shared_ptr<const TlsContext> tls_context);
     void start();
+    // Stops accepting connections. Connections that were already accepted are still served
+    void stop_accepting();
+    StreamEndpoint get_local_endpoint() const;
+    int get_listening_socket();
 private:
     void start_accept();
     void on_accept(std::shared_ptr<ClientConnection> connection,
                    const boost::system::error_code& error);
+    void on_coroutine_accept(const boost::system::error_code& error);
+    void on_tls_handshake(std::shared_ptr<ClientConnection> connection,
+                          const boost::system::error_code& error);
+    // The connection is shared with the handshake callback, so it's freed along with it if
+    // the handshake never completes
+    void on_coroutine_tls_handshake(
+        std::shared_ptr<std::unique_ptr<CoroutineConnection>> connection,
+        const boost::system::error_code& error);
+    void apply_socket_options(int socket);
 
     boost::asio::io_service& io_service_;
     boost::asio::ip::tcp::resolver resolver_;
-    boost::asio::ip::tcp::acceptor acceptor_;
-    std::shared_ptr<AuthenticationManager> auth_manager_;
+    StreamAcceptor acceptor_;
+    boost::asio::strand accept_strand_;
+    std::shared_ptr<const ConnectionContext> context_;
+    std::shared_ptr<const TlsContext> tls_context_;
+    ConnectionEngine engine_;
+    bool is_unix_{false};
+    std::unique_ptr<CoroutineConnection> pending_coroutine_connection_;
+    bool accepting_{true};
 };
 
 } // roberto
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <boost/optional.hpp>
+
+namespace roberto {
+
+// A set of TCP socket options. Options that aren't set are left at the system's defaults
+struct SocketOptions {
+    boost::optional<bool> no_delay;
+    boost::optional<int> receive_buffer_size;
+    boost::optional<int> send_buffer_size;
+    boost::optional<int> not_sent_low_watermark;
+    // Setting any of the keepalive parameters enables keepalive
+    boost::optional<int> keepalive_idle_seconds;
+    boost::optional<int> keepalive_interval_seconds;
+    boost::optional<int> keepalive_count;
+    boost::optional<int> user_timeout_milliseconds;
+    // The fast open queue length on listeners. On outbound sockets it's used as a flag, see
+    // enable_fast_open_connect
+    boost::optional<int> fast_open;
+    // Only apply to listeners
+    boost::optional<int> defer_accept_seconds;
+    // Set on each of the listeners bound to the same address when accepted connections are
+    // steered to the thread running on the CPU that received them
+    boost::optional<bool> reuse_port;
+    boost::optional<int> incoming_cpu;
+
+    // Applied before the socket starts listening, so accepted sockets inherit them
+    void apply_to_listener(int socket) const;
+    // Applied before connecting, as buffer sizes determine the window scale
+    void apply_before_connect(int socket) const;
+    // Defers the SYN until the first write if fast open is set. Nothing is sent until then, so
+    // this is only for sockets that already have data waiting to be written to them
+    void enable_fast_open_connect(int socket) const;
+    // Applied to connected sockets, both accepted and outbound ones
+    void apply_to_connection(int socket) const;
+};
+
+// The socket options used for outbound connections, which depend on the destination port. This
+// allows e.g. interactive and bulk traffic to use different latency/throughput tradeoffs
+class EgressSocketProfiles {
+public:
+    explicit EgressSocketProfiles(SocketOptions default_options = SocketOptions());
+
+    // Ranges are inclusive. If they overlap, the first one added wins
+    void add_port_range(uint16_t first_port, uint16_t last_port, SocketOptions options);
+    const SocketOptions& get_options(uint16_t port) const;
+private:
+    struct PortRange {
+        uint16_t first_port;
+        uint16_t last_port;
+        SocketOptions options;
+    };
+
+    SocketOptions default_options_;
+    std::vector<PortRange> port_ranges_;
+};
+
+} // roberto
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace roberto {
+
+// Relays data between pairs of connected TCP sockets within the kernel.
+//
+// Sockets are inserted into a BPF sockhash, keyed by the addresses and ports their traffic
+// comes from and goes to, along with a stream verdict program that sends everything a socket
+// receives out through its pair. Data relayed this way never reaches userspace, so relaying it
+// doesn't wake up any thread.
+//
+// The program only redirects the data of sockets whose key is in a separate map of enabled
+// keys, which is written once both sockets are in the sockhash. Until then, data is passed up
+// to userspace, and it must be relayed from there before anything that's redirected after it.
+// Redirecting only starts if nothing was passed up while the pair was being inserted.
+//
+// Sockets are removed from the map by the kernel when they're closed. Only IPv4 sockets that
+// aren't using a kernel TLS ULP are supported.
+class SocketRedirector {
+public:
+    // Laid out like the fields of __sk_buff the verdict program reads
+    struct Key {
+        uint32_t remote_ip4;
+        uint32_t local_ip4;
+        uint32_t remote_port;
+        uint32_t local_port;
+    };
+
+    // A pair of sockets being redirected, which has to be released once they're done
+    struct Pair {
+        Key first_key;
+        Key second_key;
+    };
+
+    enum class Status {
+        REDIRECTED,
+        // Nothing was changed, the sockets are relayed in userspace as usual
+        UNSUPPORTED,
+        // Data was passed up while data that arrived after it was already redirected, so
+        // the stream is out of order and the connection must be dropped
+        REORDERED
+    };
+
+    // Throws if the kernel doesn't support it or we're not allowed to load BPF programs
+    explicit SocketRedirector(size_t max_pairs);
+    ~SocketRedirector();
+
+    SocketRedirector(const SocketRedirector&) = delete;
+    SocketRedirector& operator=(const SocketRedirector&) = delete;
+
+    // Starts redirecting the data each socket receives into the other one. Neither socket may
+    // be read from while this runs
+    Status redirect(int first_socket, int second_socket, Pair& pair);
+    // Stops redirecting the pair. Must be called before the sockets are closed, as the kernel
+    // only forgets about closed sockets on its own, not about their keys being enabled
+    void release(const Pair& pair);
+
+    // Bytes received and sent through a socket so far, including the ones relayed within the
+    // kernel. A received FIN counts as a byte
+    struct ByteCounts {
+        uint64_t received;
+        uint64_t sent;
+    };
+
+    static ByteCounts get_byte_counts(int socket);
+private:
+    static bool make_key(int socket, Key& key);
+    static bool can_redirect(int socket);
+    static size_t get_queued_bytes(int socket);
+
+    void close_descriptors();
+
+    int load_program(const void* instructions, size_t instruction_count);
+    void attach_program(int program, int attach_type);
+    bool insert(const Key& key, int socket);
+    bool enable(const Key& key);
+    void remove(int map, const Key& key);
+    void remove(const Pair& pair);
+
+    int map_{-1};
+    int enabled_map_{-1};
+    int parser_program_{-1};
+    int verdict_program_{-1};
+};
+
+} // roberto
@@ -16,7 +16,13 @@
 namespace roberto {
 
 enum class SocksAuthentication {
-    NONE = 0
+    NONE = 0,
+    USERNAME_PASSWORD = 2
+};
+
+enum class AuthenticationStatus {
+    SUCCESS = 0,
+    FAILURE = 1
 };
 
 enum class AddressType {
@@ -55,6 +61,18 @@ struct MethodSelectionResponse {
     uint8_t method;
 } ROBERTO_END_PACK;
 
+ROBERTO_BEGIN_PACK
+struct UsernamePasswordRequestHeader {
+    uint8_t version;
+    uint8_t username_length;
+} ROBERTO_END_PACK;
+
+ROBERTO_BEGIN_PACK
+struct UsernamePasswordResponse {
+    uint8_t version;
+    uint8_t status;
+} ROBERTO_END_PACK;
+
 ROBERTO_BEGIN_PACK
 struct SocksCommandHeader {
     uint8_t version;
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <boost/asio/ip/tcp.hpp>
+#include "socks_messages.h"
+
+namespace roberto {
+
+// Builds the response to a command request into the given buffer. The bound endpoint is only
+// used on successful replies; failures carry an empty IPv4 endpoint
+void make_command_response(std::vector<uint8_t>& buffer, uint8_t version, ReplyType reply,
+                           const boost::asio::ip::tcp::endpoint& bound_endpoint);
+
+// The reply that best describes why connecting to the requested destination failed
+ReplyType get_connect_failure_reply(const boost::system::error_code& error);
+
+} // roberto
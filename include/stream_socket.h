@@ -0,0 +1,27 @@
+#pragma once
+
+#include <string>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/generic/stream_protocol.hpp>
+#include <boost/asio/basic_socket_acceptor.hpp>
+
+namespace roberto {
+
+// Stream sockets of any family, so connections can be served and made over both TCP and Unix
+// domain sockets using the same code
+using StreamProtocol = boost::asio::generic::stream_protocol;
+using StreamSocket = StreamProtocol::socket;
+using StreamEndpoint = StreamProtocol::endpoint;
+using StreamAcceptor = boost::asio::basic_socket_acceptor<StreamProtocol>;
+
+bool is_unix_endpoint(const StreamEndpoint& endpoint);
+// Returns the endpoint a socket is bound to
+StreamEndpoint get_socket_endpoint(int socket);
+// Formats the endpoint as address:port, or as unix:path for Unix domain sockets
+std::string format_endpoint(const StreamEndpoint& endpoint);
+// Formats just the endpoint's address, or unix for Unix domain sockets
+std::string format_address(const StreamEndpoint& endpoint);
+// Returns an unspecified endpoint unless this is a TCP one
+boost::asio::ip::tcp::endpoint to_tcp_endpoint(const StreamEndpoint& endpoint);
+
+} // roberto
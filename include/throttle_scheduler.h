@@ -0,0 +1,35 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <chrono>
+#include <functional>
+#include <boost/asio/steady_timer.hpp>
+
+namespace boost { namespace asio { class io_service; } }
+
+namespace roberto {
+
+// Holds the callbacks for every throttled operation that is waiting for its bucket to be
+// refilled. There's a single scheduler per thread, so the number of timers in use doesn't
+// depend on the number of throttled connections.
+class ThrottleScheduler {
+public:
+    using Clock = std::chrono::steady_clock;
+    using Callback = std::function<void()>;
+
+    static ThrottleScheduler& for_current_thread(boost::asio::io_service& io_service);
+
+    explicit ThrottleScheduler(boost::asio::io_service& io_service);
+
+    void schedule(Clock::time_point when, Callback callback);
+private:
+    void arm_timer(Clock::time_point when);
+    void handle_timer(const boost::system::error_code& error);
+
+    boost::asio::steady_timer timer_;
+    std::multimap<Clock::time_point, Callback> pending_;
+    std::mutex pending_mutex_;
+};
+
+} // roberto
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <string>
+#include <functional>
+#include <boost/system/error_code.hpp>
+#include "stream_socket.h"
+
+typedef struct ssl_ctx_st SSL_CTX;
+
+namespace roberto {
+
+// The certificate and settings used to terminate TLS on client connections.
+//
+// Only the handshake runs in userspace. Once it completes, record encryption is handed over to
+// the kernel (kTLS), so the connection is relayed through its plain socket just like any other
+// one and no TLS state is kept around. Connections for which the kernel can't take over, e.g.
+// because the tls module isn't loaded, are closed.
+class TlsContext {
+public:
+    using HandshakeCallback = std::function<void(const boost::system::error_code&)>;
+
+    TlsContext(const std::string& certificate_chain_path, const std::string& private_key_path);
+    ~TlsContext();
+
+    TlsContext(const TlsContext&) = delete;
+    TlsContext& operator=(const TlsContext&) = delete;
+
+    // Runs the server side of the handshake on the socket, which must be kept alive until
+    // the callback is executed
+    void handshake(StreamSocket& socket, HandshakeCallback callback) const;
+private:
+    SSL_CTX* context_;
+};
+
+} // roberto
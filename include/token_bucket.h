@@ -0,0 +1,30 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+
+namespace roberto {
+
+// A token bucket that is refilled lazily, whenever tokens are taken out of it. This means no
+// timers are needed to keep it up to date.
+//
+// Tokens are always granted, which means the bucket can go into debt. The caller is expected
+// to wait for the returned amount of time before consuming more tokens.
+class TokenBucket {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    TokenBucket(uint64_t rate, uint64_t burst);
+
+    Clock::duration consume(uint64_t amount, Clock::time_point now);
+    uint64_t get_rate() const;
+private:
+    void refill(Clock::time_point now);
+
+    uint64_t rate_;
+    double burst_;
+    double tokens_;
+    Clock::time_point last_refill_;
+};
+
+} // roberto
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <condition_variable>
+#include "relay_direction.h"
+
+namespace roberto {
+
+class TrafficAccountant;
+
+// Accounts the traffic relayed by a single connection on behalf of a user
+class TrafficAccount {
+public:
+    TrafficAccount(TrafficAccountant& accountant, size_t user_index);
+
+    // Returns false if the user has gone over its quota
+    bool record(RelayDirection direction, uint64_t byte_count);
+private:
+    TrafficAccountant* accountant_;
+    size_t user_index_;
+    uint64_t unchecked_bytes_{0};
+};
+
+// Keeps track of the traffic relayed by every user.
+//
+// Each thread records traffic into its own shard, so relaying data never contends on shared
+// state. Shards are periodically merged by a background thread, which also evaluates quotas
+// and writes a snapshot of the totals to disk so they survive restarts.
+//
+// During a hot restart both instances relay traffic at the same time, but only one of them
+// writes the snapshot: the one holding a lock on it. The old instance writes its final totals
+// and releases the lock once the new one took over, and the new one reloads the snapshot as
+// soon as it gets the lock. Whatever the old instance relays while draining its connections
+// is written into a delta file of its own, which the owner adds to the totals.
+class TrafficAccountant {
+public:
+    using Duration = std::chrono::steady_clock::duration;
+
+    TrafficAccountant(const std::vector<std::string>& usernames, std::string snapshot_path,
+                      Duration merge_interval);
+    ~TrafficAccountant();
+
+    // Applies to every authenticated user. The anonymous one is only limited by setting its
+    // quota, under an empty username
+    void set_default_quota(uint64_t quota);
+    void set_user_quota(const std::string& username, uint64_t quota);
+
+    void start();
+    void stop();
+    // Called once a new instance has taken over, which writes the snapshot from then on
+    void hand_over();
+
+    bool is_over_quota(const std::string& username) const;
+    TrafficAccount make_account(const std::string& username);
+private:
+    friend class TrafficAccount;
+
+    using Counters = std::array<uint64_t, RELAY_DIRECTION_COUNT>;
+    using UserCounters = std::map<std::string, Counters>;
+
+    enum class SnapshotState {
+        // Another instance holds the lock on the snapshot
+        WAITING,
+        OWNED,
+        // A new instance took over the snapshot
+        HANDED_OVER
+    };
+
+    // Every counter in a shard is only ever written by the thread that owns it
+    struct Shard {
+        explicit Shard(size_t user_count);
+
+        std::unique_ptr<std::atomic<uint64_t>[]> counters;
+    };
+
+    static const uint64_t QUOTA_CHECK_BYTES;
+
+    size_t get_user_index(const std::string& username) const;
+    Shard& get_thread_shard();
+    void record(size_t user_index, RelayDirection direction, uint64_t byte_count);
+    bool is_over_quota(size_t user_index) const;
+
+    // Everything below only runs on the merge thread, once it's started
+    void run();
+    std::vector<Counters> merge();
+    void release_snapshot(const std::vector<Counters>& totals);
+    bool lock_snapshot();
+    void load_snapshot();
+    static bool read_counters(const std::string& path, UserCounters& output);
+    std::vector<std::string> find_delta_files() const;
+    void add_counters(const UserCounters& counters);
+    void write_counters(const std::string& path, const std::vector<Counters>& totals,
+                        const std::vector<Counters>* base) const;
+
+    std::vector<std::string> usernames_;
+    std::map<std::string, size_t> user_indexes_;
+    std::vector<Counters> base_counters_;
+    // Counts for users that no longer exist, kept so they're not lost
+    UserCounters removed_user_counters_;
+    std::vector<uint64_t> quotas_;
+    std::unique_ptr<std::atomic<bool>[]> over_quota_;
+    std::string snapshot_path_;
+    SnapshotState snapshot_state_{SnapshotState::WAITING};
+    int snapshot_lock_{-1};
+    // What this instance's own traffic is counted from while it doesn't own the snapshot
+    std::vector<Counters> delta_base_;
+    Duration merge_interval_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    std::mutex shards_mutex_;
+    std::thread merge_thread_;
+    std::mutex stop_mutex_;
+    std::condition_variable stop_condition_;
+    bool stopped_{false};
+    bool hand_over_requested_{false};
+};
+
+} // roberto
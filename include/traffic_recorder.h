@@ -0,0 +1,152 @@
+#pragma once
+
+#include <array>
+#include <mutex>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <fstream>
+#include <condition_variable>
+#include "relay_direction.h"
+#include "socks_messages.h"
+
+namespace roberto {
+
+// What a single client connection looked like, without any of the data it relayed. Times are
+// in microseconds
+struct ConnectionTrace {
+    enum class Protocol : uint8_t {
+        SOCKS4,
+        SOCKS5,
+        HTTP
+    };
+
+    struct Chunk {
+        // Since the previous chunk relayed in the same direction
+        uint64_t delay;
+        uint64_t size;
+    };
+
+    struct Direction {
+        // Only the first chunks are kept, but every byte is counted
+        std::vector<Chunk> chunks;
+        uint64_t byte_count{0};
+    };
+
+    // Since the recorder started
+    uint64_t start_time{0};
+    Protocol protocol{Protocol::SOCKS5};
+    SocksAuthentication auth_method{SocksAuthentication::NONE};
+    AddressType address_type{AddressType::IPV4};
+    bool connected{false};
+    // From accepting the connection to getting its connection request
+    uint64_t handshake_time{0};
+    // From the connection request to being connected to the target
+    uint64_t connect_time{0};
+    // From accepting the connection to closing it
+    uint64_t duration{0};
+    std::array<Direction, RELAY_DIRECTION_COUNT> directions;
+};
+
+// Integers in a trace are written 7 bits per byte, least significant first. The top bit is set
+// on every byte but the last
+void write_varint(std::ostream& output, uint64_t value);
+uint64_t read_varint(std::istream& input);
+
+class TrafficRecorder;
+
+// Traces a single client connection. The trace is handed over to the recorder when this is
+// destroyed, as long as the client got as far as requesting a connection
+class TrafficRecording {
+public:
+    explicit TrafficRecording(TrafficRecorder& recorder);
+    ~TrafficRecording();
+
+    TrafficRecording(const TrafficRecording&) = delete;
+    TrafficRecording& operator=(const TrafficRecording&) = delete;
+
+    void set_protocol(ConnectionTrace::Protocol protocol);
+    void set_auth_method(SocksAuthentication auth_method);
+    void record_request(AddressType address_type);
+    void record_connected();
+    // The first chunk in each direction is timed from the moment the target was connected to,
+    // or from the request if it was read before that
+    void record_chunk(RelayDirection direction, size_t byte_count);
+private:
+    using Clock = std::chrono::steady_clock;
+
+    TrafficRecorder* recorder_;
+    ConnectionTrace trace_;
+    Clock::time_point start_time_;
+    Clock::time_point request_time_;
+    std::array<Clock::time_point, RELAY_DIRECTION_COUNT> last_chunk_times_;
+    bool requested_{false};
+};
+
+// Writes the traces of every client connection into a file, so the workload can be replayed
+// later on.
+//
+// Traces are queued by the threads serving connections and written by a background thread,
+// so relaying data never waits on the disk. If the disk can't keep up, traces are dropped.
+//
+// The file starts with a magic number and a version, followed by the traces. Every integer in
+// a trace is written as a varint, so a chunk usually takes 3 or 4 bytes.
+class TrafficRecorder {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // The amount of chunks kept per connection and direction
+    TrafficRecorder(const std::string& path, size_t max_chunks);
+    ~TrafficRecorder();
+
+    void start();
+    void stop();
+
+    Clock::time_point get_start_time() const;
+    size_t get_max_chunks() const;
+private:
+    friend class TrafficRecording;
+    friend class TraceReader;
+
+    static const uint32_t TRACE_MAGIC;
+    static const uint32_t TRACE_VERSION;
+    static const size_t MAX_QUEUED_TRACES;
+
+    void submit(ConnectionTrace trace);
+    void run();
+    void write_traces(const std::vector<ConnectionTrace>& traces);
+
+    std::ofstream output_;
+    Clock::time_point start_time_;
+    size_t max_chunks_;
+    std::vector<ConnectionTrace> queued_traces_;
+    uint64_t dropped_count_{0};
+    std::thread write_thread_;
+    std::mutex queue_mutex_;
+    std::condition_variable queue_condition_;
+    bool stopped_{false};
+};
+
+// Reads back the traces in a file written by a TrafficRecorder. If the recorder was killed
+// halfway through writing a trace, the file ends at the last complete one
+class TraceReader {
+public:
+    explicit TraceReader(const std::string& path);
+
+    // Returns false once every complete trace was read
+    bool read(ConnectionTrace& trace);
+    // Whether the file ended in the middle of a trace
+    bool is_truncated() const;
+private:
+    static const uint64_t MAX_CHUNKS;
+
+    void read_trace(ConnectionTrace& trace);
+
+    std::ifstream input_;
+    uint64_t file_size_{0};
+    bool truncated_{false};
+};
+
+} // roberto
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <array>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+namespace boost { namespace asio { class io_service; } }
+
+namespace roberto {
+
+// Spreads outbound connections over a set of parent SOCKS5 proxies.
+//
+// Each connection goes through one of two randomly picked parents, whichever of them looks
+// less loaded based on its average connect latency and on how many connections are using it
+// right now. This tracks how responsive parents actually are, while never herding every new
+// connection into the single parent that happens to look best.
+//
+// Parents that fail a number of consecutive connections in a row are ejected. Ejected parents
+// are periodically probed in the background by connecting to them and negotiating an
+// authentication method, and are put back into rotation once a probe succeeds. Both
+// connections and probes fail if the handshake with the parent takes too long.
+class UpstreamPool {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Parent {
+        std::string address;
+        uint16_t port;
+        // Empty if the parent doesn't require authentication
+        std::string username;
+        std::string password;
+    };
+
+    // Counts as a connection in flight through a parent for as long as it's alive
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(UpstreamPool& pool, size_t index);
+        Lease(Lease&& other);
+        Lease& operator=(Lease&& other);
+        ~Lease();
+
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        explicit operator bool() const;
+        const Parent& get_parent() const;
+        // How long connecting to the parent and negotiating with it may take
+        Clock::duration get_handshake_timeout() const;
+
+        // The latency covers connecting to the parent and negotiating with it, so it doesn't
+        // depend on the destination
+        void record_success(Clock::duration connect_latency);
+        void record_failure();
+        void release();
+    private:
+        UpstreamPool* pool_{nullptr};
+        size_t index_{0};
+    };
+
+    UpstreamPool(boost::asio::io_service& io_service, std::vector<Parent> parents,
+                 size_t failure_threshold, Clock::duration ejection_duration,
+                 Clock::duration handshake_timeout);
+
+    void start();
+    // Cancels every probe, so they don't keep the io_service running
+    void stop();
+
+    // Picks the parent to use for a new connection. The lease is empty if every parent is
+    // ejected
+    Lease choose();
+
+    std::string format_report() const;
+private:
+    using Resolver = boost::asio::ip::tcp::resolver;
+    using SocketPtr = std::shared_ptr<boost::asio::ip::tcp::socket>;
+
+    struct ParentState {
+        Parent parent;
+        // An exponentially weighted moving average
+        Clock::duration average_latency{};
+        size_t connections{0};
+        size_t consecutive_failures{0};
+        bool ejected{false};
+        bool probing{false};
+        Clock::time_point next_probe;
+    };
+
+    struct Probe {
+        Probe(boost::asio::io_service& io_service, size_t index);
+
+        size_t index;
+        // Covers resolving, connecting and negotiating
+        boost::asio::steady_timer deadline;
+        bool finished{false};
+        SocketPtr socket;
+        Clock::time_point start_time;
+        // A method selection request offering a single method, and its response
+        std::array<uint8_t, 3> request;
+        std::array<uint8_t, 2> response;
+    };
+
+    using ProbePtr = std::shared_ptr<Probe>;
+
+    static uint64_t get_cost(const ParentState& state);
+
+    void record_success(size_t index, Clock::duration connect_latency);
+    void record_failure(size_t index);
+    void release(size_t index);
+
+    void arm_timer();
+    void handle_timer(const boost::system::error_code& error);
+    void start_probe(size_t index);
+    void handle_probe_resolve(const ProbePtr& probe, const boost::system::error_code& error,
+                              Resolver::iterator iter);
+    void handle_probe_connect(const ProbePtr& probe, const boost::system::error_code& error);
+    void handle_probe_write(const ProbePtr& probe, const boost::system::error_code& error);
+    void handle_probe_read(const ProbePtr& probe, const boost::system::error_code& error);
+    void handle_probe_deadline(const ProbePtr& probe, const boost::system::error_code& error);
+    void finish_probe(const ProbePtr& probe, bool succeeded);
+
+    std::vector<ParentState> parents_;
+    size_t failure_threshold_;
+    Clock::duration ejection_duration_;
+    Clock::duration handshake_timeout_;
+    std::minstd_rand random_engine_;
+    Resolver resolver_;
+    boost::asio::steady_timer timer_;
+    mutable std::mutex mutex_;
+    std::vector<ProbePtr> probes_;
+    bool stopped_{false};
+};
+
+} // roberto
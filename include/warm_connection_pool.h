@@ -0,0 +1,86 @@
+#pragma once
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "socket_options.h"
+#include "stream_socket.h"
+
+namespace boost { namespace asio { class io_service; } }
+
+namespace roberto {
+
+// Keeps connections to the busiest destinations established ahead of time, so requests to them
+// don't have to wait for the name resolution and the TCP handshake.
+//
+// Requests are counted per destination over fixed intervals. Destinations that got at least
+// the minimum amount of requests during the last one are hot, and as many idle connections to
+// them are kept as requests they got, up to the maximum. Taken connections are replaced right
+// away. Idle connections are closed once they've been idle for too long, or when their
+// destination cools down. All connections belong to the pool's io_service.
+class WarmConnectionPool {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    WarmConnectionPool(boost::asio::io_service& io_service,
+                       EgressSocketProfiles socket_profiles, size_t min_requests,
+                       size_t max_idle_connections, Clock::duration max_idle_time);
+
+    void start();
+    // Closes every idle and pending connection, so they don't keep the io_service running
+    void stop();
+
+    // Counts a request to the destination. If there's an idle connection to it, it's moved
+    // into the given socket and true is returned
+    bool take(const std::string& address, uint16_t port, StreamSocket& socket);
+private:
+    using Resolver = boost::asio::ip::tcp::resolver;
+    using SocketPtr = std::shared_ptr<StreamSocket>;
+
+    struct IdleConnection {
+        SocketPtr socket;
+        Clock::time_point idle_since;
+    };
+
+    struct Destination {
+        std::string address;
+        uint16_t port;
+        size_t requests{0};
+        size_t target_connections{0};
+        size_t pending_connections{0};
+        // Oldest first
+        std::deque<IdleConnection> idle_connections;
+    };
+
+    static bool is_alive(StreamSocket& socket);
+
+    void arm_timer();
+    void handle_timer(const boost::system::error_code& error);
+    void refill(const std::string& key, Destination& destination);
+    void handle_resolve(const std::string& key, const boost::system::error_code& error,
+                        Resolver::iterator iter);
+    void handle_connect(const std::string& key, const SocketPtr& socket,
+                        const boost::system::error_code& error);
+    void finish_pending(const std::string& key, const SocketPtr& socket);
+
+    boost::asio::io_service& io_service_;
+    EgressSocketProfiles socket_profiles_;
+    size_t min_requests_;
+    size_t max_idle_connections_;
+    Clock::duration max_idle_time_;
+    Resolver resolver_;
+    boost::asio::steady_timer timer_;
+    std::mutex mutex_;
+    std::map<std::string, Destination> destinations_;
+    std::vector<SocketPtr> pending_sockets_;
+    bool stopped_{false};
+};
+
+} // roberto
@@ -0,0 +1,138 @@
+#include "admin_server.h"
+#include <memory>
+#include <istream>
+#include <unistd.h>
+#include <log4cxx/logger.h>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/read_until.hpp>
+#include <boost/asio/streambuf.hpp>
+#include <boost/asio/write.hpp>
+#include "utils.h"
+
+using std::bind;
+using std::move;
+using std::string;
+using std::istream;
+using std::shared_ptr;
+using std::enable_shared_from_this;
+using std::placeholders::_1;
+using std::placeholders::_2;
+
+using boost::asio::io_service;
+using boost::asio::streambuf;
+
+using boost::system::error_code;
+
+using log4cxx::Logger;
+using log4cxx::LoggerPtr;
+
+namespace roberto {
+
+static const LoggerPtr logger = Logger::getLogger("r.admin_server");
+
+static const size_t MAX_QUERY_SIZE = 256;
+
+// Session
+
+// Reads a single query and writes its output back
+class AdminServer::Session : public enable_shared_from_this<AdminServer::Session> {
+public:
+    Session(const AdminServer& server, LocalProtocol::socket socket)
+    : server_(server), socket_(move(socket)), query_(MAX_QUERY_SIZE) {
+
+    }
+
+    void start() {
+        auto callback = bind(&Session::handle_read, shared_from_this(), _1, _2);
+        boost::asio::async_read_until(socket_, query_, '\n', callback);
+    }
+private:
+    void handle_read(const error_code& error, size_t /*bytes_read*/) {
+        if (error) {
+            LOG4CXX_DEBUG(logger, "Failed to read admin query: " << error.message());
+            return;
+        }
+        istream input(&query_);
+        string name;
+        getline(input, name);
+        if (!name.empty() && name.back() == '\r') {
+            name.pop_back();
+        }
+        response_ = server_.run_command(name);
+        auto callback = bind(&Session::handle_write, shared_from_this(), _1, _2);
+        boost::asio::async_write(socket_, boost::asio::buffer(response_), callback);
+    }
+
+    void handle_write(const error_code& error, size_t /*bytes_written*/) {
+        if (error) {
+            LOG4CXX_DEBUG(logger, "Failed to write admin response: " << error.message());
+        }
+    }
+
+    const AdminServer& server_;
+    LocalProtocol::socket socket_;
+    streambuf query_;
+    string response_;
+};
+
+// AdminServer
+
+AdminServer::AdminServer(io_service& io_service, string socket_path)
+: socket_path_(move(socket_path)), acceptor_(io_service), peer_socket_(io_service) {
+
+}
+
+AdminServer::~AdminServer() {
+    stop();
+}
+
+void AdminServer::add_command(const string& name, Command command) {
+    commands_[name] = move(command);
+}
+
+void AdminServer::start() {
+    // Whatever is there belongs to a previous instance
+    unlink(socket_path_.c_str());
+    LocalProtocol::endpoint endpoint(socket_path_);
+    acceptor_.open(endpoint.protocol());
+    acceptor_.bind(endpoint);
+    acceptor_.listen();
+    LOG4CXX_INFO(logger, "Serving admin queries on " << socket_path_);
+    start_accept();
+}
+
+void AdminServer::stop() {
+    // Note that the socket path could belong to a new instance already, so it's not removed
+    error_code ignored;
+    acceptor_.close(ignored);
+}
+
+void AdminServer::start_accept() {
+    acceptor_.async_accept(peer_socket_, bind(&AdminServer::handle_accept, this, _1));
+}
+
+void AdminServer::handle_accept(const error_code& error) {
+    if (error) {
+        if (!utils::is_operation_aborted(error)) {
+            LOG4CXX_ERROR(logger, "Error while accepting admin socket: " << error.message());
+        }
+        return;
+    }
+    auto session = std::make_shared<Session>(*this, move(peer_socket_));
+    session->start();
+    start_accept();
+}
+
+string AdminServer::run_command(const string& name) const {
+    auto iter = commands_.find(name);
+    if (iter != commands_.end()) {
+        return iter->second();
+    }
+    string output = "Unknown command \"" + name + "\", available commands:\n";
+    for (const auto& command : commands_) {
+        output += "  " + command.first + "\n";
+    }
+    return output;
+}
+
+} // roberto
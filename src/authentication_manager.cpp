@@ -1,6 +1,7 @@
 #include "authentication_manager.h"
 
 using std::string;
+using std::vector;
 using std::make_pair;
 
 namespace roberto {
@@ -17,4 +18,12 @@ size_t AuthenticationManager::get_credentials_count() const {
     return credentials_.size();
 }
 
+vector<string> AuthenticationManager::get_usernames() const {
+    vector<string> output;
+    for (const Credentials& credentials : credentials_) {
+        output.push_back(credentials.first);
+    }
+    return output;
+}
+
 } // roberto
@@ -0,0 +1,97 @@
+#include "bandwidth_manager.h"
+#include <algorithm>
+
+using std::max;
+using std::string;
+using std::mutex;
+using std::lock_guard;
+using std::unique_ptr;
+using std::make_shared;
+
+namespace roberto {
+
+// SharedTokenBucket
+
+SharedTokenBucket::SharedTokenBucket(uint64_t rate)
+: bucket_(rate, rate) {
+
+}
+
+TokenBucket::Clock::duration SharedTokenBucket::consume(uint64_t amount,
+                                                        TokenBucket::Clock::time_point now) {
+    lock_guard<mutex> _(mutex_);
+    return bucket_.consume(amount, now);
+}
+
+// BandwidthLimiter
+
+BandwidthLimiter::Clock::duration BandwidthLimiter::consume(RelayDirection direction,
+                                                            uint64_t amount) {
+    Buckets& buckets = buckets_[direction];
+    const auto now = Clock::now();
+    // Every level is charged, and we wait for whichever is the most indebted one
+    auto delay = Clock::duration::zero();
+    for (const auto& bucket : buckets.shared_buckets) {
+        delay = max(delay, bucket->consume(amount, now));
+    }
+    if (buckets.connection_bucket) {
+        delay = max(delay, buckets.connection_bucket->consume(amount, now));
+    }
+    return delay;
+}
+
+// BandwidthManager
+
+BandwidthManager::BandwidthManager(const Limits& limits)
+: limits_(limits) {
+    if (limits_.global_rate > 0) {
+        for (auto& bucket : global_buckets_) {
+            bucket = make_shared<SharedTokenBucket>(limits_.global_rate);
+        }
+    }
+}
+
+void BandwidthManager::set_user_rate(const string& username, uint64_t rate) {
+    user_rates_[username] = rate;
+}
+
+unique_ptr<BandwidthLimiter> BandwidthManager::make_limiter(const string& username) {
+    unique_ptr<BandwidthLimiter> limiter(new BandwidthLimiter());
+    const SharedBuckets user_buckets = get_user_buckets(username);
+    for (size_t i = 0; i < RELAY_DIRECTION_COUNT; ++i) {
+        auto& buckets = limiter->buckets_[i];
+        if (global_buckets_[i]) {
+            buckets.shared_buckets.push_back(global_buckets_[i]);
+        }
+        if (user_buckets[i]) {
+            buckets.shared_buckets.push_back(user_buckets[i]);
+        }
+        if (limits_.connection_rate > 0) {
+            buckets.connection_bucket.reset(new TokenBucket(limits_.connection_rate,
+                                                            limits_.connection_rate));
+        }
+    }
+    return limiter;
+}
+
+BandwidthManager::SharedBuckets BandwidthManager::get_user_buckets(const string& username) {
+    auto rate_iter = user_rates_.find(username);
+    const uint64_t rate = rate_iter != user_rates_.end() ? rate_iter->second : limits_.user_rate;
+    SharedBuckets output;
+    if (rate == 0) {
+        return output;
+    }
+    lock_guard<mutex> _(user_buckets_mutex_);
+    WeakSharedBuckets& weak_buckets = user_buckets_[username];
+    for (size_t i = 0; i < output.size(); ++i) {
+        output[i] = weak_buckets[i].lock();
+        // If every connection for this user is gone, the bucket has to be created again
+        if (!output[i]) {
+            output[i] = make_shared<SharedTokenBucket>(rate);
+            weak_buckets[i] = output[i];
+        }
+    }
+    return output;
+}
+
+} // roberto
@@ -1,12 +1,17 @@
 #include "channel.h"
 #include <sstream>
+#include <boost/asio/read.hpp>
 #include <boost/asio/write.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
 #include <log4cxx/logger.h>
+#include "loop_profiler.h"
+#include "socks_messages.h"
 #include "utils.h"
 
-using std::vector;
 using std::bind;
+using std::move;
 using std::string;
+using std::vector;
 using std::to_string;
 using std::ostringstream;
 using std::placeholders::_1;
@@ -14,8 +19,10 @@ using std::placeholders::_2;
 
 using boost::asio::io_service;
 using boost::asio::ip::tcp;
+using boost::asio::ip::address;
 
 using boost::system::error_code;
+using boost::system::errc::make_error_code;
 
 using log4cxx::Logger;
 using log4cxx::LoggerPtr;
@@ -24,11 +31,62 @@ namespace roberto {
 
 static const LoggerPtr logger = Logger::getLogger("r.channel");
 
+static const uint8_t SOCKS_VERSION = 5;
+static const uint8_t USERNAME_PASSWORD_AUTH_VERSION = 1;
+static const size_t MAX_DOMAIN_NAME_LENGTH = 255;
+
+// Translates the reply a parent proxy sent when it failed to connect to the target into the
+// error we'd have gotten if we had connected ourselves
+static error_code get_parent_reply_error(uint8_t reply) {
+    switch (static_cast<ReplyType>(reply)) {
+        case ReplyType::CONNECTION_REFUSED:
+            return boost::asio::error::connection_refused;
+        case ReplyType::NETWORK_UNREACHABLE:
+            return boost::asio::error::network_unreachable;
+        case ReplyType::TTL_EXPIRED:
+            return boost::asio::error::timed_out;
+        default:
+            return boost::asio::error::host_unreachable;
+    }
+}
+
+template <typename T>
+static void append_bytes(vector<uint8_t>& buffer, const T& bytes) {
+    buffer.insert(buffer.end(), bytes.begin(), bytes.end());
+}
+
 Channel::Channel(io_service& io_service, tcp::resolver& resolver, const string& address,
-                 uint16_t port, StatusCallback status_callback)
-: socket_(io_service), resolver_(resolver), address_(address), port_(port),
-  status_callback_(std::move(status_callback)) {
+                 uint16_t port, const string& unix_path, const SocketOptions& socket_options,
+                 StatusCallback status_callback)
+: socket_(io_service), resolver_(&resolver), address_(address), port_(port),
+  unix_path_(unix_path), socket_options_(socket_options),
+  status_callback_(std::move(status_callback)), parent_strand_(io_service),
+  parent_deadline_(io_service) {
+
+}
 
+void Channel::initialize(tcp::resolver& resolver, const string& address, uint16_t port,
+                         const string& unix_path, const SocketOptions& socket_options,
+                         StatusCallback status_callback) {
+    resolver_ = &resolver;
+    address_ = address;
+    port_ = port;
+    unix_path_ = unix_path;
+    socket_options_ = socket_options;
+    status_callback_ = std::move(status_callback);
+    fast_open_ = false;
+}
+
+void Channel::reset() {
+    error_code error;
+    socket_.close(error);
+    parent_.release();
+    // The callback holds a reference to the connection that owned us
+    status_callback_ = nullptr;
+}
+
+io_service& Channel::get_io_service() {
+    return socket_.get_io_service();
 }
 
 string Channel::get_target_endpoint() const {
@@ -38,13 +96,46 @@ string Channel::get_target_endpoint() const {
 }
 
 tcp::endpoint Channel::get_local_endpoint() const {
-    return socket_.local_endpoint();
+    return to_tcp_endpoint(socket_.local_endpoint());
+}
+
+int Channel::get_native_handle() {
+    return socket_.native_handle();
+}
+
+void Channel::enable_fast_open() {
+    fast_open_ = true;
 }
 
 void Channel::start() {
+    if (!unix_path_.empty()) {
+        connect_unix();
+        return;
+    }
     auto callback = bind(&Channel::handle_resolve, shared_from_this(), _1, _2);
     Resolver::query query(address_, to_string(port_));
-    resolver_.async_resolve(query, move(callback));
+    resolver_->async_resolve(query, move(callback));
+}
+
+void Channel::start(StreamSocket connected_socket) {
+    socket_ = std::move(connected_socket);
+    // Report it as if we had just connected, without running the callback within this call
+    auto callback = bind(&Channel::handle_connect, shared_from_this(), error_code(),
+                         Resolver::iterator());
+    socket_.get_io_service().post(move(callback));
+}
+
+void Channel::start(UpstreamPool::Lease parent) {
+    parent_ = move(parent);
+    parent_timed_out_ = false;
+    connect_start_time_ = std::chrono::steady_clock::now();
+    parent_deadline_.expires_from_now(parent_.get_handshake_timeout());
+    parent_deadline_.async_wait(parent_strand_.wrap(bind(&Channel::handle_parent_deadline,
+                                                         shared_from_this(), _1)));
+    const UpstreamPool::Parent& parent_info = parent_.get_parent();
+    auto callback = bind(&Channel::handle_resolve, shared_from_this(), _1, _2);
+    Resolver::query query(parent_info.address, to_string(parent_info.port));
+    resolver_->async_resolve(query, parent_strand_.wrap(move(callback)));
 }
 
 void Channel::cancel() {
@@ -53,29 +144,63 @@ void Channel::cancel() {
     }
 }
 
-void Channel::read(size_t max_size) {
-    LOG4CXX_TRACE(logger, "Reading at most " << max_size << " bytes from connection to "
-                  << get_target_endpoint());
-    read_buffer_.resize(max_size);
+void Channel::read(const RingBuffer::MutableBuffers& buffers) {
+    LOG4CXX_TRACE(logger, "Reading at most " << boost::asio::buffer_size(buffers)
+                  << " bytes from connection to " << get_target_endpoint());
     auto callback = bind(&Channel::handle_read, shared_from_this(), _1, _2);
-    socket_.async_read_some(boost::asio::buffer(read_buffer_), move(callback));
+    socket_.async_read_some(buffers, make_allocating_handler(read_allocator_, move(callback)));
 }
 
-void Channel::write(const vector<uint8_t>& buffer) {
-    write_buffer_ = buffer;
-    LOG4CXX_TRACE(logger, "Writing " << buffer.size() << " bytes into connection to "
-                  << get_target_endpoint());
-    write_output_buffer();
+void Channel::write(const RingBuffer::ConstBuffers& buffers) {
+    LOG4CXX_TRACE(logger, "Writing " << boost::asio::buffer_size(buffers)
+                  << " bytes into connection to " << get_target_endpoint());
+    // Every buffer goes out in a single vectored write, unless the socket is short on space
+    auto callback = bind(&Channel::handle_write, shared_from_this(), _1, _2);
+    boost::asio::async_write(socket_, buffers,
+                             make_allocating_handler(write_allocator_, move(callback)));
 }
 
 void Channel::connect(Resolver::iterator iter) {
     auto next_iter = iter;
     ++next_iter;
     auto callback = bind(&Channel::handle_connect, shared_from_this(), _1, next_iter);
-    socket_.async_connect(*iter, move(callback));
+    // Open the socket ourselves so it can be tuned before connecting
+    error_code error;
+    socket_.close(error);
+    socket_.open(StreamProtocol(iter->endpoint().protocol()), error);
+    if (error) {
+        parent_strand_.post(bind(callback, error));
+        return;
+    }
+    socket_options_.apply_before_connect(socket_.native_handle());
+    if (fast_open_) {
+        socket_options_.enable_fast_open_connect(socket_.native_handle());
+    }
+    if (parent_) {
+        socket_.async_connect(StreamEndpoint(iter->endpoint()),
+                              parent_strand_.wrap(move(callback)));
+    }
+    else {
+        socket_.async_connect(StreamEndpoint(iter->endpoint()), move(callback));
+    }
+}
+
+void Channel::connect_unix() {
+    // There's nothing to resolve and no other endpoints to fall back to
+    auto callback = bind(&Channel::handle_connect, shared_from_this(), _1,
+                         Resolver::iterator());
+    error_code error;
+    socket_.close(error);
+    socket_.async_connect(boost::asio::local::stream_protocol::endpoint(unix_path_),
+                          move(callback));
 }
 
 void Channel::handle_resolve(const error_code& error, Resolver::iterator iter) {
+    LoopProfiler::ScopedTimer timer(LoopProfiler::CHANNEL_RESOLVE);
+    if (parent_ && (error || parent_timed_out_)) {
+        fail_parent_handshake(error);
+        return;
+    }
     if (error) {
         if (!utils::is_operation_aborted(error)) {
             LOG4CXX_INFO(logger, "Failed to resolve " << get_target_endpoint() << ": "
@@ -88,9 +213,18 @@ void Channel::handle_resolve(const error_code& error, Resolver::iterator iter) {
 }
 
 void Channel::handle_connect(const error_code& error, Resolver::iterator iter) {
+    LoopProfiler::ScopedTimer timer(LoopProfiler::CHANNEL_CONNECT);
+    if (parent_timed_out_) {
+        fail_parent_handshake(error);
+        return;
+    }
     if (error) {
         // If we still have endpoints to attempt a connection to, then don't worry error'ing
         if (iter == Resolver::iterator()) {
+            if (parent_) {
+                fail_parent_handshake(error);
+                return;
+            }
             if (!utils::is_operation_aborted(error)) {
                 LOG4CXX_INFO(logger, "Failed to connect to " << get_target_endpoint() << ": "
                              << error.message());
@@ -102,10 +236,20 @@ void Channel::handle_connect(const error_code& error, Resolver::iterator iter) {
         }
         return;
     }
-    status_callback_(Connected{});
+    if (!parent_) {
+        finish_connecting();
+        return;
+    }
+    // Offer the parent the single method we can use with it
+    const UpstreamPool::Parent& parent = parent_.get_parent();
+    const auto method = parent.username.empty() ? SocksAuthentication::NONE :
+                                                  SocksAuthentication::USERNAME_PASSWORD;
+    handshake_buffer_.assign({ SOCKS_VERSION, 1, static_cast<uint8_t>(method) });
+    exchange_with_parent(sizeof(MethodSelectionResponse), &Channel::handle_parent_method);
 }
 
 void Channel::handle_read(const error_code& error, size_t bytes_read) {
+    LoopProfiler::ScopedTimer timer(LoopProfiler::CHANNEL_READ);
     if (error) {
         if (!utils::is_operation_aborted(error)) {
             LOG4CXX_DEBUG(logger, "Failed to read from connection to " << get_target_endpoint()
@@ -116,10 +260,11 @@ void Channel::handle_read(const error_code& error, size_t bytes_read) {
     }
     LOG4CXX_TRACE(logger, "Received " << bytes_read << " bytes from connection to "
                   << get_target_endpoint());
-    status_callback_(Read{read_buffer_.begin(), read_buffer_.begin() + bytes_read});
+    status_callback_(Read{bytes_read});
 }
 
-void Channel::handle_write(const error_code& error, size_t bytes_read) {
+void Channel::handle_write(const error_code& error, size_t bytes_written) {
+    LoopProfiler::ScopedTimer timer(LoopProfiler::CHANNEL_WRITE);
     if (error) {
         if (!utils::is_operation_aborted(error)) {
             LOG4CXX_DEBUG(logger, "Failed to write to connection to " << get_target_endpoint()
@@ -128,12 +273,192 @@ void Channel::handle_write(const error_code& error, size_t bytes_read) {
         status_callback_(Error{error, Error::Stage::WRITE});
         return;
     }
-    status_callback_(Write{});
+    status_callback_(Write{bytes_written});
 }
 
-void Channel::write_output_buffer() {
-    auto callback = bind(&Channel::handle_write, shared_from_this(), _1, _2);
-    boost::asio::async_write(socket_, boost::asio::buffer(write_buffer_), move(callback));
+void Channel::exchange_with_parent(size_t response_size, ParentHandler handler) {
+    auto callback = bind(&Channel::handle_parent_write, shared_from_this(), _1, response_size,
+                         handler);
+    boost::asio::async_write(socket_, boost::asio::buffer(handshake_buffer_),
+                             parent_strand_.wrap(make_allocating_handler(write_allocator_,
+                                                                         move(callback))));
+}
+
+void Channel::handle_parent_write(const error_code& error, size_t response_size,
+                                  ParentHandler handler) {
+    if (error || parent_timed_out_) {
+        fail_parent_handshake(error);
+        return;
+    }
+    handshake_buffer_.resize(response_size);
+    auto callback = bind(handler, shared_from_this(), _1);
+    boost::asio::async_read(socket_, boost::asio::buffer(handshake_buffer_),
+                            parent_strand_.wrap(make_allocating_handler(read_allocator_,
+                                                                        move(callback))));
+}
+
+void Channel::handle_parent_method(const error_code& error) {
+    if (error || parent_timed_out_) {
+        fail_parent_handshake(error);
+        return;
+    }
+    const UpstreamPool::Parent& parent = parent_.get_parent();
+    const auto* response = reinterpret_cast<const MethodSelectionResponse*>(
+        handshake_buffer_.data());
+    const auto expected_method = parent.username.empty() ? SocksAuthentication::NONE :
+                                                           SocksAuthentication::USERNAME_PASSWORD;
+    if (response->version != SOCKS_VERSION ||
+        response->method != static_cast<uint8_t>(expected_method)) {
+        fail_parent_handshake(make_error_code(boost::system::errc::protocol_error));
+        return;
+    }
+    if (expected_method == SocksAuthentication::NONE) {
+        send_parent_connect();
+        return;
+    }
+    handshake_buffer_.assign({ USERNAME_PASSWORD_AUTH_VERSION,
+                               static_cast<uint8_t>(parent.username.size()) });
+    append_bytes(handshake_buffer_, parent.username);
+    handshake_buffer_.push_back(parent.password.size());
+    append_bytes(handshake_buffer_, parent.password);
+    exchange_with_parent(sizeof(UsernamePasswordResponse),
+                         &Channel::handle_parent_authentication);
+}
+
+void Channel::handle_parent_authentication(const error_code& error) {
+    if (error || parent_timed_out_) {
+        fail_parent_handshake(error);
+        return;
+    }
+    const auto* response = reinterpret_cast<const UsernamePasswordResponse*>(
+        handshake_buffer_.data());
+    if (response->status != static_cast<uint8_t>(AuthenticationStatus::SUCCESS)) {
+        fail_parent_handshake(make_error_code(boost::system::errc::permission_denied));
+        return;
+    }
+    send_parent_connect();
+}
+
+void Channel::send_parent_connect() {
+    // The parent is responsive, whatever happens next depends on the target
+    parent_.record_success(std::chrono::steady_clock::now() - connect_start_time_);
+    error_code error;
+    const address target_address = address::from_string(address_, error);
+    AddressType address_type = AddressType::DOMAIN_NAME;
+    if (!error) {
+        address_type = target_address.is_v4() ? AddressType::IPV4 : AddressType::IPV6;
+    }
+    else if (address_.size() > MAX_DOMAIN_NAME_LENGTH) {
+        error_code ignored;
+        parent_deadline_.cancel(ignored);
+        status_callback_(Error{boost::asio::error::host_not_found, Error::Stage::CONNECT});
+        return;
+    }
+    handshake_buffer_.assign({ SOCKS_VERSION, static_cast<uint8_t>(CommandType::CONNECT), 0,
+                               static_cast<uint8_t>(address_type) });
+    if (address_type == AddressType::IPV4) {
+        append_bytes(handshake_buffer_, target_address.to_v4().to_bytes());
+    }
+    else if (address_type == AddressType::IPV6) {
+        append_bytes(handshake_buffer_, target_address.to_v6().to_bytes());
+    }
+    else {
+        handshake_buffer_.push_back(address_.size());
+        append_bytes(handshake_buffer_, address_);
+    }
+    handshake_buffer_.push_back(port_ >> 8);
+    handshake_buffer_.push_back(port_ & 0xff);
+    // Read the header along with the first byte of the bound address, which is the length of
+    // domain names
+    exchange_with_parent(sizeof(SocksCommandResponseHeader) + 1,
+                         &Channel::handle_parent_reply_header);
+}
+
+void Channel::handle_parent_reply_header(const error_code& error) {
+    if (error || parent_timed_out_) {
+        fail_parent_handshake(error);
+        return;
+    }
+    const auto* header = reinterpret_cast<const SocksCommandResponseHeader*>(
+        handshake_buffer_.data());
+    if (header->version != SOCKS_VERSION) {
+        fail_parent_handshake(make_error_code(boost::system::errc::protocol_error));
+        return;
+    }
+    if (header->reply != static_cast<uint8_t>(ReplyType::SUCCESS)) {
+        // The parent is fine, the target isn't
+        LOG4CXX_INFO(logger, "Parent proxy failed to connect to " << get_target_endpoint()
+                     << " with reply " << static_cast<int>(header->reply));
+        error_code ignored;
+        parent_deadline_.cancel(ignored);
+        status_callback_(Error{get_parent_reply_error(header->reply), Error::Stage::CONNECT});
+        return;
+    }
+    // The rest of the bound address, followed by the port
+    size_t remaining_size = sizeof(uint16_t) - 1;
+    switch (static_cast<AddressType>(header->address_type)) {
+        case AddressType::IPV4:
+            remaining_size += sizeof(SocksCommandEndpointIPv4::address);
+            break;
+        case AddressType::IPV6:
+            remaining_size += sizeof(SocksCommandEndpointIPv6::address);
+            break;
+        case AddressType::DOMAIN_NAME:
+            remaining_size += handshake_buffer_.back() + 1;
+            break;
+        default:
+            fail_parent_handshake(make_error_code(boost::system::errc::protocol_error));
+            return;
+    }
+    handshake_buffer_.resize(remaining_size);
+    auto callback = bind(&Channel::handle_parent_reply_end, shared_from_this(), _1);
+    boost::asio::async_read(socket_, boost::asio::buffer(handshake_buffer_),
+                            parent_strand_.wrap(make_allocating_handler(read_allocator_,
+                                                                        move(callback))));
+}
+
+void Channel::handle_parent_reply_end(const error_code& error) {
+    if (error || parent_timed_out_) {
+        fail_parent_handshake(error);
+        return;
+    }
+    finish_connecting();
+}
+
+void Channel::handle_parent_deadline(const error_code& error) {
+    if (error) {
+        return;
+    }
+    // Whatever step of the handshake is pending fails as soon as the socket is closed
+    parent_timed_out_ = true;
+    error_code ignored;
+    socket_.close(ignored);
+}
+
+void Channel::fail_parent_handshake(const error_code& error) {
+    error_code ignored;
+    parent_deadline_.cancel(ignored);
+    const error_code reported_error = parent_timed_out_ ? boost::asio::error::timed_out :
+                                                          error;
+    if (!utils::is_operation_aborted(reported_error)) {
+        const UpstreamPool::Parent& parent = parent_.get_parent();
+        LOG4CXX_INFO(logger, "Failed to connect to " << get_target_endpoint()
+                     << " through parent proxy " << parent.address << ":" << parent.port
+                     << ": " << reported_error.message());
+        parent_.record_failure();
+    }
+    status_callback_(Error{reported_error, Error::Stage::PARENT});
+}
+
+void Channel::finish_connecting() {
+    if (parent_) {
+        error_code ignored;
+        parent_deadline_.cancel(ignored);
+    }
+    if (unix_path_.empty()) {
+        socket_options_.apply_to_connection(socket_.native_handle());
+    }
+    status_callback_(Connected{});
 }
 
 } // roberto
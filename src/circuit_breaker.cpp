@@ -0,0 +1,134 @@
+#include "circuit_breaker.h"
+#include <algorithm>
+#include <functional>
+#include <log4cxx/logger.h>
+#include <boost/system/error_code.hpp>
+#include "socks_response.h"
+
+using std::min;
+using std::hash;
+using std::mutex;
+using std::string;
+using std::lock_guard;
+using std::chrono::milliseconds;
+using std::chrono::duration_cast;
+
+using boost::system::error_code;
+
+using log4cxx::Logger;
+using log4cxx::LoggerPtr;
+
+namespace roberto {
+
+static const LoggerPtr logger = Logger::getLogger("r.circuit_breaker");
+
+// A circuit that keeps failing its probes is opened for at most this times the base duration
+static const size_t MAX_OPEN_DURATION_MULTIPLIER = 32;
+
+constexpr size_t CircuitBreaker::SHARD_COUNT;
+constexpr size_t CircuitBreaker::MAX_SHARD_DESTINATIONS;
+
+CircuitBreaker::CircuitBreaker(size_t failure_threshold, Clock::duration open_duration)
+: failure_threshold_(failure_threshold), open_duration_(open_duration),
+  max_open_duration_(open_duration * MAX_OPEN_DURATION_MULTIPLIER) {
+
+}
+
+bool CircuitBreaker::allow_attempt(const string& destination, ReplyType& reply) {
+    Shard& shard = get_shard(destination);
+    lock_guard<mutex> _(shard.mutex);
+    auto iter = shard.destinations.find(destination);
+    if (iter == shard.destinations.end() || iter->second.state == State::CLOSED) {
+        return true;
+    }
+    Destination& entry = iter->second;
+    const auto now = Clock::now();
+    if (now < entry.next_probe) {
+        reply = entry.failure_reply;
+        return false;
+    }
+    // Let this one through to find out whether the destination is back
+    LOG4CXX_DEBUG(logger, "Probing " << destination);
+    entry.state = State::HALF_OPEN;
+    entry.next_probe = now + entry.open_duration;
+    return true;
+}
+
+void CircuitBreaker::record_success(const string& destination, Clock::duration connect_latency) {
+    Shard& shard = get_shard(destination);
+    lock_guard<mutex> _(shard.mutex);
+    Destination* entry = find_or_insert(shard, destination);
+    if (!entry) {
+        return;
+    }
+    if (entry->state != State::CLOSED) {
+        LOG4CXX_INFO(logger, "Closing circuit for " << destination << " as it's reachable again");
+    }
+    entry->state = State::CLOSED;
+    entry->consecutive_failures = 0;
+    entry->open_duration = Clock::duration::zero();
+    if (entry->average_latency == Clock::duration::zero()) {
+        entry->average_latency = connect_latency;
+    }
+    else {
+        entry->average_latency += (connect_latency - entry->average_latency) / 8;
+    }
+}
+
+void CircuitBreaker::record_failure(const string& destination, const error_code& error) {
+    Shard& shard = get_shard(destination);
+    lock_guard<mutex> _(shard.mutex);
+    Destination* entry = find_or_insert(shard, destination);
+    if (!entry) {
+        return;
+    }
+    ++entry->consecutive_failures;
+    entry->failure_reply = get_connect_failure_reply(error);
+    if (entry->state == State::HALF_OPEN) {
+        // The probe failed, so the destination is likely to stay down for a while
+        entry->open_duration = min(entry->open_duration * 2, max_open_duration_);
+    }
+    else if (entry->state == State::CLOSED &&
+             entry->consecutive_failures >= failure_threshold_) {
+        entry->open_duration = open_duration_;
+        LOG4CXX_WARN(logger, "Opening circuit for " << destination << " after "
+                     << entry->consecutive_failures << " consecutive failures (last one: "
+                     << error.message() << ", average connect latency: "
+                     << duration_cast<milliseconds>(entry->average_latency).count() << "ms)");
+    }
+    else {
+        return;
+    }
+    entry->state = State::OPEN;
+    entry->next_probe = Clock::now() + entry->open_duration;
+}
+
+CircuitBreaker::Shard& CircuitBreaker::get_shard(const string& destination) {
+    return shards_[hash<string>()(destination) % SHARD_COUNT];
+}
+
+CircuitBreaker::Destination* CircuitBreaker::find_or_insert(Shard& shard,
+                                                            const string& destination) {
+    auto iter = shard.destinations.find(destination);
+    if (iter != shard.destinations.end()) {
+        return &iter->second;
+    }
+    if (shard.destinations.size() >= MAX_SHARD_DESTINATIONS) {
+        // Make room by forgetting about the destinations that are healthy
+        for (auto iter = shard.destinations.begin(); iter != shard.destinations.end();) {
+            if (iter->second.state == State::CLOSED && iter->second.consecutive_failures == 0) {
+                iter = shard.destinations.erase(iter);
+            }
+            else {
+                ++iter;
+            }
+        }
+        // Every destination in here is failing, don't track any more
+        if (shard.destinations.size() >= MAX_SHARD_DESTINATIONS) {
+            return nullptr;
+        }
+    }
+    return &shard.destinations[destination];
+}
+
+} // roberto
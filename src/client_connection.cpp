@@ -7,13 +7,27 @@
 #include <boost/asio/read.hpp>
 #include <boost/asio/write.hpp>
 #include "socks_messages.h"
+#include "socks_response.h"
+#include "http_connect.h"
+#include "authentication_manager.h"
+#include "circuit_breaker.h"
+#include "warm_connection_pool.h"
+#include "upstream_pool.h"
+#include "socket_redirector.h"
+#include "traffic_recorder.h"
+#include "throttle_scheduler.h"
+#include "object_pool.h"
+#include "loop_profiler.h"
 #include "utils.h"
 
 using std::unordered_set;
 using std::copy;
 using std::string;
+using std::to_string;
 using std::shared_ptr;
-using std::make_shared;
+using std::function;
+using std::chrono::milliseconds;
+using std::chrono::duration_cast;
 
 using std::placeholders::_1;
 using std::placeholders::_2;
@@ -40,6 +54,10 @@ static const LoggerPtr logger = Logger::getLogger("r.client_connection");
 const ClientConnection::ReadStateHandlerMap ClientConnection::READ_STATE_HANDLERS = {
     { ClientConnection::METHOD_SELECTION, &ClientConnection::handle_method_selection },
     { ClientConnection::METHOD_SELECTION_LIST, &ClientConnection::handle_method_selection_list },
+    { ClientConnection::AWAITING_AUTH_USERNAME_LENGTH,
+      &ClientConnection::handle_auth_username_length },
+    { ClientConnection::AWAITING_AUTH_USERNAME, &ClientConnection::handle_auth_username },
+    { ClientConnection::AWAITING_AUTH_PASSWORD, &ClientConnection::handle_auth_password },
     { ClientConnection::AWAITING_COMMAND, &ClientConnection::handle_command },
     { ClientConnection::AWAITING_COMMAND_ENDPOINT_IPV4, &ClientConnection::handle_endpoint_ipv4 },
     { ClientConnection::AWAITING_COMMAND_ENDPOINT_IPV6, &ClientConnection::handle_endpoint_ipv6 },
@@ -47,24 +65,75 @@ const ClientConnection::ReadStateHandlerMap ClientConnection::READ_STATE_HANDLER
       &ClientConnection::handle_endpoint_domain_length },
     { ClientConnection::AWAITING_COMMAND_ENDPOINT_DOMAIN_BODY,
       &ClientConnection::handle_endpoint_domain },
+    { ClientConnection::AWAITING_HTTP_REQUEST, &ClientConnection::handle_http_request },
     { ClientConnection::PROXY_READ, &ClientConnection::handle_client_read },
 };
 
 const ClientConnection::WriteStateHandlerMap ClientConnection::WRITE_STATE_HANDLERS = {
     { ClientConnection::SENDING_METHOD, &ClientConnection::handle_method_sent },
+    { ClientConnection::SENDING_AUTH_RESPONSE, &ClientConnection::handle_auth_response_sent },
     { ClientConnection::SENDING_COMMAND_RESPONSE, &ClientConnection::handle_command_response_sent },
     { ClientConnection::PROXY_WRITE, &ClientConnection::handle_client_write },
 };
 
 static unordered_set<uint8_t> SUPPORTED_VERSIONS = { 4, 5 };
+static const uint8_t USERNAME_PASSWORD_AUTH_VERSION = 1;
+
+constexpr size_t ClientConnection::RELAY_BUFFER_SIZE;
+constexpr size_t ClientConnection::COALESCING_THRESHOLD;
+constexpr milliseconds ClientConnection::REDIRECTION_DRAIN_INTERVAL;
+
+ClientConnection::RelayState::RelayState()
+: buffer(RELAY_BUFFER_SIZE) {
+
+}
 
 ClientConnection::ClientConnection(io_service& io_service, tcp::resolver& resolver,
-                                   shared_ptr<AuthenticationManager> auth_manager)
-: socket_(io_service), resolver_(resolver), strand_(io_service), auth_manager_(move(auth_manager)),
+                                   shared_ptr<const ConnectionContext> context)
+: socket_(io_service), resolver_(&resolver), strand_(io_service), context_(move(context)),
   read_buffer_(4096) {
 
 }
 
+void ClientConnection::initialize(tcp::resolver& resolver,
+                                  shared_ptr<const ConnectionContext> context) {
+    resolver_ = &resolver;
+    context_ = move(context);
+}
+
+void ClientConnection::reset() {
+    // Buffers keep their capacity, that's the whole point of reusing connections
+    stop_redirecting();
+    error_code error;
+    socket_.close(error);
+    endpoint_.clear();
+    // Submits the trace, so it has to go before the context holding the recorder
+    traffic_recording_.reset();
+    context_.reset();
+    username_.clear();
+    bandwidth_limiter_.reset();
+    traffic_account_.reset();
+    heavy_hitter_account_.reset();
+    write_buffer_.clear();
+    outbound_connection_.reset();
+    for (RelayState& relay : relays_) {
+        relay.buffer.clear();
+        relay.reading = false;
+        relay.writing = false;
+        relay.throttled = false;
+        relay.flush_scheduled = false;
+        relay.finished = false;
+        relay.flow.reset();
+    }
+    read_state_ = METHOD_SELECTION;
+    write_state_ = WriteState{};
+    is_http_ = false;
+    http_request_size_ = 0;
+    target_connected_ = false;
+    replied_optimistically_ = false;
+    redirected_ = false;
+}
+
 ClientConnection::SocketType& ClientConnection::get_socket() {
     return socket_;
 }
@@ -73,14 +142,22 @@ const ClientConnection::SocketType& ClientConnection::get_socket() const {
     return socket_;
 }
 
+io_service& ClientConnection::get_io_service() {
+    return socket_.get_io_service();
+}
+
 void ClientConnection::start() {
-    endpoint_ = socket_.remote_endpoint();
+    endpoint_ = format_endpoint(socket_.remote_endpoint());
     LOG4CXX_INFO(logger, "Accepted client connection from " << endpoint_);
+    if (context_->traffic_recorder) {
+        traffic_recording_.reset(new TrafficRecording(*context_->traffic_recorder));
+    }
 
     schedule_read(sizeof(MethodSelectionRequest));
 }
 
 void ClientConnection::cancel() {
+    stop_redirecting();
     if (outbound_connection_) {
         outbound_connection_->cancel();
         LOG4CXX_INFO(logger, "Closing connection to "
@@ -101,22 +178,32 @@ void ClientConnection::schedule_read(size_t byte_count, size_t write_offset) {
     auto callback = bind(&ClientConnection::handle_read, shared_from_this(), _1, _2);
     auto buffer_start = read_buffer_.data() + write_offset;
     boost::asio::async_read(socket_, boost::asio::buffer(buffer_start, byte_count),
-                            strand_.wrap(callback));
+                            strand_.wrap(make_allocating_handler(read_allocator_, callback)));
 }
 
-void ClientConnection::schedule_read_some() {
+void ClientConnection::schedule_http_read() {
+    // Requests are bounded by the read buffer, there's no telling how long they are up front
     auto callback = bind(&ClientConnection::handle_read, shared_from_this(), _1, _2);
-    socket_.async_read_some(boost::asio::buffer(read_buffer_), strand_.wrap(callback));
+    auto buffer = boost::asio::buffer(read_buffer_.data() + http_request_size_,
+                                      read_buffer_.size() - http_request_size_);
+    socket_.async_read_some(buffer,
+                            strand_.wrap(make_allocating_handler(read_allocator_, callback)));
 }
 
 void ClientConnection::schedule_write() {
     LOG4CXX_TRACE(logger, "Writing " << write_buffer_.size() << " bytes into connection for "
                   << endpoint_);
     auto callback = bind(&ClientConnection::handle_write, shared_from_this(), _1, _2);
-    boost::asio::async_write(socket_, boost::asio::buffer(write_buffer_), strand_.wrap(callback));
+    boost::asio::async_write(socket_, boost::asio::buffer(write_buffer_),
+                             strand_.wrap(make_allocating_handler(write_allocator_, callback)));
 }
 
 void ClientConnection::handle_read(const error_code& error, size_t bytes_read) {
+    LoopProfiler::ScopedTimer timer(LoopProfiler::CLIENT_READ);
+    if (error == boost::asio::error::eof && read_state_ == PROXY_READ) {
+        handle_relay_eof(UPSTREAM);
+        return;
+    }
     if (error) {
         if (!utils::is_operation_aborted(error)) {
             LOG4CXX_DEBUG(logger, "Failed while reading from socket: " << error.message());
@@ -130,6 +217,7 @@ void ClientConnection::handle_read(const error_code& error, size_t bytes_read) {
 }
 
 void ClientConnection::handle_write(const error_code& error, size_t bytes_written) {
+    LoopProfiler::ScopedTimer timer(LoopProfiler::CLIENT_WRITE);
     if (error) {
         if (!utils::is_operation_aborted(error)) {
             LOG4CXX_DEBUG(logger, "Error while writing to socket: " << error.message());
@@ -152,6 +240,35 @@ void ClientConnection::handle_channel_status_update(const Channel::StatusVariant
 }
 
 void ClientConnection::handle_channel_status(const Channel::Error& status) {
+    if (status.error_stage == Channel::Error::Stage::READ &&
+        status.error == boost::asio::error::eof) {
+        handle_relay_eof(DOWNSTREAM);
+        return;
+    }
+    const bool is_aborted = utils::is_operation_aborted(status.error);
+    const bool is_connecting = status.error_stage == Channel::Error::Stage::DNS ||
+                               status.error_stage == Channel::Error::Stage::CONNECT;
+    if (is_connecting && !is_aborted && context_->circuit_breaker) {
+        context_->circuit_breaker->record_failure(outbound_connection_->get_target_endpoint(),
+                                                  status.error);
+    }
+    // The client was told it's connected, so a reset is the only way to report this. Note that
+    // with fast open, connection failures show up when reading or writing
+    if (replied_optimistically_ && !is_aborted) {
+        reset_client();
+        return;
+    }
+    if (status.error_stage == Channel::Error::Stage::PARENT && !is_aborted) {
+        // The parent was already charged for it, the target may well be reachable through
+        // another one
+        send_command_failure(ReplyType::GENERAL_FAILURE);
+        return;
+    }
+    if (is_connecting && !is_aborted) {
+        // Let the client know why before closing the connection
+        send_command_failure(get_connect_failure_reply(status.error));
+        return;
+    }
     // Upon any errors, destroy our reference to the channel
     cancel();
 }
@@ -159,58 +276,73 @@ void ClientConnection::handle_channel_status(const Channel::Error& status) {
 void ClientConnection::handle_channel_status(const Channel::Connected& /*status*/) {
     LOG4CXX_INFO(logger, "Connection to " << outbound_connection_->get_target_endpoint()
                  << " established");
-    SocksCommandResponseHeader response;
-    response.version = cast_buffer<SocksCommandHeader>()->version;
-    response.reply = static_cast<int>(ReplyType::SUCCESS);
-    response.reserved = 0;
+    if (context_->circuit_breaker) {
+        const auto latency = std::chrono::steady_clock::now() - connect_start_time_;
+        context_->circuit_breaker->record_success(outbound_connection_->get_target_endpoint(),
+                                                  latency);
+    }
+    target_connected_ = true;
+    if (traffic_recording_) {
+        traffic_recording_->record_connected();
+    }
+    if (replied_optimistically_) {
+        // We're relaying already, send whatever the client sent in the meantime
+        relay_write(UPSTREAM);
+        relay_read(DOWNSTREAM);
+        return;
+    }
+    ReplyType reply = ReplyType::SUCCESS;
     tcp::endpoint local_endpoint;
     try {
         local_endpoint = outbound_connection_->get_local_endpoint();
     }
     catch (const system_error& error) {
         LOG4CXX_DEBUG(logger, "Error getting local endpoint: " << error.what());
-        response.reply = static_cast<int>(ReplyType::GENERAL_FAILURE);
-    }
-    if (response.reply == static_cast<int>(ReplyType::SUCCESS)) {
-        // Write the local endpoint after the response header
-        const uint16_t port = htons(local_endpoint.port());
-        if (local_endpoint.address().is_v4()) {
-            response.address_type = static_cast<uint8_t>(AddressType::IPV4);
-            uint32_t address = local_endpoint.address().to_v4().to_ulong();
-            SocksCommandResponseEndpointIPv4 body{address, port};
-            set_buffer(body, sizeof(response));
-        }
-        else if (local_endpoint.address().is_v6()) {
-            response.address_type = static_cast<uint8_t>(AddressType::IPV6);
-            auto address_bytes = local_endpoint.address().to_v6().to_bytes();
-            SocksCommandResponseEndpointIPv6 body;
-            copy(address_bytes.begin(), address_bytes.end(), body.bind_ipv6_address);
-            body.bind_port = port;
-            set_buffer(body, sizeof(response));
-        }
-        else {
-            LOG4CXX_DEBUG(logger, "Unknown address found on local endpoint");
-            response.reply = static_cast<int>(ReplyType::GENERAL_FAILURE);
-        }
+        reply = ReplyType::GENERAL_FAILURE;
     }
-    // Prepend our header
-    memcpy(write_buffer_.data(), &response, sizeof(response));
-    write_state_ = SENDING_COMMAND_RESPONSE;
-    schedule_write();
+    if (reply != ReplyType::SUCCESS) {
+        send_command_failure(reply);
+        return;
+    }
+    make_command_reply(reply, local_endpoint);
+    switch (redirect_in_kernel()) {
+        case SocketRedirector::Status::REDIRECTED:
+            LOG4CXX_DEBUG(logger, "Relaying connection for " << endpoint_ << " within the kernel");
+            break;
+        case SocketRedirector::Status::UNSUPPORTED:
+            break;
+        case SocketRedirector::Status::REORDERED:
+            LOG4CXX_WARN(logger, "Resetting connection for " << endpoint_ << " as data was "
+                         "reordered while redirecting it");
+            reset_client();
+            return;
+    }
+    // The response is the first thing relayed to the client, so anything the target sends
+    // before it's written goes out along with it
+    relays_[DOWNSTREAM].buffer.append(write_buffer_.data(), write_buffer_.size());
+    start_relaying();
 }
 
 void ClientConnection::handle_channel_status(const Channel::Read& status) {
-    set_buffer(status.buffer_start, status.buffer_end);
-    schedule_write();
+    handle_relay_read(DOWNSTREAM, status.bytes_read);
 }
 
-void ClientConnection::handle_channel_status(const Channel::Write& /*status*/) {
-    // When we finish writing a buffer into the outbound connection, we can read again from
-    // our client
-    schedule_read_some();
+void ClientConnection::handle_channel_status(const Channel::Write& status) {
+    handle_relay_write(UPSTREAM, status.bytes_written);
 }
 
 void ClientConnection::handle_method_selection(size_t /*bytes_read*/) {
+    if (is_http_request_start(read_buffer_[0])) {
+        // HTTP proxy clients go through the same connect and relay path as socks ones
+        is_http_ = true;
+        if (traffic_recording_) {
+            traffic_recording_->set_protocol(ConnectionTrace::Protocol::HTTP);
+        }
+        http_request_size_ = sizeof(MethodSelectionRequest);
+        read_state_ = AWAITING_HTTP_REQUEST;
+        schedule_http_read();
+        return;
+    }
     const auto* request = cast_buffer<MethodSelectionRequest>();
     if (SUPPORTED_VERSIONS.count(request->version) == 0) {
         LOG4CXX_DEBUG(logger, "Unsupported socks version " << static_cast<int>(request->version));
@@ -220,6 +352,11 @@ void ClientConnection::handle_method_selection(size_t /*bytes_read*/) {
         LOG4CXX_DEBUG(logger, "Received method selection request with no methods");
         return;
     }
+    if (traffic_recording_) {
+        const bool is_socks4 = request->version == 4;
+        traffic_recording_->set_protocol(is_socks4 ? ConnectionTrace::Protocol::SOCKS4 :
+                                                     ConnectionTrace::Protocol::SOCKS5);
+    }
     // We're now waiting for a list of methods. Change state and read them
     read_state_ = METHOD_SELECTION_LIST;
     // Read after our request so we can still access the current data
@@ -227,12 +364,18 @@ void ClientConnection::handle_method_selection(size_t /*bytes_read*/) {
 }
 
 void ClientConnection::handle_method_selection_list(size_t bytes_read) {
-    // TODO: expand this so we allow plain user/password authentication
+    // If we have credentials, then clients are required to authenticate
+    const SocksAuthentication expected_method = context_->auth_manager ?
+                                                SocksAuthentication::USERNAME_PASSWORD :
+                                                SocksAuthentication::NONE;
     const size_t offset = sizeof(MethodSelectionRequest);
     for (size_t i = 0; i < bytes_read; ++i) {
         const uint8_t method = read_buffer_[offset + i];
-        if (method == static_cast<uint8_t>(SocksAuthentication::NONE)) {
+        if (method == static_cast<uint8_t>(expected_method)) {
             const auto* request = cast_buffer<MethodSelectionRequest>();
+            if (traffic_recording_) {
+                traffic_recording_->set_auth_method(expected_method);
+            }
 
             set_buffer(MethodSelectionResponse{request->version, method});
             write_state_ = SENDING_METHOD;
@@ -243,14 +386,65 @@ void ClientConnection::handle_method_selection_list(size_t bytes_read) {
     LOG4CXX_DEBUG(logger, "Ignoring request as no selected authentication method is supported");
 }
 
+void ClientConnection::handle_auth_username_length(size_t /*bytes_read*/) {
+    const auto* header = cast_buffer<UsernamePasswordRequestHeader>();
+    if (header->version != USERNAME_PASSWORD_AUTH_VERSION) {
+        LOG4CXX_DEBUG(logger, "Unsupported authentication version "
+                      << static_cast<int>(header->version));
+        return;
+    }
+    if (header->username_length == 0) {
+        LOG4CXX_DEBUG(logger, "Received invalid length 0 for username");
+        return;
+    }
+    read_state_ = AWAITING_AUTH_USERNAME;
+    // Read the username along with the password length that follows it
+    schedule_read(header->username_length + sizeof(uint8_t),
+                  sizeof(UsernamePasswordRequestHeader));
+}
+
+void ClientConnection::handle_auth_username(size_t bytes_read) {
+    const size_t username_length = bytes_read - sizeof(uint8_t);
+    const size_t offset = sizeof(UsernamePasswordRequestHeader);
+    const size_t password_length = read_buffer_[offset + username_length];
+    read_state_ = AWAITING_AUTH_PASSWORD;
+    schedule_read(password_length, offset + bytes_read);
+}
+
+void ClientConnection::handle_auth_password(size_t bytes_read) {
+    const size_t username_length = cast_buffer<UsernamePasswordRequestHeader>()->username_length;
+    const auto username_start = read_buffer_.begin() + sizeof(UsernamePasswordRequestHeader);
+    const auto password_start = username_start + username_length + sizeof(uint8_t);
+    string username(username_start, username_start + username_length);
+    string password(password_start, password_start + bytes_read);
+
+    AuthenticationStatus status = AuthenticationStatus::FAILURE;
+    if (context_->auth_manager->validate_credentials(username, password)) {
+        LOG4CXX_DEBUG(logger, "Client " << endpoint_ << " authenticated as " << username);
+        status = AuthenticationStatus::SUCCESS;
+        username_ = move(username);
+    }
+    else {
+        LOG4CXX_INFO(logger, "Client " << endpoint_ << " failed to authenticate as " << username);
+    }
+    set_buffer(UsernamePasswordResponse{USERNAME_PASSWORD_AUTH_VERSION,
+                                        static_cast<uint8_t>(status)});
+    write_state_ = SENDING_AUTH_RESPONSE;
+    schedule_write();
+}
+
 void ClientConnection::handle_command(size_t /*bytes_read*/) {
     const auto* command = cast_buffer<SocksCommandHeader>();
     if (SUPPORTED_VERSIONS.count(command->version) == 0) {
         LOG4CXX_DEBUG(logger, "Unsupported socks version " << static_cast<int>(command->version));
         return;
     }
+    if (static_cast<CommandType>(command->command) != CommandType::CONNECT) {
+        LOG4CXX_DEBUG(logger, "Ignoring command request due to unsupported command: "
+                      << static_cast<int>(command->command));
+        return;
+    }
     size_t next_read_size = 0;
-    // TODO add support for domain names
     switch (static_cast<AddressType>(command->address_type)) {
         case AddressType::IPV4:
             read_state_ = AWAITING_COMMAND_ENDPOINT_IPV4;
@@ -311,52 +505,470 @@ void ClientConnection::handle_endpoint_domain(size_t bytes_read) {
     handle_command_endpoint(endpoint_address, port); 
 }
 
-void ClientConnection::handle_command_endpoint(const string& address, uint16_t port) {
-    const auto* command = cast_buffer<SocksCommandHeader>();
-    switch (static_cast<CommandType>(command->command)) {
-        case CommandType::CONNECT:
+void ClientConnection::handle_http_request(size_t bytes_read) {
+    http_request_size_ += bytes_read;
+    HttpConnectRequest request;
+    switch (parse_http_connect(read_buffer_.data(), http_request_size_, request)) {
+        case HttpParseStatus::COMPLETE:
             break;
-        default:
-            LOG4CXX_DEBUG(logger, "Ignoring command request due to unsupported command: "
-                          << static_cast<int>(command->command));
+        case HttpParseStatus::INCOMPLETE:
+            if (http_request_size_ == read_buffer_.size()) {
+                LOG4CXX_DEBUG(logger, "HTTP request from " << endpoint_ << " is too large");
+                send_http_error(431);
+            }
+            else {
+                schedule_http_read();
+            }
+            return;
+        case HttpParseStatus::BAD_REQUEST:
+            LOG4CXX_DEBUG(logger, "Received malformed HTTP request from " << endpoint_);
+            send_http_error(400);
+            return;
+        case HttpParseStatus::METHOD_NOT_ALLOWED:
+            LOG4CXX_DEBUG(logger, "Ignoring HTTP request from " << endpoint_
+                          << " as only CONNECT is supported");
+            send_http_error(405);
             return;
     }
+    if (context_->auth_manager) {
+        string username;
+        string password;
+        if (!decode_http_credentials(request.credentials, username, password) ||
+            !context_->auth_manager->validate_credentials(username, password)) {
+            LOG4CXX_INFO(logger, "Client " << endpoint_ << " failed to authenticate");
+            send_http_error(407);
+            return;
+        }
+        LOG4CXX_DEBUG(logger, "Client " << endpoint_ << " authenticated as " << username);
+        username_ = move(username);
+        if (traffic_recording_) {
+            traffic_recording_->set_auth_method(SocksAuthentication::USERNAME_PASSWORD);
+        }
+    }
+    // Whatever the client sent right after the request is relayed once we're connected
+    relays_[UPSTREAM].buffer.append(read_buffer_.data() + request.size,
+                                    http_request_size_ - request.size);
+    handle_command_endpoint(request.host.to_string(), request.port);
+}
+
+void ClientConnection::handle_command_endpoint(const string& address, uint16_t port) {
     LOG4CXX_DEBUG(logger, "Received connection request for " << address << ":" << port);
+    if (traffic_recording_) {
+        const auto address_type = is_http_ ? get_host_address_type(address) :
+            static_cast<AddressType>(cast_buffer<SocksCommandHeader>()->address_type);
+        traffic_recording_->record_request(address_type);
+    }
+    const auto& traffic_accountant = context_->traffic_accountant;
+    if (traffic_accountant) {
+        if (traffic_accountant->is_over_quota(username_)) {
+            LOG4CXX_INFO(logger, "Rejecting connection request from " << endpoint_
+                         << " as its user is over quota");
+            send_command_failure(ReplyType::CONNECTION_NOT_ALLOWED);
+            return;
+        }
+        traffic_account_.reset(new TrafficAccount(traffic_accountant->make_account(username_)));
+    }
+    if (context_->bandwidth_manager) {
+        bandwidth_limiter_ = context_->bandwidth_manager->make_limiter(username_);
+    }
+    if (context_->heavy_hitter_tracker) {
+        error_code error;
+        const auto client_endpoint = socket_.remote_endpoint(error);
+        heavy_hitter_account_.reset(new HeavyHitterAccount(
+            *context_->heavy_hitter_tracker, address + ":" + to_string(port),
+            error ? string() : format_address(client_endpoint)));
+    }
+    ReplyType reply;
+    const auto& circuit_breaker = context_->circuit_breaker;
+    if (circuit_breaker && !circuit_breaker->allow_attempt(address + ":" + to_string(port),
+                                                           reply)) {
+        LOG4CXX_DEBUG(logger, "Rejecting connection request for " << address << ":" << port
+                      << " as it's unreachable");
+        send_command_failure(reply);
+        return;
+    }
+    const string& unix_path = context_->get_unix_egress_path(address, port);
+    // Local services are still reached directly
+    UpstreamPool::Lease parent;
+    if (context_->upstream_pool && unix_path.empty()) {
+        parent = context_->upstream_pool->choose();
+        if (!parent) {
+            LOG4CXX_DEBUG(logger, "Rejecting connection request for " << address << ":" << port
+                          << " as every parent proxy is down");
+            send_command_failure(ReplyType::NETWORK_UNREACHABLE);
+            return;
+        }
+    }
+    connect_start_time_ = std::chrono::steady_clock::now();
     auto callback = bind(&ClientConnection::handle_channel_status_update, shared_from_this(), _1);
-    outbound_connection_ = make_shared<Channel>(socket_.get_io_service(), resolver_, address, port,
-                                                strand_.wrap(callback));
-    outbound_connection_->start();
+    // Channel statuses are dispatched into our strand using our own allocator
+    auto status_callback = make_allocating_handler(status_allocator_, callback);
+    const auto& socket_options = context_->egress_socket_profiles.get_options(port);
+    outbound_connection_ = ObjectPool<Channel>::acquire(get_io_service(), *resolver_, address,
+                                                        port, unix_path, socket_options,
+                                                        strand_.wrap(status_callback));
+    const auto& warm_connection_pool = context_->warm_connection_pool;
+    StreamSocket warm_socket(get_io_service());
+    if (parent) {
+        outbound_connection_->start(std::move(parent));
+    }
+    else if (warm_connection_pool && unix_path.empty() &&
+             warm_connection_pool->take(address, port, warm_socket)) {
+        outbound_connection_->start(std::move(warm_socket));
+    }
+    else {
+        // Only worth deferring the SYN if the client's first bytes are already here to go
+        // along with it. Otherwise targets that speak first would never see a connection
+        if (context_->optimistic_connect && has_early_data()) {
+            outbound_connection_->enable_fast_open();
+        }
+        outbound_connection_->start();
+    }
+    if (context_->optimistic_connect) {
+        // Tell the client it's connected right away, so its first bytes are buffered while
+        // connecting instead of being sent a round trip later
+        replied_optimistically_ = true;
+        make_command_reply(ReplyType::SUCCESS, tcp::endpoint());
+        relays_[DOWNSTREAM].buffer.append(write_buffer_.data(), write_buffer_.size());
+        start_relaying();
+    }
 }
 
-void ClientConnection::handle_client_read(size_t bytes_read) {
-    // We might have just destroyed this
-    if (outbound_connection_) {
-        // Forward the read bytes into our outbound connection
-        outbound_connection_->write(read_buffer_.begin(), read_buffer_.begin() + bytes_read);
+void ClientConnection::make_command_reply(ReplyType reply, const tcp::endpoint& endpoint) {
+    if (is_http_) {
+        make_http_response(write_buffer_, reply);
+    }
+    else {
+        make_command_response(write_buffer_, cast_buffer<SocksCommandHeader>()->version, reply,
+                              endpoint);
     }
 }
 
+void ClientConnection::send_command_failure(ReplyType reply) {
+    make_command_reply(reply, tcp::endpoint());
+    write_state_ = SENDING_COMMAND_RESPONSE;
+    schedule_write();
+}
+
+void ClientConnection::send_http_error(unsigned status_code) {
+    make_http_response(write_buffer_, status_code);
+    // Sent as a command response so the connection is closed afterwards
+    write_state_ = SENDING_COMMAND_RESPONSE;
+    schedule_write();
+}
+
+void ClientConnection::reset_client() {
+    LOG4CXX_DEBUG(logger, "Resetting connection for " << endpoint_);
+    // Once released, closing the socket sends a reset rather than a FIN, so the client can't
+    // mistake this for the target closing the connection
+    error_code error;
+    socket_.set_option(boost::asio::socket_base::linger(true, 0), error);
+    cancel();
+}
+
+void ClientConnection::handle_client_read(size_t bytes_read) {
+    handle_relay_read(UPSTREAM, bytes_read);
+}
+
 void ClientConnection::handle_method_sent(size_t bytes_written) {
     assert(bytes_written == sizeof(MethodSelectionResponse));
+    if (context_->auth_manager) {
+        read_state_ = AWAITING_AUTH_USERNAME_LENGTH;
+        schedule_read(sizeof(UsernamePasswordRequestHeader));
+    }
+    else {
+        read_state_ = AWAITING_COMMAND;
+        schedule_read(sizeof(SocksCommandHeader));
+    }
+}
+
+void ClientConnection::handle_auth_response_sent(size_t /*bytes_written*/) {
+    // The username is only set if authentication succeeded
+    if (username_.empty()) {
+        cancel();
+        return;
+    }
     read_state_ = AWAITING_COMMAND;
     schedule_read(sizeof(SocksCommandHeader));
 }
 
-void ClientConnection::handle_command_response_sent(size_t bytes_written) {
-    // TODO: add endpoint on this thing
-    LOG4CXX_DEBUG(logger, "Starting proxying connection");
+void ClientConnection::handle_command_response_sent(size_t /*bytes_written*/) {
+    // Successful responses are sent through the relay, so this one reported a failure
+    cancel();
+}
+
+void ClientConnection::handle_client_write(size_t bytes_written) {
+    handle_relay_write(DOWNSTREAM, bytes_written);
+}
+
+void ClientConnection::stop_redirecting() {
+    // The sockets are about to be closed, so their keys must not stay enabled
+    if (redirected_) {
+        context_->socket_redirector->release(redirected_pair_);
+        redirected_ = false;
+    }
+}
+
+SocketRedirector::Status ClientConnection::redirect_in_kernel() {
+    const auto& socket_redirector = context_->socket_redirector;
+    // Redirected data never reaches us, so it can't be throttled, accounted for or traced
+    if (!socket_redirector || bandwidth_limiter_ || traffic_account_ || heavy_hitter_account_ ||
+        traffic_recording_ || !relays_[UPSTREAM].buffer.empty()) {
+        return SocketRedirector::Status::UNSUPPORTED;
+    }
+    // The response has to be sent before anything the target sends is redirected after it.
+    // It's tiny and nothing was written to the socket yet, so this normally sends all of it
+    const ssize_t bytes_sent = send(socket_.native_handle(), write_buffer_.data(),
+                                    write_buffer_.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+    if (bytes_sent > 0) {
+        write_buffer_.erase(write_buffer_.begin(), write_buffer_.begin() + bytes_sent);
+    }
+    if (!write_buffer_.empty()) {
+        return SocketRedirector::Status::UNSUPPORTED;
+    }
+    // We keep reading from both sockets, which is how closes and errors are noticed
+    const int client_socket = socket_.native_handle();
+    const int target_socket = outbound_connection_->get_native_handle();
+    // Taken before redirecting, so whatever arrives from now on is expected to be relayed
+    redirection_start_counts_[UPSTREAM] = SocketRedirector::get_byte_counts(client_socket);
+    redirection_start_counts_[DOWNSTREAM] = SocketRedirector::get_byte_counts(target_socket);
+    const auto status = socket_redirector->redirect(client_socket, target_socket,
+                                                    redirected_pair_);
+    redirected_ = status == SocketRedirector::Status::REDIRECTED;
+    return status;
+}
+
+// Whatever an HTTP client sent after its request, or data a client sent without waiting for
+// the command reply
+bool ClientConnection::has_early_data() {
+    error_code error;
+    return !relays_[UPSTREAM].buffer.empty() || (socket_.available(error) > 0 && !error);
+}
+
+void ClientConnection::start_relaying() {
+    LOG4CXX_DEBUG(logger, "Starting proxying connection for " << endpoint_);
     read_state_ = PROXY_READ;
     write_state_ = PROXY_WRITE;
-    // Try to read at most our read buffer size from our outbound connection
-    outbound_connection_->read(read_buffer_.size());
-    // Try to read from out client's connection
-    schedule_read_some();
+    // Don't hold the command response back, the client won't talk until it gets it
+    if (!relays_[DOWNSTREAM].buffer.empty()) {
+        start_relay_write(DOWNSTREAM);
+    }
+    // HTTP clients may have sent data right after their request
+    relay_write(UPSTREAM);
+    relay_read(UPSTREAM);
+    relay_read(DOWNSTREAM);
+}
+
+void ClientConnection::relay_read(RelayDirection direction) {
+    RelayState& relay = relays_[direction];
+    if (!outbound_connection_ || relay.reading || relay.throttled || relay.finished ||
+        relay.buffer.full() || (direction == DOWNSTREAM && !target_connected_)) {
+        return;
+    }
+    relay.reading = true;
+    if (direction == UPSTREAM) {
+        auto callback = bind(&ClientConnection::handle_read, shared_from_this(), _1, _2);
+        socket_.async_read_some(relay.buffer.get_free_buffers(),
+                                strand_.wrap(make_allocating_handler(read_allocator_, callback)));
+    }
+    else {
+        outbound_connection_->read(relay.buffer.get_free_buffers());
+    }
+}
+
+void ClientConnection::relay_write(RelayDirection direction) {
+    RelayState& relay = relays_[direction];
+    // Until we're connected, the buffer holds the client's early data
+    if (relay.writing || relay.buffer.empty() || (direction == UPSTREAM && !target_connected_)) {
+        return;
+    }
+    // Give small writes a chance to be coalesced with the data that follows them, if any
+    const auto window = context_->coalescing_window;
+    if (window > window.zero() && relay.buffer.size() < COALESCING_THRESHOLD &&
+        !relay.finished) {
+        if (!relay.flush_scheduled) {
+            relay.flush_scheduled = true;
+            schedule_delayed(window, bind(&ClientConnection::flush_relay, shared_from_this(),
+                                          direction));
+        }
+        return;
+    }
+    start_relay_write(direction);
+}
+
+void ClientConnection::start_relay_write(RelayDirection direction) {
+    RelayState& relay = relays_[direction];
+    relay.writing = true;
+    if (direction == UPSTREAM) {
+        outbound_connection_->write(relay.buffer.get_data_buffers());
+    }
+    else {
+        LOG4CXX_TRACE(logger, "Writing " << relay.buffer.size() << " bytes into connection for "
+                      << endpoint_);
+        auto callback = bind(&ClientConnection::handle_write, shared_from_this(), _1, _2);
+        boost::asio::async_write(socket_, relay.buffer.get_data_buffers(),
+                                 strand_.wrap(make_allocating_handler(write_allocator_,
+                                                                      callback)));
+    }
+}
+
+void ClientConnection::handle_relay_read(RelayDirection direction, size_t bytes_read) {
+    RelayState& relay = relays_[direction];
+    relay.reading = false;
+    // We might have just destroyed this
+    if (!outbound_connection_) {
+        return;
+    }
+    if (redirected_ && bytes_read > 0) {
+        // Whatever the kernel redirects after this could overtake it, so there's no way to
+        // relay it in order
+        LOG4CXX_WARN(logger, "Resetting connection for " << endpoint_ << " as " << bytes_read
+                     << " bytes weren't redirected");
+        reset_client();
+        return;
+    }
+    relay.buffer.commit(bytes_read);
+    if (!account_traffic(direction, bytes_read)) {
+        return;
+    }
+    relay_write(direction);
+    // Keep reading while the data is being written, unless we're over our bandwidth or we
+    // used up our turn
+    const auto delay = throttle(direction, bytes_read);
+    if (delay != BandwidthLimiter::Clock::duration::zero()) {
+        relay.throttled = true;
+        schedule_throttled(delay, bind(&ClientConnection::resume_relay_read, shared_from_this(),
+                                       direction));
+    }
+    else if (must_yield(direction, bytes_read)) {
+        // Reading is paused until our next turn, just like when throttled
+        relay.throttled = true;
+        auto& scheduler = RelayScheduler::for_current_thread(get_io_service());
+        scheduler.wait_for_turn(strand_.wrap(bind(&ClientConnection::resume_relay_read,
+                                          shared_from_this(), direction)));
+    }
+    else {
+        relay_read(direction);
+    }
+}
+
+void ClientConnection::handle_relay_write(RelayDirection direction, size_t bytes_written) {
+    RelayState& relay = relays_[direction];
+    relay.writing = false;
+    if (!outbound_connection_) {
+        return;
+    }
+    relay.buffer.consume(bytes_written);
+    if (relay.finished && relay.buffer.empty()) {
+        // Everything the source sent before closing was relayed, we're done
+        finish_relay(direction);
+        return;
+    }
+    relay_write(direction);
+    // Reading stops while the buffer is full, so there could be room to resume it now
+    relay_read(direction);
+}
+
+void ClientConnection::handle_relay_eof(RelayDirection direction) {
+    RelayState& relay = relays_[direction];
+    relay.reading = false;
+    relay.finished = true;
+    if (!outbound_connection_ || relay.writing) {
+        return;
+    }
+    if (relay.buffer.empty()) {
+        finish_relay(direction);
+    }
+    else {
+        relay_write(direction);
+    }
+}
+
+void ClientConnection::finish_relay(RelayDirection direction) {
+    if (!outbound_connection_) {
+        return;
+    }
+    // Closing the sockets would drop whatever the kernel still has to redirect, so wait until
+    // everything the source sent made it into the sink
+    if (redirected_ && !is_redirection_drained(direction)) {
+        schedule_delayed(REDIRECTION_DRAIN_INTERVAL,
+                         bind(&ClientConnection::finish_relay, shared_from_this(), direction));
+        return;
+    }
+    cancel();
+}
+
+bool ClientConnection::is_redirection_drained(RelayDirection direction) {
+    const int client_socket = socket_.native_handle();
+    const int target_socket = outbound_connection_->get_native_handle();
+    const auto client_counts = SocketRedirector::get_byte_counts(client_socket);
+    const auto target_counts = SocketRedirector::get_byte_counts(target_socket);
+    uint64_t received;
+    uint64_t sent;
+    if (direction == UPSTREAM) {
+        received = client_counts.received - redirection_start_counts_[UPSTREAM].received;
+        sent = target_counts.sent - redirection_start_counts_[DOWNSTREAM].sent;
+    }
+    else {
+        received = target_counts.received - redirection_start_counts_[DOWNSTREAM].received;
+        sent = client_counts.sent - redirection_start_counts_[UPSTREAM].sent;
+    }
+    // The source's FIN was received but isn't relayed
+    return sent + 1 >= received;
+}
+
+void ClientConnection::resume_relay_read(RelayDirection direction) {
+    relays_[direction].throttled = false;
+    relay_read(direction);
+}
+
+void ClientConnection::flush_relay(RelayDirection direction) {
+    RelayState& relay = relays_[direction];
+    relay.flush_scheduled = false;
+    if (outbound_connection_ && !relay.writing && !relay.buffer.empty()) {
+        start_relay_write(direction);
+    }
+}
+
+bool ClientConnection::account_traffic(RelayDirection direction, size_t byte_count) {
+    if (heavy_hitter_account_) {
+        heavy_hitter_account_->record(byte_count);
+    }
+    if (traffic_recording_) {
+        traffic_recording_->record_chunk(direction, byte_count);
+    }
+    if (!traffic_account_ || traffic_account_->record(direction, byte_count)) {
+        return true;
+    }
+    LOG4CXX_INFO(logger, "Closing connection for " << endpoint_ << " as its user is over quota");
+    cancel();
+    return false;
+}
+
+BandwidthLimiter::Clock::duration ClientConnection::throttle(RelayDirection direction,
+                                                             size_t byte_count) {
+    if (!bandwidth_limiter_) {
+        return BandwidthLimiter::Clock::duration::zero();
+    }
+    return bandwidth_limiter_->consume(direction, byte_count);
+}
+
+bool ClientConnection::must_yield(RelayDirection direction, size_t byte_count) {
+    const RelayScheduler::Policy& policy = context_->relay_scheduling;
+    return policy.is_enabled() && relays_[direction].flow.record(policy, byte_count);
+}
+
+void ClientConnection::schedule_throttled(BandwidthLimiter::Clock::duration delay,
+                                          function<void()> callback) {
+    LOG4CXX_TRACE(logger, "Throttling connection for " << endpoint_ << " during "
+                  << duration_cast<milliseconds>(delay).count() << "ms");
+    schedule_delayed(delay, move(callback));
 }
 
-void ClientConnection::handle_client_write(size_t /*bytes_written*/) {
-    // We finished forwarding data to our client. It's time to read again from the outbound 
-    // connection
-    outbound_connection_->read(read_buffer_.size());
+void ClientConnection::schedule_delayed(ThrottleScheduler::Clock::duration delay,
+                                        function<void()> callback) {
+    auto& scheduler = ThrottleScheduler::for_current_thread(get_io_service());
+    scheduler.schedule(ThrottleScheduler::Clock::now() + delay, strand_.wrap(move(callback)));
 }
 
 } // roberto
@@ -0,0 +1,750 @@
+#include "coroutine_connection.h"
+#include <cassert>
+#include <unordered_set>
+#include <algorithm>
+#include <log4cxx/logger.h>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/coroutine.hpp>
+#include <boost/asio/connect.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
+#include "socks_messages.h"
+#include "socks_response.h"
+#include "http_connect.h"
+#include "authentication_manager.h"
+#include "circuit_breaker.h"
+#include "warm_connection_pool.h"
+#include "throttle_scheduler.h"
+#include "loop_profiler.h"
+#include "recycling_allocator.h"
+#include "utils.h"
+
+using std::copy;
+using std::move;
+using std::string;
+using std::function;
+using std::unique_ptr;
+using std::shared_ptr;
+using std::to_string;
+using std::unordered_set;
+using std::chrono::milliseconds;
+using std::chrono::duration_cast;
+
+using boost::asio::io_service;
+using boost::asio::ip::address_v4;
+using boost::asio::ip::address_v6;
+using boost::asio::ip::tcp;
+
+using boost::system::error_code;
+
+using log4cxx::Logger;
+using log4cxx::LoggerPtr;
+
+namespace roberto {
+
+static const LoggerPtr logger = Logger::getLogger("r.coroutine_connection");
+
+static const unordered_set<uint8_t> SUPPORTED_VERSIONS = { 4, 5 };
+static const uint8_t USERNAME_PASSWORD_AUTH_VERSION = 1;
+
+constexpr size_t CoroutineConnection::BUFFER_SIZE;
+
+// Makes a handler run within the strand, using the given allocator
+template <typename Handler>
+static auto wrap_handler(boost::asio::strand& strand, HandlerAllocator& allocator,
+                         const Handler& handler)
+    -> decltype(strand.wrap(make_allocating_handler(allocator, handler))) {
+    return strand.wrap(make_allocating_handler(allocator, handler));
+}
+
+#include <boost/asio/yield.hpp>
+
+// Runs the socks handshake and establishes the outbound connection
+class CoroutineConnection::Handshake : public boost::asio::coroutine {
+public:
+    explicit Handshake(CoroutineConnection& connection)
+    : connection_(&connection) {
+
+    }
+
+    void operator()(const error_code& error = error_code(), size_t bytes_transferred = 0);
+
+    void operator()(const error_code& error, Resolver::iterator iter) {
+        connection_->target_endpoints_ = iter;
+        (*this)(error, 0);
+    }
+private:
+    void read(size_t byte_count, size_t offset = 0) {
+        CoroutineConnection& c = *connection_;
+        auto buffer = boost::asio::buffer(c.buffers_[UPSTREAM].data() + offset, byte_count);
+        boost::asio::async_read(c.client_socket_, buffer,
+                                wrap_handler(c.strand_, c.allocators_[UPSTREAM], *this));
+    }
+
+    void read_some(size_t offset) {
+        CoroutineConnection& c = *connection_;
+        auto buffer = boost::asio::buffer(c.buffers_[UPSTREAM].data() + offset,
+                                          c.buffers_[UPSTREAM].size() - offset);
+        c.client_socket_.async_read_some(buffer,
+                                         wrap_handler(c.strand_, c.allocators_[UPSTREAM], *this));
+    }
+
+    void connect_to_next_endpoint() {
+        CoroutineConnection& c = *connection_;
+        const tcp::endpoint endpoint = c.target_endpoints_->endpoint();
+        // Open the socket ourselves so it can be tuned before connecting
+        error_code error;
+        c.target_socket_.close(error);
+        c.target_socket_.open(StreamProtocol(endpoint.protocol()), error);
+        if (error) {
+            c.strand_.post(std::bind(*this, error, size_t(0)));
+            return;
+        }
+        const SocketOptions& options = c.context_->egress_socket_profiles.get_options(
+            c.target_port_);
+        options.apply_before_connect(c.target_socket_.native_handle());
+        // The SYN is only deferred if there's data to go along with it, otherwise targets that
+        // speak first would never see a connection
+        if (replied_optimistically_ && has_early_data()) {
+            options.enable_fast_open_connect(c.target_socket_.native_handle());
+        }
+        c.target_socket_.async_connect(StreamEndpoint(endpoint),
+                                       wrap_handler(c.strand_, c.allocators_[UPSTREAM], *this));
+    }
+
+    // Whatever an HTTP client sent after its request, or what's waiting in the client socket
+    bool has_early_data() {
+        CoroutineConnection& c = *connection_;
+        error_code error;
+        return http_request_size_ > http_request_end_ ||
+               (c.client_socket_.available(error) > 0 && !error);
+    }
+
+    void connect_to_unix_path() {
+        CoroutineConnection& c = *connection_;
+        c.target_socket_.async_connect(boost::asio::local::stream_protocol::endpoint(*unix_path_),
+                                       wrap_handler(c.strand_, c.allocators_[UPSTREAM], *this));
+    }
+
+    void write() {
+        CoroutineConnection& c = *connection_;
+        boost::asio::async_write(c.client_socket_, boost::asio::buffer(c.write_buffer_),
+                                 wrap_handler(c.strand_, c.allocators_[UPSTREAM], *this));
+    }
+
+    // Whatever an HTTP client sent right after its request goes to the target once connected
+    void write_early_data() {
+        CoroutineConnection& c = *connection_;
+        auto buffer = boost::asio::buffer(c.buffers_[UPSTREAM].data() + http_request_end_,
+                                          http_request_size_ - http_request_end_);
+        boost::asio::async_write(c.target_socket_, buffer,
+                                 wrap_handler(c.strand_, c.allocators_[UPSTREAM], *this));
+    }
+
+    AddressType get_address_type() const {
+        const auto* command = connection_->cast_buffer<SocksCommandHeader>();
+        return static_cast<AddressType>(command->address_type);
+    }
+
+    string get_target_endpoint() const {
+        return connection_->target_address_ + ":" + to_string(connection_->target_port_);
+    }
+
+    // What to do after looking at what was read of an HTTP request so far
+    enum class HttpRequestState {
+        INCOMPLETE,
+        // The response explaining why is in the write buffer
+        REJECTED,
+        ACCEPTED
+    };
+
+    bool select_method(size_t method_count);
+    HttpRequestState handle_http_request();
+    bool parse_endpoint(AddressType address_type, size_t bytes_read);
+    bool prepare_connection();
+    void make_reply(ReplyType reply, const tcp::endpoint& endpoint);
+    bool allow_connection_attempt();
+    void record_connection_failure(const error_code& error);
+    void reset_client();
+    void start_relaying();
+
+    CoroutineConnection* connection_;
+    // Whether we're resolving or connecting to the target, as those errors are reported
+    bool connecting_{false};
+    CircuitBreaker::Clock::time_point connect_start_time_;
+    // Points into the context's mappings, empty unless connecting through a Unix domain socket
+    const string* unix_path_{nullptr};
+    // Set if the client was told it's connected before connecting to the target
+    bool replied_optimistically_{false};
+    // Set if the client is speaking HTTP CONNECT rather than socks
+    bool is_http_{false};
+    HttpRequestState http_request_state_{HttpRequestState::INCOMPLETE};
+    // How much of the request was read, and where the data sent after it starts
+    size_t http_request_size_{0};
+    size_t http_request_end_{0};
+};
+
+// Forwards data from one socket into the other one, until either of them fails
+class CoroutineConnection::Relay : public boost::asio::coroutine {
+public:
+    Relay(CoroutineConnection& connection, RelayDirection direction)
+    : connection_(&connection), direction_(direction) {
+
+    }
+
+    void operator()(const error_code& error = error_code(), size_t bytes_transferred = 0);
+private:
+    CoroutineConnection* connection_;
+    RelayDirection direction_;
+    size_t byte_count_{0};
+    BandwidthLimiter::Clock::duration delay_{};
+};
+
+void CoroutineConnection::Handshake::operator()(const error_code& error,
+                                                size_t bytes_transferred) {
+    LoopProfiler::ScopedTimer timer(LoopProfiler::COROUTINE_HANDSHAKE);
+    CoroutineConnection& c = *connection_;
+    if (error && (!connecting_ || utils::is_operation_aborted(error))) {
+        if (!utils::is_operation_aborted(error)) {
+            LOG4CXX_DEBUG(logger, "Handshake with " << c.endpoint_ << " failed: "
+                          << error.message());
+        }
+        c.release();
+        return;
+    }
+    reenter (this) {
+        yield read(sizeof(MethodSelectionRequest));
+        if (is_http_request_start(c.buffers_[UPSTREAM][0])) {
+            // HTTP proxy clients go through the same connect and relay path as socks ones
+            is_http_ = true;
+            if (c.traffic_recording_) {
+                c.traffic_recording_->set_protocol(ConnectionTrace::Protocol::HTTP);
+            }
+            http_request_size_ = sizeof(MethodSelectionRequest);
+            while ((http_request_state_ = handle_http_request()) ==
+                       HttpRequestState::INCOMPLETE) {
+                yield read_some(http_request_size_);
+                http_request_size_ += bytes_transferred;
+            }
+            if (http_request_state_ == HttpRequestState::REJECTED) {
+                yield write();
+                c.release();
+                return;
+            }
+        }
+        else {
+            if (SUPPORTED_VERSIONS.count(c.cast_buffer<MethodSelectionRequest>()->version) == 0 ||
+                c.cast_buffer<MethodSelectionRequest>()->method_count == 0) {
+                LOG4CXX_DEBUG(logger, "Received invalid method selection request");
+                c.release();
+                return;
+            }
+            if (c.traffic_recording_) {
+                const bool is_socks4 = c.cast_buffer<MethodSelectionRequest>()->version == 4;
+                c.traffic_recording_->set_protocol(is_socks4 ? ConnectionTrace::Protocol::SOCKS4 :
+                                                               ConnectionTrace::Protocol::SOCKS5);
+            }
+            yield read(c.cast_buffer<MethodSelectionRequest>()->method_count,
+                       sizeof(MethodSelectionRequest));
+            if (!select_method(bytes_transferred)) {
+                LOG4CXX_DEBUG(logger, "Ignoring request as no selected authentication method "
+                              "is supported");
+                c.release();
+                return;
+            }
+            yield write();
+
+            if (c.context_->auth_manager) {
+                yield read(sizeof(UsernamePasswordRequestHeader));
+                if (c.cast_buffer<UsernamePasswordRequestHeader>()->version !=
+                        USERNAME_PASSWORD_AUTH_VERSION ||
+                    c.cast_buffer<UsernamePasswordRequestHeader>()->username_length == 0) {
+                    LOG4CXX_DEBUG(logger, "Received invalid authentication request");
+                    c.release();
+                    return;
+                }
+                // Read the username along with the password length that follows it
+                yield read(c.cast_buffer<UsernamePasswordRequestHeader>()->username_length +
+                           sizeof(uint8_t), sizeof(UsernamePasswordRequestHeader));
+                yield read(c.buffers_[UPSTREAM][sizeof(UsernamePasswordRequestHeader) +
+                                                bytes_transferred - sizeof(uint8_t)],
+                           sizeof(UsernamePasswordRequestHeader) + bytes_transferred);
+                {
+                    const auto& buffer = c.buffers_[UPSTREAM];
+                    const size_t username_length =
+                        c.cast_buffer<UsernamePasswordRequestHeader>()->username_length;
+                    const auto username_start = buffer.begin() +
+                                                sizeof(UsernamePasswordRequestHeader);
+                    const auto password_start = username_start + username_length + sizeof(uint8_t);
+                    string username(username_start, username_start + username_length);
+                    string password(password_start, password_start + bytes_transferred);
+                    AuthenticationStatus status = AuthenticationStatus::FAILURE;
+                    if (c.context_->auth_manager->validate_credentials(username, password)) {
+                        status = AuthenticationStatus::SUCCESS;
+                        c.username_ = move(username);
+                    }
+                    else {
+                        LOG4CXX_INFO(logger, "Client " << c.endpoint_
+                                     << " failed to authenticate as " << username);
+                    }
+                    c.set_buffer(UsernamePasswordResponse{USERNAME_PASSWORD_AUTH_VERSION,
+                                                          static_cast<uint8_t>(status)});
+                }
+                yield write();
+                // The username is only set if authentication succeeded
+                if (c.username_.empty()) {
+                    c.release();
+                    return;
+                }
+            }
+
+            yield read(sizeof(SocksCommandHeader));
+            if (SUPPORTED_VERSIONS.count(c.cast_buffer<SocksCommandHeader>()->version) == 0) {
+                LOG4CXX_DEBUG(logger, "Unsupported socks version "
+                              << static_cast<int>(c.cast_buffer<SocksCommandHeader>()->version));
+                c.release();
+                return;
+            }
+            // Note that yielding isn't allowed within a switch statement
+            if (get_address_type() == AddressType::IPV4) {
+                yield read(sizeof(SocksCommandEndpointIPv4), sizeof(SocksCommandHeader));
+            }
+            else if (get_address_type() == AddressType::IPV6) {
+                yield read(sizeof(SocksCommandEndpointIPv6), sizeof(SocksCommandHeader));
+            }
+            else if (get_address_type() == AddressType::DOMAIN_NAME) {
+                yield read(sizeof(uint8_t), sizeof(SocksCommandHeader));
+                if (c.buffers_[UPSTREAM][sizeof(SocksCommandHeader)] == 0) {
+                    LOG4CXX_DEBUG(logger, "Received invalid length 0 for domain name");
+                    c.release();
+                    return;
+                }
+                yield read(c.buffers_[UPSTREAM][sizeof(SocksCommandHeader)] + sizeof(uint16_t),
+                           sizeof(SocksCommandHeader) + sizeof(uint8_t));
+            }
+            else {
+                LOG4CXX_DEBUG(logger, "Unsupported address type "
+                              << static_cast<int>(get_address_type()));
+                c.release();
+                return;
+            }
+            if (!parse_endpoint(get_address_type(), bytes_transferred)) {
+                c.release();
+                return;
+            }
+        }
+        // Either way, the reply explaining why is in the write buffer
+        if (!prepare_connection() || !allow_connection_attempt()) {
+            yield write();
+            c.release();
+            return;
+        }
+        if (c.context_->optimistic_connect) {
+            // Tell the client it's connected right away. Whatever it sends in the meantime
+            // waits in its socket until we start relaying
+            replied_optimistically_ = true;
+            make_reply(ReplyType::SUCCESS, tcp::endpoint());
+            yield write();
+        }
+
+        connecting_ = true;
+        connect_start_time_ = CircuitBreaker::Clock::now();
+        unix_path_ = &c.context_->get_unix_egress_path(c.target_address_, c.target_port_);
+        if (!unix_path_->empty()) {
+            yield connect_to_unix_path();
+        }
+        else if (c.context_->warm_connection_pool &&
+                 c.context_->warm_connection_pool->take(c.target_address_, c.target_port_,
+                                                        c.target_socket_)) {
+            // Already connected, there's nothing to wait for
+        }
+        else {
+            yield c.resolver_.async_resolve(Resolver::query(c.target_address_,
+                                                            to_string(c.target_port_)),
+                                            wrap_handler(c.strand_, c.allocators_[UPSTREAM],
+                                                         *this));
+            // Every resolved endpoint is attempted until one of them accepts the connection
+            if (!error) {
+                do {
+                    yield connect_to_next_endpoint();
+                } while (error && ++c.target_endpoints_ != Resolver::iterator());
+            }
+        }
+        connecting_ = false;
+        if (error) {
+            LOG4CXX_INFO(logger, "Failed to connect to " << get_target_endpoint() << ": "
+                         << error.message());
+            record_connection_failure(error);
+            if (replied_optimistically_) {
+                reset_client();
+                c.release();
+                return;
+            }
+            // Let the client know why before closing the connection
+            yield write();
+            c.release();
+            return;
+        }
+        if (c.context_->circuit_breaker) {
+            c.context_->circuit_breaker->record_success(
+                get_target_endpoint(), CircuitBreaker::Clock::now() - connect_start_time_);
+        }
+        if (c.traffic_recording_) {
+            c.traffic_recording_->record_connected();
+        }
+        LOG4CXX_INFO(logger, "Connection to " << c.target_address_ << ":" << c.target_port_
+                     << " established");
+        // Options that only take effect once connected. Unix domain sockets aren't tuned
+        if (unix_path_->empty()) {
+            c.context_->egress_socket_profiles.get_options(c.target_port_).apply_to_connection(
+                c.target_socket_.native_handle());
+        }
+        if (http_request_size_ > http_request_end_) {
+            yield write_early_data();
+        }
+        if (replied_optimistically_) {
+            start_relaying();
+            return;
+        }
+        {
+            ReplyType reply = ReplyType::SUCCESS;
+            error_code endpoint_error;
+            const tcp::endpoint local_endpoint = to_tcp_endpoint(
+                c.target_socket_.local_endpoint(endpoint_error));
+            if (endpoint_error) {
+                LOG4CXX_DEBUG(logger, "Error getting local endpoint: " << endpoint_error.message());
+                reply = ReplyType::GENERAL_FAILURE;
+            }
+            make_reply(reply, local_endpoint);
+        }
+        yield write();
+        start_relaying();
+    }
+}
+
+bool CoroutineConnection::Handshake::select_method(size_t method_count) {
+    CoroutineConnection& c = *connection_;
+    // If we have credentials, then clients are required to authenticate
+    const SocksAuthentication expected_method = c.context_->auth_manager ?
+                                                SocksAuthentication::USERNAME_PASSWORD :
+                                                SocksAuthentication::NONE;
+    const uint8_t* methods = c.buffers_[UPSTREAM].data() + sizeof(MethodSelectionRequest);
+    if (std::find(methods, methods + method_count, static_cast<uint8_t>(expected_method)) ==
+            methods + method_count) {
+        return false;
+    }
+    c.set_buffer(MethodSelectionResponse{c.cast_buffer<MethodSelectionRequest>()->version,
+                                         static_cast<uint8_t>(expected_method)});
+    if (c.traffic_recording_) {
+        c.traffic_recording_->set_auth_method(expected_method);
+    }
+    return true;
+}
+
+CoroutineConnection::Handshake::HttpRequestState
+CoroutineConnection::Handshake::handle_http_request() {
+    CoroutineConnection& c = *connection_;
+    HttpConnectRequest request;
+    switch (parse_http_connect(c.buffers_[UPSTREAM].data(), http_request_size_, request)) {
+        case HttpParseStatus::COMPLETE:
+            break;
+        case HttpParseStatus::INCOMPLETE:
+            if (http_request_size_ < c.buffers_[UPSTREAM].size()) {
+                return HttpRequestState::INCOMPLETE;
+            }
+            LOG4CXX_DEBUG(logger, "HTTP request from " << c.endpoint_ << " is too large");
+            make_http_response(c.write_buffer_, 431);
+            return HttpRequestState::REJECTED;
+        case HttpParseStatus::BAD_REQUEST:
+            LOG4CXX_DEBUG(logger, "Received malformed HTTP request from " << c.endpoint_);
+            make_http_response(c.write_buffer_, 400);
+            return HttpRequestState::REJECTED;
+        case HttpParseStatus::METHOD_NOT_ALLOWED:
+            LOG4CXX_DEBUG(logger, "Ignoring HTTP request from " << c.endpoint_
+                          << " as only CONNECT is supported");
+            make_http_response(c.write_buffer_, 405);
+            return HttpRequestState::REJECTED;
+    }
+    if (c.context_->auth_manager) {
+        string username;
+        string password;
+        if (!decode_http_credentials(request.credentials, username, password) ||
+            !c.context_->auth_manager->validate_credentials(username, password)) {
+            LOG4CXX_INFO(logger, "Client " << c.endpoint_ << " failed to authenticate");
+            make_http_response(c.write_buffer_, 407);
+            return HttpRequestState::REJECTED;
+        }
+        LOG4CXX_DEBUG(logger, "Client " << c.endpoint_ << " authenticated as " << username);
+        c.username_ = move(username);
+        if (c.traffic_recording_) {
+            c.traffic_recording_->set_auth_method(SocksAuthentication::USERNAME_PASSWORD);
+        }
+    }
+    http_request_end_ = request.size;
+    c.target_address_ = request.host.to_string();
+    c.target_port_ = request.port;
+    LOG4CXX_DEBUG(logger, "Received connection request for " << get_target_endpoint());
+    return HttpRequestState::ACCEPTED;
+}
+
+bool CoroutineConnection::Handshake::parse_endpoint(AddressType address_type,
+                                                    size_t bytes_read) {
+    CoroutineConnection& c = *connection_;
+    switch (address_type) {
+        case AddressType::IPV4:
+            {
+                const auto* endpoint = c.cast_buffer<SocksCommandEndpointIPv4>(
+                    sizeof(SocksCommandHeader));
+                c.target_address_ = address_v4(ntohl(endpoint->address)).to_string();
+                c.target_port_ = ntohs(endpoint->port);
+            }
+            break;
+        case AddressType::IPV6:
+            {
+                const auto* endpoint = c.cast_buffer<SocksCommandEndpointIPv6>(
+                    sizeof(SocksCommandHeader));
+                address_v6::bytes_type address_buffer;
+                copy(endpoint->address, endpoint->address + 16, address_buffer.begin());
+                c.target_address_ = address_v6(address_buffer).to_string();
+                c.target_port_ = ntohs(endpoint->port);
+            }
+            break;
+        default:
+            {
+                const size_t address_length = bytes_read - sizeof(uint16_t);
+                const auto buffer_start = c.buffers_[UPSTREAM].begin() +
+                                          sizeof(SocksCommandHeader) + sizeof(uint8_t);
+                c.target_address_.assign(buffer_start, buffer_start + address_length);
+                uint16_t port;
+                memcpy(&port, &*(buffer_start + address_length), sizeof(port));
+                c.target_port_ = ntohs(port);
+            }
+            break;
+    }
+    const auto command = c.cast_buffer<SocksCommandHeader>()->command;
+    if (static_cast<CommandType>(command) != CommandType::CONNECT) {
+        LOG4CXX_DEBUG(logger, "Ignoring command request due to unsupported command: "
+                      << static_cast<int>(command));
+        return false;
+    }
+    LOG4CXX_DEBUG(logger, "Received connection request for " << c.target_address_ << ":"
+                  << c.target_port_);
+    return true;
+}
+
+bool CoroutineConnection::Handshake::prepare_connection() {
+    CoroutineConnection& c = *connection_;
+    if (c.traffic_recording_) {
+        c.traffic_recording_->record_request(is_http_ ? get_host_address_type(c.target_address_) :
+                                                        get_address_type());
+    }
+    const auto& traffic_accountant = c.context_->traffic_accountant;
+    if (traffic_accountant) {
+        if (traffic_accountant->is_over_quota(c.username_)) {
+            LOG4CXX_INFO(logger, "Rejecting connection request from " << c.endpoint_
+                         << " as its user is over quota");
+            make_reply(ReplyType::CONNECTION_NOT_ALLOWED, tcp::endpoint());
+            return false;
+        }
+        c.traffic_account_.reset(new TrafficAccount(
+            traffic_accountant->make_account(c.username_)));
+    }
+    if (c.context_->bandwidth_manager) {
+        c.bandwidth_limiter_ = c.context_->bandwidth_manager->make_limiter(c.username_);
+    }
+    if (c.context_->heavy_hitter_tracker) {
+        error_code error;
+        const auto client_endpoint = c.client_socket_.remote_endpoint(error);
+        c.heavy_hitter_account_.reset(new HeavyHitterAccount(
+            *c.context_->heavy_hitter_tracker, get_target_endpoint(),
+            error ? string() : format_address(client_endpoint)));
+    }
+    return true;
+}
+
+bool CoroutineConnection::Handshake::allow_connection_attempt() {
+    CoroutineConnection& c = *connection_;
+    ReplyType reply;
+    const auto& circuit_breaker = c.context_->circuit_breaker;
+    if (!circuit_breaker || circuit_breaker->allow_attempt(get_target_endpoint(), reply)) {
+        return true;
+    }
+    LOG4CXX_DEBUG(logger, "Rejecting connection request for " << get_target_endpoint()
+                  << " as it's unreachable");
+    make_reply(reply, tcp::endpoint());
+    return false;
+}
+
+void CoroutineConnection::Handshake::make_reply(ReplyType reply,
+                                                const tcp::endpoint& endpoint) {
+    CoroutineConnection& c = *connection_;
+    if (is_http_) {
+        make_http_response(c.write_buffer_, reply);
+    }
+    else {
+        make_command_response(c.write_buffer_, c.cast_buffer<SocksCommandHeader>()->version,
+                              reply, endpoint);
+    }
+}
+
+void CoroutineConnection::Handshake::record_connection_failure(const error_code& error) {
+    CoroutineConnection& c = *connection_;
+    if (c.context_->circuit_breaker) {
+        c.context_->circuit_breaker->record_failure(get_target_endpoint(), error);
+    }
+    make_reply(get_connect_failure_reply(error), tcp::endpoint());
+}
+
+void CoroutineConnection::Handshake::reset_client() {
+    CoroutineConnection& c = *connection_;
+    LOG4CXX_DEBUG(logger, "Resetting connection for " << c.endpoint_);
+    // The client was told it's connected, so a reset is the only way to report this. Closing
+    // the socket sends one rather than a FIN
+    error_code error;
+    c.client_socket_.set_option(boost::asio::socket_base::linger(true, 0), error);
+    c.client_socket_.close(error);
+}
+
+void CoroutineConnection::Handshake::start_relaying() {
+    CoroutineConnection& c = *connection_;
+    LOG4CXX_DEBUG(logger, "Starting proxying connection");
+    c.buffers_[DOWNSTREAM].resize(BUFFER_SIZE);
+    // The relay coroutines take over the handshake's reference on the frame
+    c.coroutine_count_ += 2;
+    Relay(c, UPSTREAM)();
+    Relay(c, DOWNSTREAM)();
+    c.release();
+}
+
+void CoroutineConnection::Relay::operator()(const error_code& error, size_t bytes_transferred) {
+    LoopProfiler::ScopedTimer timer(LoopProfiler::COROUTINE_RELAY);
+    CoroutineConnection& c = *connection_;
+    if (error) {
+        if (!utils::is_operation_aborted(error)) {
+            LOG4CXX_DEBUG(logger, "Failed while relaying data for " << c.endpoint_ << ": "
+                          << error.message());
+        }
+        // Closing both sockets makes the other direction's coroutine finish as well
+        c.close();
+        c.release();
+        return;
+    }
+    SocketType& source = direction_ == UPSTREAM ? c.client_socket_ : c.target_socket_;
+    SocketType& destination = direction_ == UPSTREAM ? c.target_socket_ : c.client_socket_;
+    auto& buffer = c.buffers_[direction_];
+    reenter (this) {
+        for (;;) {
+            yield source.async_read_some(boost::asio::buffer(buffer),
+                                         wrap_handler(c.strand_, c.allocators_[direction_],
+                                                      *this));
+            byte_count_ = bytes_transferred;
+            if (!c.account_traffic(direction_, byte_count_)) {
+                c.close();
+                c.release();
+                return;
+            }
+            delay_ = c.throttle(direction_, byte_count_);
+            if (delay_ != BandwidthLimiter::Clock::duration::zero()) {
+                yield c.schedule_throttled(delay_, c.strand_.wrap(*this));
+            }
+            yield boost::asio::async_write(destination,
+                                           boost::asio::buffer(buffer.data(), byte_count_),
+                                           wrap_handler(c.strand_, c.allocators_[direction_],
+                                                        *this));
+            if (c.must_yield(direction_, byte_count_)) {
+                yield c.wait_for_turn(c.strand_.wrap(*this));
+            }
+        }
+    }
+}
+
+#include <boost/asio/unyield.hpp>
+
+void* CoroutineConnection::operator new(size_t size) {
+    assert(size == sizeof(CoroutineConnection));
+    return RecyclingAllocator<CoroutineConnection>::allocate();
+}
+
+void CoroutineConnection::operator delete(void* pointer) {
+    RecyclingAllocator<CoroutineConnection>::deallocate(pointer);
+}
+
+void CoroutineConnection::start(unique_ptr<CoroutineConnection> connection) {
+    connection->endpoint_ = format_endpoint(connection->client_socket_.remote_endpoint());
+    LOG4CXX_INFO(logger, "Accepted client connection from " << connection->endpoint_);
+    if (connection->context_->traffic_recorder) {
+        connection->traffic_recording_.reset(
+            new TrafficRecording(*connection->context_->traffic_recorder));
+    }
+    // From now on, the frame is owned by its coroutines
+    CoroutineConnection& c = *connection.release();
+    c.coroutine_count_ = 1;
+    c.strand_.dispatch(Handshake(c));
+}
+
+CoroutineConnection::CoroutineConnection(io_service& io_service, tcp::resolver& resolver,
+                                         shared_ptr<const ConnectionContext> context)
+: client_socket_(io_service), target_socket_(io_service), resolver_(resolver),
+  strand_(io_service), context_(move(context)) {
+    buffers_[UPSTREAM].resize(BUFFER_SIZE);
+}
+
+CoroutineConnection::SocketType& CoroutineConnection::get_socket() {
+    return client_socket_;
+}
+
+bool CoroutineConnection::account_traffic(RelayDirection direction, size_t byte_count) {
+    if (heavy_hitter_account_) {
+        heavy_hitter_account_->record(byte_count);
+    }
+    if (traffic_recording_) {
+        traffic_recording_->record_chunk(direction, byte_count);
+    }
+    if (!traffic_account_ || traffic_account_->record(direction, byte_count)) {
+        return true;
+    }
+    LOG4CXX_INFO(logger, "Closing connection for " << endpoint_ << " as its user is over quota");
+    return false;
+}
+
+BandwidthLimiter::Clock::duration CoroutineConnection::throttle(RelayDirection direction,
+                                                                size_t byte_count) {
+    if (!bandwidth_limiter_) {
+        return BandwidthLimiter::Clock::duration::zero();
+    }
+    return bandwidth_limiter_->consume(direction, byte_count);
+}
+
+bool CoroutineConnection::must_yield(RelayDirection direction, size_t byte_count) {
+    const RelayScheduler::Policy& policy = context_->relay_scheduling;
+    return policy.is_enabled() && flows_[direction].record(policy, byte_count);
+}
+
+void CoroutineConnection::schedule_throttled(BandwidthLimiter::Clock::duration delay,
+                                             function<void()> callback) {
+    LOG4CXX_TRACE(logger, "Throttling connection for " << endpoint_ << " during "
+                  << duration_cast<milliseconds>(delay).count() << "ms");
+    auto& scheduler = ThrottleScheduler::for_current_thread(client_socket_.get_io_service());
+    scheduler.schedule(ThrottleScheduler::Clock::now() + delay, move(callback));
+}
+
+void CoroutineConnection::wait_for_turn(function<void()> callback) {
+    auto& scheduler = RelayScheduler::for_current_thread(client_socket_.get_io_service());
+    scheduler.wait_for_turn(move(callback));
+}
+
+void CoroutineConnection::close() {
+    error_code error;
+    client_socket_.close(error);
+    target_socket_.close(error);
+}
+
+void CoroutineConnection::release() {
+    if (--coroutine_count_ == 0) {
+        LOG4CXX_DEBUG(logger, "Finished serving connection for " << endpoint_);
+        delete this;
+    }
+}
+
+} // roberto
@@ -0,0 +1,68 @@
+#include "cpu_affinity.h"
+#include <cerrno>
+#include <string>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <log4cxx/logger.h>
+#include <boost/system/system_error.hpp>
+
+using std::string;
+using std::stoi;
+using std::to_string;
+
+using boost::system::error_code;
+using boost::system::system_error;
+using boost::system::system_category;
+
+using log4cxx::Logger;
+using log4cxx::LoggerPtr;
+
+namespace roberto {
+
+static const LoggerPtr logger = Logger::getLogger("r.cpu_affinity");
+
+// From linux/mempolicy.h: allocate on the node of the CPU the allocating thread runs on. We
+// call set_mempolicy directly so we don't depend on libnuma
+static const int MPOL_LOCAL_POLICY = 4;
+
+void pin_current_thread(int cpu) {
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    const int result = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set);
+    if (result != 0) {
+        throw system_error(error_code(result, system_category()),
+                           "Failed to pin thread to CPU " + to_string(cpu));
+    }
+    // Local allocation is the default policy, but the process could have been started with a
+    // different one (e.g. through numactl --interleave)
+    if (syscall(SYS_set_mempolicy, MPOL_LOCAL_POLICY, nullptr, 0) != 0) {
+        LOG4CXX_WARN(logger, "Failed to set local memory policy on CPU " << cpu << ": "
+                     << error_code(errno, system_category()).message());
+    }
+}
+
+int get_numa_node(int cpu) {
+    // The CPU's directory contains a link named after the node it belongs to
+    const string path = "/sys/devices/system/cpu/cpu" + to_string(cpu);
+    DIR* directory = opendir(path.c_str());
+    if (!directory) {
+        return -1;
+    }
+    int node = -1;
+    while (dirent* entry = readdir(directory)) {
+        const string name = entry->d_name;
+        if (name.size() > 4 && name.compare(0, 4, "node") == 0 &&
+            name.find_first_not_of("0123456789", 4) == string::npos) {
+            node = stoi(name.substr(4));
+            break;
+        }
+    }
+    closedir(directory);
+    return node;
+}
+
+} // roberto
@@ -0,0 +1,41 @@
+#include "handler_allocator.h"
+#include <new>
+
+using std::memory_order_acquire;
+using std::memory_order_release;
+using std::memory_order_relaxed;
+
+namespace roberto {
+
+constexpr size_t HandlerAllocator::SLOT_SIZE;
+constexpr size_t HandlerAllocator::SLOT_COUNT;
+
+HandlerAllocator::HandlerAllocator() {
+    for (Slot& slot : slots_) {
+        slot.in_use.store(false, memory_order_relaxed);
+    }
+}
+
+void* HandlerAllocator::allocate(size_t size) {
+    if (size <= SLOT_SIZE) {
+        for (Slot& slot : slots_) {
+            // Operations in different directions can complete on different threads at once
+            if (!slot.in_use.exchange(true, memory_order_acquire)) {
+                return &slot.storage;
+            }
+        }
+    }
+    return ::operator new(size);
+}
+
+void HandlerAllocator::deallocate(void* pointer) {
+    for (Slot& slot : slots_) {
+        if (pointer == &slot.storage) {
+            slot.in_use.store(false, memory_order_release);
+            return;
+        }
+    }
+    ::operator delete(pointer);
+}
+
+} // roberto
@@ -0,0 +1,281 @@
+#include "heavy_hitters.h"
+#include <map>
+#include <sstream>
+#include <algorithm>
+#include <functional>
+
+using std::map;
+using std::move;
+using std::mutex;
+using std::string;
+using std::vector;
+using std::lock_guard;
+using std::ostringstream;
+
+namespace roberto {
+
+static const size_t SKETCH_WIDTH = 2048;
+static const size_t SKETCH_DEPTH = 4;
+// Summaries track more keys than reported so the ones close to the top aren't evicted early
+static const size_t SUMMARY_CAPACITY_FACTOR = 4;
+
+static const char* KEY_TYPE_NAMES[HeavyHitterTracker::KEY_TYPE_COUNT] = {
+    "destinations",
+    "clients"
+};
+
+static const char* METRIC_NAMES[HeavyHitterTracker::METRIC_COUNT] = {
+    "connections",
+    "bytes"
+};
+
+// The splitmix64 finalizer, to derive a second independent looking hash out of the key's
+static uint64_t mix(uint64_t value) {
+    value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+    return value ^ (value >> 31);
+}
+
+// CountMinSketch
+
+CountMinSketch::CountMinSketch(size_t width, size_t depth)
+: width_(width), depth_(depth), counters_(width * depth) {
+
+}
+
+void CountMinSketch::add(uint64_t key_hash, uint64_t count) {
+    for (size_t row = 0; row < depth_; ++row) {
+        counters_[get_index(key_hash, row)] += count;
+    }
+}
+
+uint64_t CountMinSketch::estimate(uint64_t key_hash) const {
+    uint64_t output = UINT64_MAX;
+    for (size_t row = 0; row < depth_; ++row) {
+        output = std::min(output, counters_[get_index(key_hash, row)]);
+    }
+    return output;
+}
+
+void CountMinSketch::merge(const CountMinSketch& other) {
+    for (size_t i = 0; i < counters_.size(); ++i) {
+        counters_[i] += other.counters_[i];
+    }
+}
+
+void CountMinSketch::clear() {
+    std::fill(counters_.begin(), counters_.end(), 0);
+}
+
+size_t CountMinSketch::get_index(uint64_t key_hash, size_t row) const {
+    // Double hashing gives every row its own hash function out of just two of them
+    const uint64_t row_hash = key_hash + row * (mix(key_hash) | 1);
+    return row * width_ + row_hash % width_;
+}
+
+// SpaceSaving
+
+SpaceSaving::SpaceSaving(size_t capacity)
+: capacity_(capacity) {
+    entries_.reserve(capacity_);
+}
+
+void SpaceSaving::add(const string& key, uint64_t key_hash, uint64_t count) {
+    Entry* min_entry = nullptr;
+    for (Entry& entry : entries_) {
+        if (entry.key_hash == key_hash && entry.key == key) {
+            entry.count += count;
+            return;
+        }
+        if (!min_entry || entry.count < min_entry->count) {
+            min_entry = &entry;
+        }
+    }
+    if (entries_.size() < capacity_) {
+        entries_.push_back(Entry{key, key_hash, count});
+        return;
+    }
+    // The new key inherits the evicted one's count, which it could have been responsible for
+    min_entry->key = key;
+    min_entry->key_hash = key_hash;
+    min_entry->count += count;
+}
+
+const vector<SpaceSaving::Entry>& SpaceSaving::get_entries() const {
+    return entries_;
+}
+
+void SpaceSaving::clear() {
+    entries_.clear();
+}
+
+// HeavyHitterTracker
+
+HeavyHitterTracker::Summary::Summary(size_t capacity)
+: sketch(SKETCH_WIDTH, SKETCH_DEPTH), top(capacity) {
+
+}
+
+HeavyHitterTracker::Shard::Shard(size_t capacity)
+: summaries(KEY_TYPE_COUNT * METRIC_COUNT, Summary(capacity)),
+  previous_summaries(summaries) {
+
+}
+
+void HeavyHitterTracker::Shard::rotate(uint64_t current_window) {
+    // Another thread may have rotated it since we looked at the clock
+    if (current_window <= window) {
+        return;
+    }
+    if (current_window == window + 1) {
+        summaries.swap(previous_summaries);
+    }
+    else {
+        for (Summary& summary : previous_summaries) {
+            summary.sketch.clear();
+            summary.top.clear();
+        }
+    }
+    for (Summary& summary : summaries) {
+        summary.sketch.clear();
+        summary.top.clear();
+    }
+    window = current_window;
+}
+
+HeavyHitterTracker::HeavyHitterTracker(size_t top_count, Clock::duration window_duration)
+: top_count_(top_count), window_duration_(window_duration), start_time_(Clock::now()) {
+
+}
+
+uint64_t HeavyHitterTracker::hash_key(const string& key) {
+    return std::hash<string>()(key);
+}
+
+void HeavyHitterTracker::record(KeyType key_type, Metric metric, const string& key,
+                                uint64_t key_hash, uint64_t count) {
+    Shard& shard = get_thread_shard();
+    const uint64_t window = get_window(Clock::now());
+    lock_guard<mutex> _(shard.mutex);
+    shard.rotate(window);
+    Summary& summary = shard.summaries[get_summary_index(key_type, metric)];
+    summary.sketch.add(key_hash, count);
+    summary.top.add(key, key_hash, count);
+}
+
+vector<HeavyHitterTracker::HeavyHitter> HeavyHitterTracker::get_top(KeyType key_type,
+                                                                    Metric metric) const {
+    CountMinSketch connections(SKETCH_WIDTH, SKETCH_DEPTH);
+    CountMinSketch bytes(SKETCH_WIDTH, SKETCH_DEPTH);
+    map<string, uint64_t> candidates;
+    const uint64_t window = get_window(Clock::now());
+    {
+        lock_guard<mutex> _(shards_mutex_);
+        for (const auto& shard : shards_) {
+            lock_guard<mutex> shard_lock(shard->mutex);
+            // Shards that haven't recorded anything lately still hold old windows
+            shard->rotate(window);
+            for (const auto* summaries : { &shard->summaries, &shard->previous_summaries }) {
+                const auto& top = (*summaries)[get_summary_index(key_type, metric)].top;
+                connections.merge((*summaries)[get_summary_index(key_type, CONNECTIONS)].sketch);
+                bytes.merge((*summaries)[get_summary_index(key_type, BYTES)].sketch);
+                for (const auto& entry : top.get_entries()) {
+                    candidates.emplace(entry.key, entry.key_hash);
+                }
+            }
+        }
+    }
+    vector<HeavyHitter> output;
+    output.reserve(candidates.size());
+    for (const auto& candidate : candidates) {
+        output.push_back(HeavyHitter{candidate.first, connections.estimate(candidate.second),
+                                     bytes.estimate(candidate.second)});
+    }
+    auto compare = [&](const HeavyHitter& lhs, const HeavyHitter& rhs) {
+        return metric == CONNECTIONS ? lhs.connections > rhs.connections : lhs.bytes > rhs.bytes;
+    };
+    const size_t count = std::min(top_count_, output.size());
+    std::partial_sort(output.begin(), output.begin() + count, output.end(), compare);
+    output.resize(count);
+    return output;
+}
+
+HeavyHitterTracker::Clock::duration HeavyHitterTracker::get_reported_duration() const {
+    const Clock::duration elapsed = Clock::now() - start_time_;
+    return std::min(elapsed, window_duration_ + elapsed % window_duration_);
+}
+
+string HeavyHitterTracker::format_report(KeyType key_type) const {
+    const auto duration = std::chrono::duration_cast<std::chrono::seconds>(
+        get_reported_duration());
+    ostringstream output;
+    for (size_t metric = 0; metric < METRIC_COUNT; ++metric) {
+        output << "Top " << KEY_TYPE_NAMES[key_type] << " by " << METRIC_NAMES[metric]
+               << " over the last " << duration.count() << "s:\n";
+        for (const HeavyHitter& hitter : get_top(key_type, static_cast<Metric>(metric))) {
+            output << "  " << hitter.key << " connections=" << hitter.connections
+                   << " bytes=" << hitter.bytes << "\n";
+        }
+    }
+    return output.str();
+}
+
+size_t HeavyHitterTracker::get_summary_index(KeyType key_type, Metric metric) {
+    return key_type * METRIC_COUNT + metric;
+}
+
+uint64_t HeavyHitterTracker::get_window(Clock::time_point now) const {
+    return (now - start_time_) / window_duration_;
+}
+
+HeavyHitterTracker::Shard& HeavyHitterTracker::get_thread_shard() {
+    static thread_local const HeavyHitterTracker* shard_owner = nullptr;
+    static thread_local Shard* shard = nullptr;
+    if (shard_owner != this) {
+        lock_guard<mutex> _(shards_mutex_);
+        shards_.emplace_back(new Shard(top_count_ * SUMMARY_CAPACITY_FACTOR));
+        shard = shards_.back().get();
+        shard_owner = this;
+    }
+    return *shard;
+}
+
+// HeavyHitterAccount
+
+const uint64_t HeavyHitterAccount::RECORD_BATCH_BYTES = 64 * 1024;
+
+HeavyHitterAccount::HeavyHitterAccount(HeavyHitterTracker& tracker, string destination,
+                                       string client)
+: tracker_(&tracker), keys_{{move(destination), move(client)}} {
+    for (size_t key_type = 0; key_type < HeavyHitterTracker::KEY_TYPE_COUNT; ++key_type) {
+        key_hashes_[key_type] = HeavyHitterTracker::hash_key(keys_[key_type]);
+        tracker_->record(static_cast<HeavyHitterTracker::KeyType>(key_type),
+                         HeavyHitterTracker::CONNECTIONS, keys_[key_type], key_hashes_[key_type],
+                         1);
+    }
+}
+
+HeavyHitterAccount::~HeavyHitterAccount() {
+    flush();
+}
+
+void HeavyHitterAccount::record(uint64_t byte_count) {
+    unrecorded_bytes_ += byte_count;
+    if (unrecorded_bytes_ >= RECORD_BATCH_BYTES) {
+        flush();
+    }
+}
+
+void HeavyHitterAccount::flush() {
+    if (unrecorded_bytes_ == 0) {
+        return;
+    }
+    for (size_t key_type = 0; key_type < HeavyHitterTracker::KEY_TYPE_COUNT; ++key_type) {
+        tracker_->record(static_cast<HeavyHitterTracker::KeyType>(key_type),
+                         HeavyHitterTracker::BYTES, keys_[key_type], key_hashes_[key_type],
+                         unrecorded_bytes_);
+    }
+    unrecorded_bytes_ = 0;
+}
+
+} // roberto
@@ -0,0 +1,197 @@
+#include "hot_restart.h"
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <log4cxx/logger.h>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/read.hpp>
+#include "utils.h"
+
+using std::bind;
+using std::move;
+using std::string;
+using std::vector;
+using std::runtime_error;
+using std::placeholders::_1;
+using std::placeholders::_2;
+
+using boost::asio::io_service;
+
+using boost::system::error_code;
+using boost::system::system_error;
+using boost::system::system_category;
+
+using log4cxx::Logger;
+using log4cxx::LoggerPtr;
+
+namespace roberto {
+
+static const LoggerPtr logger = Logger::getLogger("r.hot_restart");
+
+// There's one listening socket per thread when steering connections to CPUs. This is the most
+// the kernel passes in a single message
+static const size_t MAX_LISTENING_SOCKETS = 253;
+// A stuck running instance shouldn't prevent the new one from starting
+static const time_t TAKEOVER_TIMEOUT_SECONDS = 5;
+
+static system_error make_system_error(const char* what) {
+    return system_error(error_code(errno, system_category()), what);
+}
+
+HotRestarter::HotRestarter(io_service& io_service, string socket_path)
+: socket_path_(move(socket_path)), acceptor_(io_service), peer_socket_(io_service) {
+
+}
+
+HotRestarter::~HotRestarter() {
+    if (takeover_socket_ != -1) {
+        close(takeover_socket_);
+    }
+}
+
+vector<int> HotRestarter::take_over_sockets() {
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (socket_path_.size() >= sizeof(address.sun_path)) {
+        throw runtime_error("Hot restart socket path is too long");
+    }
+    memcpy(address.sun_path, socket_path_.data(), socket_path_.size());
+
+    const int socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (socket_fd == -1) {
+        throw make_system_error("socket");
+    }
+    if (connect(socket_fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        const int error = errno;
+        close(socket_fd);
+        // Nobody is listening, so there's no running instance to take over from
+        if (error == ENOENT || error == ECONNREFUSED) {
+            return {};
+        }
+        errno = error;
+        throw make_system_error("connect");
+    }
+    timeval timeout = { TAKEOVER_TIMEOUT_SECONDS, 0 };
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    uint8_t socket_count = 0;
+    iovec payload = { &socket_count, sizeof(socket_count) };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_LISTENING_SOCKETS)];
+    msghdr message = {};
+    message.msg_iov = &payload;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    if (recvmsg(socket_fd, &message, MSG_CMSG_CLOEXEC) != sizeof(socket_count)) {
+        close(socket_fd);
+        throw runtime_error("Failed to receive listening sockets from running instance");
+    }
+    vector<int> sockets;
+    for (cmsghdr* header = CMSG_FIRSTHDR(&message); header;
+         header = CMSG_NXTHDR(&message, header)) {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            const size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int* sockets_start = reinterpret_cast<const int*>(CMSG_DATA(header));
+            sockets.insert(sockets.end(), sockets_start, sockets_start + count);
+        }
+    }
+    if (sockets.size() != socket_count) {
+        for (int socket : sockets) {
+            close(socket);
+        }
+        close(socket_fd);
+        throw runtime_error("Received an unexpected amount of listening sockets");
+    }
+    LOG4CXX_INFO(logger, "Took over " << sockets.size() << " listening sockets from running "
+                 "instance");
+    takeover_socket_ = socket_fd;
+    return sockets;
+}
+
+void HotRestarter::complete_takeover() {
+    if (takeover_socket_ == -1) {
+        return;
+    }
+    // The running instance stops accepting connections as soon as it reads this
+    const uint8_t acknowledgement = 1;
+    if (send(takeover_socket_, &acknowledgement, sizeof(acknowledgement), MSG_NOSIGNAL) == -1) {
+        LOG4CXX_WARN(logger, "Failed to acknowledge takeover: " << strerror(errno));
+    }
+    close(takeover_socket_);
+    takeover_socket_ = -1;
+}
+
+void HotRestarter::listen(vector<int> listening_sockets, HandoffCallback handoff_callback) {
+    if (listening_sockets.size() > MAX_LISTENING_SOCKETS) {
+        throw runtime_error("Too many listening sockets to hand over");
+    }
+    listening_sockets_ = move(listening_sockets);
+    handoff_callback_ = move(handoff_callback);
+    // Whatever is there belongs to the instance we took over from or to a dead one
+    unlink(socket_path_.c_str());
+    LocalProtocol::endpoint endpoint(socket_path_);
+    acceptor_.open(endpoint.protocol());
+    acceptor_.bind(endpoint);
+    acceptor_.listen();
+    LOG4CXX_INFO(logger, "Waiting for hot restarts on " << socket_path_);
+    start_accept();
+}
+
+void HotRestarter::start_accept() {
+    acceptor_.async_accept(peer_socket_, bind(&HotRestarter::handle_accept, this, _1));
+}
+
+void HotRestarter::handle_accept(const error_code& error) {
+    if (error) {
+        if (!utils::is_operation_aborted(error)) {
+            LOG4CXX_ERROR(logger, "Error while accepting hot restart socket: "
+                          << error.message());
+        }
+        return;
+    }
+    LOG4CXX_INFO(logger, "New instance connected, handing over listening sockets");
+    uint8_t socket_count = listening_sockets_.size();
+    iovec payload = { &socket_count, sizeof(socket_count) };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * MAX_LISTENING_SOCKETS)] = {};
+    msghdr message = {};
+    message.msg_iov = &payload;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(sizeof(int) * listening_sockets_.size());
+    cmsghdr* header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(int) * listening_sockets_.size());
+    memcpy(CMSG_DATA(header), listening_sockets_.data(),
+           sizeof(int) * listening_sockets_.size());
+    if (sendmsg(peer_socket_.native_handle(), &message, MSG_NOSIGNAL) == -1) {
+        LOG4CXX_ERROR(logger, "Failed to hand over listening sockets: " << strerror(errno));
+        error_code ignored;
+        peer_socket_.close(ignored);
+        start_accept();
+        return;
+    }
+    auto callback = bind(&HotRestarter::handle_acknowledgement, this, _1, _2);
+    boost::asio::async_read(peer_socket_, boost::asio::buffer(&acknowledgement_, 1), callback);
+}
+
+void HotRestarter::handle_acknowledgement(const error_code& error, size_t /*bytes_read*/) {
+    error_code ignored;
+    peer_socket_.close(ignored);
+    if (error) {
+        // The new instance died before it started accepting, so we keep going
+        LOG4CXX_WARN(logger, "New instance failed to take over: " << error.message());
+        start_accept();
+        return;
+    }
+    LOG4CXX_INFO(logger, "New instance took over the listening sockets");
+    // Note that the socket path now belongs to the new instance, so it's not removed
+    acceptor_.close(ignored);
+    handoff_callback_();
+}
+
+} // roberto
@@ -0,0 +1,258 @@
+#include "http_connect.h"
+#include <cstring>
+#include <strings.h>
+#include <boost/asio/ip/address.hpp>
+
+using std::string;
+using std::vector;
+
+using boost::string_ref;
+using boost::asio::ip::address;
+
+using boost::system::error_code;
+
+namespace roberto {
+
+static const string_ref END_OF_LINE("\r\n");
+static const string_ref END_OF_HEADERS("\r\n\r\n");
+static const string_ref CONNECT_METHOD("CONNECT");
+static const string_ref AUTHORIZATION_HEADER("Proxy-Authorization");
+static const string_ref BASIC_SCHEME("Basic");
+// Credentials are limited by the username and password lengths socks supports
+static const size_t MAX_DECODED_CREDENTIALS_SIZE = 512;
+
+static string_ref trim(string_ref text) {
+    while (!text.empty() && (text.front() == ' ' || text.front() == '\t')) {
+        text.remove_prefix(1);
+    }
+    while (!text.empty() && (text.back() == ' ' || text.back() == '\t')) {
+        text.remove_suffix(1);
+    }
+    return text;
+}
+
+static bool equals_ignore_case(string_ref lhs, string_ref rhs) {
+    return lhs.size() == rhs.size() && strncasecmp(lhs.data(), rhs.data(), lhs.size()) == 0;
+}
+
+// Splits off the text up to the first occurrence of the separator, which is dropped
+static bool split_prefix(string_ref& text, char separator, string_ref& prefix) {
+    const size_t position = text.find(separator);
+    if (position == string_ref::npos) {
+        return false;
+    }
+    prefix = text.substr(0, position);
+    text.remove_prefix(position + 1);
+    return true;
+}
+
+static bool parse_port(string_ref text, uint16_t& port) {
+    if (text.empty() || text.size() > 5) {
+        return false;
+    }
+    unsigned value = 0;
+    for (char c : text) {
+        if (c < '0' || c > '9') {
+            return false;
+        }
+        value = value * 10 + (c - '0');
+    }
+    if (value == 0 || value > 65535) {
+        return false;
+    }
+    port = value;
+    return true;
+}
+
+// Parses an authority in the format host:port, where host can be a bracketed IPv6 address
+static bool parse_authority(string_ref authority, HttpConnectRequest& request) {
+    const size_t port_separator = authority.rfind(':');
+    if (port_separator == string_ref::npos ||
+        !parse_port(authority.substr(port_separator + 1), request.port)) {
+        return false;
+    }
+    string_ref host = authority.substr(0, port_separator);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+        host = host.substr(1, host.size() - 2);
+    }
+    // Same limit as socks domain names
+    if (host.empty() || host.size() > 255) {
+        return false;
+    }
+    request.host = host;
+    return true;
+}
+
+static int decode_base64_character(char c) {
+    if (c >= 'A' && c <= 'Z') {
+        return c - 'A';
+    }
+    if (c >= 'a' && c <= 'z') {
+        return c - 'a' + 26;
+    }
+    if (c >= '0' && c <= '9') {
+        return c - '0' + 52;
+    }
+    if (c == '+') {
+        return 62;
+    }
+    if (c == '/') {
+        return 63;
+    }
+    return -1;
+}
+
+bool is_http_request_start(uint8_t byte) {
+    // Methods are uppercase tokens, while socks versions are tiny numbers
+    return byte >= 'A' && byte <= 'Z';
+}
+
+HttpParseStatus parse_http_connect(const uint8_t* data, size_t size,
+                                   HttpConnectRequest& request) {
+    string_ref input(reinterpret_cast<const char*>(data), size);
+    const size_t headers_end = input.find(END_OF_HEADERS);
+    if (headers_end == string_ref::npos) {
+        return HttpParseStatus::INCOMPLETE;
+    }
+    request = HttpConnectRequest();
+    request.size = headers_end + END_OF_HEADERS.size();
+    // Keep the last line's terminator so every line ends in one
+    string_ref remaining = input.substr(0, headers_end + END_OF_LINE.size());
+
+    const size_t request_line_end = remaining.find(END_OF_LINE);
+    string_ref request_line = remaining.substr(0, request_line_end);
+    remaining.remove_prefix(request_line_end + END_OF_LINE.size());
+    string_ref method;
+    string_ref target;
+    if (!split_prefix(request_line, ' ', method) || !split_prefix(request_line, ' ', target)) {
+        return HttpParseStatus::BAD_REQUEST;
+    }
+    if (!request_line.starts_with("HTTP/1.")) {
+        return HttpParseStatus::BAD_REQUEST;
+    }
+    if (method != CONNECT_METHOD) {
+        return HttpParseStatus::METHOD_NOT_ALLOWED;
+    }
+    if (!parse_authority(target, request)) {
+        return HttpParseStatus::BAD_REQUEST;
+    }
+
+    while (!remaining.empty()) {
+        const size_t line_end = remaining.find(END_OF_LINE);
+        string_ref line = remaining.substr(0, line_end);
+        remaining.remove_prefix(line_end + END_OF_LINE.size());
+        string_ref name;
+        if (!split_prefix(line, ':', name) || name.empty()) {
+            return HttpParseStatus::BAD_REQUEST;
+        }
+        if (!equals_ignore_case(name, AUTHORIZATION_HEADER)) {
+            continue;
+        }
+        string_ref value = trim(line);
+        string_ref scheme;
+        if (split_prefix(value, ' ', scheme) && equals_ignore_case(scheme, BASIC_SCHEME)) {
+            request.credentials = trim(value);
+        }
+    }
+    return HttpParseStatus::COMPLETE;
+}
+
+AddressType get_host_address_type(const string& host) {
+    error_code error;
+    const address host_address = address::from_string(host, error);
+    if (error) {
+        return AddressType::DOMAIN_NAME;
+    }
+    return host_address.is_v4() ? AddressType::IPV4 : AddressType::IPV6;
+}
+
+bool decode_http_credentials(string_ref credentials, string& username, string& password) {
+    char decoded[MAX_DECODED_CREDENTIALS_SIZE];
+    size_t decoded_size = 0;
+    uint32_t accumulator = 0;
+    size_t bit_count = 0;
+    for (char c : credentials) {
+        if (c == '=') {
+            break;
+        }
+        const int value = decode_base64_character(c);
+        if (value < 0) {
+            return false;
+        }
+        accumulator = (accumulator << 6) | value;
+        bit_count += 6;
+        if (bit_count >= 8) {
+            if (decoded_size == sizeof(decoded)) {
+                return false;
+            }
+            bit_count -= 8;
+            decoded[decoded_size++] = static_cast<char>((accumulator >> bit_count) & 0xff);
+        }
+    }
+    const char* separator = static_cast<const char*>(memchr(decoded, ':', decoded_size));
+    if (!separator || separator == decoded) {
+        return false;
+    }
+    username.assign(decoded, separator - decoded);
+    password.assign(separator + 1, decoded + decoded_size - separator - 1);
+    return true;
+}
+
+void make_http_response(vector<uint8_t>& buffer, ReplyType reply) {
+    switch (reply) {
+        case ReplyType::SUCCESS:
+            make_http_response(buffer, 200);
+            break;
+        case ReplyType::CONNECTION_NOT_ALLOWED:
+            make_http_response(buffer, 403);
+            break;
+        case ReplyType::TTL_EXPIRED:
+            make_http_response(buffer, 504);
+            break;
+        default:
+            make_http_response(buffer, 502);
+            break;
+    }
+}
+
+void make_http_response(vector<uint8_t>& buffer, unsigned status_code) {
+    const char* response;
+    switch (status_code) {
+        case 200:
+            response = "HTTP/1.1 200 Connection established\r\n\r\n";
+            break;
+        case 400:
+            response = "HTTP/1.1 400 Bad Request\r\n"
+                       "Connection: close\r\nContent-Length: 0\r\n\r\n";
+            break;
+        case 403:
+            response = "HTTP/1.1 403 Forbidden\r\n"
+                       "Connection: close\r\nContent-Length: 0\r\n\r\n";
+            break;
+        case 405:
+            response = "HTTP/1.1 405 Method Not Allowed\r\nAllow: CONNECT\r\n"
+                       "Connection: close\r\nContent-Length: 0\r\n\r\n";
+            break;
+        case 407:
+            response = "HTTP/1.1 407 Proxy Authentication Required\r\n"
+                       "Proxy-Authenticate: Basic realm=\"roberto\"\r\n"
+                       "Connection: close\r\nContent-Length: 0\r\n\r\n";
+            break;
+        case 431:
+            response = "HTTP/1.1 431 Request Header Fields Too Large\r\n"
+                       "Connection: close\r\nContent-Length: 0\r\n\r\n";
+            break;
+        case 504:
+            response = "HTTP/1.1 504 Gateway Timeout\r\n"
+                       "Connection: close\r\nContent-Length: 0\r\n\r\n";
+            break;
+        default:
+            response = "HTTP/1.1 502 Bad Gateway\r\n"
+                       "Connection: close\r\nContent-Length: 0\r\n\r\n";
+            break;
+    }
+    const auto* response_start = reinterpret_cast<const uint8_t*>(response);
+    buffer.assign(response_start, response_start + strlen(response));
+}
+
+} // roberto
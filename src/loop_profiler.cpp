@@ -0,0 +1,289 @@
+#include "loop_profiler.h"
+#include <cmath>
+#include <csignal>
+#include <cstdlib>
+#include <stdexcept>
+#include <algorithm>
+#include <execinfo.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <log4cxx/logger.h>
+
+using std::mutex;
+using std::thread;
+using std::runtime_error;
+using std::lock_guard;
+using std::unique_lock;
+using std::memory_order_relaxed;
+using std::memory_order_acquire;
+using std::memory_order_release;
+using std::chrono::milliseconds;
+using std::chrono::microseconds;
+using std::chrono::duration_cast;
+
+using log4cxx::Logger;
+using log4cxx::LoggerPtr;
+
+namespace roberto {
+
+static const LoggerPtr logger = Logger::getLogger("r.loop_profiler");
+
+// Sent to a stalled thread so it captures its own backtrace. Note that blocking calls that aren't
+// restarted after a signal, like sleeps, will return early on that thread
+static const int BACKTRACE_SIGNAL = SIGUSR1;
+static const milliseconds BACKTRACE_TIMEOUT(100);
+static const milliseconds MAX_CHECK_INTERVAL(100);
+
+static thread_local void* current_thread_state = nullptr;
+
+constexpr size_t LoopProfiler::HISTOGRAM_BUCKET_COUNT;
+constexpr size_t LoopProfiler::MAX_BACKTRACE_FRAMES;
+
+std::atomic<LoopProfiler*> LoopProfiler::active_profiler_{nullptr};
+
+const char* LoopProfiler::HANDLER_NAMES[HANDLER_TYPE_COUNT] = {
+    "Server::on_accept",
+    "ClientConnection::handle_read",
+    "ClientConnection::handle_write",
+    "Channel::handle_resolve",
+    "Channel::handle_connect",
+    "Channel::handle_read",
+    "Channel::handle_write",
+    "ThrottleScheduler::handle_timer",
+    "RelayScheduler::run_turn",
+    "CoroutineConnection::Handshake",
+    "CoroutineConnection::Relay"
+};
+
+// ScopedTimer
+
+LoopProfiler::ScopedTimer::ScopedTimer(HandlerType type)
+: profiler_(active_profiler_.load(memory_order_relaxed)), type_(type) {
+    if (profiler_) {
+        start_time_ = Clock::now();
+        profiler_->handler_started(type_, start_time_);
+    }
+}
+
+LoopProfiler::ScopedTimer::~ScopedTimer() {
+    if (profiler_) {
+        profiler_->handler_finished(type_, start_time_);
+    }
+}
+
+// LoopProfiler
+
+LoopProfiler::ThreadState::ThreadState()
+: thread(pthread_self()), thread_id(syscall(SYS_gettid)) {
+    for (auto& histogram : histograms) {
+        for (auto& bucket : histogram) {
+            bucket.store(0, memory_order_relaxed);
+        }
+    }
+}
+
+LoopProfiler::LoopProfiler(Duration stall_threshold, Duration report_interval)
+: stall_threshold_(stall_threshold), report_interval_(report_interval) {
+
+}
+
+LoopProfiler::~LoopProfiler() {
+    stop();
+}
+
+void LoopProfiler::start() {
+    struct sigaction action = {};
+    action.sa_handler = &LoopProfiler::handle_backtrace_signal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(BACKTRACE_SIGNAL, &action, nullptr) != 0) {
+        throw runtime_error("Failed to install backtrace signal handler");
+    }
+    // The first call to backtrace can allocate memory, which is not safe within a signal handler
+    void* frame = nullptr;
+    backtrace(&frame, 1);
+
+    LoopProfiler* expected = nullptr;
+    if (!active_profiler_.compare_exchange_strong(expected, this)) {
+        throw runtime_error("There's already an active loop profiler");
+    }
+    watchdog_thread_ = thread(&LoopProfiler::run, this);
+}
+
+void LoopProfiler::stop() {
+    if (!watchdog_thread_.joinable()) {
+        return;
+    }
+    {
+        lock_guard<mutex> _(stop_mutex_);
+        stopped_ = true;
+    }
+    stop_condition_.notify_one();
+    watchdog_thread_.join();
+    active_profiler_.store(nullptr);
+}
+
+void LoopProfiler::handle_backtrace_signal(int) {
+    auto state = static_cast<ThreadState*>(current_thread_state);
+    if (state) {
+        const int size = backtrace(state->backtrace_frames.data(), MAX_BACKTRACE_FRAMES);
+        state->backtrace_size.store(size, memory_order_release);
+    }
+}
+
+size_t LoopProfiler::get_bucket(Duration duration) {
+    const auto micros = duration_cast<microseconds>(duration).count();
+    if (micros <= 0) {
+        return 0;
+    }
+    const size_t bucket = 64 - __builtin_clzll(micros);
+    return bucket < HISTOGRAM_BUCKET_COUNT ? bucket : HISTOGRAM_BUCKET_COUNT - 1;
+}
+
+int64_t LoopProfiler::to_ticks(Clock::time_point time_point) {
+    return time_point.time_since_epoch().count();
+}
+
+LoopProfiler::ThreadState& LoopProfiler::get_thread_state() {
+    static thread_local const LoopProfiler* state_owner = nullptr;
+    static thread_local ThreadState* state = nullptr;
+    if (state_owner != this) {
+        lock_guard<mutex> _(thread_states_mutex_);
+        thread_states_.emplace_back(new ThreadState());
+        state = thread_states_.back().get();
+        state_owner = this;
+        current_thread_state = state;
+    }
+    return *state;
+}
+
+void LoopProfiler::handler_started(HandlerType type, Clock::time_point start_time) {
+    ThreadState& state = get_thread_state();
+    // Handlers can run others inline (e.g. through a strand), only the outermost one can stall
+    if (state.handler_depth++ == 0) {
+        state.handler_type.store(type, memory_order_relaxed);
+        state.handler_start.store(to_ticks(start_time), memory_order_release);
+    }
+}
+
+void LoopProfiler::handler_finished(HandlerType type, Clock::time_point start_time) {
+    ThreadState& state = get_thread_state();
+    auto& bucket = state.histograms[type][get_bucket(Clock::now() - start_time)];
+    // We're the only writer so there's no need for an atomic increment
+    bucket.store(bucket.load(memory_order_relaxed) + 1, memory_order_relaxed);
+    if (--state.handler_depth == 0) {
+        state.handler_start.store(0, memory_order_release);
+    }
+}
+
+void LoopProfiler::run() {
+    Duration check_interval = report_interval_;
+    if (stall_threshold_ > Duration::zero()) {
+        // Check often enough to notice a stall shortly after it crosses the threshold
+        check_interval = std::min<Duration>(stall_threshold_ / 4, MAX_CHECK_INTERVAL);
+    }
+    auto next_report = Clock::now() + report_interval_;
+    unique_lock<mutex> lock(stop_mutex_);
+    while (!stop_condition_.wait_for(lock, check_interval, [&] { return stopped_; })) {
+        if (stall_threshold_ > Duration::zero()) {
+            check_stalls();
+        }
+        if (report_interval_ > Duration::zero() && Clock::now() >= next_report) {
+            report_latencies();
+            next_report += report_interval_;
+        }
+    }
+}
+
+void LoopProfiler::check_stalls() {
+    lock_guard<mutex> _(thread_states_mutex_);
+    const int64_t now = to_ticks(Clock::now());
+    for (const auto& state : thread_states_) {
+        const int64_t handler_start = state->handler_start.load(memory_order_acquire);
+        if (handler_start == 0 || handler_start == state->reported_handler_start ||
+            Duration(now - handler_start) < stall_threshold_) {
+            continue;
+        }
+        state->reported_handler_start = handler_start;
+        const auto handler_type = state->handler_type.load(memory_order_relaxed);
+        LOG4CXX_WARN(logger, "Thread " << state->thread_id << " has been running "
+                     << HANDLER_NAMES[handler_type] << " for "
+                     << duration_cast<milliseconds>(Duration(now - handler_start)).count()
+                     << "ms without returning to the event loop");
+        log_backtrace(*state);
+    }
+}
+
+void LoopProfiler::log_backtrace(ThreadState& state) {
+    state.backtrace_size.store(-1, memory_order_relaxed);
+    if (pthread_kill(state.thread, BACKTRACE_SIGNAL) != 0) {
+        LOG4CXX_WARN(logger, "Failed to signal thread " << state.thread_id);
+        return;
+    }
+    const auto deadline = Clock::now() + BACKTRACE_TIMEOUT;
+    int size = state.backtrace_size.load(memory_order_acquire);
+    while (size < 0 && Clock::now() < deadline) {
+        std::this_thread::sleep_for(milliseconds(1));
+        size = state.backtrace_size.load(memory_order_acquire);
+    }
+    if (size < 0) {
+        LOG4CXX_WARN(logger, "Timed out waiting for backtrace of thread " << state.thread_id);
+        return;
+    }
+    char** symbols = backtrace_symbols(state.backtrace_frames.data(), size);
+    if (!symbols) {
+        return;
+    }
+    // Skip the frames for the signal handler itself
+    for (int i = 2; i < size; ++i) {
+        LOG4CXX_WARN(logger, "    #" << (i - 2) << " " << symbols[i]);
+    }
+    free(symbols);
+}
+
+void LoopProfiler::report_latencies() {
+    Histograms histograms{};
+    {
+        lock_guard<mutex> _(thread_states_mutex_);
+        for (const auto& state : thread_states_) {
+            for (size_t type = 0; type < HANDLER_TYPE_COUNT; ++type) {
+                for (size_t bucket = 0; bucket < HISTOGRAM_BUCKET_COUNT; ++bucket) {
+                    const auto& counter = state->histograms[type][bucket];
+                    histograms[type][bucket] += counter.load(memory_order_relaxed);
+                }
+            }
+        }
+    }
+    for (size_t type = 0; type < HANDLER_TYPE_COUNT; ++type) {
+        // Only report what happened since the last report
+        Histogram histogram = histograms[type];
+        uint64_t count = 0;
+        for (size_t bucket = 0; bucket < HISTOGRAM_BUCKET_COUNT; ++bucket) {
+            histogram[bucket] -= reported_histograms_[type][bucket];
+            count += histogram[bucket];
+        }
+        reported_histograms_[type] = histograms[type];
+        if (count == 0) {
+            continue;
+        }
+        // Bucket N holds latencies below 2^N microseconds
+        auto percentile = [&](double ratio) {
+            const uint64_t target = std::max<uint64_t>(1, std::ceil(count * ratio));
+            uint64_t accumulated = 0;
+            size_t bucket = 0;
+            while (bucket < HISTOGRAM_BUCKET_COUNT - 1) {
+                accumulated += histogram[bucket];
+                if (accumulated >= target) {
+                    break;
+                }
+                ++bucket;
+            }
+            return uint64_t(1) << bucket;
+        };
+        LOG4CXX_INFO(logger, HANDLER_NAMES[type] << ": " << count << " calls, p50 < "
+                     << percentile(0.5) << "us, p99 < " << percentile(0.99) << "us, p99.9 < "
+                     << percentile(0.999) << "us, max < " << percentile(1.0) << "us");
+    }
+}
+
+} // roberto
@@ -3,10 +3,16 @@
 #include <string>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <vector>
 #include <stdexcept>
 #include <thread>
+#include <future>
+#include <algorithm>
+#include <sched.h>
+#include <unistd.h>
 #include <boost/asio/io_service.hpp>
+#include <boost/asio/local/stream_protocol.hpp>
 #include <boost/program_options.hpp>
 #include <boost/algorithm/string/split.hpp>
 #include <boost/algorithm/string/classification.hpp>
@@ -15,6 +21,22 @@
 #include <log4cxx/consoleappender.h>
 #include "server.h"
 #include "authentication_manager.h"
+#include "bandwidth_manager.h"
+#include "traffic_accountant.h"
+#include "traffic_recorder.h"
+#include "connection_context.h"
+#include "loop_profiler.h"
+#include "hot_restart.h"
+#include "socket_options.h"
+#include "circuit_breaker.h"
+#include "cpu_affinity.h"
+#include "stream_socket.h"
+#include "tls_context.h"
+#include "heavy_hitters.h"
+#include "admin_server.h"
+#include "warm_connection_pool.h"
+#include "socket_redirector.h"
+#include "upstream_pool.h"
 
 using std::function;
 using std::signal;
@@ -26,9 +48,23 @@ using std::endl;
 using std::exception;
 using std::shared_ptr;
 using std::make_shared;
+using std::unique_ptr;
 using std::vector;
 using std::thread;
+using std::promise;
+using std::future_status;
 using std::runtime_error;
+using std::stoull;
+using std::stoi;
+using std::to_string;
+using std::map;
+using std::pair;
+using std::make_pair;
+using std::min;
+using std::max;
+using std::chrono::seconds;
+using std::chrono::milliseconds;
+using std::chrono::microseconds;
 
 using boost::asio::io_service;
 using boost::asio::ip::address;
@@ -82,13 +118,402 @@ shared_ptr<AuthenticationManager> make_auth_manager(const string& raw_credential
     return output;
 }
 
+// Parses a list in the format username1:value1[,username2:value2[,...]]
+vector<pair<string, uint64_t>> parse_user_values(const string& raw_user_values) {
+    vector<pair<string, uint64_t>> output;
+    if (raw_user_values.empty()) {
+        return output;
+    }
+    vector<string> user_value_pairs;
+    split(user_value_pairs, raw_user_values, is_any_of(","));
+    for (const string& raw_user_value_pair : user_value_pairs) {
+        vector<string> user_value;
+        split(user_value, raw_user_value_pair, is_any_of(":"));
+        if (user_value.size() != 2) {
+            throw runtime_error("Per user values need format username:value");
+        }
+        output.push_back(make_pair(user_value[0], stoull(user_value[1])));
+    }
+    return output;
+}
+
+shared_ptr<BandwidthManager> make_bandwidth_manager(const BandwidthManager::Limits& limits,
+                                                   const string& raw_user_limits) {
+    if (limits.global_rate == 0 && limits.user_rate == 0 && limits.connection_rate == 0 &&
+        raw_user_limits.empty()) {
+        return {};
+    }
+    auto output = make_shared<BandwidthManager>(limits);
+    for (const auto& user_limit : parse_user_values(raw_user_limits)) {
+        output->set_user_rate(user_limit.first, user_limit.second);
+    }
+    return output;
+}
+
+shared_ptr<TrafficAccountant> make_traffic_accountant(const AuthenticationManager* auth_manager,
+                                                      const string& snapshot_path,
+                                                      size_t interval, uint64_t default_quota,
+                                                      const string& raw_user_quotas) {
+    if (snapshot_path.empty() && default_quota == 0 && raw_user_quotas.empty()) {
+        return {};
+    }
+    vector<string> usernames;
+    if (auth_manager) {
+        usernames = auth_manager->get_usernames();
+    }
+    auto output = make_shared<TrafficAccountant>(usernames, snapshot_path, seconds(interval));
+    output->set_default_quota(default_quota);
+    for (const auto& user_quota : parse_user_values(raw_user_quotas)) {
+        output->set_user_quota(user_quota.first, user_quota.second);
+    }
+    return output;
+}
+
+unique_ptr<LoopProfiler> make_loop_profiler(size_t stall_threshold, size_t report_interval) {
+    if (stall_threshold == 0 && report_interval == 0) {
+        return {};
+    }
+    return unique_ptr<LoopProfiler>(new LoopProfiler(milliseconds(stall_threshold),
+                                                     seconds(report_interval)));
+}
+
+// Parses options in the format option1=value1[,option2=value2[,...]]
+SocketOptions parse_socket_options(const string& raw_options) {
+    using IntegerOption = boost::optional<int> SocketOptions::*;
+    static const map<string, IntegerOption> INTEGER_OPTIONS = {
+        { "rcvbuf", &SocketOptions::receive_buffer_size },
+        { "sndbuf", &SocketOptions::send_buffer_size },
+        { "notsent-lowat", &SocketOptions::not_sent_low_watermark },
+        { "keepalive-idle", &SocketOptions::keepalive_idle_seconds },
+        { "keepalive-interval", &SocketOptions::keepalive_interval_seconds },
+        { "keepalive-count", &SocketOptions::keepalive_count },
+        { "user-timeout", &SocketOptions::user_timeout_milliseconds },
+        { "fastopen", &SocketOptions::fast_open },
+        { "defer-accept", &SocketOptions::defer_accept_seconds },
+    };
+    SocketOptions output;
+    vector<string> option_pairs;
+    split(option_pairs, raw_options, is_any_of(","));
+    for (const string& raw_option_pair : option_pairs) {
+        vector<string> option;
+        split(option, raw_option_pair, is_any_of("="));
+        if (option.size() != 2) {
+            throw runtime_error("Socket options need format option=value");
+        }
+        if (option[0] == "nodelay") {
+            output.no_delay = stoi(option[1]) != 0;
+            continue;
+        }
+        auto iter = INTEGER_OPTIONS.find(option[0]);
+        if (iter == INTEGER_OPTIONS.end()) {
+            throw runtime_error("Unknown socket option " + option[0]);
+        }
+        output.*(iter->second) = stoi(option[1]);
+    }
+    return output;
+}
+
+// Parses a list of profiles, each of them in the format name:option1=value1[,...]
+map<string, SocketOptions> parse_socket_profiles(const vector<string>& raw_profiles) {
+    map<string, SocketOptions> output;
+    for (const string& raw_profile : raw_profiles) {
+        const auto separator = raw_profile.find(':');
+        if (separator == string::npos) {
+            throw runtime_error("Socket profiles need format name:options");
+        }
+        output[raw_profile.substr(0, separator)] =
+            parse_socket_options(raw_profile.substr(separator + 1));
+    }
+    return output;
+}
+
+const SocketOptions& find_socket_profile(const map<string, SocketOptions>& profiles,
+                                         const string& name) {
+    auto iter = profiles.find(name);
+    if (iter == profiles.end()) {
+        throw runtime_error("Unknown socket profile " + name);
+    }
+    return iter->second;
+}
+
+// Parses port classes in the format port1[-port2]:profile1[,port3[-port4]:profile2[,...]]
+EgressSocketProfiles make_egress_socket_profiles(const map<string, SocketOptions>& profiles,
+                                                 const string& default_profile,
+                                                 const string& raw_port_profiles) {
+    SocketOptions default_options;
+    if (!default_profile.empty()) {
+        default_options = find_socket_profile(profiles, default_profile);
+    }
+    EgressSocketProfiles output(default_options);
+    if (raw_port_profiles.empty()) {
+        return output;
+    }
+    vector<string> port_profile_pairs;
+    split(port_profile_pairs, raw_port_profiles, is_any_of(","));
+    for (const string& raw_port_profile_pair : port_profile_pairs) {
+        vector<string> port_profile;
+        split(port_profile, raw_port_profile_pair, is_any_of(":"));
+        if (port_profile.size() != 2) {
+            throw runtime_error("Port profiles need format port[-port]:profile");
+        }
+        vector<string> ports;
+        split(ports, port_profile[0], is_any_of("-"));
+        if (ports.size() > 2) {
+            throw runtime_error("Invalid port range " + port_profile[0]);
+        }
+        output.add_port_range(stoi(ports.front()), stoi(ports.back()),
+                              find_socket_profile(profiles, port_profile[1]));
+    }
+    return output;
+}
+
+// Parses CPU lists in the format cpu1[-cpu2][,cpu3[-cpu4][,...]]
+vector<int> parse_cpu_list(const string& raw_cpus) {
+    vector<int> output;
+    if (raw_cpus.empty()) {
+        return output;
+    }
+    vector<string> cpu_ranges;
+    split(cpu_ranges, raw_cpus, is_any_of(","));
+    for (const string& raw_cpu_range : cpu_ranges) {
+        vector<string> cpu_range;
+        split(cpu_range, raw_cpu_range, is_any_of("-"));
+        if (cpu_range.size() > 2) {
+            throw runtime_error("CPU ranges need format cpu[-cpu]");
+        }
+        const int first_cpu = stoi(cpu_range[0]);
+        const int last_cpu = stoi(cpu_range.back());
+        if (first_cpu < 0 || last_cpu < first_cpu || last_cpu >= CPU_SETSIZE) {
+            throw runtime_error("Invalid CPU range " + raw_cpu_range);
+        }
+        for (int cpu = first_cpu; cpu <= last_cpu; ++cpu) {
+            output.push_back(cpu);
+        }
+    }
+    return output;
+}
+
+// Parses mappings in the format host1:port1=path1[,host2:port2=path2[,...]]
+map<string, string> parse_unix_egress_paths(const string& raw_mappings) {
+    map<string, string> output;
+    if (raw_mappings.empty()) {
+        return output;
+    }
+    vector<string> mappings;
+    split(mappings, raw_mappings, is_any_of(","));
+    for (const string& mapping : mappings) {
+        const auto separator = mapping.find('=');
+        const auto port_separator = mapping.rfind(':', separator);
+        if (separator == string::npos || port_separator == string::npos ||
+            port_separator == 0 || separator + 1 == mapping.size()) {
+            throw runtime_error("Unix egress mappings need format host:port=path");
+        }
+        const int port = stoi(mapping.substr(port_separator + 1,
+                                             separator - port_separator - 1));
+        if (port <= 0 || port > 65535) {
+            throw runtime_error("Invalid port in unix egress mapping " + mapping);
+        }
+        // Destinations are looked up using the port as we format it
+        const string destination = mapping.substr(0, port_separator) + ":" + to_string(port);
+        output[destination] = mapping.substr(separator + 1);
+    }
+    return output;
+}
+
+// Parses parent proxies in the format [username:password@]host1:port1[,...]
+vector<UpstreamPool::Parent> parse_upstream_proxies(const string& raw_proxies) {
+    vector<UpstreamPool::Parent> output;
+    vector<string> proxies;
+    split(proxies, raw_proxies, is_any_of(","));
+    for (const string& proxy : proxies) {
+        UpstreamPool::Parent parent;
+        const auto credentials_separator = proxy.rfind('@');
+        size_t endpoint_start = 0;
+        if (credentials_separator != string::npos) {
+            const auto password_separator = proxy.find(':');
+            if (password_separator > credentials_separator) {
+                throw runtime_error("Parent proxy credentials need format username:password");
+            }
+            parent.username = proxy.substr(0, password_separator);
+            parent.password = proxy.substr(password_separator + 1,
+                                           credentials_separator - password_separator - 1);
+            if (parent.username.empty() || parent.username.size() > 255 ||
+                parent.password.size() > 255) {
+                throw runtime_error("Invalid credentials for parent proxy " + proxy);
+            }
+            endpoint_start = credentials_separator + 1;
+        }
+        const auto port_separator = proxy.rfind(':');
+        if (port_separator == string::npos || port_separator <= endpoint_start) {
+            throw runtime_error("Parent proxies need format host:port");
+        }
+        const int port = stoi(proxy.substr(port_separator + 1));
+        if (port <= 0 || port > 65535) {
+            throw runtime_error("Invalid port in parent proxy " + proxy);
+        }
+        parent.address = proxy.substr(endpoint_start, port_separator - endpoint_start);
+        parent.port = port;
+        output.push_back(std::move(parent));
+    }
+    return output;
+}
+
+// The endpoints client connections are accepted on
+struct Listeners {
+    tcp::endpoint endpoint;
+    // Only used if there's a TLS context
+    tcp::endpoint tls_endpoint;
+    shared_ptr<const TlsContext> tls_context;
+    // Empty if there's no Unix domain socket listener
+    string unix_path;
+};
+
+// Listens on the configured endpoints, unless the listening sockets were taken over from a
+// running instance.
+//
+// When steering connections to CPUs there's one TCP server per I/O service for each endpoint,
+// each listening on its own socket within a reuseport group and accepting the connections
+// received by its CPU. Otherwise there's a single one. Unix domain socket servers always run
+// on the first service
+vector<unique_ptr<Server>> make_servers(const vector<unique_ptr<io_service>>& services,
+                                        const vector<int>& steering_cpus,
+                                        const Listeners& listeners,
+                                        HotRestarter* hot_restarter,
+                                        shared_ptr<const ConnectionContext> context,
+                                        const vector<shared_ptr<WarmConnectionPool>>& warm_pools,
+                                        ConnectionEngine engine) {
+    map<uint16_t, vector<int>> listening_sockets;
+    vector<int> unix_listening_sockets;
+    if (hot_restarter) {
+        for (int socket : hot_restarter->take_over_sockets()) {
+            const auto socket_endpoint = get_socket_endpoint(socket);
+            if (is_unix_endpoint(socket_endpoint)) {
+                unix_listening_sockets.push_back(socket);
+            }
+            else {
+                listening_sockets[to_tcp_endpoint(socket_endpoint).port()].push_back(socket);
+            }
+        }
+    }
+    vector<shared_ptr<const ConnectionContext>> contexts;
+    if (steering_cpus.empty() && warm_pools.empty()) {
+        contexts.push_back(move(context));
+    }
+    else {
+        // Every event loop gets its own context, with the state that belongs to it
+        for (size_t i = 0; i < services.size(); ++i) {
+            auto server_context = make_shared<ConnectionContext>(*context);
+            if (!steering_cpus.empty()) {
+                server_context->listener_socket_options.reuse_port = true;
+                server_context->listener_socket_options.incoming_cpu = steering_cpus[i];
+            }
+            if (!warm_pools.empty()) {
+                server_context->warm_connection_pool = warm_pools[i];
+            }
+            contexts.push_back(move(server_context));
+        }
+    }
+    vector<unique_ptr<Server>> output;
+    auto add_servers = [&](const tcp::endpoint& endpoint,
+                           const shared_ptr<const TlsContext>& tls_context) {
+        vector<int> sockets;
+        sockets.swap(listening_sockets[endpoint.port()]);
+        // Sockets we took over are all kept, so none of the connections queued on them is lost
+        const size_t server_count = max(contexts.size(), sockets.size());
+        for (size_t i = 0; i < server_count; ++i) {
+            io_service& service = *services[i % services.size()];
+            const auto& server_context = contexts[i % contexts.size()];
+            if (i < sockets.size()) {
+                output.emplace_back(new Server(service, sockets[i], server_context, engine));
+            }
+            else {
+                output.emplace_back(new Server(service, endpoint, server_context, engine));
+            }
+            if (tls_context) {
+                output.back()->enable_tls(tls_context);
+            }
+        }
+    };
+    add_servers(listeners.endpoint, nullptr);
+    if (listeners.tls_context) {
+        add_servers(listeners.tls_endpoint, listeners.tls_context);
+    }
+    for (const auto& port_sockets : listening_sockets) {
+        for (int socket : port_sockets.second) {
+            // We don't know what these are meant to serve anymore
+            close(socket);
+        }
+    }
+    for (int socket : unix_listening_sockets) {
+        output.emplace_back(new Server(*services[0], socket, contexts[0], engine));
+    }
+    if (unix_listening_sockets.empty() && !listeners.unix_path.empty()) {
+        boost::asio::local::stream_protocol::endpoint unix_endpoint(listeners.unix_path);
+        output.emplace_back(new Server(*services[0], unix_endpoint, contexts[0], engine));
+    }
+    return output;
+}
+
+ConnectionEngine parse_engine(const string& engine) {
+    if (engine == "callbacks") {
+        return ConnectionEngine::CALLBACKS;
+    }
+    if (engine == "coroutines") {
+        return ConnectionEngine::COROUTINES;
+    }
+    throw runtime_error("Unknown engine " + engine);
+}
+
 int main(int argc, char* argv[]) {
     string config_file;
     string address;
     string log_level;
     string credentials;
+    string bandwidth_user_limits;
+    string accounting_snapshot_file;
+    string traffic_record_file;
+    size_t traffic_record_max_chunks;
+    string user_quotas;
+    string engine;
     uint16_t port;
+#ifdef ROBERTO_HAVE_TLS
+    uint16_t tls_port;
+    string tls_certificate;
+    string tls_private_key;
+#endif
     size_t num_threads;
+    size_t accounting_interval;
+    size_t stall_threshold;
+    size_t profiler_report_interval;
+    size_t coalescing_window;
+    string hot_restart_socket;
+    size_t drain_timeout;
+    vector<string> socket_profiles;
+    string listener_socket_profile;
+    string egress_socket_profile;
+    string egress_port_profiles;
+    string cpu_affinity;
+    string unix_listen_path;
+    string unix_egress;
+    bool incoming_cpu_steering;
+    size_t circuit_breaker_failures;
+    size_t circuit_breaker_open_time;
+    size_t heavy_hitters;
+    size_t heavy_hitter_window;
+    bool kernel_redirection;
+    bool optimistic_connect;
+    size_t kernel_redirection_max_connections;
+    size_t warm_pool_min_requests;
+    size_t warm_pool_max_idle;
+    size_t warm_pool_idle_timeout;
+    string admin_socket;
+    string upstream_proxies;
+    size_t upstream_failure_threshold;
+    size_t upstream_ejection_time;
+    size_t upstream_handshake_timeout;
+    uint64_t quota;
+    BandwidthManager::Limits bandwidth_limits;
+    RelayScheduler::Policy relay_scheduling;
 
     po::options_description options("Options");
     options.add_options()
@@ -102,14 +527,188 @@ int main(int argc, char* argv[]) {
                         "the address to bind to")
         ("port",        po::value<uint16_t>(&port)->required(),
                         "the port to bind to")
+        ("unix-listen", po::value<string>(&unix_listen_path),
+                        "the path of a Unix domain socket to accept connections on as well, "
+                        "e.g. from clients running on this same host")
         ("num-threads", po::value<size_t>(&num_threads)->default_value(2),
                         "the amount of threads to use")
+        ("cpu-affinity", po::value<string>(&cpu_affinity),
+                        "the CPUs the threads are pinned to, one per thread in order, in the "
+                        "format cpu1[-cpu2][,cpu3[-cpu4][,...]]. Each thread allocates memory "
+                        "from its CPU's NUMA node")
+        ("incoming-cpu-steering",
+                        po::value<bool>(&incoming_cpu_steering)->default_value(false),
+                        "whether each thread runs its own event loop and listening socket, "
+                        "serving the connections received by the CPU it's pinned to. Requires "
+                        "cpu-affinity")
+        ("engine",      po::value<string>(&engine)->default_value("callbacks"),
+                        "the implementation used to serve connections (callbacks, coroutines)")
         ("log-level",   po::value<string>(&log_level)->default_value("INFO"),
                         "the log level to use (TRACE, DEBUG, INFO, WARN, ERROR)")
+        ("coalescing-window", po::value<size_t>(&coalescing_window)->default_value(0),
+                        "the time in microseconds small relayed writes are held back so they can "
+                        "be sent along with the data that follows them (0 disables it). "
+                        "Requires the callbacks engine")
+        ("relay-turn-bytes",
+                        po::value<size_t>(&relay_scheduling.turn_bytes)->default_value(0),
+                        "the amount of bytes each relayed direction can read before letting "
+                        "other connections run (0 means unlimited)")
+        ("relay-turn-operations",
+                        po::value<size_t>(&relay_scheduling.turn_operations)->default_value(0),
+                        "the amount of reads each relayed direction can do before letting "
+                        "other connections run (0 means unlimited)")
+        ("relay-interactive-chunk-size",
+                        po::value<size_t>(&relay_scheduling.interactive_chunk_size)
+                            ->default_value(0),
+                        "relayed directions reading chunks smaller than this on average are "
+                        "interactive and are never made to wait for their turn (0 disables it)")
         ("credentials", po::value<string>(&credentials),
                         "credentials to be used in the format "
                         "username1:password1[,username2:password2[,...]]")
+        ("bandwidth-global-limit",
+                        po::value<uint64_t>(&bandwidth_limits.global_rate)->default_value(0),
+                        "the maximum bytes per second relayed in each direction across all "
+                        "connections (0 means unlimited)")
+        ("bandwidth-user-limit",
+                        po::value<uint64_t>(&bandwidth_limits.user_rate)->default_value(0),
+                        "the maximum bytes per second relayed in each direction for each "
+                        "user (0 means unlimited)")
+        ("bandwidth-connection-limit",
+                        po::value<uint64_t>(&bandwidth_limits.connection_rate)->default_value(0),
+                        "the maximum bytes per second relayed in each direction for each "
+                        "connection (0 means unlimited)")
+        ("bandwidth-user-tiers", po::value<string>(&bandwidth_user_limits),
+                        "per user bandwidth limits, overriding bandwidth-user-limit, in the format "
+                        "username1:bytes_per_second1[,username2:bytes_per_second2[,...]]")
+        ("accounting-snapshot-file", po::value<string>(&accounting_snapshot_file),
+                        "the file in which per user traffic counts are periodically stored. "
+                        "During a hot restart, a lock file and per instance delta files next "
+                        "to it hand the counts over to the new instance")
+        ("accounting-interval", po::value<size_t>(&accounting_interval)->default_value(10),
+                        "the interval in seconds at which per user traffic counts are merged, "
+                        "quotas are evaluated and the snapshot is written")
+        ("quota",       po::value<uint64_t>(&quota)->default_value(0),
+                        "the maximum amount of bytes each authenticated user can relay (0 "
+                        "means unlimited). Connections without authentication aren't limited "
+                        "unless user-quotas has one for an empty username")
+        ("user-quotas", po::value<string>(&user_quotas),
+                        "per user quotas, overriding quota, in the format "
+                        "username1:bytes1[,username2:bytes2[,...]]")
+        ("traffic-record-file", po::value<string>(&traffic_record_file),
+                        "the file in which the shape of every connection is recorded, without "
+                        "any of the data relayed: its handshake, timings and the sizes and "
+                        "times of the chunks relayed in each direction. The traffic-replay "
+                        "benchmark replays it. If hot-restart-socket is set, each instance "
+                        "appends its pid to the file name so it doesn't overwrite the others")
+        ("traffic-record-max-chunks",
+                        po::value<size_t>(&traffic_record_max_chunks)->default_value(1024),
+                        "the amount of chunks recorded per connection and direction. Bytes "
+                        "past them are still counted")
+        ("hot-restart-socket", po::value<string>(&hot_restart_socket),
+                        "the unix socket used to hand the listening socket over to a new "
+                        "instance, which then takes over while this one drains its connections")
+        ("drain-timeout", po::value<size_t>(&drain_timeout)->default_value(30),
+                        "the maximum time in seconds to wait for connections to finish after "
+                        "a hot restart")
+        ("socket-profile", po::value<vector<string>>(&socket_profiles),
+                        "a named set of socket options in the format "
+                        "name:option1=value1[,option2=value2[,...]]. Options are nodelay, "
+                        "rcvbuf, sndbuf, notsent-lowat, keepalive-idle, keepalive-interval, "
+                        "keepalive-count, user-timeout, fastopen and defer-accept. Can be "
+                        "specified multiple times")
+        ("listener-socket-profile", po::value<string>(&listener_socket_profile),
+                        "the socket profile used for the listening and accepted sockets")
+        ("egress-socket-profile", po::value<string>(&egress_socket_profile),
+                        "the socket profile used for outbound connections")
+        ("unix-egress", po::value<string>(&unix_egress),
+                        "destinations connected to through Unix domain sockets instead, in the "
+                        "format host1:port1=path1[,host2:port2=path2[,...]]")
+        ("egress-port-profiles", po::value<string>(&egress_port_profiles),
+                        "per destination port socket profiles for outbound connections, "
+                        "overriding egress-socket-profile, in the format "
+                        "port1[-port2]:profile1[,port3[-port4]:profile2[,...]]")
+        ("optimistic-connect", po::value<bool>(&optimistic_connect)->default_value(false),
+                        "whether clients are told they're connected before the connection to "
+                        "the target is made, so they can send data right away. That data is "
+                        "buffered until connected. If the egress socket profile uses fastopen "
+                        "and the client sent data before connecting started, it goes out along "
+                        "with the SYN. If connecting fails, the client connection is reset")
+        ("upstream-proxies", po::value<string>(&upstream_proxies),
+                        "parent socks5 proxies that TCP connections are made through instead of "
+                        "connecting directly, in the format "
+                        "[username:password@]host1:port1[,...]. Each connection goes through "
+                        "the least loaded of two random parents, by connect latency and "
+                        "connections in flight. Requires the callbacks engine")
+        ("upstream-failure-threshold",
+                        po::value<size_t>(&upstream_failure_threshold)->default_value(3),
+                        "the amount of consecutive connection failures after which a parent "
+                        "proxy stops being used")
+        ("upstream-ejection-time",
+                        po::value<size_t>(&upstream_ejection_time)->default_value(10),
+                        "the time in seconds between probes to a parent proxy that stopped "
+                        "being used, until one of them succeeds")
+        ("upstream-handshake-timeout",
+                        po::value<size_t>(&upstream_handshake_timeout)->default_value(5),
+                        "the time in seconds connecting to a parent proxy and negotiating "
+                        "with it may take, both for connections and probes, before it counts "
+                        "as a failure")
+        ("circuit-breaker-failures",
+                        po::value<size_t>(&circuit_breaker_failures)->default_value(0),
+                        "the amount of consecutive connection failures after which requests to "
+                        "a destination are rejected right away (0 disables it)")
+        ("circuit-breaker-open-time",
+                        po::value<size_t>(&circuit_breaker_open_time)->default_value(10),
+                        "the time in seconds requests to a failing destination are rejected "
+                        "for before trying to connect to it again")
+        ("kernel-redirection", po::value<bool>(&kernel_redirection)->default_value(false),
+                        "whether established IPv4 connections are relayed within the kernel "
+                        "through a BPF sockhash, when no bandwidth limits, traffic accounting, "
+                        "traffic recording or heavy hitter tracking is in use. Requires the "
+                        "callbacks engine")
+        ("kernel-redirection-max-connections",
+                        po::value<size_t>(&kernel_redirection_max_connections)
+                            ->default_value(65536),
+                        "the maximum amount of connections relayed within the kernel at once. "
+                        "Connections over it are relayed as usual")
+        ("warm-pool-min-requests",
+                        po::value<size_t>(&warm_pool_min_requests)->default_value(0),
+                        "the amount of requests per second a destination needs to get for "
+                        "connections to it to be established ahead of time (0 disables it)")
+        ("warm-pool-max-idle", po::value<size_t>(&warm_pool_max_idle)->default_value(4),
+                        "the maximum amount of connections established ahead of time to each "
+                        "destination, per event loop")
+        ("warm-pool-idle-timeout",
+                        po::value<size_t>(&warm_pool_idle_timeout)->default_value(10),
+                        "the time in seconds after which connections established ahead of time "
+                        "that weren't used are closed")
+        ("heavy-hitters", po::value<size_t>(&heavy_hitters)->default_value(0),
+                        "the amount of destinations and client addresses driving the most "
+                        "connections and traffic that are tracked and reported through the "
+                        "admin socket (0 disables it)")
+        ("heavy-hitter-window", po::value<size_t>(&heavy_hitter_window)->default_value(60),
+                        "the length in seconds of the windows heavy hitters are counted over. "
+                        "Reports cover the previous window and the current one so far")
+        ("admin-socket", po::value<string>(&admin_socket),
+                        "the unix socket on which admin queries are served")
+        ("stall-threshold", po::value<size_t>(&stall_threshold)->default_value(0),
+                        "the time in milliseconds after which a thread that hasn't returned "
+                        "to the event loop is reported, along with its backtrace (0 disables it)")
+        ("profiler-report-interval",
+                        po::value<size_t>(&profiler_report_interval)->default_value(0),
+                        "the interval in seconds at which handler latency histograms are "
+                        "logged (0 disables it)")
         ;
+#ifdef ROBERTO_HAVE_TLS
+    config_file_options.add_options()
+        ("tls-port",    po::value<uint16_t>(&tls_port)->default_value(0),
+                        "the port to accept connections wrapped in TLS on, which are then "
+                        "encrypted by the kernel (0 disables it)")
+        ("tls-certificate", po::value<string>(&tls_certificate),
+                        "the PEM file holding the TLS listener's certificate chain")
+        ("tls-private-key", po::value<string>(&tls_private_key),
+                        "the PEM file holding the TLS listener's private key")
+        ;
+#endif
 
     po::variables_map vm;
 
@@ -150,37 +749,325 @@ int main(int argc, char* argv[]) {
     }
     auto logger = Logger::getLogger("r.main");
 
-    shared_ptr<AuthenticationManager> auth_manager;
+    auto context = make_shared<ConnectionContext>();
+    context->coalescing_window = microseconds(coalescing_window);
+    context->relay_scheduling = relay_scheduling;
+    context->optimistic_connect = optimistic_connect;
     try {
-        auth_manager = make_auth_manager(credentials);
+        context->auth_manager = make_auth_manager(credentials);
     }
     catch (const exception& error) {
         LOG4CXX_ERROR(logger, "Error parsing credentials: " << error.what());
         return 1;
     }
-    if (auth_manager) {
-        LOG4CXX_INFO(logger, "Using " << auth_manager->get_credentials_count() << " credentials");
+    if (context->auth_manager) {
+        LOG4CXX_INFO(logger, "Using " << context->auth_manager->get_credentials_count()
+                     << " credentials");
     }
 
     try {
-        tcp::endpoint endpoint(address::from_string(address), port);
+        context->bandwidth_manager = make_bandwidth_manager(bandwidth_limits,
+                                                            bandwidth_user_limits);
+    }
+    catch (const exception& error) {
+        LOG4CXX_ERROR(logger, "Error parsing bandwidth limits: " << error.what());
+        return 1;
+    }
+
+    try {
+        context->traffic_accountant = make_traffic_accountant(context->auth_manager.get(),
+                                                              accounting_snapshot_file,
+                                                              accounting_interval, quota,
+                                                              user_quotas);
+    }
+    catch (const exception& error) {
+        LOG4CXX_ERROR(logger, "Error setting up traffic accounting: " << error.what());
+        return 1;
+    }
+    auto traffic_accountant = context->traffic_accountant;
+
+    if (!traffic_record_file.empty()) {
+        // Truncating the file would destroy the traces an instance that's still draining
+        // connections is writing into it
+        if (!hot_restart_socket.empty()) {
+            traffic_record_file += "." + to_string(getpid());
+        }
+        try {
+            context->traffic_recorder = make_shared<TrafficRecorder>(traffic_record_file,
+                                                                     traffic_record_max_chunks);
+        }
+        catch (const exception& error) {
+            LOG4CXX_ERROR(logger, "Error setting up traffic recording: " << error.what());
+            return 1;
+        }
+    }
+    auto traffic_recorder = context->traffic_recorder;
+
+    try {
+        const auto profiles = parse_socket_profiles(socket_profiles);
+        if (!listener_socket_profile.empty()) {
+            context->listener_socket_options = find_socket_profile(profiles,
+                                                                   listener_socket_profile);
+        }
+        context->egress_socket_profiles = make_egress_socket_profiles(profiles,
+                                                                      egress_socket_profile,
+                                                                      egress_port_profiles);
+    }
+    catch (const exception& error) {
+        LOG4CXX_ERROR(logger, "Error parsing socket profiles: " << error.what());
+        return 1;
+    }
+
+    try {
+        context->unix_egress_paths = parse_unix_egress_paths(unix_egress);
+    }
+    catch (const exception& error) {
+        LOG4CXX_ERROR(logger, "Error parsing unix egress mappings: " << error.what());
+        return 1;
+    }
+
+    if (circuit_breaker_failures > 0) {
+        context->circuit_breaker = make_shared<CircuitBreaker>(
+            circuit_breaker_failures, seconds(circuit_breaker_open_time));
+    }
+
+    if (heavy_hitters > 0) {
+        if (admin_socket.empty()) {
+            LOG4CXX_ERROR(logger, "Tracking heavy hitters requires an admin socket");
+            return 1;
+        }
+        if (heavy_hitter_window == 0) {
+            LOG4CXX_ERROR(logger, "The heavy hitter window can't be empty");
+            return 1;
+        }
+        context->heavy_hitter_tracker = make_shared<HeavyHitterTracker>(
+            heavy_hitters, seconds(heavy_hitter_window));
+    }
+    auto heavy_hitter_tracker = context->heavy_hitter_tracker;
+
+    ConnectionEngine connection_engine;
+    try {
+        connection_engine = parse_engine(engine);
+    }
+    catch (const exception& error) {
+        LOG4CXX_ERROR(logger, "Error parsing engine: " << error.what());
+        return 1;
+    }
+
+    if (coalescing_window > 0 && connection_engine != ConnectionEngine::CALLBACKS) {
+        LOG4CXX_ERROR(logger, "Write coalescing requires the callbacks engine");
+        return 1;
+    }
+
+    if (kernel_redirection) {
+        if (connection_engine != ConnectionEngine::CALLBACKS) {
+            LOG4CXX_ERROR(logger, "Kernel redirection requires the callbacks engine");
+            return 1;
+        }
+        try {
+            context->socket_redirector = make_shared<SocketRedirector>(
+                kernel_redirection_max_connections);
+        }
+        catch (const exception& error) {
+            LOG4CXX_ERROR(logger, "Error setting up kernel redirection: " << error.what());
+            return 1;
+        }
+    }
+
+    vector<UpstreamPool::Parent> upstream_parents;
+    if (!upstream_proxies.empty()) {
+        if (connection_engine != ConnectionEngine::CALLBACKS) {
+            LOG4CXX_ERROR(logger, "Parent proxies require the callbacks engine");
+            return 1;
+        }
+        try {
+            upstream_parents = parse_upstream_proxies(upstream_proxies);
+        }
+        catch (const exception& error) {
+            LOG4CXX_ERROR(logger, "Error parsing parent proxies: " << error.what());
+            return 1;
+        }
+    }
+
+    vector<int> thread_cpus;
+    try {
+        thread_cpus = parse_cpu_list(cpu_affinity);
+        if (!thread_cpus.empty() && thread_cpus.size() < num_threads) {
+            throw runtime_error("There must be at least one CPU per thread");
+        }
+        if (incoming_cpu_steering && thread_cpus.empty()) {
+            throw runtime_error("Steering connections to CPUs requires pinning threads to them");
+        }
+    }
+    catch (const exception& error) {
+        LOG4CXX_ERROR(logger, "Error parsing CPU affinity: " << error.what());
+        return 1;
+    }
+    thread_cpus.resize(min(thread_cpus.size(), num_threads));
 
-        io_service service;
-        Server server(service, endpoint, move(auth_manager));
-        server.start();
+    auto loop_profiler = make_loop_profiler(stall_threshold, profiler_report_interval);
 
-        signal_handler_functor = [&] {
-            service.stop();
+    try {
+        Listeners listeners;
+        listeners.endpoint = tcp::endpoint(address::from_string(address), port);
+        listeners.unix_path = unix_listen_path;
+#ifdef ROBERTO_HAVE_TLS
+        if (tls_port != 0) {
+            listeners.tls_endpoint = tcp::endpoint(listeners.endpoint.address(), tls_port);
+            listeners.tls_context = make_shared<TlsContext>(tls_certificate, tls_private_key);
+        }
+#endif
+
+        // Threads share a single event loop unless each of them serves its own connections
+        vector<unique_ptr<io_service>> services(incoming_cpu_steering ? num_threads : 1);
+        for (auto& service : services) {
+            service.reset(new io_service());
+        }
+        auto stop_services = [&] {
+            for (auto& service : services) {
+                service->stop();
+            }
         };
+        unique_ptr<HotRestarter> hot_restarter;
+        if (!hot_restart_socket.empty()) {
+            hot_restarter.reset(new HotRestarter(*services[0], hot_restart_socket));
+        }
+        shared_ptr<UpstreamPool> upstream_pool;
+        if (!upstream_parents.empty()) {
+            // Probes run on the first event loop, but parents are chosen from every thread
+            upstream_pool = make_shared<UpstreamPool>(*services[0], move(upstream_parents),
+                                                      upstream_failure_threshold,
+                                                      seconds(upstream_ejection_time),
+                                                      seconds(upstream_handshake_timeout));
+            context->upstream_pool = upstream_pool;
+        }
+        unique_ptr<AdminServer> admin_server;
+        if (!admin_socket.empty()) {
+            admin_server.reset(new AdminServer(*services[0], admin_socket));
+            if (heavy_hitter_tracker) {
+                admin_server->add_command("top-destinations", [&] {
+                    return heavy_hitter_tracker->format_report(HeavyHitterTracker::DESTINATION);
+                });
+                admin_server->add_command("top-clients", [&] {
+                    return heavy_hitter_tracker->format_report(HeavyHitterTracker::CLIENT);
+                });
+            }
+            if (upstream_pool) {
+                admin_server->add_command("upstream-proxies", [&] {
+                    return upstream_pool->format_report();
+                });
+            }
+        }
+        vector<shared_ptr<WarmConnectionPool>> warm_pools;
+        if (warm_pool_min_requests > 0) {
+            for (auto& service : services) {
+                warm_pools.push_back(make_shared<WarmConnectionPool>(
+                    *service, context->egress_socket_profiles, warm_pool_min_requests,
+                    warm_pool_max_idle, seconds(warm_pool_idle_timeout)));
+            }
+        }
+        const vector<int> steering_cpus = incoming_cpu_steering ? thread_cpus : vector<int>();
+        auto servers = make_servers(services, steering_cpus, listeners, hot_restarter.get(),
+                                    move(context), warm_pools, connection_engine);
+        vector<int> listening_sockets;
+        for (auto& server : servers) {
+            server->start();
+            listening_sockets.push_back(server->get_listening_socket());
+        }
+        if (traffic_accountant) {
+            traffic_accountant->start();
+        }
+        if (traffic_recorder) {
+            traffic_recorder->start();
+        }
+        if (admin_server) {
+            admin_server->start();
+        }
+        for (auto& warm_pool : warm_pools) {
+            warm_pool->start();
+        }
+        if (upstream_pool) {
+            upstream_pool->start();
+        }
+        if (loop_profiler) {
+            loop_profiler->start();
+        }
+
+        // Once a new instance takes over, the threads finish running as soon as every
+        // connection is closed. The drain thread stops them if that takes too long
+        promise<void> drained;
+        auto drained_future = drained.get_future();
+        thread drain_thread;
+        if (hot_restarter) {
+            // We're accepting connections already, so the previous instance can stop
+            hot_restarter->complete_takeover();
+            hot_restarter->listen(listening_sockets, [&] {
+                LOG4CXX_INFO(logger, "Draining connections for at most " << drain_timeout
+                             << " seconds");
+                for (auto& server : servers) {
+                    server->stop_accepting();
+                }
+                // The new instance writes the accounting snapshot from now on
+                if (traffic_accountant) {
+                    traffic_accountant->hand_over();
+                }
+                if (admin_server) {
+                    admin_server->stop();
+                }
+                for (auto& warm_pool : warm_pools) {
+                    warm_pool->stop();
+                }
+                if (upstream_pool) {
+                    upstream_pool->stop();
+                }
+                drain_thread = thread([&] {
+                    if (drained_future.wait_for(seconds(drain_timeout)) ==
+                        future_status::timeout) {
+                        LOG4CXX_WARN(logger, "Closing connections that are still open");
+                        stop_services();
+                    }
+                });
+            });
+        }
+
+        signal_handler_functor = stop_services;
         signal(SIGINT, &signal_handler);
 
         vector<thread> threads;
         for (size_t i = 0; i < num_threads; ++i) {
-            threads.emplace_back([&] { service.run(); });
+            threads.emplace_back([&, i] {
+                // Pinning happens before running anything, so every pooled buffer and
+                // object this thread allocates is local to its node
+                if (!thread_cpus.empty()) {
+                    try {
+                        pin_current_thread(thread_cpus[i]);
+                        LOG4CXX_INFO(logger, "Pinned thread " << i << " to CPU "
+                                     << thread_cpus[i] << " on NUMA node "
+                                     << get_numa_node(thread_cpus[i]));
+                    }
+                    catch (const exception& error) {
+                        LOG4CXX_WARN(logger, error.what());
+                    }
+                }
+                services[i % services.size()]->run();
+            });
         }
         for (auto& th : threads) {
             th.join();
         }
+        drained.set_value();
+        if (drain_thread.joinable()) {
+            drain_thread.join();
+        }
+        if (loop_profiler) {
+            loop_profiler->stop();
+        }
+        if (traffic_accountant) {
+            traffic_accountant->stop();
+        }
+        if (traffic_recorder) {
+            traffic_recorder->stop();
+        }
     }
     catch (const exception& error) {
         LOG4CXX_ERROR(logger, "Error running server: " << error.what());
@@ -0,0 +1,88 @@
+#include "relay_scheduler.h"
+#include <memory>
+#include <boost/asio/io_service.hpp>
+#include "loop_profiler.h"
+
+using std::bind;
+using std::move;
+using std::mutex;
+using std::vector;
+using std::lock_guard;
+using std::unique_ptr;
+
+using boost::asio::io_service;
+
+namespace roberto {
+
+// The weight of the latest chunk in the average chunk size is 1 / 2^AVERAGE_SHIFT
+static const size_t AVERAGE_SHIFT = 3;
+
+// Flow
+
+bool RelayScheduler::Flow::record(const Policy& policy, size_t byte_count) {
+    if (policy.interactive_chunk_size > 0) {
+        average_chunk_size_ -= average_chunk_size_ >> AVERAGE_SHIFT;
+        average_chunk_size_ += byte_count >> AVERAGE_SHIFT;
+        if (average_chunk_size_ < policy.interactive_chunk_size) {
+            turn_bytes_ = 0;
+            turn_operations_ = 0;
+            return false;
+        }
+    }
+    turn_bytes_ += byte_count;
+    ++turn_operations_;
+    if ((policy.turn_bytes > 0 && turn_bytes_ >= policy.turn_bytes) ||
+        (policy.turn_operations > 0 && turn_operations_ >= policy.turn_operations)) {
+        turn_bytes_ = 0;
+        turn_operations_ = 0;
+        return true;
+    }
+    return false;
+}
+
+void RelayScheduler::Flow::reset() {
+    average_chunk_size_ = 0;
+    turn_bytes_ = 0;
+    turn_operations_ = 0;
+}
+
+// RelayScheduler
+
+RelayScheduler& RelayScheduler::for_current_thread(io_service& io_service) {
+    static thread_local unique_ptr<RelayScheduler> scheduler;
+    if (!scheduler) {
+        scheduler.reset(new RelayScheduler(io_service));
+    }
+    return *scheduler;
+}
+
+RelayScheduler::RelayScheduler(io_service& io_service)
+: io_service_(io_service) {
+
+}
+
+void RelayScheduler::wait_for_turn(Callback callback) {
+    lock_guard<mutex> _(pending_mutex_);
+    pending_.push_back(move(callback));
+    // Posting puts the turn behind every handler that's ready to run by now
+    if (!turn_scheduled_) {
+        turn_scheduled_ = true;
+        io_service_.post(bind(&RelayScheduler::run_turn, this));
+    }
+}
+
+void RelayScheduler::run_turn() {
+    LoopProfiler::ScopedTimer timer(LoopProfiler::RELAY_TURN);
+    vector<Callback> ready_callbacks;
+    {
+        lock_guard<mutex> _(pending_mutex_);
+        ready_callbacks.swap(pending_);
+        turn_scheduled_ = false;
+    }
+    // Relays yielding again while these run wait for the next turn
+    for (const Callback& callback : ready_callbacks) {
+        callback();
+    }
+}
+
+} // roberto
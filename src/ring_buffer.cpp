@@ -0,0 +1,83 @@
+#include "ring_buffer.h"
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+
+using std::min;
+
+using boost::asio::const_buffer;
+using boost::asio::mutable_buffer;
+
+namespace roberto {
+
+RingBuffer::RingBuffer(size_t capacity)
+: storage_(capacity) {
+
+}
+
+RingBuffer::MutableBuffers RingBuffer::get_free_buffers() {
+    const size_t end = (start_ + size_) % storage_.size();
+    const size_t free_space = storage_.size() - size_;
+    // The free space either runs until the end of the storage and then wraps around to the
+    // start of the data, or it's fully contained between the end and the start of the data
+    const size_t first_size = min(free_space, storage_.size() - end);
+    return MutableBuffers{{
+        mutable_buffer(storage_.data() + end, first_size),
+        mutable_buffer(storage_.data(), free_space - first_size)
+    }};
+}
+
+void RingBuffer::commit(size_t byte_count) {
+    assert(byte_count <= storage_.size() - size_);
+    size_ += byte_count;
+}
+
+RingBuffer::ConstBuffers RingBuffer::get_data_buffers() const {
+    const size_t first_size = min(size_, storage_.size() - start_);
+    return ConstBuffers{{
+        const_buffer(storage_.data() + start_, first_size),
+        const_buffer(storage_.data(), size_ - first_size)
+    }};
+}
+
+void RingBuffer::consume(size_t byte_count) {
+    assert(byte_count <= size_);
+    // Note that the start can't be moved back when this becomes empty, as there could be a
+    // read in flight into the free space
+    start_ = (start_ + byte_count) % storage_.size();
+    size_ -= byte_count;
+}
+
+size_t RingBuffer::append(const uint8_t* data, size_t byte_count) {
+    size_t appended = 0;
+    for (const mutable_buffer& buffer : get_free_buffers()) {
+        const size_t chunk_size = min(boost::asio::buffer_size(buffer), byte_count - appended);
+        memcpy(boost::asio::buffer_cast<uint8_t*>(buffer), data + appended, chunk_size);
+        appended += chunk_size;
+    }
+    commit(appended);
+    return appended;
+}
+
+void RingBuffer::clear() {
+    start_ = 0;
+    size_ = 0;
+}
+
+size_t RingBuffer::size() const {
+    return size_;
+}
+
+size_t RingBuffer::capacity() const {
+    return storage_.size();
+}
+
+bool RingBuffer::empty() const {
+    return size_ == 0;
+}
+
+bool RingBuffer::full() const {
+    return size_ == storage_.size();
+}
+
+} // roberto
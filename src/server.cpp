@@ -1,15 +1,22 @@
 #include "server.h"
 #include <functional>
+#include <unistd.h>
+#include <sys/un.h>
+#include <sys/socket.h>
 #include <log4cxx/logger.h>
 #include <boost/asio/io_service.hpp>
 #include "client_connection.h"
-#include "authentication_manager.h"
+#include "coroutine_connection.h"
+#include "loop_profiler.h"
+#include "object_pool.h"
+#include "tls_context.h"
 
 using std::shared_ptr;
+using std::unique_ptr;
 using std::make_shared;
 using std::bind;
+using std::placeholders::_1;
 
-using boost::asio::ip::tcp;
 using boost::asio::io_service;
 
 using boost::system::error_code;
@@ -22,26 +29,117 @@ namespace roberto {
 
 static const LoggerPtr logger = Logger::getLogger("r.server");
 
-Server::Server(io_service& io_service, const tcp::endpoint& endpoint,
-               shared_ptr<AuthenticationManager> auth_manager)
-: io_service_(io_service), resolver_(io_service_), acceptor_(io_service_, endpoint),
-  auth_manager_(move(auth_manager)) {
+Server::Server(io_service& io_service, const StreamEndpoint& endpoint,
+               shared_ptr<const ConnectionContext> context, ConnectionEngine engine)
+: io_service_(io_service), resolver_(io_service_), acceptor_(io_service_),
+  accept_strand_(io_service_), context_(move(context)), engine_(engine),
+  is_unix_(is_unix_endpoint(endpoint)) {
+    acceptor_.open(endpoint.protocol());
+    if (is_unix_) {
+        // A leftover socket file, e.g. after a crash, would make binding fail
+        unlink(reinterpret_cast<const sockaddr_un*>(endpoint.data())->sun_path);
+    }
+    else {
+        acceptor_.set_option(StreamAcceptor::reuse_address(true));
+        // Some options only take effect if they're set before listening
+        context_->listener_socket_options.apply_to_listener(acceptor_.native_handle());
+    }
+    acceptor_.bind(endpoint);
+    acceptor_.listen();
+}
+
+Server::Server(io_service& io_service, int listening_socket,
+               shared_ptr<const ConnectionContext> context, ConnectionEngine engine)
+: io_service_(io_service), resolver_(io_service_), acceptor_(io_service_),
+  accept_strand_(io_service_), context_(move(context)), engine_(engine) {
+    const int family = get_socket_endpoint(listening_socket).data()->sa_family;
+    is_unix_ = family == AF_UNIX;
+    const int protocol = is_unix_ ? 0 : static_cast<int>(IPPROTO_TCP);
+    acceptor_.assign(StreamProtocol(family, protocol), listening_socket);
+    if (!is_unix_) {
+        context_->listener_socket_options.apply_to_listener(listening_socket);
+    }
+}
+
+// Defined here as CoroutineConnection is incomplete in our header
+Server::~Server() {
+
+}
 
+void Server::enable_tls(shared_ptr<const TlsContext> tls_context) {
+    tls_context_ = move(tls_context);
 }
 
 void Server::start() {
-    LOG4CXX_INFO(logger, "Listening for connections on " << acceptor_.local_endpoint());
+    LOG4CXX_INFO(logger, "Listening for connections on "
+                 << format_endpoint(acceptor_.local_endpoint()));
     start_accept();
 }
 
+void Server::stop_accepting() {
+    // Accept handlers run within the strand, so this can't race with them
+    accept_strand_.dispatch([this] {
+        accepting_ = false;
+        error_code error;
+        acceptor_.close(error);
+    });
+}
+
+StreamEndpoint Server::get_local_endpoint() const {
+    return acceptor_.local_endpoint();
+}
+
+int Server::get_listening_socket() {
+    return acceptor_.native_handle();
+}
+
 void Server::start_accept() {
-    using std::placeholders::_1;
-    auto connection = make_shared<ClientConnection>(io_service_, resolver_, auth_manager_);
+    if (!accepting_) {
+        return;
+    }
+    if (engine_ == ConnectionEngine::COROUTINES) {
+        // Coroutine connections aren't reference counted, so we own it until it's accepted
+        pending_coroutine_connection_.reset(new CoroutineConnection(io_service_, resolver_,
+                                                                    context_));
+        auto callback = bind(&Server::on_coroutine_accept, this, _1);
+        acceptor_.async_accept(pending_coroutine_connection_->get_socket(),
+                               accept_strand_.wrap(move(callback)));
+        return;
+    }
+    auto connection = ObjectPool<ClientConnection>::acquire(io_service_, resolver_, context_);
     auto callback = bind(&Server::on_accept, this, connection, _1);
-    acceptor_.async_accept(connection->get_socket(), move(callback));
+    acceptor_.async_accept(connection->get_socket(), accept_strand_.wrap(move(callback)));
 }
 
 void Server::on_accept(shared_ptr<ClientConnection> connection, const error_code& error) {
+    LoopProfiler::ScopedTimer timer(LoopProfiler::SERVER_ACCEPT);
+    if (error) {
+        if (error != boost::asio::error::operation_aborted) {
+            LOG4CXX_ERROR(logger, "Error while accepting socket: " << error.message());
+        }
+    }
+    else {
+        try {
+            apply_socket_options(connection->get_socket().native_handle());
+            if (!tls_context_) {
+                connection->start();
+            }
+#ifdef ROBERTO_HAVE_TLS
+            else {
+                auto callback = bind(&Server::on_tls_handshake, this, connection, _1);
+                tls_context_->handshake(connection->get_socket(), move(callback));
+            }
+#endif
+        }
+        catch (const system_error& error) {
+            LOG4CXX_DEBUG(logger, "Error while starting connection: " << error.what());
+        }
+        start_accept();
+    }
+}
+
+void Server::on_coroutine_accept(const error_code& error) {
+    LoopProfiler::ScopedTimer timer(LoopProfiler::SERVER_ACCEPT);
     if (error) {
         if (error != boost::asio::error::operation_aborted) {
             LOG4CXX_ERROR(logger, "Error while accepting socket: " << error.message());
@@ -49,7 +147,20 @@ void Server::on_accept(shared_ptr<ClientConnection> connection, const error_code
     }
     else {
         try {
-            connection->start();
+            apply_socket_options(pending_coroutine_connection_->get_socket().native_handle());
+            if (!tls_context_) {
+                CoroutineConnection::start(move(pending_coroutine_connection_));
+            }
+#ifdef ROBERTO_HAVE_TLS
+            else {
+                // The handshake callback owns the connection until it's started
+                auto connection = make_shared<unique_ptr<CoroutineConnection>>(
+                    move(pending_coroutine_connection_));
+                auto& socket = (*connection)->get_socket();
+                auto callback = bind(&Server::on_coroutine_tls_handshake, this, connection, _1);
+                tls_context_->handshake(socket, move(callback));
+            }
+#endif
         }
         catch (const system_error& error) {
             LOG4CXX_DEBUG(logger, "Error while starting connection: " << error.what());
@@ -58,4 +169,38 @@ void Server::on_accept(shared_ptr<ClientConnection> connection, const error_code
     }
 }
 
+void Server::on_tls_handshake(shared_ptr<ClientConnection> connection,
+                              const error_code& error) {
+    if (error) {
+        LOG4CXX_DEBUG(logger, "TLS handshake failed: " << error.message());
+        return;
+    }
+    try {
+        connection->start();
+    }
+    catch (const system_error& error) {
+        LOG4CXX_DEBUG(logger, "Error while starting connection: " << error.what());
+    }
+}
+
+void Server::on_coroutine_tls_handshake(shared_ptr<unique_ptr<CoroutineConnection>> connection,
+                                        const error_code& error) {
+    if (error) {
+        LOG4CXX_DEBUG(logger, "TLS handshake failed: " << error.message());
+        return;
+    }
+    try {
+        CoroutineConnection::start(move(*connection));
+    }
+    catch (const system_error& error) {
+        LOG4CXX_DEBUG(logger, "Error while starting connection: " << error.what());
+    }
+}
+
+void Server::apply_socket_options(int socket) {
+    if (!is_unix_) {
+        context_->listener_socket_options.apply_to_connection(socket);
+    }
+}
+
 } // roberto
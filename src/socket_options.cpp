@@ -0,0 +1,109 @@
+#include "socket_options.h"
+#include <cerrno>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <log4cxx/logger.h>
+
+using std::move;
+
+using boost::optional;
+
+using log4cxx::Logger;
+using log4cxx::LoggerPtr;
+
+namespace roberto {
+
+static const LoggerPtr logger = Logger::getLogger("r.socket_options");
+
+// Failing to tune a socket is not a reason to drop the connection
+static void set_option(int socket, int level, int name, const char* option_name, int value) {
+    if (setsockopt(socket, level, name, &value, sizeof(value)) != 0) {
+        LOG4CXX_WARN(logger, "Failed to set " << option_name << " to " << value << ": "
+                     << strerror(errno));
+    }
+}
+
+static void set_option(int socket, int level, int name, const char* option_name,
+                       const optional<int>& value) {
+    if (value) {
+        set_option(socket, level, name, option_name, *value);
+    }
+}
+
+// SocketOptions
+
+void SocketOptions::apply_to_listener(int socket) const {
+    set_option(socket, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", receive_buffer_size);
+    set_option(socket, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", send_buffer_size);
+    set_option(socket, IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN", fast_open);
+    set_option(socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, "TCP_DEFER_ACCEPT", defer_accept_seconds);
+    if (reuse_port) {
+        set_option(socket, SOL_SOCKET, SO_REUSEPORT, "SO_REUSEPORT", *reuse_port ? 1 : 0);
+    }
+#ifdef SO_INCOMING_CPU
+    // Within a reuseport group, the kernel prefers the listener whose CPU matches the one
+    // processing the incoming connection
+    set_option(socket, SOL_SOCKET, SO_INCOMING_CPU, "SO_INCOMING_CPU", incoming_cpu);
+#endif
+}
+
+void SocketOptions::apply_before_connect(int socket) const {
+    set_option(socket, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", receive_buffer_size);
+    set_option(socket, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", send_buffer_size);
+}
+
+void SocketOptions::enable_fast_open_connect(int socket) const {
+#ifdef TCP_FASTOPEN_CONNECT
+    // The SYN is sent along with the first write, so connecting completes right away
+    if (fast_open && *fast_open > 0) {
+        set_option(socket, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, "TCP_FASTOPEN_CONNECT", 1);
+    }
+#endif
+}
+
+void SocketOptions::apply_to_connection(int socket) const {
+    if (no_delay) {
+        set_option(socket, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", *no_delay ? 1 : 0);
+    }
+#ifdef TCP_NOTSENT_LOWAT
+    set_option(socket, IPPROTO_TCP, TCP_NOTSENT_LOWAT, "TCP_NOTSENT_LOWAT",
+               not_sent_low_watermark);
+#endif
+    if (keepalive_idle_seconds || keepalive_interval_seconds || keepalive_count) {
+        set_option(socket, SOL_SOCKET, SO_KEEPALIVE, "SO_KEEPALIVE", 1);
+        set_option(socket, IPPROTO_TCP, TCP_KEEPIDLE, "TCP_KEEPIDLE", keepalive_idle_seconds);
+        set_option(socket, IPPROTO_TCP, TCP_KEEPINTVL, "TCP_KEEPINTVL",
+                   keepalive_interval_seconds);
+        set_option(socket, IPPROTO_TCP, TCP_KEEPCNT, "TCP_KEEPCNT", keepalive_count);
+    }
+#ifdef TCP_USER_TIMEOUT
+    set_option(socket, IPPROTO_TCP, TCP_USER_TIMEOUT, "TCP_USER_TIMEOUT",
+               user_timeout_milliseconds);
+#endif
+}
+
+// EgressSocketProfiles
+
+EgressSocketProfiles::EgressSocketProfiles(SocketOptions default_options)
+: default_options_(move(default_options)) {
+
+}
+
+void EgressSocketProfiles::add_port_range(uint16_t first_port, uint16_t last_port,
+                                          SocketOptions options) {
+    port_ranges_.push_back(PortRange{first_port, last_port, move(options)});
+}
+
+const SocketOptions& EgressSocketProfiles::get_options(uint16_t port) const {
+    // There's only a handful of ranges, a linear search is as fast as anything else
+    for (const PortRange& range : port_ranges_) {
+        if (port >= range.first_port && port <= range.last_port) {
+            return range.options;
+        }
+    }
+    return default_options_;
+}
+
+} // roberto
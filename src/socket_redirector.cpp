@@ -0,0 +1,355 @@
+#include "socket_redirector.h"
+#include <cerrno>
+#include <cstring>
+#include <cstddef>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <linux/bpf.h>
+#include <linux/sockios.h>
+// Unlike glibc's, this one has the byte counters in tcp_info
+#include <linux/tcp.h>
+#include <log4cxx/logger.h>
+#include <boost/system/system_error.hpp>
+
+using boost::system::error_code;
+using boost::system::system_error;
+using boost::system::system_category;
+
+using log4cxx::Logger;
+using log4cxx::LoggerPtr;
+
+namespace roberto {
+
+static const LoggerPtr logger = Logger::getLogger("r.socket_redirector");
+
+static const char PROGRAM_LICENSE[] = "Dual BSD/GPL";
+static const size_t VERIFIER_LOG_SIZE = 4096;
+
+// The verdict program keeps the key on its stack, right below the frame pointer
+static const int16_t KEY_STACK_OFFSET = -16;
+
+static int16_t get_stack_offset(size_t key_field_offset) {
+    return KEY_STACK_OFFSET + static_cast<int16_t>(key_field_offset);
+}
+
+static system_error make_system_error(const char* what) {
+    return system_error(error_code(errno, system_category()), what);
+}
+
+static int bpf(int command, bpf_attr& attributes) {
+    return syscall(__NR_bpf, command, &attributes, sizeof(attributes));
+}
+
+static uint64_t to_attribute(const void* pointer) {
+    return reinterpret_cast<uintptr_t>(pointer);
+}
+
+// Helpers to assemble BPF instructions, named after the kernel's own macros
+
+static bpf_insn make_instruction(uint8_t code, uint8_t destination, uint8_t source,
+                                 int16_t offset, int32_t immediate) {
+    bpf_insn output = {};
+    output.code = code;
+    output.dst_reg = destination;
+    output.src_reg = source;
+    output.off = offset;
+    output.imm = immediate;
+    return output;
+}
+
+static bpf_insn load_word(uint8_t destination, uint8_t source, int16_t offset) {
+    return make_instruction(BPF_LDX | BPF_MEM | BPF_W, destination, source, offset, 0);
+}
+
+static bpf_insn store_word(uint8_t destination, uint8_t source, int16_t offset) {
+    return make_instruction(BPF_STX | BPF_MEM | BPF_W, destination, source, offset, 0);
+}
+
+static bpf_insn move_register(uint8_t destination, uint8_t source) {
+    return make_instruction(BPF_ALU64 | BPF_MOV | BPF_X, destination, source, 0, 0);
+}
+
+static bpf_insn move_immediate(uint8_t destination, int32_t immediate) {
+    return make_instruction(BPF_ALU64 | BPF_MOV | BPF_K, destination, 0, 0, immediate);
+}
+
+static bpf_insn add_immediate(uint8_t destination, int32_t immediate) {
+    return make_instruction(BPF_ALU64 | BPF_ADD | BPF_K, destination, 0, 0, immediate);
+}
+
+static bpf_insn load_map(uint8_t destination, int map) {
+    return make_instruction(BPF_LD | BPF_DW | BPF_IMM, destination, BPF_PSEUDO_MAP_FD, 0, map);
+}
+
+static bpf_insn jump_if_not_equal(uint8_t destination, int32_t immediate, int16_t offset) {
+    return make_instruction(BPF_JMP | BPF_JNE | BPF_K, destination, 0, offset, immediate);
+}
+
+static bpf_insn call(int32_t function) {
+    return make_instruction(BPF_JMP | BPF_CALL, 0, 0, 0, function);
+}
+
+static bpf_insn exit_program() {
+    return make_instruction(BPF_JMP | BPF_EXIT, 0, 0, 0, 0);
+}
+
+SocketRedirector::SocketRedirector(size_t max_pairs) {
+    bpf_attr map_attributes = {};
+    map_attributes.map_type = BPF_MAP_TYPE_SOCKHASH;
+    map_attributes.key_size = sizeof(Key);
+    map_attributes.value_size = sizeof(uint32_t);
+    map_attributes.max_entries = max_pairs * 2;
+    map_ = bpf(BPF_MAP_CREATE, map_attributes);
+    if (map_ == -1) {
+        throw make_system_error("Failed to create sockhash");
+    }
+    try {
+        bpf_attr enabled_map_attributes = {};
+        enabled_map_attributes.map_type = BPF_MAP_TYPE_HASH;
+        enabled_map_attributes.key_size = sizeof(Key);
+        enabled_map_attributes.value_size = sizeof(uint32_t);
+        enabled_map_attributes.max_entries = max_pairs * 2;
+        enabled_map_ = bpf(BPF_MAP_CREATE, enabled_map_attributes);
+        if (enabled_map_ == -1) {
+            throw make_system_error("Failed to create enabled keys map");
+        }
+
+        // Every message is as long as whatever was received
+        const bpf_insn parser[] = {
+            load_word(BPF_REG_0, BPF_REG_1, offsetof(__sk_buff, len)),
+            exit_program()
+        };
+        parser_program_ = load_program(parser, sizeof(parser) / sizeof(parser[0]));
+
+        // Looks up the socket paired to the one that received the data, and redirects the
+        // data into it. If the key isn't enabled yet or there's no pair, the data is passed up
+        // to userspace instead
+        const bpf_insn verdict[] = {
+            move_register(BPF_REG_6, BPF_REG_1),
+            load_word(BPF_REG_2, BPF_REG_6, offsetof(__sk_buff, remote_ip4)),
+            store_word(BPF_REG_10, BPF_REG_2, get_stack_offset(offsetof(Key, remote_ip4))),
+            load_word(BPF_REG_2, BPF_REG_6, offsetof(__sk_buff, local_ip4)),
+            store_word(BPF_REG_10, BPF_REG_2, get_stack_offset(offsetof(Key, local_ip4))),
+            load_word(BPF_REG_2, BPF_REG_6, offsetof(__sk_buff, remote_port)),
+            store_word(BPF_REG_10, BPF_REG_2, get_stack_offset(offsetof(Key, remote_port))),
+            load_word(BPF_REG_2, BPF_REG_6, offsetof(__sk_buff, local_port)),
+            store_word(BPF_REG_10, BPF_REG_2, get_stack_offset(offsetof(Key, local_port))),
+            // Loading a map takes two instructions, holding the two halves of the immediate
+            load_map(BPF_REG_1, enabled_map_),
+            make_instruction(0, 0, 0, 0, 0),
+            move_register(BPF_REG_2, BPF_REG_10),
+            add_immediate(BPF_REG_2, KEY_STACK_OFFSET),
+            call(BPF_FUNC_map_lookup_elem),
+            jump_if_not_equal(BPF_REG_0, 0, 2),
+            move_immediate(BPF_REG_0, SK_PASS),
+            exit_program(),
+            move_register(BPF_REG_1, BPF_REG_6),
+            load_map(BPF_REG_2, map_),
+            make_instruction(0, 0, 0, 0, 0),
+            move_register(BPF_REG_3, BPF_REG_10),
+            add_immediate(BPF_REG_3, KEY_STACK_OFFSET),
+            move_immediate(BPF_REG_4, 0),
+            call(BPF_FUNC_sk_redirect_hash),
+            jump_if_not_equal(BPF_REG_0, SK_DROP, 1),
+            move_immediate(BPF_REG_0, SK_PASS),
+            exit_program()
+        };
+        verdict_program_ = load_program(verdict, sizeof(verdict) / sizeof(verdict[0]));
+
+        attach_program(parser_program_, BPF_SK_SKB_STREAM_PARSER);
+        attach_program(verdict_program_, BPF_SK_SKB_STREAM_VERDICT);
+    }
+    catch (...) {
+        close_descriptors();
+        throw;
+    }
+}
+
+SocketRedirector::~SocketRedirector() {
+    close_descriptors();
+}
+
+void SocketRedirector::close_descriptors() {
+    for (int* descriptor : { &verdict_program_, &parser_program_, &enabled_map_, &map_ }) {
+        if (*descriptor != -1) {
+            close(*descriptor);
+            *descriptor = -1;
+        }
+    }
+}
+
+SocketRedirector::Status SocketRedirector::redirect(int first_socket, int second_socket,
+                                                    Pair& pair) {
+    if (!make_key(first_socket, pair.first_key) || !make_key(second_socket, pair.second_key) ||
+        !can_redirect(first_socket) || !can_redirect(second_socket)) {
+        return Status::UNSUPPORTED;
+    }
+    // Nobody reads from the sockets, so the bytes they received that aren't queued in them
+    // only go up when data is redirected. The received count is taken first, so that data
+    // arriving in between can only make this look lower
+    const int sockets[] = { first_socket, second_socket };
+    uint64_t unqueued_bytes[2];
+    for (size_t i = 0; i < 2; ++i) {
+        const uint64_t received = get_byte_counts(sockets[i]).received;
+        unqueued_bytes[i] = received - get_queued_bytes(sockets[i]);
+    }
+    // Whatever the first socket receives goes out through the second one and vice versa. The
+    // keys are enabled last, so neither socket redirects anything until both are in the map
+    if (!insert(pair.first_key, second_socket) || !insert(pair.second_key, first_socket) ||
+        !enable(pair.first_key) || !enable(pair.second_key)) {
+        remove(pair);
+        return Status::UNSUPPORTED;
+    }
+    if (get_queued_bytes(first_socket) == 0 && get_queued_bytes(second_socket) == 0) {
+        return Status::REDIRECTED;
+    }
+    // Data was passed up before the keys were enabled. It can still be relayed in userspace
+    // as long as nothing that came after it was redirected already
+    remove(pair);
+    for (size_t i = 0; i < 2; ++i) {
+        const uint64_t queued = get_queued_bytes(sockets[i]);
+        const uint64_t received = get_byte_counts(sockets[i]).received;
+        if (queued > 0 && received - queued != unqueued_bytes[i]) {
+            return Status::REORDERED;
+        }
+    }
+    return Status::UNSUPPORTED;
+}
+
+void SocketRedirector::release(const Pair& pair) {
+    remove(pair);
+}
+
+bool SocketRedirector::make_key(int socket, Key& key) {
+    sockaddr_in local_address;
+    sockaddr_in remote_address;
+    socklen_t local_length = sizeof(local_address);
+    socklen_t remote_length = sizeof(remote_address);
+    if (getsockname(socket, reinterpret_cast<sockaddr*>(&local_address), &local_length) != 0 ||
+        getpeername(socket, reinterpret_cast<sockaddr*>(&remote_address), &remote_length) != 0 ||
+        local_address.sin_family != AF_INET || remote_address.sin_family != AF_INET) {
+        return false;
+    }
+    key.remote_ip4 = remote_address.sin_addr.s_addr;
+    key.local_ip4 = local_address.sin_addr.s_addr;
+    // The kernel exposes the remote port in network byte order in the upper half of the word
+    // on little endian machines, and the local port in host byte order
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+    key.remote_port = static_cast<uint32_t>(remote_address.sin_port) << 16;
+#else
+    key.remote_port = remote_address.sin_port;
+#endif
+    key.local_port = ntohs(local_address.sin_port);
+    return true;
+}
+
+bool SocketRedirector::can_redirect(int socket) {
+    // Sockets using kernel TLS can't have their records spliced into another socket
+    char ulp[16] = {};
+    socklen_t ulp_length = sizeof(ulp);
+    if (getsockopt(socket, IPPROTO_TCP, TCP_ULP, ulp, &ulp_length) != 0 || ulp[0] != '\0') {
+        return false;
+    }
+    // Data that's already queued isn't seen by the verdict program until more data arrives,
+    // so it would get stuck
+    int queued_bytes = 0;
+    return ioctl(socket, SIOCINQ, &queued_bytes) == 0 && queued_bytes == 0;
+}
+
+size_t SocketRedirector::get_queued_bytes(int socket) {
+    int queued_bytes = 0;
+    ioctl(socket, SIOCINQ, &queued_bytes);
+    return queued_bytes;
+}
+
+SocketRedirector::ByteCounts SocketRedirector::get_byte_counts(int socket) {
+    tcp_info info = {};
+    socklen_t info_length = sizeof(info);
+    int unsent_bytes = 0;
+    ByteCounts output = {};
+    if (getsockopt(socket, IPPROTO_TCP, TCP_INFO, &info, &info_length) == 0 &&
+        ioctl(socket, SIOCOUTQ, &unsent_bytes) == 0) {
+        output.received = info.tcpi_bytes_received;
+        // Anything that was redirected into the socket either was acked or is still queued
+        output.sent = info.tcpi_bytes_acked + unsent_bytes;
+    }
+    return output;
+}
+
+int SocketRedirector::load_program(const void* instructions, size_t instruction_count) {
+    char verifier_log[VERIFIER_LOG_SIZE] = {};
+    bpf_attr attributes = {};
+    attributes.prog_type = BPF_PROG_TYPE_SK_SKB;
+    attributes.insns = to_attribute(instructions);
+    attributes.insn_cnt = instruction_count;
+    attributes.license = to_attribute(PROGRAM_LICENSE);
+    attributes.log_buf = to_attribute(verifier_log);
+    attributes.log_size = sizeof(verifier_log);
+    attributes.log_level = 1;
+    const int program = bpf(BPF_PROG_LOAD, attributes);
+    if (program == -1) {
+        const system_error error = make_system_error("Failed to load BPF program");
+        LOG4CXX_ERROR(logger, "BPF verifier output: " << verifier_log);
+        throw error;
+    }
+    return program;
+}
+
+void SocketRedirector::attach_program(int program, int attach_type) {
+    bpf_attr attributes = {};
+    attributes.target_fd = map_;
+    attributes.attach_bpf_fd = program;
+    attributes.attach_type = attach_type;
+    if (bpf(BPF_PROG_ATTACH, attributes) != 0) {
+        throw make_system_error("Failed to attach BPF program");
+    }
+}
+
+bool SocketRedirector::insert(const Key& key, int socket) {
+    const uint32_t value = socket;
+    bpf_attr attributes = {};
+    attributes.map_fd = map_;
+    attributes.key = to_attribute(&key);
+    attributes.value = to_attribute(&value);
+    attributes.flags = BPF_NOEXIST;
+    if (bpf(BPF_MAP_UPDATE_ELEM, attributes) != 0) {
+        LOG4CXX_DEBUG(logger, "Failed to insert socket into sockhash: " << strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool SocketRedirector::enable(const Key& key) {
+    const uint32_t value = 1;
+    bpf_attr attributes = {};
+    attributes.map_fd = enabled_map_;
+    attributes.key = to_attribute(&key);
+    attributes.value = to_attribute(&value);
+    attributes.flags = BPF_ANY;
+    if (bpf(BPF_MAP_UPDATE_ELEM, attributes) != 0) {
+        LOG4CXX_DEBUG(logger, "Failed to enable socket key: " << strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+void SocketRedirector::remove(int map, const Key& key) {
+    bpf_attr attributes = {};
+    attributes.map_fd = map;
+    attributes.key = to_attribute(&key);
+    bpf(BPF_MAP_DELETE_ELEM, attributes);
+}
+
+void SocketRedirector::remove(const Pair& pair) {
+    // Disabled first, so neither socket redirects into a pair that's half gone
+    remove(enabled_map_, pair.first_key);
+    remove(enabled_map_, pair.second_key);
+    remove(map_, pair.first_key);
+    remove(map_, pair.second_key);
+}
+
+} // roberto
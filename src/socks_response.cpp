@@ -0,0 +1,62 @@
+#include "socks_response.h"
+#include <cstring>
+#include <algorithm>
+#include <boost/asio/error.hpp>
+
+using std::copy;
+using std::vector;
+
+using boost::asio::ip::tcp;
+
+using boost::system::error_code;
+
+namespace roberto {
+
+template <typename T>
+static void append_to_buffer(vector<uint8_t>& buffer, const T& contents) {
+    const auto* contents_start = reinterpret_cast<const uint8_t*>(&contents);
+    buffer.insert(buffer.end(), contents_start, contents_start + sizeof(contents));
+}
+
+void make_command_response(vector<uint8_t>& buffer, uint8_t version, ReplyType reply,
+                           const tcp::endpoint& bound_endpoint) {
+    SocksCommandResponseHeader response;
+    response.version = version;
+    response.reply = static_cast<uint8_t>(reply);
+    response.reserved = 0;
+    response.address_type = static_cast<uint8_t>(AddressType::IPV4);
+    buffer.clear();
+    const auto& address = bound_endpoint.address();
+    const uint16_t port = htons(bound_endpoint.port());
+    if (reply == ReplyType::SUCCESS && address.is_v6()) {
+        response.address_type = static_cast<uint8_t>(AddressType::IPV6);
+        auto address_bytes = address.to_v6().to_bytes();
+        SocksCommandResponseEndpointIPv6 body;
+        copy(address_bytes.begin(), address_bytes.end(), body.bind_ipv6_address);
+        body.bind_port = port;
+        append_to_buffer(buffer, response);
+        append_to_buffer(buffer, body);
+    }
+    else {
+        SocksCommandResponseEndpointIPv4 body{0, 0};
+        if (reply == ReplyType::SUCCESS) {
+            body.bind_ipv4_address = htonl(address.to_v4().to_ulong());
+            body.bind_port = port;
+        }
+        append_to_buffer(buffer, response);
+        append_to_buffer(buffer, body);
+    }
+}
+
+ReplyType get_connect_failure_reply(const error_code& error) {
+    if (error == boost::asio::error::connection_refused) {
+        return ReplyType::CONNECTION_REFUSED;
+    }
+    if (error == boost::asio::error::network_unreachable) {
+        return ReplyType::NETWORK_UNREACHABLE;
+    }
+    // Timeouts, unreachable hosts and names that can't be resolved
+    return ReplyType::HOST_UNREACHABLE;
+}
+
+} // roberto
@@ -0,0 +1,67 @@
+#include "stream_socket.h"
+#include <cstddef>
+#include <cstring>
+#include <sstream>
+#include <cerrno>
+#include <sys/un.h>
+#include <sys/socket.h>
+#include <boost/system/system_error.hpp>
+
+using std::string;
+using std::ostringstream;
+
+using boost::asio::ip::tcp;
+
+using boost::system::error_code;
+using boost::system::system_error;
+using boost::system::system_category;
+
+namespace roberto {
+
+bool is_unix_endpoint(const StreamEndpoint& endpoint) {
+    return endpoint.data()->sa_family == AF_UNIX;
+}
+
+StreamEndpoint get_socket_endpoint(int socket) {
+    sockaddr_storage address;
+    socklen_t address_length = sizeof(address);
+    if (getsockname(socket, reinterpret_cast<sockaddr*>(&address), &address_length) != 0) {
+        throw system_error(error_code(errno, system_category()), "getsockname");
+    }
+    return StreamEndpoint(&address, address_length);
+}
+
+string format_endpoint(const StreamEndpoint& endpoint) {
+    if (is_unix_endpoint(endpoint)) {
+        const auto* address = reinterpret_cast<const sockaddr_un*>(endpoint.data());
+        const size_t path_offset = offsetof(sockaddr_un, sun_path);
+        if (endpoint.size() <= path_offset || address->sun_path[0] == '\0') {
+            // Clients connecting through Unix domain sockets are usually unnamed
+            return "unix:(unnamed)";
+        }
+        return "unix:" + string(address->sun_path, strnlen(address->sun_path,
+                                                           endpoint.size() - path_offset));
+    }
+    ostringstream output;
+    output << to_tcp_endpoint(endpoint);
+    return output.str();
+}
+
+string format_address(const StreamEndpoint& endpoint) {
+    if (is_unix_endpoint(endpoint)) {
+        return "unix";
+    }
+    return to_tcp_endpoint(endpoint).address().to_string();
+}
+
+tcp::endpoint to_tcp_endpoint(const StreamEndpoint& endpoint) {
+    tcp::endpoint output;
+    const auto family = endpoint.data()->sa_family;
+    if ((family == AF_INET || family == AF_INET6) && endpoint.size() <= output.capacity()) {
+        memcpy(output.data(), endpoint.data(), endpoint.size());
+        output.resize(endpoint.size());
+    }
+    return output;
+}
+
+} // roberto
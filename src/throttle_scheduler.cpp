@@ -0,0 +1,75 @@
+#include "throttle_scheduler.h"
+#include <vector>
+#include <memory>
+#include <boost/asio/io_service.hpp>
+#include "loop_profiler.h"
+#include "utils.h"
+
+using std::bind;
+using std::move;
+using std::mutex;
+using std::vector;
+using std::lock_guard;
+using std::unique_ptr;
+using std::placeholders::_1;
+
+using boost::asio::io_service;
+
+using boost::system::error_code;
+
+namespace roberto {
+
+ThrottleScheduler& ThrottleScheduler::for_current_thread(io_service& io_service) {
+    static thread_local unique_ptr<ThrottleScheduler> scheduler;
+    if (!scheduler) {
+        scheduler.reset(new ThrottleScheduler(io_service));
+    }
+    return *scheduler;
+}
+
+ThrottleScheduler::ThrottleScheduler(io_service& io_service)
+: timer_(io_service) {
+
+}
+
+void ThrottleScheduler::schedule(Clock::time_point when, Callback callback) {
+    lock_guard<mutex> _(pending_mutex_);
+    // Only re-arm the timer if this callback has to run before every other one
+    const bool is_earliest = pending_.empty() || when < pending_.begin()->first;
+    pending_.emplace(when, move(callback));
+    if (is_earliest) {
+        arm_timer(when);
+    }
+}
+
+void ThrottleScheduler::arm_timer(Clock::time_point when) {
+    // Note that cancelling the timer causes the previous wait to complete with an error
+    timer_.expires_at(when);
+    timer_.async_wait(bind(&ThrottleScheduler::handle_timer, this, _1));
+}
+
+void ThrottleScheduler::handle_timer(const error_code& error) {
+    LoopProfiler::ScopedTimer timer(LoopProfiler::THROTTLE_TIMER);
+    if (utils::is_operation_aborted(error)) {
+        return;
+    }
+    vector<Callback> ready_callbacks;
+    {
+        lock_guard<mutex> _(pending_mutex_);
+        const auto now = Clock::now();
+        auto iter = pending_.begin();
+        while (iter != pending_.end() && iter->first <= now) {
+            ready_callbacks.push_back(move(iter->second));
+            iter = pending_.erase(iter);
+        }
+        if (!pending_.empty()) {
+            arm_timer(pending_.begin()->first);
+        }
+    }
+    // Callbacks are executed outside of the lock as they can schedule themselves again
+    for (const Callback& callback : ready_callbacks) {
+        callback();
+    }
+}
+
+} // roberto
@@ -0,0 +1,164 @@
+#include "tls_context.h"
+#include <memory>
+#include <stdexcept>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <log4cxx/logger.h>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ssl/error.hpp>
+#include "utils.h"
+
+using std::bind;
+using std::move;
+using std::string;
+using std::shared_ptr;
+using std::runtime_error;
+using std::enable_shared_from_this;
+using std::placeholders::_1;
+
+using boost::system::error_code;
+
+using log4cxx::Logger;
+using log4cxx::LoggerPtr;
+
+namespace roberto {
+
+static const LoggerPtr logger = Logger::getLogger("r.tls_context");
+
+// Only AEAD ciphers can be offloaded to the kernel
+static const char* TLS12_CIPHERS = "ECDHE-ECDSA-AES128-GCM-SHA256:ECDHE-RSA-AES128-GCM-SHA256:"
+                                   "ECDHE-ECDSA-AES256-GCM-SHA384:ECDHE-RSA-AES256-GCM-SHA384:"
+                                   "ECDHE-ECDSA-CHACHA20-POLY1305:ECDHE-RSA-CHACHA20-POLY1305";
+static const char* TLS13_CIPHERS = "TLS_AES_128_GCM_SHA256:TLS_AES_256_GCM_SHA384:"
+                                   "TLS_CHACHA20_POLY1305_SHA256";
+
+static error_code get_ssl_error() {
+    return error_code(static_cast<int>(ERR_get_error()), boost::asio::error::get_ssl_category());
+}
+
+static string get_ssl_error_message() {
+    return get_ssl_error().message();
+}
+
+// Drives a non blocking handshake by waiting for the socket to become ready whenever OpenSSL
+// needs to read or write
+class TlsHandshake : public enable_shared_from_this<TlsHandshake> {
+public:
+    TlsHandshake(SSL* ssl, StreamSocket& socket, TlsContext::HandshakeCallback callback)
+    : ssl_(ssl), socket_(socket), callback_(move(callback)) {
+
+    }
+
+    ~TlsHandshake() {
+        // Freeing this doesn't close the socket nor touch the kernel's TLS state
+        SSL_free(ssl_);
+    }
+
+    void run() {
+        ERR_clear_error();
+        const int result = SSL_do_handshake(ssl_);
+        if (result == 1) {
+            finish(enable_offload());
+            return;
+        }
+        auto callback = bind(&TlsHandshake::handle_ready, shared_from_this(), _1);
+        switch (SSL_get_error(ssl_, result)) {
+            case SSL_ERROR_WANT_READ:
+                socket_.async_read_some(boost::asio::null_buffers(), move(callback));
+                break;
+            case SSL_ERROR_WANT_WRITE:
+                socket_.async_write_some(boost::asio::null_buffers(), move(callback));
+                break;
+            case SSL_ERROR_SYSCALL:
+                // The client went away in the middle of the handshake
+                finish(boost::asio::error::eof);
+                break;
+            default:
+                finish(get_ssl_error());
+                break;
+        }
+    }
+private:
+    error_code enable_offload() {
+        // Anything OpenSSL read past the handshake would be lost once it's gone
+        if (!BIO_get_ktls_send(SSL_get_wbio(ssl_)) || !BIO_get_ktls_recv(SSL_get_rbio(ssl_)) ||
+            SSL_pending(ssl_) > 0) {
+            LOG4CXX_WARN(logger, "Kernel TLS is not available for cipher "
+                         << SSL_get_cipher_name(ssl_) << ", make sure the tls module is loaded");
+            return boost::asio::error::operation_not_supported;
+        }
+        LOG4CXX_DEBUG(logger, "Completed " << SSL_get_version(ssl_) << " handshake using "
+                      << SSL_get_cipher_name(ssl_));
+        return {};
+    }
+
+    void handle_ready(const error_code& error) {
+        if (error) {
+            finish(error);
+        }
+        else {
+            run();
+        }
+    }
+
+    void finish(const error_code& error) {
+        error_code ignored;
+        socket_.native_non_blocking(false, ignored);
+        callback_(error);
+    }
+
+    SSL* ssl_;
+    StreamSocket& socket_;
+    TlsContext::HandshakeCallback callback_;
+};
+
+TlsContext::TlsContext(const string& certificate_chain_path, const string& private_key_path)
+: context_(SSL_CTX_new(TLS_server_method())) {
+    if (!context_) {
+        throw runtime_error("Failed to create TLS context: " + get_ssl_error_message());
+    }
+    // The handshake is only a means to hand encryption over to the kernel, so nothing that
+    // needs state after it (renegotiation, session tickets) is supported
+    SSL_CTX_set_min_proto_version(context_, TLS1_2_VERSION);
+    SSL_CTX_set_options(context_, SSL_OP_ENABLE_KTLS | SSL_OP_NO_RENEGOTIATION |
+                                  SSL_OP_NO_TICKET);
+    SSL_CTX_set_num_tickets(context_, 0);
+    SSL_CTX_set_session_cache_mode(context_, SSL_SESS_CACHE_OFF);
+    if (SSL_CTX_set_cipher_list(context_, TLS12_CIPHERS) != 1 ||
+        SSL_CTX_set_ciphersuites(context_, TLS13_CIPHERS) != 1) {
+        SSL_CTX_free(context_);
+        throw runtime_error("Failed to set TLS ciphers: " + get_ssl_error_message());
+    }
+    if (SSL_CTX_use_certificate_chain_file(context_, certificate_chain_path.c_str()) != 1 ||
+        SSL_CTX_use_PrivateKey_file(context_, private_key_path.c_str(), SSL_FILETYPE_PEM) != 1 ||
+        SSL_CTX_check_private_key(context_) != 1) {
+        const string message = get_ssl_error_message();
+        SSL_CTX_free(context_);
+        throw runtime_error("Failed to load TLS certificate: " + message);
+    }
+}
+
+TlsContext::~TlsContext() {
+    SSL_CTX_free(context_);
+}
+
+void TlsContext::handshake(StreamSocket& socket, HandshakeCallback callback) const {
+    SSL* ssl = SSL_new(context_);
+    if (!ssl || SSL_set_fd(ssl, socket.native_handle()) != 1) {
+        SSL_free(ssl);
+        socket.get_io_service().post(bind(move(callback), get_ssl_error()));
+        return;
+    }
+    SSL_set_accept_state(ssl);
+    // OpenSSL reads from and writes into the socket directly
+    error_code error;
+    socket.native_non_blocking(true, error);
+    if (error) {
+        SSL_free(ssl);
+        socket.get_io_service().post(bind(move(callback), error));
+        return;
+    }
+    std::make_shared<TlsHandshake>(ssl, socket, move(callback))->run();
+}
+
+} // roberto
@@ -0,0 +1,38 @@
+#include "token_bucket.h"
+#include <algorithm>
+
+using std::min;
+using std::chrono::duration;
+using std::chrono::duration_cast;
+
+namespace roberto {
+
+TokenBucket::TokenBucket(uint64_t rate, uint64_t burst)
+: rate_(rate), burst_(burst), tokens_(burst), last_refill_(Clock::now()) {
+
+}
+
+TokenBucket::Clock::duration TokenBucket::consume(uint64_t amount, Clock::time_point now) {
+    refill(now);
+    tokens_ -= amount;
+    if (tokens_ >= 0) {
+        return Clock::duration::zero();
+    }
+    // We're in debt. Wait until enough tokens have been added to cover it
+    return duration_cast<Clock::duration>(duration<double>(-tokens_ / rate_));
+}
+
+uint64_t TokenBucket::get_rate() const {
+    return rate_;
+}
+
+void TokenBucket::refill(Clock::time_point now) {
+    if (now <= last_refill_) {
+        return;
+    }
+    const duration<double> elapsed = now - last_refill_;
+    tokens_ = min(burst_, tokens_ + elapsed.count() * rate_);
+    last_refill_ = now;
+}
+
+} // roberto
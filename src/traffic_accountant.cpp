@@ -0,0 +1,428 @@
+#include "traffic_accountant.h"
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <algorithm>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <log4cxx/logger.h>
+
+using std::ios;
+using std::map;
+using std::move;
+using std::mutex;
+using std::string;
+using std::thread;
+using std::exception;
+using std::to_string;
+using std::vector;
+using std::ifstream;
+using std::ofstream;
+using std::lock_guard;
+using std::unique_lock;
+using std::runtime_error;
+using std::memory_order_relaxed;
+
+using log4cxx::Logger;
+using log4cxx::LoggerPtr;
+
+namespace roberto {
+
+static const LoggerPtr logger = Logger::getLogger("r.traffic_accountant");
+
+static const uint32_t SNAPSHOT_MAGIC = 0x41544252;
+static const uint32_t SNAPSHOT_VERSION = 1;
+static const size_t MAX_USERNAME_LENGTH = 255;
+static const string DELTA_SUFFIX = ".delta";
+
+template <typename T>
+static void write_value(ofstream& output, const T& value) {
+    output.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+static T read_value(ifstream& input) {
+    T value;
+    if (!input.read(reinterpret_cast<char*>(&value), sizeof(value))) {
+        throw runtime_error("Truncated traffic accounting snapshot");
+    }
+    return value;
+}
+
+// TrafficAccount
+
+TrafficAccount::TrafficAccount(TrafficAccountant& accountant, size_t user_index)
+: accountant_(&accountant), user_index_(user_index) {
+
+}
+
+bool TrafficAccount::record(RelayDirection direction, uint64_t byte_count) {
+    accountant_->record(user_index_, direction, byte_count);
+    // Quotas are only checked once in a while, there's no need to be precise
+    unchecked_bytes_ += byte_count;
+    if (unchecked_bytes_ < TrafficAccountant::QUOTA_CHECK_BYTES) {
+        return true;
+    }
+    unchecked_bytes_ = 0;
+    return !accountant_->is_over_quota(user_index_);
+}
+
+// TrafficAccountant
+
+const uint64_t TrafficAccountant::QUOTA_CHECK_BYTES = 256 * 1024;
+
+TrafficAccountant::Shard::Shard(size_t user_count)
+: counters(new std::atomic<uint64_t>[user_count * RELAY_DIRECTION_COUNT]) {
+    for (size_t i = 0; i < user_count * RELAY_DIRECTION_COUNT; ++i) {
+        counters[i].store(0, memory_order_relaxed);
+    }
+}
+
+TrafficAccountant::TrafficAccountant(const vector<string>& usernames, string snapshot_path,
+                                     Duration merge_interval)
+: snapshot_path_(move(snapshot_path)), merge_interval_(merge_interval) {
+    // The anonymous user, used when there's no authentication, always goes first
+    user_indexes_.emplace(string(), 0);
+    usernames_.push_back(string());
+    for (const string& username : usernames) {
+        if (user_indexes_.emplace(username, usernames_.size()).second) {
+            usernames_.push_back(username);
+        }
+    }
+    base_counters_.resize(usernames_.size());
+    load_snapshot();
+    delta_base_ = base_counters_;
+    quotas_.resize(usernames_.size());
+    over_quota_.reset(new std::atomic<bool>[usernames_.size()]);
+    for (size_t i = 0; i < usernames_.size(); ++i) {
+        over_quota_[i].store(false, memory_order_relaxed);
+    }
+}
+
+TrafficAccountant::~TrafficAccountant() {
+    stop();
+    if (snapshot_lock_ >= 0) {
+        close(snapshot_lock_);
+    }
+}
+
+void TrafficAccountant::set_default_quota(uint64_t quota) {
+    // Every connection made without authentication is accounted to the anonymous user, so
+    // the default would end up limiting all of them together
+    for (size_t i = 1; i < quotas_.size(); ++i) {
+        quotas_[i] = quota;
+    }
+}
+
+void TrafficAccountant::set_user_quota(const string& username, uint64_t quota) {
+    auto iter = user_indexes_.find(username);
+    if (iter == user_indexes_.end()) {
+        throw runtime_error("Can't set quota for unknown user " + username);
+    }
+    quotas_[iter->second] = quota;
+}
+
+void TrafficAccountant::start() {
+    // Evaluate quotas right away, as the snapshot could have put some users over theirs
+    merge();
+    merge_thread_ = thread(&TrafficAccountant::run, this);
+}
+
+void TrafficAccountant::stop() {
+    if (!merge_thread_.joinable()) {
+        return;
+    }
+    {
+        lock_guard<mutex> _(stop_mutex_);
+        stopped_ = true;
+    }
+    stop_condition_.notify_one();
+    merge_thread_.join();
+}
+
+void TrafficAccountant::hand_over() {
+    {
+        lock_guard<mutex> _(stop_mutex_);
+        hand_over_requested_ = true;
+    }
+    stop_condition_.notify_one();
+}
+
+bool TrafficAccountant::is_over_quota(const string& username) const {
+    return is_over_quota(get_user_index(username));
+}
+
+TrafficAccount TrafficAccountant::make_account(const string& username) {
+    return TrafficAccount(*this, get_user_index(username));
+}
+
+size_t TrafficAccountant::get_user_index(const string& username) const {
+    auto iter = user_indexes_.find(username);
+    // Unknown users can't exist as they wouldn't be authenticated. Use the anonymous one
+    return iter != user_indexes_.end() ? iter->second : 0;
+}
+
+TrafficAccountant::Shard& TrafficAccountant::get_thread_shard() {
+    static thread_local const TrafficAccountant* shard_owner = nullptr;
+    static thread_local Shard* shard = nullptr;
+    if (shard_owner != this) {
+        lock_guard<mutex> _(shards_mutex_);
+        shards_.emplace_back(new Shard(usernames_.size()));
+        shard = shards_.back().get();
+        shard_owner = this;
+    }
+    return *shard;
+}
+
+void TrafficAccountant::record(size_t user_index, RelayDirection direction,
+                               uint64_t byte_count) {
+    auto& counter = get_thread_shard().counters[user_index * RELAY_DIRECTION_COUNT + direction];
+    // We're the only writer so there's no need for an atomic increment
+    counter.store(counter.load(memory_order_relaxed) + byte_count, memory_order_relaxed);
+}
+
+bool TrafficAccountant::is_over_quota(size_t user_index) const {
+    return over_quota_[user_index].load(memory_order_relaxed);
+}
+
+void TrafficAccountant::run() {
+    unique_lock<mutex> lock(stop_mutex_);
+    for (;;) {
+        stop_condition_.wait_for(lock, merge_interval_,
+                                 [&] { return stopped_ || hand_over_requested_; });
+        if (stopped_) {
+            break;
+        }
+        const vector<Counters> totals = merge();
+        if (hand_over_requested_) {
+            hand_over_requested_ = false;
+            release_snapshot(totals);
+        }
+    }
+    // Make sure the latest counts make it into the snapshot, or into our delta if it's not ours
+    const vector<Counters> totals = merge();
+    if (snapshot_state_ != SnapshotState::OWNED) {
+        write_counters(snapshot_path_ + "." + to_string(getpid()) + DELTA_SUFFIX, totals,
+                       &delta_base_);
+    }
+}
+
+vector<TrafficAccountant::Counters> TrafficAccountant::merge() {
+    if (snapshot_state_ == SnapshotState::WAITING && lock_snapshot()) {
+        snapshot_state_ = SnapshotState::OWNED;
+        // The previous owner kept writing it after we loaded it
+        try {
+            load_snapshot();
+        }
+        catch (const exception& error) {
+            LOG4CXX_ERROR(logger, error.what());
+        }
+    }
+    vector<string> delta_files;
+    if (snapshot_state_ == SnapshotState::OWNED) {
+        delta_files = find_delta_files();
+        for (const string& path : delta_files) {
+            UserCounters counters;
+            try {
+                if (read_counters(path, counters)) {
+                    add_counters(counters);
+                }
+            }
+            catch (const exception& error) {
+                LOG4CXX_WARN(logger, "Discarding traffic accounting delta: " << error.what());
+            }
+        }
+    }
+    vector<Counters> totals = base_counters_;
+    {
+        lock_guard<mutex> _(shards_mutex_);
+        for (const auto& shard : shards_) {
+            for (size_t i = 0; i < totals.size(); ++i) {
+                for (size_t direction = 0; direction < RELAY_DIRECTION_COUNT; ++direction) {
+                    const size_t index = i * RELAY_DIRECTION_COUNT + direction;
+                    totals[i][direction] += shard->counters[index].load(memory_order_relaxed);
+                }
+            }
+        }
+    }
+    for (size_t i = 0; i < totals.size(); ++i) {
+        const uint64_t total = totals[i][UPSTREAM] + totals[i][DOWNSTREAM];
+        if (quotas_[i] > 0 && total >= quotas_[i] &&
+            !over_quota_[i].exchange(true, memory_order_relaxed)) {
+            LOG4CXX_INFO(logger, "User \"" << usernames_[i] << "\" went over its quota of "
+                         << quotas_[i] << " bytes");
+        }
+    }
+    if (snapshot_state_ == SnapshotState::OWNED) {
+        write_counters(snapshot_path_, totals, nullptr);
+        // Deltas are only removed once they're part of the snapshot
+        for (const string& path : delta_files) {
+            std::remove(path.c_str());
+        }
+    }
+    return totals;
+}
+
+void TrafficAccountant::release_snapshot(const vector<Counters>& totals) {
+    if (snapshot_state_ == SnapshotState::OWNED) {
+        // Our final totals are in the snapshot, whatever we relay from now on is a delta
+        delta_base_ = totals;
+        LOG4CXX_INFO(logger, "Handing the traffic accounting snapshot over");
+    }
+    if (snapshot_lock_ >= 0) {
+        close(snapshot_lock_);
+        snapshot_lock_ = -1;
+    }
+    snapshot_state_ = SnapshotState::HANDED_OVER;
+}
+
+bool TrafficAccountant::lock_snapshot() {
+    if (snapshot_path_.empty()) {
+        return false;
+    }
+    if (snapshot_lock_ < 0) {
+        const string lock_path = snapshot_path_ + ".lock";
+        snapshot_lock_ = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (snapshot_lock_ < 0) {
+            LOG4CXX_WARN(logger, "Failed to open " << lock_path << ": " << strerror(errno));
+            return false;
+        }
+    }
+    // Held until the snapshot is handed over. The kernel releases it if we die
+    return flock(snapshot_lock_, LOCK_EX | LOCK_NB) == 0;
+}
+
+void TrafficAccountant::load_snapshot() {
+    if (snapshot_path_.empty()) {
+        return;
+    }
+    UserCounters counters;
+    const bool found = read_counters(snapshot_path_, counters);
+    // Replaces whatever was loaded before, this instance's own traffic is in the shards
+    base_counters_.assign(usernames_.size(), Counters());
+    removed_user_counters_.clear();
+    if (!found) {
+        LOG4CXX_INFO(logger, "No traffic accounting snapshot found at " << snapshot_path_);
+        return;
+    }
+    add_counters(counters);
+    LOG4CXX_INFO(logger, "Loaded traffic accounting snapshot for " << counters.size()
+                 << " users");
+}
+
+bool TrafficAccountant::read_counters(const string& path, UserCounters& output) {
+    ifstream input(path, ios::binary);
+    if (!input) {
+        return false;
+    }
+    if (read_value<uint32_t>(input) != SNAPSHOT_MAGIC ||
+        read_value<uint32_t>(input) != SNAPSHOT_VERSION) {
+        throw runtime_error("Invalid traffic accounting snapshot " + path);
+    }
+    const uint32_t user_count = read_value<uint32_t>(input);
+    for (uint32_t i = 0; i < user_count; ++i) {
+        string username(read_value<uint8_t>(input), '\0');
+        if (!input.read(&username[0], username.size())) {
+            throw runtime_error("Truncated traffic accounting snapshot");
+        }
+        Counters& counters = output[username];
+        for (uint64_t& counter : counters) {
+            counter = read_value<uint64_t>(input);
+        }
+    }
+    return true;
+}
+
+vector<string> TrafficAccountant::find_delta_files() const {
+    // Deltas are named after the snapshot and the pid of the instance that wrote them
+    const size_t separator = snapshot_path_.rfind('/');
+    const string directory = separator == string::npos ? string() :
+                                                         snapshot_path_.substr(0, separator + 1);
+    const string prefix = snapshot_path_.substr(directory.size()) + ".";
+    vector<string> output;
+    DIR* dir = opendir(directory.empty() ? "." : directory.c_str());
+    if (!dir) {
+        return output;
+    }
+    while (dirent* entry = readdir(dir)) {
+        const string name = entry->d_name;
+        if (name.size() <= prefix.size() + DELTA_SUFFIX.size() ||
+            name.compare(0, prefix.size(), prefix) != 0 ||
+            name.compare(name.size() - DELTA_SUFFIX.size(), string::npos, DELTA_SUFFIX) != 0) {
+            continue;
+        }
+        const string pid = name.substr(prefix.size(),
+                                       name.size() - prefix.size() - DELTA_SUFFIX.size());
+        if (pid.find_first_not_of("0123456789") == string::npos) {
+            output.push_back(directory + name);
+        }
+    }
+    closedir(dir);
+    return output;
+}
+
+void TrafficAccountant::add_counters(const UserCounters& counters) {
+    for (const auto& user_counters : counters) {
+        auto iter = user_indexes_.find(user_counters.first);
+        Counters& target = iter != user_indexes_.end() ?
+                           base_counters_[iter->second] :
+                           removed_user_counters_[user_counters.first];
+        for (size_t direction = 0; direction < RELAY_DIRECTION_COUNT; ++direction) {
+            target[direction] += user_counters.second[direction];
+        }
+    }
+}
+
+// Without a base, these are the full totals. Otherwise only what was relayed since then
+void TrafficAccountant::write_counters(const string& path, const vector<Counters>& totals,
+                                       const vector<Counters>* base) const {
+    if (snapshot_path_.empty()) {
+        return;
+    }
+    UserCounters counters;
+    if (!base) {
+        counters = removed_user_counters_;
+    }
+    for (size_t i = 0; i < totals.size(); ++i) {
+        Counters user_counters = totals[i];
+        for (size_t direction = 0; base && direction < RELAY_DIRECTION_COUNT; ++direction) {
+            user_counters[direction] -= (*base)[i][direction];
+        }
+        const bool has_traffic = user_counters[UPSTREAM] > 0 || user_counters[DOWNSTREAM] > 0;
+        if (has_traffic && usernames_[i].size() <= MAX_USERNAME_LENGTH) {
+            counters[usernames_[i]] = user_counters;
+        }
+    }
+    if (base && counters.empty()) {
+        return;
+    }
+    // Write into a temporary file and rename it, so a crash never leaves a partial file. It's
+    // named after our pid as the instance we're hot restarting with may be writing its own
+    const string temp_path = path + "." + to_string(getpid()) + ".tmp";
+    {
+        ofstream output(temp_path, ios::binary | ios::trunc);
+        write_value(output, SNAPSHOT_MAGIC);
+        write_value(output, SNAPSHOT_VERSION);
+        write_value(output, static_cast<uint32_t>(counters.size()));
+        for (const auto& user_counters : counters) {
+            write_value(output, static_cast<uint8_t>(user_counters.first.size()));
+            output.write(user_counters.first.data(), user_counters.first.size());
+            for (uint64_t counter : user_counters.second) {
+                write_value(output, counter);
+            }
+        }
+        if (!output) {
+            LOG4CXX_WARN(logger, "Failed to write traffic accounting snapshot into " << temp_path);
+            return;
+        }
+    }
+    if (std::rename(temp_path.c_str(), path.c_str()) != 0) {
+        LOG4CXX_WARN(logger, "Failed to rename traffic accounting snapshot into " << path);
+    }
+}
+
+} // roberto
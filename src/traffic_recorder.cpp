@@ -0,0 +1,311 @@
+#include "traffic_recorder.h"
+#include <stdexcept>
+#include <log4cxx/logger.h>
+
+using std::ios;
+using std::move;
+using std::mutex;
+using std::string;
+using std::thread;
+using std::vector;
+using std::istream;
+using std::ostream;
+using std::lock_guard;
+using std::unique_lock;
+using std::runtime_error;
+using std::chrono::seconds;
+using std::chrono::microseconds;
+using std::chrono::duration_cast;
+
+using log4cxx::Logger;
+using log4cxx::LoggerPtr;
+
+namespace roberto {
+
+static const LoggerPtr logger = Logger::getLogger("r.traffic_recorder");
+
+// How often queued traces are written, unless enough of them pile up before that
+static const TrafficRecorder::Clock::duration WRITE_INTERVAL = seconds(1);
+static const size_t WRITE_BATCH_SIZE = 256;
+
+static uint64_t to_microseconds(TrafficRecorder::Clock::duration duration) {
+    return duration_cast<microseconds>(duration).count();
+}
+
+template <typename T>
+static void write_value(ostream& output, const T& value) {
+    output.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+static T read_value(istream& input) {
+    T value;
+    if (!input.read(reinterpret_cast<char*>(&value), sizeof(value))) {
+        throw runtime_error("Truncated traffic trace");
+    }
+    return value;
+}
+
+void write_varint(ostream& output, uint64_t value) {
+    while (value >= 0x80) {
+        output.put(static_cast<char>((value & 0x7f) | 0x80));
+        value >>= 7;
+    }
+    output.put(static_cast<char>(value));
+}
+
+uint64_t read_varint(istream& input) {
+    uint64_t value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        const uint8_t byte = read_value<uint8_t>(input);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return value;
+        }
+    }
+    throw runtime_error("Malformed varint in traffic trace");
+}
+
+// TrafficRecording
+
+TrafficRecording::TrafficRecording(TrafficRecorder& recorder)
+: recorder_(&recorder), start_time_(Clock::now()) {
+    trace_.start_time = to_microseconds(start_time_ - recorder.get_start_time());
+}
+
+TrafficRecording::~TrafficRecording() {
+    if (!requested_) {
+        return;
+    }
+    trace_.duration = to_microseconds(Clock::now() - start_time_);
+    recorder_->submit(move(trace_));
+}
+
+void TrafficRecording::set_protocol(ConnectionTrace::Protocol protocol) {
+    trace_.protocol = protocol;
+}
+
+void TrafficRecording::set_auth_method(SocksAuthentication auth_method) {
+    trace_.auth_method = auth_method;
+}
+
+void TrafficRecording::record_request(AddressType address_type) {
+    request_time_ = Clock::now();
+    requested_ = true;
+    trace_.address_type = address_type;
+    trace_.handshake_time = to_microseconds(request_time_ - start_time_);
+    last_chunk_times_.fill(request_time_);
+}
+
+void TrafficRecording::record_connected() {
+    const auto now = Clock::now();
+    trace_.connected = true;
+    trace_.connect_time = to_microseconds(now - request_time_);
+    for (size_t i = 0; i < RELAY_DIRECTION_COUNT; ++i) {
+        if (trace_.directions[i].byte_count == 0) {
+            last_chunk_times_[i] = now;
+        }
+    }
+}
+
+void TrafficRecording::record_chunk(RelayDirection direction, size_t byte_count) {
+    ConnectionTrace::Direction& trace_direction = trace_.directions[direction];
+    trace_direction.byte_count += byte_count;
+    if (trace_direction.chunks.size() >= recorder_->get_max_chunks()) {
+        return;
+    }
+    const auto now = Clock::now();
+    const uint64_t delay = to_microseconds(now - last_chunk_times_[direction]);
+    trace_direction.chunks.push_back({ delay, byte_count });
+    last_chunk_times_[direction] = now;
+}
+
+// TrafficRecorder
+
+const uint32_t TrafficRecorder::TRACE_MAGIC = 0x43525452;
+const uint32_t TrafficRecorder::TRACE_VERSION = 1;
+const size_t TrafficRecorder::MAX_QUEUED_TRACES = 65536;
+
+TrafficRecorder::TrafficRecorder(const string& path, size_t max_chunks)
+: output_(path, ios::binary | ios::trunc), start_time_(Clock::now()), max_chunks_(max_chunks) {
+    if (!output_) {
+        throw runtime_error("Failed to open traffic trace file " + path);
+    }
+    write_value(output_, TRACE_MAGIC);
+    write_value(output_, TRACE_VERSION);
+}
+
+TrafficRecorder::~TrafficRecorder() {
+    stop();
+}
+
+void TrafficRecorder::start() {
+    write_thread_ = thread(&TrafficRecorder::run, this);
+}
+
+void TrafficRecorder::stop() {
+    if (!write_thread_.joinable()) {
+        return;
+    }
+    {
+        lock_guard<mutex> _(queue_mutex_);
+        stopped_ = true;
+    }
+    queue_condition_.notify_one();
+    write_thread_.join();
+}
+
+TrafficRecorder::Clock::time_point TrafficRecorder::get_start_time() const {
+    return start_time_;
+}
+
+size_t TrafficRecorder::get_max_chunks() const {
+    return max_chunks_;
+}
+
+void TrafficRecorder::submit(ConnectionTrace trace) {
+    bool must_notify = false;
+    {
+        lock_guard<mutex> _(queue_mutex_);
+        if (queued_traces_.size() >= MAX_QUEUED_TRACES) {
+            ++dropped_count_;
+            return;
+        }
+        queued_traces_.push_back(move(trace));
+        must_notify = queued_traces_.size() == WRITE_BATCH_SIZE;
+    }
+    if (must_notify) {
+        queue_condition_.notify_one();
+    }
+}
+
+void TrafficRecorder::run() {
+    vector<ConnectionTrace> traces;
+    bool stopped = false;
+    while (!stopped) {
+        uint64_t dropped_count;
+        {
+            unique_lock<mutex> lock(queue_mutex_);
+            queue_condition_.wait_for(lock, WRITE_INTERVAL, [&] {
+                return stopped_ || queued_traces_.size() >= WRITE_BATCH_SIZE;
+            });
+            // Whatever is queued by the time we're stopped is still written
+            stopped = stopped_;
+            traces.swap(queued_traces_);
+            dropped_count = dropped_count_;
+            dropped_count_ = 0;
+        }
+        if (dropped_count > 0) {
+            LOG4CXX_WARN(logger, "Dropped " << dropped_count << " traffic traces as they "
+                         "couldn't be written fast enough");
+        }
+        write_traces(traces);
+        traces.clear();
+    }
+}
+
+void TrafficRecorder::write_traces(const vector<ConnectionTrace>& traces) {
+    if (traces.empty()) {
+        return;
+    }
+    for (const ConnectionTrace& trace : traces) {
+        write_varint(output_, trace.start_time);
+        write_value(output_, static_cast<uint8_t>(trace.protocol));
+        write_value(output_, static_cast<uint8_t>(trace.auth_method));
+        write_value(output_, static_cast<uint8_t>(trace.address_type));
+        write_value(output_, static_cast<uint8_t>(trace.connected));
+        write_varint(output_, trace.handshake_time);
+        write_varint(output_, trace.connect_time);
+        write_varint(output_, trace.duration);
+        for (const ConnectionTrace::Direction& direction : trace.directions) {
+            write_varint(output_, direction.byte_count);
+            write_varint(output_, direction.chunks.size());
+            for (const ConnectionTrace::Chunk& chunk : direction.chunks) {
+                write_varint(output_, chunk.delay);
+                write_varint(output_, chunk.size);
+            }
+        }
+    }
+    // Flushing every batch keeps the file usable if we're killed
+    if (!output_.flush()) {
+        LOG4CXX_WARN(logger, "Failed to write " << traces.size() << " traffic traces");
+        output_.clear();
+    }
+}
+
+// TraceReader
+
+// Far more than any recorder keeps, it only guards against corrupt files
+const uint64_t TraceReader::MAX_CHUNKS = 1 << 24;
+
+TraceReader::TraceReader(const string& path)
+: input_(path, ios::binary) {
+    if (!input_) {
+        throw runtime_error("Failed to open traffic trace file " + path);
+    }
+    input_.seekg(0, ios::end);
+    file_size_ = input_.tellg();
+    input_.seekg(0, ios::beg);
+    if (read_value<uint32_t>(input_) != TrafficRecorder::TRACE_MAGIC) {
+        throw runtime_error(path + " isn't a traffic trace file");
+    }
+    const uint32_t version = read_value<uint32_t>(input_);
+    if (version != TrafficRecorder::TRACE_VERSION) {
+        throw runtime_error("Unsupported traffic trace version " + std::to_string(version));
+    }
+}
+
+bool TraceReader::read(ConnectionTrace& trace) {
+    // A trace can only end right before the next one starts
+    if (truncated_ || input_.peek() == istream::traits_type::eof()) {
+        return false;
+    }
+    try {
+        read_trace(trace);
+    }
+    catch (const runtime_error&) {
+        // Running out of data means the recorder didn't get to write the rest of the trace.
+        // Anything else is corrupt
+        if (!truncated_ && !input_.eof()) {
+            throw;
+        }
+        truncated_ = true;
+        return false;
+    }
+    return true;
+}
+
+bool TraceReader::is_truncated() const {
+    return truncated_;
+}
+
+void TraceReader::read_trace(ConnectionTrace& trace) {
+    trace.start_time = read_varint(input_);
+    trace.protocol = static_cast<ConnectionTrace::Protocol>(read_value<uint8_t>(input_));
+    trace.auth_method = static_cast<SocksAuthentication>(read_value<uint8_t>(input_));
+    trace.address_type = static_cast<AddressType>(read_value<uint8_t>(input_));
+    trace.connected = read_value<uint8_t>(input_) != 0;
+    trace.handshake_time = read_varint(input_);
+    trace.connect_time = read_varint(input_);
+    trace.duration = read_varint(input_);
+    for (ConnectionTrace::Direction& direction : trace.directions) {
+        direction.byte_count = read_varint(input_);
+        const uint64_t chunk_count = read_varint(input_);
+        if (chunk_count > MAX_CHUNKS) {
+            throw runtime_error("Malformed chunk count in traffic trace");
+        }
+        // Each chunk takes at least 2 bytes, so a count past what's left can't be complete
+        const uint64_t remaining_bytes = file_size_ - static_cast<uint64_t>(input_.tellg());
+        if (chunk_count > remaining_bytes / 2) {
+            truncated_ = true;
+            throw runtime_error("Truncated traffic trace");
+        }
+        direction.chunks.resize(chunk_count);
+        for (ConnectionTrace::Chunk& chunk : direction.chunks) {
+            chunk.delay = read_varint(input_);
+            chunk.size = read_varint(input_);
+        }
+    }
+}
+
+} // roberto
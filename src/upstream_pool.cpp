@@ -0,0 +1,348 @@
+#include "upstream_pool.h"
+#include <sstream>
+#include <algorithm>
+#include <log4cxx/logger.h>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include "socks_messages.h"
+
+using std::bind;
+using std::find;
+using std::move;
+using std::mutex;
+using std::string;
+using std::vector;
+using std::to_string;
+using std::lock_guard;
+using std::make_shared;
+using std::ostringstream;
+using std::random_device;
+using std::uniform_int_distribution;
+using std::placeholders::_1;
+using std::placeholders::_2;
+using std::chrono::seconds;
+using std::chrono::milliseconds;
+using std::chrono::microseconds;
+using std::chrono::duration_cast;
+
+using boost::asio::io_service;
+using boost::asio::ip::tcp;
+
+using boost::system::error_code;
+
+using log4cxx::Logger;
+using log4cxx::LoggerPtr;
+
+namespace roberto {
+
+static const LoggerPtr logger = Logger::getLogger("r.upstream_pool");
+
+// How often ejected parents are checked for whether they're due to be probed
+static const UpstreamPool::Clock::duration PROBE_CHECK_INTERVAL = seconds(1);
+static const uint8_t SOCKS_VERSION = 5;
+
+static string format_parent(const UpstreamPool::Parent& parent) {
+    return parent.address + ":" + to_string(parent.port);
+}
+
+// Lease
+
+UpstreamPool::Lease::Lease(UpstreamPool& pool, size_t index)
+: pool_(&pool), index_(index) {
+
+}
+
+UpstreamPool::Lease::Lease(Lease&& other)
+: pool_(other.pool_), index_(other.index_) {
+    other.pool_ = nullptr;
+}
+
+UpstreamPool::Lease& UpstreamPool::Lease::operator=(Lease&& other) {
+    if (this != &other) {
+        release();
+        pool_ = other.pool_;
+        index_ = other.index_;
+        other.pool_ = nullptr;
+    }
+    return *this;
+}
+
+UpstreamPool::Lease::~Lease() {
+    release();
+}
+
+UpstreamPool::Lease::operator bool() const {
+    return pool_ != nullptr;
+}
+
+const UpstreamPool::Parent& UpstreamPool::Lease::get_parent() const {
+    // Parents are never added or modified, so this doesn't need locking
+    return pool_->parents_[index_].parent;
+}
+
+UpstreamPool::Clock::duration UpstreamPool::Lease::get_handshake_timeout() const {
+    return pool_->handshake_timeout_;
+}
+
+void UpstreamPool::Lease::record_success(Clock::duration connect_latency) {
+    pool_->record_success(index_, connect_latency);
+}
+
+void UpstreamPool::Lease::record_failure() {
+    pool_->record_failure(index_);
+}
+
+void UpstreamPool::Lease::release() {
+    if (pool_) {
+        pool_->release(index_);
+        pool_ = nullptr;
+    }
+}
+
+// UpstreamPool
+
+UpstreamPool::Probe::Probe(io_service& io_service, size_t index)
+: index(index), deadline(io_service) {
+
+}
+
+UpstreamPool::UpstreamPool(io_service& io_service, vector<Parent> parents,
+                           size_t failure_threshold, Clock::duration ejection_duration,
+                           Clock::duration handshake_timeout)
+: failure_threshold_(failure_threshold), ejection_duration_(ejection_duration),
+  handshake_timeout_(handshake_timeout), random_engine_(random_device()()),
+  resolver_(io_service), timer_(io_service) {
+    for (Parent& parent : parents) {
+        parents_.emplace_back();
+        parents_.back().parent = move(parent);
+    }
+}
+
+void UpstreamPool::start() {
+    arm_timer();
+}
+
+void UpstreamPool::stop() {
+    lock_guard<mutex> _(mutex_);
+    stopped_ = true;
+    error_code ignored;
+    timer_.cancel(ignored);
+    resolver_.cancel();
+    for (const ProbePtr& probe : probes_) {
+        probe->deadline.cancel(ignored);
+        if (probe->socket) {
+            probe->socket->close(ignored);
+        }
+    }
+}
+
+UpstreamPool::Lease UpstreamPool::choose() {
+    lock_guard<mutex> _(mutex_);
+    vector<size_t> candidates;
+    for (size_t i = 0; i < parents_.size(); ++i) {
+        if (!parents_[i].ejected) {
+            candidates.push_back(i);
+        }
+    }
+    if (candidates.empty()) {
+        return Lease();
+    }
+    uniform_int_distribution<size_t> distribution(0, candidates.size() - 1);
+    const size_t first = distribution(random_engine_);
+    size_t chosen = candidates[first];
+    if (candidates.size() > 1) {
+        // Pick a second one out of the rest
+        uniform_int_distribution<size_t> offset_distribution(1, candidates.size() - 1);
+        const size_t second = candidates[(first + offset_distribution(random_engine_)) %
+                                         candidates.size()];
+        if (get_cost(parents_[second]) < get_cost(parents_[chosen])) {
+            chosen = second;
+        }
+    }
+    ++parents_[chosen].connections;
+    return Lease(*this, chosen);
+}
+
+string UpstreamPool::format_report() const {
+    lock_guard<mutex> _(mutex_);
+    ostringstream output;
+    for (const ParentState& state : parents_) {
+        output << format_parent(state.parent) << " " << (state.ejected ? "ejected" : "healthy")
+               << " latency=" << duration_cast<milliseconds>(state.average_latency).count()
+               << "ms connections=" << state.connections
+               << " failures=" << state.consecutive_failures << "\n";
+    }
+    return output.str();
+}
+
+uint64_t UpstreamPool::get_cost(const ParentState& state) {
+    // Parents that weren't measured yet look fast, so they get some connections to measure
+    const uint64_t latency = duration_cast<microseconds>(state.average_latency).count();
+    return (latency + 1) * (state.connections + 1);
+}
+
+void UpstreamPool::record_success(size_t index, Clock::duration connect_latency) {
+    lock_guard<mutex> _(mutex_);
+    ParentState& state = parents_[index];
+    state.consecutive_failures = 0;
+    if (state.ejected) {
+        LOG4CXX_INFO(logger, "Parent proxy " << format_parent(state.parent) << " is back");
+        state.ejected = false;
+    }
+    if (state.average_latency == Clock::duration::zero()) {
+        state.average_latency = connect_latency;
+    }
+    else {
+        state.average_latency += (connect_latency - state.average_latency) / 8;
+    }
+}
+
+void UpstreamPool::record_failure(size_t index) {
+    lock_guard<mutex> _(mutex_);
+    ParentState& state = parents_[index];
+    ++state.consecutive_failures;
+    if (state.ejected || state.consecutive_failures < failure_threshold_) {
+        return;
+    }
+    LOG4CXX_WARN(logger, "Ejecting parent proxy " << format_parent(state.parent) << " after "
+                 << state.consecutive_failures << " consecutive failures");
+    state.ejected = true;
+    state.next_probe = Clock::now() + ejection_duration_;
+}
+
+void UpstreamPool::release(size_t index) {
+    lock_guard<mutex> _(mutex_);
+    --parents_[index].connections;
+}
+
+void UpstreamPool::arm_timer() {
+    timer_.expires_from_now(PROBE_CHECK_INTERVAL);
+    timer_.async_wait(bind(&UpstreamPool::handle_timer, this, _1));
+}
+
+void UpstreamPool::handle_timer(const error_code& error) {
+    if (error) {
+        return;
+    }
+    lock_guard<mutex> _(mutex_);
+    if (stopped_) {
+        return;
+    }
+    const auto now = Clock::now();
+    for (size_t i = 0; i < parents_.size(); ++i) {
+        const ParentState& state = parents_[i];
+        if (state.ejected && !state.probing && state.next_probe <= now) {
+            start_probe(i);
+        }
+    }
+    arm_timer();
+}
+
+void UpstreamPool::start_probe(size_t index) {
+    ParentState& state = parents_[index];
+    LOG4CXX_DEBUG(logger, "Probing parent proxy " << format_parent(state.parent));
+    state.probing = true;
+    auto probe = make_shared<Probe>(resolver_.get_io_service(), index);
+    probes_.push_back(probe);
+    probe->deadline.expires_from_now(handshake_timeout_);
+    probe->deadline.async_wait(bind(&UpstreamPool::handle_probe_deadline, this, probe, _1));
+    auto callback = bind(&UpstreamPool::handle_probe_resolve, this, probe, _1, _2);
+    resolver_.async_resolve(Resolver::query(state.parent.address, to_string(state.parent.port)),
+                            move(callback));
+}
+
+void UpstreamPool::handle_probe_resolve(const ProbePtr& probe, const error_code& error,
+                                        Resolver::iterator iter) {
+    lock_guard<mutex> _(mutex_);
+    if (probe->finished) {
+        return;
+    }
+    if (error || stopped_) {
+        finish_probe(probe, false);
+        return;
+    }
+    probe->socket = make_shared<tcp::socket>(resolver_.get_io_service());
+    probe->start_time = Clock::now();
+    // Like warm connections, probes don't fall back to other resolved endpoints
+    probe->socket->async_connect(iter->endpoint(),
+                                 bind(&UpstreamPool::handle_probe_connect, this, probe, _1));
+}
+
+void UpstreamPool::handle_probe_connect(const ProbePtr& probe, const error_code& error) {
+    lock_guard<mutex> _(mutex_);
+    if (probe->finished) {
+        return;
+    }
+    if (error || stopped_) {
+        finish_probe(probe, false);
+        return;
+    }
+    // A parent is healthy if it's willing to negotiate the method we'd use with it
+    const Parent& parent = parents_[probe->index].parent;
+    const auto method = parent.username.empty() ? SocksAuthentication::NONE :
+                                                  SocksAuthentication::USERNAME_PASSWORD;
+    probe->request = {{ SOCKS_VERSION, 1, static_cast<uint8_t>(method) }};
+    boost::asio::async_write(*probe->socket, boost::asio::buffer(probe->request),
+                             bind(&UpstreamPool::handle_probe_write, this, probe, _1));
+}
+
+void UpstreamPool::handle_probe_write(const ProbePtr& probe, const error_code& error) {
+    lock_guard<mutex> _(mutex_);
+    if (probe->finished) {
+        return;
+    }
+    if (error || stopped_) {
+        finish_probe(probe, false);
+        return;
+    }
+    boost::asio::async_read(*probe->socket, boost::asio::buffer(probe->response),
+                            bind(&UpstreamPool::handle_probe_read, this, probe, _1));
+}
+
+void UpstreamPool::handle_probe_read(const ProbePtr& probe, const error_code& error) {
+    lock_guard<mutex> _(mutex_);
+    if (probe->finished) {
+        return;
+    }
+    finish_probe(probe, !error && probe->response[0] == SOCKS_VERSION &&
+                        probe->response[1] == probe->request[2]);
+}
+
+void UpstreamPool::handle_probe_deadline(const ProbePtr& probe, const error_code& error) {
+    lock_guard<mutex> _(mutex_);
+    if (error || probe->finished) {
+        return;
+    }
+    LOG4CXX_DEBUG(logger, "Probe to parent proxy "
+                  << format_parent(parents_[probe->index].parent) << " timed out");
+    // Whatever step is pending completes with an error, and is ignored
+    finish_probe(probe, false);
+}
+
+void UpstreamPool::finish_probe(const ProbePtr& probe, bool succeeded) {
+    probe->finished = true;
+    error_code ignored;
+    probe->deadline.cancel(ignored);
+    if (probe->socket) {
+        probe->socket->close(ignored);
+    }
+    probes_.erase(find(probes_.begin(), probes_.end(), probe));
+    ParentState& state = parents_[probe->index];
+    state.probing = false;
+    if (stopped_) {
+        return;
+    }
+    if (!succeeded) {
+        LOG4CXX_DEBUG(logger, "Probe to parent proxy " << format_parent(state.parent)
+                      << " failed");
+        state.next_probe = Clock::now() + ejection_duration_;
+        return;
+    }
+    LOG4CXX_INFO(logger, "Parent proxy " << format_parent(state.parent) << " is back");
+    state.ejected = false;
+    state.consecutive_failures = 0;
+    state.average_latency = Clock::now() - probe->start_time;
+}
+
+} // roberto
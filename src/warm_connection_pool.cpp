@@ -0,0 +1,206 @@
+#include "warm_connection_pool.h"
+#include <cerrno>
+#include <algorithm>
+#include <sys/socket.h>
+#include <log4cxx/logger.h>
+#include <boost/asio/io_service.hpp>
+#include "utils.h"
+
+using std::min;
+using std::bind;
+using std::move;
+using std::mutex;
+using std::string;
+using std::to_string;
+using std::lock_guard;
+using std::make_shared;
+using std::placeholders::_1;
+using std::placeholders::_2;
+using std::chrono::seconds;
+
+using boost::asio::io_service;
+
+using boost::system::error_code;
+
+using log4cxx::Logger;
+using log4cxx::LoggerPtr;
+
+namespace roberto {
+
+static const LoggerPtr logger = Logger::getLogger("r.warm_connection_pool");
+
+// Requests are counted over this interval, which is also how often the pool is resized
+static const WarmConnectionPool::Clock::duration SIZING_INTERVAL = seconds(1);
+// Bounds the memory used to count requests when there's lots of distinct destinations
+static const size_t MAX_TRACKED_DESTINATIONS = 4096;
+
+WarmConnectionPool::WarmConnectionPool(io_service& io_service,
+                                       EgressSocketProfiles socket_profiles,
+                                       size_t min_requests, size_t max_idle_connections,
+                                       Clock::duration max_idle_time)
+: io_service_(io_service), socket_profiles_(move(socket_profiles)), min_requests_(min_requests),
+  max_idle_connections_(max_idle_connections), max_idle_time_(max_idle_time),
+  resolver_(io_service_), timer_(io_service_) {
+
+}
+
+void WarmConnectionPool::start() {
+    arm_timer();
+}
+
+void WarmConnectionPool::stop() {
+    lock_guard<mutex> _(mutex_);
+    stopped_ = true;
+    error_code ignored;
+    timer_.cancel(ignored);
+    resolver_.cancel();
+    for (const SocketPtr& socket : pending_sockets_) {
+        socket->close(ignored);
+    }
+    // Whatever is still pending finds its destination gone and is dropped
+    destinations_.clear();
+}
+
+bool WarmConnectionPool::take(const string& address, uint16_t port, StreamSocket& socket) {
+    const string key = address + ":" + to_string(port);
+    lock_guard<mutex> _(mutex_);
+    if (stopped_) {
+        return false;
+    }
+    auto iter = destinations_.find(key);
+    if (iter == destinations_.end()) {
+        if (destinations_.size() == MAX_TRACKED_DESTINATIONS) {
+            return false;
+        }
+        iter = destinations_.emplace(key, Destination()).first;
+        iter->second.address = address;
+        iter->second.port = port;
+    }
+    Destination& destination = iter->second;
+    ++destination.requests;
+    bool found = false;
+    // The newest connections are the least likely to have been closed by the destination
+    while (!found && !destination.idle_connections.empty()) {
+        SocketPtr idle_socket = move(destination.idle_connections.back().socket);
+        destination.idle_connections.pop_back();
+        if (is_alive(*idle_socket)) {
+            socket = move(*idle_socket);
+            found = true;
+        }
+    }
+    if (found) {
+        LOG4CXX_DEBUG(logger, "Using warm connection to " << key);
+        refill(key, destination);
+    }
+    return found;
+}
+
+bool WarmConnectionPool::is_alive(StreamSocket& socket) {
+    uint8_t byte;
+    const ssize_t result = recv(socket.native_handle(), &byte, sizeof(byte),
+                                MSG_PEEK | MSG_DONTWAIT);
+    // Some protocols have the server talk first, so pending data is fine. Closing isn't
+    return result > 0 || (result == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+void WarmConnectionPool::arm_timer() {
+    timer_.expires_from_now(SIZING_INTERVAL);
+    timer_.async_wait(bind(&WarmConnectionPool::handle_timer, this, _1));
+}
+
+void WarmConnectionPool::handle_timer(const error_code& error) {
+    if (error) {
+        return;
+    }
+    lock_guard<mutex> _(mutex_);
+    if (stopped_) {
+        return;
+    }
+    const auto now = Clock::now();
+    for (auto iter = destinations_.begin(); iter != destinations_.end();) {
+        Destination& destination = iter->second;
+        destination.target_connections = 0;
+        if (destination.requests >= min_requests_) {
+            destination.target_connections = min(destination.requests, max_idle_connections_);
+        }
+        destination.requests = 0;
+        auto& idle_connections = destination.idle_connections;
+        while (!idle_connections.empty() &&
+               (idle_connections.size() > destination.target_connections ||
+                now - idle_connections.front().idle_since >= max_idle_time_)) {
+            idle_connections.pop_front();
+        }
+        if (destination.target_connections == 0 && idle_connections.empty() &&
+            destination.pending_connections == 0) {
+            iter = destinations_.erase(iter);
+            continue;
+        }
+        refill(iter->first, destination);
+        ++iter;
+    }
+    arm_timer();
+}
+
+void WarmConnectionPool::refill(const string& key, Destination& destination) {
+    while (destination.idle_connections.size() + destination.pending_connections <
+           destination.target_connections) {
+        ++destination.pending_connections;
+        auto callback = bind(&WarmConnectionPool::handle_resolve, this, key, _1, _2);
+        Resolver::query query(destination.address, to_string(destination.port));
+        resolver_.async_resolve(query, move(callback));
+    }
+}
+
+void WarmConnectionPool::handle_resolve(const string& key, const error_code& error,
+                                        Resolver::iterator iter) {
+    lock_guard<mutex> _(mutex_);
+    if (error || stopped_) {
+        finish_pending(key, nullptr);
+        return;
+    }
+    auto socket = make_shared<StreamSocket>(io_service_);
+    error_code open_error;
+    socket->open(StreamProtocol(iter->endpoint().protocol()), open_error);
+    if (open_error) {
+        finish_pending(key, nullptr);
+        return;
+    }
+    socket_profiles_.get_options(iter->endpoint().port()).apply_before_connect(
+        socket->native_handle());
+    pending_sockets_.push_back(socket);
+    // Unlike client requests, warming up doesn't fall back to other resolved endpoints
+    socket->async_connect(StreamEndpoint(iter->endpoint()),
+                          bind(&WarmConnectionPool::handle_connect, this, key, socket, _1));
+}
+
+void WarmConnectionPool::handle_connect(const string& key, const SocketPtr& socket,
+                                        const error_code& error) {
+    lock_guard<mutex> _(mutex_);
+    finish_pending(key, socket);
+    auto iter = destinations_.find(key);
+    if (error || iter == destinations_.end()) {
+        if (error && !utils::is_operation_aborted(error)) {
+            LOG4CXX_DEBUG(logger, "Failed to warm up connection to " << key << ": "
+                          << error.message());
+        }
+        error_code ignored;
+        socket->close(ignored);
+        return;
+    }
+    iter->second.idle_connections.push_back(IdleConnection{socket, Clock::now()});
+}
+
+void WarmConnectionPool::finish_pending(const string& key, const SocketPtr& socket) {
+    if (socket) {
+        auto iter = std::find(pending_sockets_.begin(), pending_sockets_.end(), socket);
+        if (iter != pending_sockets_.end()) {
+            pending_sockets_.erase(iter);
+        }
+    }
+    auto iter = destinations_.find(key);
+    if (iter != destinations_.end()) {
+        --iter->second.pending_connections;
+    }
+}
+
+} // roberto
@@ -0,0 +1,84 @@
+#define BOOST_TEST_MODULE circuit_breaker
+#include <thread>
+#include <boost/test/unit_test.hpp>
+#include <boost/asio/error.hpp>
+#include "circuit_breaker.h"
+
+using std::this_thread::sleep_for;
+using std::chrono::milliseconds;
+
+using roberto::ReplyType;
+using roberto::CircuitBreaker;
+
+static const char* DESTINATION = "example.com:443";
+// Circuits are timed using the real clock, so keep them short
+static const milliseconds OPEN_DURATION(100);
+
+static bool is_allowed(CircuitBreaker& breaker) {
+    ReplyType reply;
+    return breaker.allow_attempt(DESTINATION, reply);
+}
+
+static void fail(CircuitBreaker& breaker, size_t count = 1) {
+    for (size_t i = 0; i < count; ++i) {
+        breaker.record_failure(DESTINATION, boost::asio::error::connection_refused);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(opens_after_consecutive_failures) {
+    CircuitBreaker breaker(3, OPEN_DURATION);
+    BOOST_CHECK(is_allowed(breaker));
+    fail(breaker, 2);
+    BOOST_CHECK(is_allowed(breaker));
+    fail(breaker);
+    ReplyType reply = ReplyType::SUCCESS;
+    BOOST_CHECK(!breaker.allow_attempt(DESTINATION, reply));
+    // The client is told why the last attempt failed
+    BOOST_CHECK(reply == ReplyType::CONNECTION_REFUSED);
+    // Other destinations aren't affected
+    BOOST_CHECK(breaker.allow_attempt("example.com:80", reply));
+}
+
+BOOST_AUTO_TEST_CASE(success_resets_failures) {
+    CircuitBreaker breaker(3, OPEN_DURATION);
+    fail(breaker, 2);
+    breaker.record_success(DESTINATION, milliseconds(1));
+    fail(breaker, 2);
+    BOOST_CHECK(is_allowed(breaker));
+}
+
+BOOST_AUTO_TEST_CASE(lets_a_single_probe_through) {
+    CircuitBreaker breaker(1, OPEN_DURATION);
+    fail(breaker);
+    BOOST_CHECK(!is_allowed(breaker));
+    sleep_for(OPEN_DURATION);
+    // Half open, only the first request gets to find out whether the destination is back
+    BOOST_CHECK(is_allowed(breaker));
+    BOOST_CHECK(!is_allowed(breaker));
+    breaker.record_success(DESTINATION, milliseconds(1));
+    BOOST_CHECK(is_allowed(breaker));
+    BOOST_CHECK(is_allowed(breaker));
+}
+
+BOOST_AUTO_TEST_CASE(failed_probe_doubles_open_duration) {
+    CircuitBreaker breaker(1, OPEN_DURATION);
+    fail(breaker);
+    sleep_for(OPEN_DURATION);
+    BOOST_CHECK(is_allowed(breaker));
+    fail(breaker);
+    BOOST_CHECK(!is_allowed(breaker));
+    sleep_for(OPEN_DURATION);
+    BOOST_CHECK(!is_allowed(breaker));
+    sleep_for(OPEN_DURATION);
+    BOOST_CHECK(is_allowed(breaker));
+}
+
+BOOST_AUTO_TEST_CASE(lost_probe_is_retried) {
+    CircuitBreaker breaker(1, OPEN_DURATION);
+    fail(breaker);
+    sleep_for(OPEN_DURATION);
+    BOOST_CHECK(is_allowed(breaker));
+    // The probe never reports back, e.g. because its connection was cancelled
+    sleep_for(OPEN_DURATION);
+    BOOST_CHECK(is_allowed(breaker));
+}
@@ -0,0 +1,122 @@
+#define BOOST_TEST_MODULE heavy_hitters
+#include <map>
+#include <string>
+#include <chrono>
+#include <thread>
+#include <boost/test/unit_test.hpp>
+#include "heavy_hitters.h"
+
+using std::map;
+using std::string;
+using std::thread;
+using std::to_string;
+using std::chrono::seconds;
+using std::chrono::milliseconds;
+using std::this_thread::sleep_for;
+
+using roberto::SpaceSaving;
+using roberto::CountMinSketch;
+using roberto::HeavyHitterTracker;
+
+BOOST_AUTO_TEST_CASE(sketch_never_underestimates) {
+    // Narrow enough for keys to collide
+    CountMinSketch sketch(16, 4);
+    map<uint64_t, uint64_t> counts;
+    for (uint64_t key = 0; key < 200; ++key) {
+        const uint64_t key_hash = HeavyHitterTracker::hash_key("key" + to_string(key));
+        sketch.add(key_hash, key + 1);
+        counts[key_hash] += key + 1;
+    }
+    for (const auto& count : counts) {
+        BOOST_CHECK_GE(sketch.estimate(count.first), count.second);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(sketch_merge_adds_counts) {
+    CountMinSketch first(1024, 4);
+    CountMinSketch second(1024, 4);
+    const uint64_t key_hash = HeavyHitterTracker::hash_key("example.com:443");
+    first.add(key_hash, 3);
+    second.add(key_hash, 4);
+    first.merge(second);
+    BOOST_CHECK_EQUAL(first.estimate(key_hash), 7);
+    BOOST_CHECK_EQUAL(first.estimate(HeavyHitterTracker::hash_key("other")), 0);
+}
+
+BOOST_AUTO_TEST_CASE(space_saving_evicts_the_smallest_entry) {
+    SpaceSaving top(2);
+    top.add("a", 1, 10);
+    top.add("b", 2, 2);
+    top.add("a", 1, 5);
+    // "b" has the lowest count, so "c" takes over its entry along with its count
+    top.add("c", 3, 1);
+    const auto& entries = top.get_entries();
+    BOOST_REQUIRE_EQUAL(entries.size(), 2);
+    BOOST_CHECK_EQUAL(entries[0].key, "a");
+    BOOST_CHECK_EQUAL(entries[0].count, 15);
+    BOOST_CHECK_EQUAL(entries[1].key, "c");
+    BOOST_CHECK_EQUAL(entries[1].count, 3);
+}
+
+BOOST_AUTO_TEST_CASE(tracker_merges_thread_shards) {
+    HeavyHitterTracker tracker(2, seconds(60));
+    auto record = [&](const string& key, uint64_t connections, uint64_t bytes) {
+        const uint64_t key_hash = HeavyHitterTracker::hash_key(key);
+        tracker.record(HeavyHitterTracker::DESTINATION, HeavyHitterTracker::CONNECTIONS, key,
+                       key_hash, connections);
+        tracker.record(HeavyHitterTracker::DESTINATION, HeavyHitterTracker::BYTES, key,
+                       key_hash, bytes);
+    };
+    record("a:80", 5, 100);
+    record("b:80", 1, 5000);
+    thread([&] {
+        record("a:80", 5, 100);
+        record("c:80", 3, 10);
+    }).join();
+
+    const auto by_connections = tracker.get_top(HeavyHitterTracker::DESTINATION,
+                                                HeavyHitterTracker::CONNECTIONS);
+    BOOST_REQUIRE_EQUAL(by_connections.size(), 2);
+    BOOST_CHECK_EQUAL(by_connections[0].key, "a:80");
+    BOOST_CHECK_EQUAL(by_connections[0].connections, 10);
+    BOOST_CHECK_EQUAL(by_connections[0].bytes, 200);
+    BOOST_CHECK_EQUAL(by_connections[1].key, "c:80");
+
+    const auto by_bytes = tracker.get_top(HeavyHitterTracker::DESTINATION,
+                                          HeavyHitterTracker::BYTES);
+    BOOST_REQUIRE_EQUAL(by_bytes.size(), 2);
+    BOOST_CHECK_EQUAL(by_bytes[0].key, "b:80");
+    BOOST_CHECK_EQUAL(by_bytes[1].key, "a:80");
+
+    // Clients are tracked separately
+    BOOST_CHECK(tracker.get_top(HeavyHitterTracker::CLIENT,
+                                HeavyHitterTracker::CONNECTIONS).empty());
+}
+
+BOOST_AUTO_TEST_CASE(tracker_forgets_old_windows) {
+    const auto window = milliseconds(200);
+    HeavyHitterTracker tracker(2, window);
+    auto record = [&](const string& key) {
+        tracker.record(HeavyHitterTracker::CLIENT, HeavyHitterTracker::CONNECTIONS, key,
+                       HeavyHitterTracker::hash_key(key), 1);
+    };
+    auto get_top = [&] {
+        return tracker.get_top(HeavyHitterTracker::CLIENT, HeavyHitterTracker::CONNECTIONS);
+    };
+    // Recorded right away, so it's in the previous window once we're past the first one
+    record("10.0.0.1");
+    sleep_for(window * 13 / 10);
+    record("10.0.0.2");
+    BOOST_CHECK_EQUAL(get_top().size(), 2);
+    BOOST_CHECK(tracker.get_reported_duration() >= window);
+    BOOST_CHECK(tracker.get_reported_duration() < window * 2);
+
+    // Nothing was recorded for a whole window, which drops both of them
+    sleep_for(window * 2);
+    BOOST_CHECK(get_top().empty());
+    record("10.0.0.3");
+    const auto top = get_top();
+    BOOST_REQUIRE_EQUAL(top.size(), 1);
+    BOOST_CHECK_EQUAL(top[0].key, "10.0.0.3");
+    BOOST_CHECK_EQUAL(top[0].connections, 1);
+}
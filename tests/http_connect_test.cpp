@@ -0,0 +1,147 @@
+#define BOOST_TEST_MODULE http_connect
+#include <string>
+#include <boost/test/unit_test.hpp>
+#include "http_connect.h"
+
+using std::string;
+using std::vector;
+
+using roberto::ReplyType;
+using roberto::AddressType;
+using roberto::HttpParseStatus;
+using roberto::HttpConnectRequest;
+using roberto::parse_http_connect;
+using roberto::decode_http_credentials;
+using roberto::get_host_address_type;
+using roberto::make_http_response;
+
+// The request points into the input, which must outlive it
+static HttpParseStatus parse(const string& input, HttpConnectRequest& request) {
+    return parse_http_connect(reinterpret_cast<const uint8_t*>(input.data()), input.size(),
+                              request);
+}
+
+static HttpParseStatus parse(const string& input) {
+    HttpConnectRequest request;
+    return parse(input, request);
+}
+
+BOOST_AUTO_TEST_CASE(parses_connect_request) {
+    const string input = "CONNECT example.com:443 HTTP/1.1\r\n"
+                         "Host: example.com:443\r\n"
+                         "Proxy-Authorization: Basic dXNlcjpwYXNz\r\n"
+                         "\r\n"
+                         "early data";
+    HttpConnectRequest request;
+    BOOST_REQUIRE(parse(input, request) == HttpParseStatus::COMPLETE);
+    BOOST_CHECK_EQUAL(request.host, "example.com");
+    BOOST_CHECK_EQUAL(request.port, 443);
+    BOOST_CHECK_EQUAL(request.credentials, "dXNlcjpwYXNz");
+    // Whatever follows the headers is tunneled data
+    BOOST_CHECK_EQUAL(input.substr(request.size), "early data");
+}
+
+BOOST_AUTO_TEST_CASE(parses_bracketed_ipv6_host) {
+    const string input = "CONNECT [2001:db8::1]:8080 HTTP/1.0\r\n\r\n";
+    HttpConnectRequest request;
+    BOOST_REQUIRE(parse(input, request) == HttpParseStatus::COMPLETE);
+    BOOST_CHECK_EQUAL(request.host, "2001:db8::1");
+    BOOST_CHECK_EQUAL(request.port, 8080);
+    BOOST_CHECK(request.credentials.empty());
+    BOOST_CHECK_EQUAL(request.size, input.size());
+}
+
+BOOST_AUTO_TEST_CASE(header_names_are_case_insensitive) {
+    const string input = "CONNECT example.com:443 HTTP/1.1\r\n"
+                         "proxy-authorization:   basic   dTpw  \r\n\r\n";
+    HttpConnectRequest request;
+    BOOST_REQUIRE(parse(input, request) == HttpParseStatus::COMPLETE);
+    BOOST_CHECK_EQUAL(request.credentials, "dTpw");
+}
+
+BOOST_AUTO_TEST_CASE(ignores_other_authorization_schemes) {
+    const string input = "CONNECT example.com:443 HTTP/1.1\r\n"
+                         "Proxy-Authorization: Bearer token\r\n\r\n";
+    HttpConnectRequest request;
+    BOOST_REQUIRE(parse(input, request) == HttpParseStatus::COMPLETE);
+    BOOST_CHECK(request.credentials.empty());
+}
+
+BOOST_AUTO_TEST_CASE(waits_for_the_end_of_the_headers) {
+    BOOST_CHECK(parse("CONNECT example.com:443 HTTP/1.1\r\n") == HttpParseStatus::INCOMPLETE);
+    BOOST_CHECK(parse("CONNECT example.com:443 HTTP/1.1\r\nHost: example.com\r\n\r") ==
+                HttpParseStatus::INCOMPLETE);
+}
+
+BOOST_AUTO_TEST_CASE(rejects_other_methods) {
+    BOOST_CHECK(parse("GET http://example.com/ HTTP/1.1\r\n\r\n") ==
+                HttpParseStatus::METHOD_NOT_ALLOWED);
+}
+
+BOOST_AUTO_TEST_CASE(rejects_malformed_requests) {
+    BOOST_CHECK(parse("CONNECT example.com:443\r\n\r\n") == HttpParseStatus::BAD_REQUEST);
+    BOOST_CHECK(parse("CONNECT example.com:443 SPDY/3\r\n\r\n") ==
+                HttpParseStatus::BAD_REQUEST);
+    BOOST_CHECK(parse("CONNECT example.com HTTP/1.1\r\n\r\n") == HttpParseStatus::BAD_REQUEST);
+    BOOST_CHECK(parse("CONNECT example.com:0 HTTP/1.1\r\n\r\n") ==
+                HttpParseStatus::BAD_REQUEST);
+    BOOST_CHECK(parse("CONNECT example.com:65536 HTTP/1.1\r\n\r\n") ==
+                HttpParseStatus::BAD_REQUEST);
+    BOOST_CHECK(parse("CONNECT example.com:44a HTTP/1.1\r\n\r\n") ==
+                HttpParseStatus::BAD_REQUEST);
+    BOOST_CHECK(parse("CONNECT :443 HTTP/1.1\r\n\r\n") == HttpParseStatus::BAD_REQUEST);
+    BOOST_CHECK(parse("CONNECT " + string(256, 'a') + ":443 HTTP/1.1\r\n\r\n") ==
+                HttpParseStatus::BAD_REQUEST);
+    BOOST_CHECK(parse("CONNECT example.com:443 HTTP/1.1\r\nno colon\r\n\r\n") ==
+                HttpParseStatus::BAD_REQUEST);
+}
+
+BOOST_AUTO_TEST_CASE(decodes_credentials) {
+    string username;
+    string password;
+    BOOST_REQUIRE(decode_http_credentials("dXNlcjpwYXNz", username, password));
+    BOOST_CHECK_EQUAL(username, "user");
+    BOOST_CHECK_EQUAL(password, "pass");
+    // Padded, and only the first colon separates the username from the password
+    BOOST_REQUIRE(decode_http_credentials("dTpwOnE=", username, password));
+    BOOST_CHECK_EQUAL(username, "u");
+    BOOST_CHECK_EQUAL(password, "p:q");
+    // An empty password is fine
+    BOOST_REQUIRE(decode_http_credentials("dTo=", username, password));
+    BOOST_CHECK_EQUAL(username, "u");
+    BOOST_CHECK_EQUAL(password, "");
+}
+
+BOOST_AUTO_TEST_CASE(rejects_invalid_credentials) {
+    string username;
+    string password;
+    // Not base64
+    BOOST_CHECK(!decode_http_credentials("dXNl*jpwYXNz", username, password));
+    // No separator
+    BOOST_CHECK(!decode_http_credentials("dXNlcg==", username, password));
+    // Empty username
+    BOOST_CHECK(!decode_http_credentials("OnBhc3M=", username, password));
+    BOOST_CHECK(!decode_http_credentials("", username, password));
+    // Longer than any socks username and password
+    BOOST_CHECK(!decode_http_credentials(string(1024, 'A'), username, password));
+}
+
+BOOST_AUTO_TEST_CASE(classifies_hosts) {
+    BOOST_CHECK(get_host_address_type("10.0.0.1") == AddressType::IPV4);
+    BOOST_CHECK(get_host_address_type("2001:db8::1") == AddressType::IPV6);
+    BOOST_CHECK(get_host_address_type("example.com") == AddressType::DOMAIN_NAME);
+}
+
+BOOST_AUTO_TEST_CASE(maps_replies_to_status_codes) {
+    vector<uint8_t> buffer;
+    const auto get_status_line = [&] {
+        const string response(buffer.begin(), buffer.end());
+        return response.substr(0, response.find("\r\n"));
+    };
+    make_http_response(buffer, ReplyType::SUCCESS);
+    BOOST_CHECK_EQUAL(get_status_line(), "HTTP/1.1 200 Connection established");
+    make_http_response(buffer, ReplyType::CONNECTION_NOT_ALLOWED);
+    BOOST_CHECK_EQUAL(get_status_line(), "HTTP/1.1 403 Forbidden");
+    make_http_response(buffer, ReplyType::CONNECTION_REFUSED);
+    BOOST_CHECK_EQUAL(get_status_line().substr(0, 12), "HTTP/1.1 502");
+}
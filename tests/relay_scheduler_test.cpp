@@ -0,0 +1,68 @@
+#define BOOST_TEST_MODULE relay_scheduler
+#include <boost/test/unit_test.hpp>
+#include "relay_scheduler.h"
+
+using roberto::RelayScheduler;
+
+BOOST_AUTO_TEST_CASE(yields_after_turn_bytes) {
+    RelayScheduler::Policy policy;
+    policy.turn_bytes = 1000;
+    RelayScheduler::Flow flow;
+    BOOST_CHECK(!flow.record(policy, 400));
+    BOOST_CHECK(!flow.record(policy, 400));
+    BOOST_CHECK(flow.record(policy, 400));
+    // A new turn starts after yielding
+    BOOST_CHECK(!flow.record(policy, 400));
+}
+
+BOOST_AUTO_TEST_CASE(yields_after_turn_operations) {
+    RelayScheduler::Policy policy;
+    policy.turn_operations = 3;
+    RelayScheduler::Flow flow;
+    for (int turn = 0; turn < 2; ++turn) {
+        BOOST_CHECK(!flow.record(policy, 1));
+        BOOST_CHECK(!flow.record(policy, 1));
+        BOOST_CHECK(flow.record(policy, 1));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(either_limit_ends_the_turn) {
+    RelayScheduler::Policy policy;
+    policy.turn_bytes = 1000;
+    policy.turn_operations = 10;
+    RelayScheduler::Flow flow;
+    BOOST_CHECK(flow.record(policy, 5000));
+    for (int i = 0; i < 9; ++i) {
+        BOOST_CHECK(!flow.record(policy, 1));
+    }
+    BOOST_CHECK(flow.record(policy, 1));
+}
+
+BOOST_AUTO_TEST_CASE(interactive_flows_never_yield) {
+    RelayScheduler::Policy policy;
+    policy.turn_operations = 1;
+    policy.interactive_chunk_size = 512;
+    RelayScheduler::Flow flow;
+    for (int i = 0; i < 100; ++i) {
+        BOOST_CHECK(!flow.record(policy, 100));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(classification_follows_the_traffic) {
+    RelayScheduler::Policy policy;
+    policy.turn_operations = 1;
+    policy.interactive_chunk_size = 512;
+    RelayScheduler::Flow flow;
+    // A single bulk chunk is enough to push the average over the threshold
+    BOOST_CHECK(flow.record(policy, 16384));
+    // Small chunks bring it back down after a while
+    int small_chunks = 0;
+    while (flow.record(policy, 100)) {
+        ++small_chunks;
+        BOOST_REQUIRE_LT(small_chunks, 100);
+    }
+    BOOST_CHECK_GT(small_chunks, 0);
+    BOOST_CHECK(flow.record(policy, 16384));
+    flow.reset();
+    BOOST_CHECK(!flow.record(policy, 100));
+}
@@ -0,0 +1,103 @@
+#define BOOST_TEST_MODULE ring_buffer
+#include <string>
+#include <boost/test/unit_test.hpp>
+#include "ring_buffer.h"
+
+using std::string;
+
+using boost::asio::buffer_size;
+
+using roberto::RingBuffer;
+
+static size_t append(RingBuffer& buffer, const string& data) {
+    return buffer.append(reinterpret_cast<const uint8_t*>(data.data()), data.size());
+}
+
+static string get_data(const RingBuffer& buffer) {
+    string output(buffer.size(), '\0');
+    boost::asio::buffer_copy(boost::asio::buffer(&output[0], output.size()),
+                             buffer.get_data_buffers());
+    return output;
+}
+
+BOOST_AUTO_TEST_CASE(starts_empty) {
+    RingBuffer buffer(8);
+    BOOST_CHECK(buffer.empty());
+    BOOST_CHECK(!buffer.full());
+    BOOST_CHECK_EQUAL(buffer.capacity(), 8);
+    const auto free_buffers = buffer.get_free_buffers();
+    BOOST_CHECK_EQUAL(buffer_size(free_buffers[0]), 8);
+    BOOST_CHECK_EQUAL(buffer_size(free_buffers[1]), 0);
+}
+
+BOOST_AUTO_TEST_CASE(append_stops_when_full) {
+    RingBuffer buffer(8);
+    BOOST_CHECK_EQUAL(append(buffer, "0123456789"), 8);
+    BOOST_CHECK(buffer.full());
+    BOOST_CHECK_EQUAL(get_data(buffer), "01234567");
+    BOOST_CHECK_EQUAL(append(buffer, "89"), 0);
+    const auto free_buffers = buffer.get_free_buffers();
+    BOOST_CHECK_EQUAL(buffer_size(free_buffers[0]) + buffer_size(free_buffers[1]), 0);
+}
+
+BOOST_AUTO_TEST_CASE(data_wraps_around) {
+    RingBuffer buffer(8);
+    append(buffer, "012345");
+    buffer.consume(4);
+    // The free space runs until the end of the storage and then up to the remaining data
+    auto free_buffers = buffer.get_free_buffers();
+    BOOST_CHECK_EQUAL(buffer_size(free_buffers[0]), 2);
+    BOOST_CHECK_EQUAL(buffer_size(free_buffers[1]), 4);
+
+    BOOST_CHECK_EQUAL(append(buffer, "6789"), 4);
+    const auto data_buffers = buffer.get_data_buffers();
+    BOOST_CHECK_EQUAL(buffer_size(data_buffers[0]), 4);
+    BOOST_CHECK_EQUAL(buffer_size(data_buffers[1]), 2);
+    BOOST_CHECK_EQUAL(get_data(buffer), "456789");
+
+    // What's left of the free space sits between the end and the start of the data
+    free_buffers = buffer.get_free_buffers();
+    BOOST_CHECK_EQUAL(buffer_size(free_buffers[0]), 2);
+    BOOST_CHECK_EQUAL(buffer_size(free_buffers[1]), 0);
+    BOOST_CHECK_EQUAL(append(buffer, "abcd"), 2);
+    BOOST_CHECK(buffer.full());
+    BOOST_CHECK_EQUAL(get_data(buffer), "456789ab");
+}
+
+BOOST_AUTO_TEST_CASE(consume_across_the_end) {
+    RingBuffer buffer(8);
+    append(buffer, "0123456");
+    buffer.consume(6);
+    BOOST_CHECK_EQUAL(append(buffer, "789abc"), 6);
+    BOOST_CHECK_EQUAL(get_data(buffer), "6789abc");
+    buffer.consume(4);
+    BOOST_CHECK_EQUAL(get_data(buffer), "abc");
+    const auto data_buffers = buffer.get_data_buffers();
+    BOOST_CHECK_EQUAL(buffer_size(data_buffers[0]), 3);
+    BOOST_CHECK_EQUAL(buffer_size(data_buffers[1]), 0);
+    buffer.consume(3);
+    BOOST_CHECK(buffer.empty());
+}
+
+BOOST_AUTO_TEST_CASE(commit_after_filling_free_buffers) {
+    RingBuffer buffer(4);
+    append(buffer, "012");
+    buffer.consume(2);
+    // Fill the free space like a vectored read would
+    const string incoming = "abc";
+    const size_t copied = boost::asio::buffer_copy(buffer.get_free_buffers(),
+                                                   boost::asio::buffer(incoming));
+    BOOST_CHECK_EQUAL(copied, 3);
+    buffer.commit(copied);
+    BOOST_CHECK_EQUAL(get_data(buffer), "2abc");
+}
+
+BOOST_AUTO_TEST_CASE(clear_discards_data) {
+    RingBuffer buffer(4);
+    append(buffer, "0123");
+    buffer.consume(3);
+    buffer.clear();
+    BOOST_CHECK(buffer.empty());
+    BOOST_CHECK_EQUAL(append(buffer, "abcd"), 4);
+    BOOST_CHECK_EQUAL(get_data(buffer), "abcd");
+}
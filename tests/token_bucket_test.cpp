@@ -0,0 +1,54 @@
+#define BOOST_TEST_MODULE token_bucket
+#include <boost/test/unit_test.hpp>
+#include "token_bucket.h"
+
+using std::chrono::seconds;
+using std::chrono::milliseconds;
+using std::chrono::duration_cast;
+
+using roberto::TokenBucket;
+
+// Waits are computed out of doubles, so they're only compared up to the millisecond
+static milliseconds to_milliseconds(TokenBucket::Clock::duration duration) {
+    return duration_cast<milliseconds>(duration + std::chrono::microseconds(500));
+}
+
+BOOST_AUTO_TEST_CASE(starts_full) {
+    TokenBucket bucket(1000, 500);
+    const auto now = TokenBucket::Clock::now();
+    BOOST_CHECK(bucket.consume(200, now) == TokenBucket::Clock::duration::zero());
+    BOOST_CHECK(bucket.consume(300, now) == TokenBucket::Clock::duration::zero());
+    BOOST_CHECK_EQUAL(bucket.get_rate(), 1000);
+}
+
+BOOST_AUTO_TEST_CASE(debt_is_paid_off_over_time) {
+    TokenBucket bucket(1000, 1000);
+    const auto start = TokenBucket::Clock::now();
+    // 500 tokens short, which takes half a second to refill
+    BOOST_CHECK_EQUAL(to_milliseconds(bucket.consume(1500, start)).count(), 500);
+    // Tokens are granted anyway, so the debt keeps growing until it's waited for
+    BOOST_CHECK_EQUAL(to_milliseconds(bucket.consume(100, start)).count(), 600);
+    BOOST_CHECK_EQUAL(to_milliseconds(bucket.consume(0, start + milliseconds(200))).count(),
+                      400);
+    BOOST_CHECK(bucket.consume(0, start + milliseconds(600)) ==
+                TokenBucket::Clock::duration::zero());
+}
+
+BOOST_AUTO_TEST_CASE(refill_is_capped_by_burst) {
+    TokenBucket bucket(1000, 100);
+    const auto start = TokenBucket::Clock::now();
+    BOOST_CHECK(bucket.consume(100, start) == TokenBucket::Clock::duration::zero());
+    // Idling for long doesn't allow for more than a burst at once
+    const auto later = start + seconds(10);
+    BOOST_CHECK(bucket.consume(100, later) == TokenBucket::Clock::duration::zero());
+    BOOST_CHECK_EQUAL(to_milliseconds(bucket.consume(10, later)).count(), 10);
+}
+
+BOOST_AUTO_TEST_CASE(ignores_time_going_backwards) {
+    TokenBucket bucket(1000, 100);
+    const auto start = TokenBucket::Clock::now();
+    bucket.consume(200, start + milliseconds(50));
+    // Whoever consumes with an older time point doesn't get tokens back, nor takes any away
+    BOOST_CHECK_EQUAL(to_milliseconds(bucket.consume(0, start)).count(), 100);
+    BOOST_CHECK_EQUAL(to_milliseconds(bucket.consume(0, start + milliseconds(100))).count(), 50);
+}
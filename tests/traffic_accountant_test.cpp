@@ -0,0 +1,169 @@
+#define BOOST_TEST_MODULE traffic_accountant
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+#include <unistd.h>
+#include <boost/test/unit_test.hpp>
+#include "traffic_accountant.h"
+
+using std::ios;
+using std::string;
+using std::thread;
+using std::vector;
+using std::ofstream;
+using std::runtime_error;
+using std::chrono::hours;
+using std::chrono::seconds;
+using std::chrono::milliseconds;
+using std::chrono::steady_clock;
+
+using roberto::UPSTREAM;
+using roberto::DOWNSTREAM;
+using roberto::TrafficAccount;
+using roberto::TrafficAccountant;
+
+static const vector<string> USERNAMES = { "alice", "bob" };
+
+// Removes the snapshot and its lock file once the test is done with them
+struct SnapshotFile {
+    SnapshotFile()
+    : path("/tmp/traffic_accountant_test." + std::to_string(getpid())) {
+
+    }
+
+    ~SnapshotFile() {
+        std::remove(path.c_str());
+        std::remove((path + ".lock").c_str());
+    }
+
+    string path;
+};
+
+// Waits for the merge thread to evaluate quotas, giving up after a while
+static bool wait_until_over_quota(const TrafficAccountant& accountant, const string& username) {
+    const auto deadline = steady_clock::now() + seconds(5);
+    while (!accountant.is_over_quota(username)) {
+        if (steady_clock::now() >= deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(milliseconds(1));
+    }
+    return true;
+}
+
+BOOST_AUTO_TEST_CASE(merges_shards_from_every_thread) {
+    SnapshotFile file;
+    {
+        TrafficAccountant accountant(USERNAMES, file.path, hours(1));
+        accountant.start();
+        vector<thread> threads;
+        for (int i = 0; i < 4; ++i) {
+            threads.emplace_back([&] {
+                TrafficAccount alice = accountant.make_account("alice");
+                TrafficAccount bob = accountant.make_account("bob");
+                for (int j = 0; j < 100; ++j) {
+                    alice.record(UPSTREAM, 1000);
+                    bob.record(DOWNSTREAM, 10);
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        // The final merge writes the snapshot
+        accountant.stop();
+    }
+    // Quotas are evaluated against the loaded totals as soon as it's started
+    TrafficAccountant accountant(USERNAMES, file.path, hours(1));
+    accountant.set_user_quota("alice", 400000);
+    accountant.set_user_quota("bob", 4001);
+    accountant.start();
+    BOOST_CHECK(accountant.is_over_quota("alice"));
+    BOOST_CHECK(!accountant.is_over_quota("bob"));
+    accountant.stop();
+}
+
+BOOST_AUTO_TEST_CASE(starts_from_zero_without_snapshot) {
+    SnapshotFile file;
+    TrafficAccountant accountant(USERNAMES, file.path, hours(1));
+    accountant.set_default_quota(1);
+    accountant.start();
+    BOOST_CHECK(!accountant.is_over_quota("alice"));
+    BOOST_CHECK(!accountant.is_over_quota("bob"));
+    accountant.stop();
+}
+
+BOOST_AUTO_TEST_CASE(rejects_corrupt_snapshots) {
+    SnapshotFile file;
+    {
+        ofstream output(file.path, ios::binary);
+        output << "not a snapshot";
+    }
+    BOOST_CHECK_THROW(TrafficAccountant(USERNAMES, file.path, hours(1)), runtime_error);
+
+    // A valid one cut short
+    {
+        TrafficAccountant accountant(USERNAMES, file.path + ".valid", hours(1));
+        accountant.start();
+        accountant.make_account("alice").record(UPSTREAM, 1000);
+        accountant.stop();
+    }
+    BOOST_REQUIRE_EQUAL(std::rename((file.path + ".valid").c_str(), file.path.c_str()), 0);
+    std::remove((file.path + ".valid.lock").c_str());
+    BOOST_REQUIRE_EQUAL(truncate(file.path.c_str(), 20), 0);
+    BOOST_CHECK_THROW(TrafficAccountant(USERNAMES, file.path, hours(1)), runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(rejects_quotas_for_unknown_users) {
+    TrafficAccountant accountant(USERNAMES, "", hours(1));
+    BOOST_CHECK_THROW(accountant.set_user_quota("carol", 1000), runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(cuts_users_off_over_their_quota) {
+    const uint64_t chunk_size = 64 * 1024;
+    TrafficAccountant accountant(USERNAMES, "", milliseconds(5));
+    accountant.set_default_quota(chunk_size * 8);
+    accountant.start();
+    TrafficAccount alice = accountant.make_account("alice");
+    TrafficAccount bob = accountant.make_account("bob");
+    for (int i = 0; i < 7; ++i) {
+        BOOST_CHECK(alice.record(i % 2 ? UPSTREAM : DOWNSTREAM, chunk_size));
+    }
+    bob.record(UPSTREAM, chunk_size);
+    // Just under the quota, then right at it
+    std::this_thread::sleep_for(milliseconds(50));
+    BOOST_CHECK(!accountant.is_over_quota("alice"));
+    alice.record(UPSTREAM, chunk_size);
+    BOOST_REQUIRE(wait_until_over_quota(accountant, "alice"));
+    BOOST_CHECK(!accountant.is_over_quota("bob"));
+    // Connections only find out once they relayed enough to check again
+    bool allowed = true;
+    for (int i = 0; i < 4 && allowed; ++i) {
+        allowed = alice.record(UPSTREAM, chunk_size);
+    }
+    BOOST_CHECK(!allowed);
+    accountant.stop();
+}
+
+BOOST_AUTO_TEST_CASE(leaves_anonymous_user_out_of_default_quota) {
+    TrafficAccountant accountant(USERNAMES, "", milliseconds(5));
+    accountant.set_default_quota(1000);
+    accountant.start();
+    accountant.make_account("").record(UPSTREAM, 10000);
+    accountant.make_account("alice").record(UPSTREAM, 10000);
+    BOOST_REQUIRE(wait_until_over_quota(accountant, "alice"));
+    BOOST_CHECK(!accountant.is_over_quota(""));
+    accountant.stop();
+
+    // Unless it's given one of its own
+    TrafficAccountant limited_accountant(USERNAMES, "", milliseconds(5));
+    limited_accountant.set_user_quota("", 1000);
+    limited_accountant.start();
+    limited_accountant.make_account("").record(UPSTREAM, 10000);
+    BOOST_CHECK(wait_until_over_quota(limited_accountant, ""));
+    limited_accountant.stop();
+}
@@ -0,0 +1,164 @@
+#define BOOST_TEST_MODULE traffic_recorder
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <stdexcept>
+#include <unistd.h>
+#include <boost/test/unit_test.hpp>
+#include "traffic_recorder.h"
+
+using std::ios;
+using std::string;
+using std::vector;
+using std::ofstream;
+using std::stringstream;
+using std::runtime_error;
+
+using roberto::UPSTREAM;
+using roberto::DOWNSTREAM;
+using roberto::AddressType;
+using roberto::TraceReader;
+using roberto::ConnectionTrace;
+using roberto::TrafficRecorder;
+using roberto::TrafficRecording;
+
+static string encode(uint64_t value) {
+    stringstream stream;
+    roberto::write_varint(stream, value);
+    return stream.str();
+}
+
+static uint64_t decode(const string& bytes) {
+    stringstream stream(bytes);
+    return roberto::read_varint(stream);
+}
+
+// Removes the trace file once the test is done with it
+struct TraceFile {
+    TraceFile()
+    : path("/tmp/traffic_recorder_test." + std::to_string(getpid())) {
+
+    }
+
+    ~TraceFile() {
+        unlink(path.c_str());
+    }
+
+    // Records a connection per element, with that many chunks upstream and twice as many
+    // downstream
+    void record(const vector<size_t>& chunk_counts, size_t max_chunks = 1024) {
+        TrafficRecorder recorder(path, max_chunks);
+        recorder.start();
+        for (size_t chunk_count : chunk_counts) {
+            TrafficRecording recording(recorder);
+            recording.set_protocol(ConnectionTrace::Protocol::HTTP);
+            recording.record_request(AddressType::DOMAIN_NAME);
+            recording.record_connected();
+            for (size_t i = 0; i < chunk_count; ++i) {
+                recording.record_chunk(UPSTREAM, 100 + i);
+                recording.record_chunk(DOWNSTREAM, 1000);
+                recording.record_chunk(DOWNSTREAM, 200000);
+            }
+        }
+        recorder.stop();
+    }
+
+    vector<ConnectionTrace> read_all(bool expect_truncated) {
+        TraceReader reader(path);
+        vector<ConnectionTrace> output;
+        ConnectionTrace trace;
+        while (reader.read(trace)) {
+            output.push_back(trace);
+        }
+        BOOST_CHECK_EQUAL(reader.is_truncated(), expect_truncated);
+        return output;
+    }
+
+    string path;
+};
+
+BOOST_AUTO_TEST_CASE(encodes_varints) {
+    BOOST_CHECK_EQUAL(encode(0), string(1, '\x00'));
+    BOOST_CHECK_EQUAL(encode(127), string("\x7f"));
+    BOOST_CHECK_EQUAL(encode(128), string("\x80\x01"));
+    BOOST_CHECK_EQUAL(encode(300), string("\xac\x02"));
+    BOOST_CHECK_EQUAL(encode(UINT64_MAX).size(), 10);
+    for (uint64_t value : vector<uint64_t>{ 0, 1, 127, 128, 16383, 16384, 1ull << 35,
+                                            UINT64_MAX }) {
+        BOOST_CHECK_EQUAL(decode(encode(value)), value);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(rejects_malformed_varints) {
+    // Truncated halfway through, and longer than any 64 bit value
+    BOOST_CHECK_THROW(decode("\x80\x80"), runtime_error);
+    BOOST_CHECK_THROW(decode(string(11, '\xff')), runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(round_trips_traces) {
+    TraceFile file;
+    file.record({ 1, 5, 0 });
+    const vector<ConnectionTrace> traces = file.read_all(false);
+    BOOST_REQUIRE_EQUAL(traces.size(), 3);
+    for (size_t i = 0; i < traces.size(); ++i) {
+        const ConnectionTrace& trace = traces[i];
+        const size_t chunk_count = i == 0 ? 1 : (i == 1 ? 5 : 0);
+        BOOST_CHECK(trace.protocol == ConnectionTrace::Protocol::HTTP);
+        BOOST_CHECK(trace.address_type == AddressType::DOMAIN_NAME);
+        BOOST_CHECK(trace.connected);
+        const auto& upstream = trace.directions[UPSTREAM];
+        const auto& downstream = trace.directions[DOWNSTREAM];
+        BOOST_REQUIRE_EQUAL(upstream.chunks.size(), chunk_count);
+        BOOST_REQUIRE_EQUAL(downstream.chunks.size(), chunk_count * 2);
+        for (size_t j = 0; j < chunk_count; ++j) {
+            BOOST_CHECK_EQUAL(upstream.chunks[j].size, 100 + j);
+            BOOST_CHECK_EQUAL(downstream.chunks[j * 2].size, 1000);
+            BOOST_CHECK_EQUAL(downstream.chunks[j * 2 + 1].size, 200000);
+        }
+        BOOST_CHECK_EQUAL(downstream.byte_count, chunk_count * 201000);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(counts_bytes_past_the_last_chunk) {
+    TraceFile file;
+    file.record({ 4 }, 2);
+    const vector<ConnectionTrace> traces = file.read_all(false);
+    BOOST_REQUIRE_EQUAL(traces.size(), 1);
+    BOOST_CHECK_EQUAL(traces[0].directions[UPSTREAM].chunks.size(), 2);
+    BOOST_CHECK_EQUAL(traces[0].directions[UPSTREAM].byte_count, 100 + 101 + 102 + 103);
+}
+
+BOOST_AUTO_TEST_CASE(stops_at_truncated_tail) {
+    TraceFile file;
+    file.record({ 3, 3, 3 });
+    const size_t trace_count = file.read_all(false).size();
+    BOOST_REQUIRE_EQUAL(trace_count, 3);
+    // Cut the last trace short, as if the recorder was killed while writing it
+    std::ifstream input(file.path, ios::binary | ios::ate);
+    const off_t size = input.tellg();
+    for (off_t removed_bytes : { 1, 5, 12 }) {
+        BOOST_REQUIRE_EQUAL(truncate(file.path.c_str(), size - removed_bytes), 0);
+        BOOST_CHECK_EQUAL(file.read_all(true).size(), 2);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(bounds_chunk_counts) {
+    TraceFile file;
+    file.record({});
+    // A trace claiming far more chunks than any recorder keeps
+    {
+        ofstream output(file.path, ios::binary | ios::app);
+        roberto::write_varint(output, 0);
+        // Protocol, authentication method, address type and whether it connected
+        output.write("\x02\x00\x03\x01", 4);
+        for (int i = 0; i < 4; ++i) {
+            roberto::write_varint(output, 0);
+        }
+        roberto::write_varint(output, 1ull << 40);
+        roberto::write_varint(output, 0);
+    }
+    TraceReader reader(file.path);
+    ConnectionTrace trace;
+    BOOST_CHECK_THROW(reader.read(trace), runtime_error);
+}
@@ -0,0 +1,173 @@
+#define BOOST_TEST_MODULE upstream_pool
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include <functional>
+#include <boost/test/unit_test.hpp>
+#include <boost/asio/io_service.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include "upstream_pool.h"
+
+using std::map;
+using std::move;
+using std::string;
+using std::vector;
+using std::function;
+using std::shared_ptr;
+using std::make_shared;
+using std::chrono::seconds;
+using std::chrono::milliseconds;
+
+using boost::asio::io_service;
+using boost::asio::steady_timer;
+using boost::asio::ip::tcp;
+
+using boost::system::error_code;
+
+using roberto::UpstreamPool;
+
+static vector<UpstreamPool::Parent> make_parents(size_t count) {
+    vector<UpstreamPool::Parent> output;
+    for (size_t i = 0; i < count; ++i) {
+        output.push_back(UpstreamPool::Parent{"parent" + std::to_string(i), 1080, "", ""});
+    }
+    return output;
+}
+
+// The pool is never started, so no probes are made
+struct PoolFixture {
+    PoolFixture(size_t parent_count, size_t failure_threshold = 3)
+    : pool(service, make_parents(parent_count), failure_threshold, seconds(60), seconds(5)) {
+
+    }
+
+    // Keeps the leases around, so they count as connections in flight
+    map<string, size_t> choose(size_t count) {
+        map<string, size_t> output;
+        for (size_t i = 0; i < count; ++i) {
+            UpstreamPool::Lease lease = pool.choose();
+            BOOST_REQUIRE(lease);
+            ++output[lease.get_parent().address];
+            leases.push_back(move(lease));
+        }
+        return output;
+    }
+
+    io_service service;
+    UpstreamPool pool;
+    vector<UpstreamPool::Lease> leases;
+};
+
+BOOST_AUTO_TEST_CASE(spreads_load_over_equal_parents) {
+    PoolFixture fixture(2);
+    // Out of two parents, the one with less connections in flight is always picked
+    auto chosen = fixture.choose(10);
+    BOOST_CHECK_EQUAL(chosen["parent0"], 5);
+    BOOST_CHECK_EQUAL(chosen["parent1"], 5);
+}
+
+BOOST_AUTO_TEST_CASE(prefers_faster_parents) {
+    PoolFixture fixture(2);
+    auto first = fixture.pool.choose();
+    auto second = fixture.pool.choose();
+    BOOST_REQUIRE_NE(first.get_parent().address, second.get_parent().address);
+    const string fast_parent = first.get_parent().address;
+    first.record_success(milliseconds(1));
+    second.record_success(milliseconds(100));
+    first.release();
+    second.release();
+    // Until it's carrying many times more connections than the slow one
+    auto chosen = fixture.choose(10);
+    BOOST_CHECK_EQUAL(chosen[fast_parent], 10);
+}
+
+BOOST_AUTO_TEST_CASE(releasing_leases_frees_capacity) {
+    PoolFixture fixture(2);
+    fixture.choose(4);
+    // Only the leases on parent0 go away, so parent0 takes the next ones
+    vector<UpstreamPool::Lease> kept;
+    for (auto& lease : fixture.leases) {
+        if (lease.get_parent().address == "parent1") {
+            kept.push_back(move(lease));
+        }
+    }
+    fixture.leases.clear();
+    BOOST_CHECK_EQUAL(fixture.choose(2)["parent0"], 2);
+}
+
+BOOST_AUTO_TEST_CASE(ejects_failing_parents) {
+    PoolFixture fixture(2, 2);
+    fixture.choose(4);
+    for (auto& lease : fixture.leases) {
+        if (lease.get_parent().address == "parent0") {
+            lease.record_failure();
+        }
+    }
+    fixture.leases.clear();
+    BOOST_CHECK_EQUAL(fixture.choose(5)["parent1"], 5);
+}
+
+BOOST_AUTO_TEST_CASE(success_brings_parents_back) {
+    PoolFixture fixture(1, 1);
+    auto lease = fixture.pool.choose();
+    auto other_lease = fixture.pool.choose();
+    BOOST_REQUIRE(lease && other_lease);
+    lease.record_failure();
+    // Every parent is ejected
+    BOOST_CHECK(!fixture.pool.choose());
+    // A connection that was already going through it succeeds after all
+    other_lease.record_success(milliseconds(5));
+    BOOST_CHECK(fixture.pool.choose());
+}
+
+BOOST_AUTO_TEST_CASE(moved_leases_release_once) {
+    PoolFixture fixture(2);
+    UpstreamPool::Lease lease = fixture.pool.choose();
+    const string address = lease.get_parent().address;
+    UpstreamPool::Lease moved(move(lease));
+    BOOST_CHECK(!lease);
+    BOOST_CHECK(moved);
+    lease.release();
+    moved.release();
+    BOOST_CHECK(!moved);
+    // Both parents are idle again, so the next two connections are split between them
+    auto chosen = fixture.choose(2);
+    BOOST_CHECK_EQUAL(chosen["parent0"], 1);
+    BOOST_CHECK_EQUAL(chosen["parent1"], 1);
+}
+
+BOOST_AUTO_TEST_CASE(probes_time_out) {
+    io_service service;
+    // Accepts connections but never answers, like a parent that hangs
+    tcp::acceptor acceptor(service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    size_t accepted = 0;
+    vector<shared_ptr<tcp::socket>> sockets;
+    function<void()> accept = [&] {
+        auto socket = make_shared<tcp::socket>(service);
+        acceptor.async_accept(*socket, [&, socket](const error_code& error) {
+            if (!error) {
+                ++accepted;
+                sockets.push_back(socket);
+                accept();
+            }
+        });
+    };
+    accept();
+    vector<UpstreamPool::Parent> parents{{"127.0.0.1", acceptor.local_endpoint().port(), "", ""}};
+    UpstreamPool pool(service, move(parents), 1, seconds(0), milliseconds(100));
+    pool.choose().record_failure();
+    pool.start();
+    steady_timer stop_timer(service);
+    stop_timer.expires_from_now(milliseconds(2500));
+    stop_timer.async_wait([&](const error_code&) {
+        pool.stop();
+        acceptor.close();
+    });
+    service.run();
+    // Ejected parents are probed every second. Without a deadline, the first probe would
+    // never finish and no other one would be made
+    BOOST_CHECK_GE(accepted, 2);
+    BOOST_CHECK(pool.format_report().find("ejected") != string::npos);
+}